@@ -45,6 +45,7 @@
 #include <linux/workqueue.h>
 
 #include <sys/syscallsubr.h>	/* kern_kldload() */
+#include <sys/cpuset.h>
 #include <sys/refcount.h>
 #include <sys/sbuf.h>
 
@@ -325,9 +326,22 @@ flush_work(struct work_struct *work)
 
 struct workqueue_struct *
 create_singlethread_workqueue(const char *name)
+{
+	return create_singlethread_workqueue_cpu(name, -1);
+}
+
+/*
+ * A single threaded workqueue whose thread only runs on the given CPU,
+ * or anywhere if cpu is -1.
+ */
+struct workqueue_struct *
+create_singlethread_workqueue_cpu(const char *name, int cpu)
 {
 	int res;
 	struct workqueue_struct *wq;
+#if __FreeBSD_version >= 1100000
+	cpuset_t mask;
+#endif
 
 	wq = malloc(sizeof(*wq), M_LINUX, M_NOWAIT);
 	if (wq == NULL)
@@ -339,7 +353,14 @@ create_singlethread_workqueue(const char *name)
 		return NULL;
 	}
 
-	res = taskqueue_start_threads(&wq->tq, 1, PI_REALTIME, "%s taskq", name);
+#if __FreeBSD_version >= 1100000
+	if (cpu >= 0) {
+		CPU_SETOF(cpu, &mask);
+		res = taskqueue_start_threads_cpuset(&wq->tq, 1, PI_REALTIME,
+		    &mask, "%s taskq", name);
+	} else
+#endif
+		res = taskqueue_start_threads(&wq->tq, 1, PI_REALTIME, "%s taskq", name);
 	if (res) {
 		destroy_workqueue(wq);
 		return NULL;
@@ -34,8 +34,11 @@
 #include <sys/syscallsubr.h>
 #include <sys/taskqueue.h>
 #include <sys/kernel.h>
+#include <sys/sysctl.h>
+#include <machine/atomic.h>
 
 #include <netgraph/ng_message.h>
+#include <netgraph/ng_parse.h>
 #include <netgraph/netgraph.h>
 
 #include <netinet/in.h>
@@ -55,12 +58,66 @@ struct ng_node *ng_name2noderef(struct ng_node *node, const char *name);
 
 #define DAHDI_IFACE_HOOK_UPPER "upper"
 
+static SYSCTL_NODE(_dahdi, OID_AUTO, iface, CTLFLAG_RW, 0, "DAHDI network interfaces");
+
+static int dahdi_iface_rx_pool = 8;
+TUNABLE_INT("dahdi.iface.rx_pool", &dahdi_iface_rx_pool);
+SYSCTL_INT(_dahdi_iface, OID_AUTO, rx_pool, CTLFLAG_RW,
+    &dahdi_iface_rx_pool, 0, "mbufs kept ready per channel for hardware HDLC frames");
+
+static u_long dahdi_iface_rx_pool_hits;
+SYSCTL_ULONG(_dahdi_iface, OID_AUTO, rx_pool_hits, CTLFLAG_RD,
+    &dahdi_iface_rx_pool_hits, 0, "Hardware HDLC frames received straight into an mbuf");
+
+static u_long dahdi_iface_rx_pool_misses;
+SYSCTL_ULONG(_dahdi_iface, OID_AUTO, rx_pool_misses, CTLFLAG_RD,
+    &dahdi_iface_rx_pool_misses, 0, "Hardware HDLC frames copied through the read buffers");
+
+static int dahdi_iface_rx_budget = 16;
+TUNABLE_INT("dahdi.iface.rx_budget", &dahdi_iface_rx_budget);
+SYSCTL_INT(_dahdi_iface, OID_AUTO, rx_budget, CTLFLAG_RW,
+    &dahdi_iface_rx_budget, 0, "Frames a channel sends up per rx task run");
+
+static int dahdi_iface_tx_queue = 16384;
+TUNABLE_INT("dahdi.iface.tx_queue", &dahdi_iface_tx_queue);
+SYSCTL_INT(_dahdi_iface, OID_AUTO, tx_queue, CTLFLAG_RW,
+    &dahdi_iface_tx_queue, 0, "Bytes of frames a channel may queue for transmit");
+
+static u_long dahdi_iface_tx_drops;
+SYSCTL_ULONG(_dahdi_iface, OID_AUTO, tx_drops, CTLFLAG_RD,
+    &dahdi_iface_tx_drops, 0, "Frames dropped because a transmit queue was full");
+
 static ng_rcvmsg_t ng_dahdi_iface_rcvmsg;
 static ng_shutdown_t ng_dahdi_iface_shutdown;
 static ng_newhook_t ng_dahdi_iface_newhook;
 static ng_disconnect_t ng_dahdi_iface_disconnect;
 static ng_rcvdata_t ng_dahdi_iface_rcvdata;
 
+static const struct ng_parse_struct_field ng_dahdi_iface_stats_type_fields[]
+	= NG_DAHDI_IFACE_STATS_TYPE_INFO;
+static const struct ng_parse_type ng_dahdi_iface_stats_type = {
+	&ng_parse_struct_type,
+	&ng_dahdi_iface_stats_type_fields
+};
+
+static const struct ng_cmdlist ng_dahdi_iface_cmdlist[] = {
+	{
+	  NGM_DAHDI_IFACE_COOKIE,
+	  NGM_DAHDI_IFACE_GET_STATS,
+	  "getstats",
+	  NULL,
+	  &ng_dahdi_iface_stats_type
+	},
+	{
+	  NGM_DAHDI_IFACE_COOKIE,
+	  NGM_DAHDI_IFACE_CLR_STATS,
+	  "clrstats",
+	  NULL,
+	  NULL
+	},
+	{ 0 }
+};
+
 static struct ng_type ng_dahdi_iface_typestruct = {
 	.version =	NG_ABI_VERSION,
 	.name =		"dahdi_iface",
@@ -69,21 +126,51 @@ static struct ng_type ng_dahdi_iface_typestruct = {
 	.newhook =	ng_dahdi_iface_newhook,
 	.rcvdata =	ng_dahdi_iface_rcvdata,
 	.disconnect =	ng_dahdi_iface_disconnect,
+	.cmdlist =	ng_dahdi_iface_cmdlist,
 };
 NETGRAPH_INIT(dahdi_iface, &ng_dahdi_iface_typestruct);
 
 static void dahdi_iface_rx_task(void *context, int pending);
+static void dahdi_iface_tx_task(void *context, int pending);
 
 /**
  * iface struct
  */
 struct dahdi_iface {
 	struct dahdi_chan *chan;	/**< dahdi master channel associated with the iface */
-	struct taskqueue *rx_taskqueue;	/**< rx task queue */
+	struct taskqueue *rx_taskqueue;	/**< rx (and tx) task queue */
 	struct task rx_task;		/**< rx task */
+	struct task tx_task;		/**< tx task */
 	struct ng_node *node;		/**< our netgraph node */
 	struct ng_hook *upper;		/**< our upper hook */
 	char path[64];			/**< iface node path */
+
+	/*
+	 * Frames from hardware HDLC are put together right in an mbuf
+	 * from rx_pool, which rx task keeps topped up. Protected by
+	 * the channel lock.
+	 */
+	struct mbuf *rx_pool;		/**< ready mbufs, linked by m_nextpkt */
+	int rx_pool_count;		/**< number of mbufs in rx_pool */
+	struct mbuf *rx_m;		/**< mbuf the current frame goes to */
+	struct mbuf *rx_ready;		/**< frames for rx task to send up */
+	struct mbuf **rx_ready_tail;	/**< where to link the next one */
+
+	/*
+	 * Frames wait in tx_queue rather than in the channel write
+	 * buffers, which only get as many bytes as tx_limit allows. The
+	 * limit grows when the line runs dry with frames waiting and
+	 * shrinks when more than it needs stays buffered, so that the
+	 * line stays busy without frames sitting behind seconds of
+	 * others. Protected by the channel lock.
+	 */
+	struct mbuf *tx_queue;		/**< frames to send, linked by m_nextpkt */
+	struct mbuf **tx_queue_tail;	/**< where to link the next one */
+	int tx_queue_len;		/**< frames in tx_queue */
+	int tx_queue_bytes;		/**< bytes in tx_queue */
+	int tx_limit;			/**< bytes allowed in the write buffers */
+
+	struct ng_dahdi_iface_stats stats; /**< counters */
 };
 
 /**
@@ -100,9 +187,27 @@ dahdi_iface_alloc(struct dahdi_chan *chan)
 	    taskqueue_thread_enqueue, &iface->rx_taskqueue);
 	taskqueue_start_threads(&iface->rx_taskqueue, 1, PI_NET, "%s taskq", chan->name);
 	TASK_INIT(&iface->rx_task, 0, dahdi_iface_rx_task, chan);
+	TASK_INIT(&iface->tx_task, 0, dahdi_iface_tx_task, chan);
+	iface->rx_ready_tail = &iface->rx_ready;
+	iface->tx_queue_tail = &iface->tx_queue;
 	return iface;
 }
 
+/**
+ * Free a list of mbuf chains linked by m_nextpkt
+ */
+static void
+dahdi_iface_freem_list(struct mbuf *m)
+{
+	struct mbuf *next;
+
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		m_freem(m);
+	}
+}
+
 /**
  * Free iface struct
  */
@@ -110,9 +215,49 @@ static void
 dahdi_iface_free(struct dahdi_iface *iface)
 {
 	taskqueue_free(iface->rx_taskqueue);
+	dahdi_iface_freem_list(iface->rx_pool);
+	dahdi_iface_freem_list(iface->rx_ready);
+	dahdi_iface_freem_list(iface->tx_queue);
+	if (iface->rx_m != NULL)
+		m_freem(iface->rx_m);
 	free(iface, M_DAHDI);
 }
 
+/**
+ * Top up rx mbuf pool
+ *
+ * Called without the channel lock held.
+ */
+static void
+dahdi_iface_rx_pool_fill(struct dahdi_chan *chan, struct dahdi_iface *iface, int how)
+{
+	struct mbuf *m, *pool = NULL;
+	unsigned long flags;
+	int count = 0;
+	int need;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	need = dahdi_iface_rx_pool - iface->rx_pool_count;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	for (; count < need; count++) {
+		if ((m = m_getcl(how, MT_DATA, M_PKTHDR)) == NULL)
+			break;
+		m->m_nextpkt = pool;
+		pool = m;
+	}
+	if (pool == NULL)
+		return;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	for (m = pool; m->m_nextpkt != NULL; m = m->m_nextpkt)
+		;
+	m->m_nextpkt = iface->rx_pool;
+	iface->rx_pool = pool;
+	iface->rx_pool_count += count;
+	spin_unlock_irqrestore(&chan->lock, flags);
+}
+
 /**
  * Ensure that specified netgraph type is available
  */
@@ -308,6 +453,8 @@ dahdi_iface_create(struct dahdi_chan *chan)
 		    NG_NODE_NAME(node));
 		goto error;
 	}
+	dahdi_iface_rx_pool_fill(chan, iface, M_WAITOK);
+	iface->tx_limit = chan->blocksize;
 
 	return (0);
 
@@ -378,9 +525,12 @@ dahdi_iface_rx(struct dahdi_chan *chan)
 }
 
 /**
- * Receive data frame from the synchronous line
+ * Receive data frames from the synchronous line
  *
- * Receives data frame from the synchronous line and sends it up to the upstream.
+ * Takes up to dahdi.iface.rx_budget received frames off the channel and
+ * sends them up to the upstream in one go, then requeues itself if there
+ * are more. dahdi_iface_rx() only has to schedule it, however many frames
+ * arrive before it gets to run.
  */
 static void
 dahdi_iface_rx_task(void *context, int pending)
@@ -389,13 +539,27 @@ dahdi_iface_rx_task(void *context, int pending)
 	struct dahdi_iface *iface;
 	unsigned long flags;
 	int oldreadbuf;
+	int budget = dahdi_iface_rx_budget;
+	int more;
+	struct mbuf *batch = NULL, **tail = &batch, *m, *next;
 
 	if ((iface = chan->iface) == NULL)
 		return;
 
 	spin_lock_irqsave(&chan->lock, flags);
-	while ((oldreadbuf = chan->outreadbuf) >= 0) {
-		struct mbuf *m = NULL;
+
+	/* frames from hardware HDLC, already in mbufs */
+	while (budget > 0 && (m = iface->rx_ready) != NULL) {
+		if ((iface->rx_ready = m->m_nextpkt) == NULL)
+			iface->rx_ready_tail = &iface->rx_ready;
+		*tail = m;
+		tail = &m->m_nextpkt;
+		budget--;
+	}
+
+	/* frames from the read buffers, copied into new mbufs */
+	while (budget > 0 && (oldreadbuf = chan->outreadbuf) >= 0) {
+		m = NULL;
 
 		/* read frame */
 		if (iface->upper != NULL && chan->readn[chan->outreadbuf] > 1) {
@@ -411,6 +575,11 @@ dahdi_iface_rx_task(void *context, int pending)
 
 				/* copy data */
 				m_append(m, chan->readn[chan->outreadbuf], chan->readbuf[chan->outreadbuf]);
+				*tail = m;
+				tail = &m->m_nextpkt;
+				budget--;
+			} else {
+				iface->stats.rx_dropped++;
 			}
 		}
 
@@ -422,16 +591,123 @@ dahdi_iface_rx_task(void *context, int pending)
 			chan->outreadbuf = -1;		/* no more buffers to read from */
 		if (chan->inreadbuf < 0)
 			chan->inreadbuf = oldreadbuf;	/* new buffer to read to */
+	}
+	more = (iface->rx_ready != NULL || chan->outreadbuf >= 0);
+	spin_unlock_irqrestore(&chan->lock, flags);
 
-		if (m != NULL) {
-			int error;
+	/* send the whole batch up without the channel lock */
+	for (m = batch; m != NULL; m = next) {
+		int error;
 
-			spin_unlock_irqrestore(&chan->lock, flags);
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		if (iface->upper != NULL) {
+			iface->stats.rx_packets++;
+			iface->stats.rx_bytes += m->m_pkthdr.len;
 			NG_SEND_DATA_ONLY(error, iface->upper, m);
-			spin_lock_irqsave(&chan->lock, flags);
+		} else {
+			m_freem(m);
 		}
 	}
-	spin_unlock_irqrestore(&chan->lock, flags);
+	dahdi_iface_rx_pool_fill(chan, iface, M_NOWAIT);
+
+	/* out of budget: go round again after whatever else is queued */
+	if (more)
+		taskqueue_enqueue_fast(iface->rx_taskqueue, &iface->rx_task);
+}
+
+/**
+ * Append bytes of a frame received by hardware HDLC
+ *
+ * The frame goes straight into an mbuf from the pool if one is free when
+ * it starts. Called with the channel lock held.
+ *
+ * @return number of bytes taken, or -1 if the frame has to go through the
+ * channel read buffers instead
+ */
+int
+dahdi_iface_hdlc_putbuf(struct dahdi_chan *chan, const unsigned char *rxb, int bytes)
+{
+	struct dahdi_iface *iface;
+	struct mbuf *m;
+
+	if ((iface = chan->iface) == NULL)
+		return (-1);
+
+	if ((m = iface->rx_m) == NULL) {
+		/* a frame that started in the read buffers ends there */
+		if (chan->inreadbuf >= 0 && chan->readidx[chan->inreadbuf] != 0)
+			return (-1);
+
+		if ((m = iface->rx_pool) == NULL) {
+			iface->stats.rx_pool_misses++;
+			atomic_add_long(&dahdi_iface_rx_pool_misses, 1);
+			taskqueue_enqueue_fast(iface->rx_taskqueue, &iface->rx_task);
+			return (-1);
+		}
+		iface->rx_pool = m->m_nextpkt;
+		iface->rx_pool_count--;
+		m->m_nextpkt = NULL;
+		iface->rx_m = m;
+		iface->stats.rx_pool_hits++;
+		atomic_add_long(&dahdi_iface_rx_pool_hits, 1);
+	}
+
+	if (bytes > M_TRAILINGSPACE(m))
+		bytes = M_TRAILINGSPACE(m);
+	memcpy(mtod(m, unsigned char *) + m->m_len, rxb, bytes);
+	m->m_len += bytes;
+	m->m_pkthdr.len = m->m_len;
+	return (bytes);
+}
+
+/**
+ * Finish a frame received by hardware HDLC
+ *
+ * Called with the channel lock held.
+ *
+ * @return 0 if the frame was in an mbuf, -1 if it is in the read buffers
+ */
+int
+dahdi_iface_hdlc_finish(struct dahdi_chan *chan)
+{
+	struct dahdi_iface *iface;
+	struct mbuf *m;
+
+	if ((iface = chan->iface) == NULL || (m = iface->rx_m) == NULL)
+		return (-1);
+
+	if (m->m_len <= 2) {
+		/* nothing but (part of) the FCS, keep the mbuf for the next one */
+		m->m_len = m->m_pkthdr.len = 0;
+		return (0);
+	}
+	iface->rx_m = NULL;
+
+	/* Drop the FCS */
+	m_adj(m, -2);
+
+	*iface->rx_ready_tail = m;
+	iface->rx_ready_tail = &m->m_nextpkt;
+	taskqueue_enqueue_fast(iface->rx_taskqueue, &iface->rx_task);
+	return (0);
+}
+
+/**
+ * Drop a frame received by hardware HDLC
+ *
+ * Its mbuf is kept for the next frame. Called with the channel lock held.
+ */
+void
+dahdi_iface_hdlc_abort(struct dahdi_chan *chan)
+{
+	struct dahdi_iface *iface;
+	struct mbuf *m;
+
+	if ((iface = chan->iface) == NULL || (m = iface->rx_m) == NULL)
+		return;
+
+	m->m_len = m->m_pkthdr.len = 0;
 }
 
 /**
@@ -440,19 +716,150 @@ dahdi_iface_rx_task(void *context, int pending)
 void
 dahdi_iface_abort(struct dahdi_chan *chan, int event)
 {
-	/* nothing to do */
-#if 0
-	module_printk(KERN_DEBUG, "%s: event %d\n", __func__, event);
-#endif
+	struct dahdi_iface *iface;
+
+	if ((iface = chan->iface) == NULL)
+		return;
+
+	iface->stats.rx_errors++;
+	switch (event) {
+	case DAHDI_EVENT_BADFCS:
+		iface->stats.rx_crc_errors++;
+		break;
+	case DAHDI_EVENT_OVERRUN:
+		iface->stats.rx_over_errors++;
+		break;
+	case DAHDI_EVENT_ABORT:
+		iface->stats.rx_frame_errors++;
+		break;
+	}
+}
+
+/**
+ * Count the bytes in the channel write buffers still to be sent
+ *
+ * Called with the channel lock held.
+ */
+static int
+dahdi_iface_tx_inflight(struct dahdi_chan *chan)
+{
+	int x, bytes = 0;
+
+	if ((x = chan->outwritebuf) < 0)
+		return (0);
+	do {
+		bytes += chan->writen[x] - chan->writeidx[x];
+		x = (x + 1) % chan->numbufs;
+	} while (x != chan->inwritebuf && x != chan->outwritebuf);
+	return (bytes);
+}
+
+/**
+ * Check if a frame of 'len' bytes may go to the write buffers now
+ *
+ * Called with the channel lock held.
+ */
+static int
+dahdi_iface_tx_room(struct dahdi_chan *chan, struct dahdi_iface *iface, int len)
+{
+	int inflight;
+
+	if (chan->inwritebuf < 0)
+		return (0);
+	inflight = dahdi_iface_tx_inflight(chan);
+	return (inflight == 0 || inflight + len <= iface->tx_limit);
+}
+
+/**
+ * Copy a frame to the channel write buffers and start sending it
+ *
+ * Called with the channel lock held.
+ */
+static void
+dahdi_iface_tx_put(struct dahdi_chan *chan, struct mbuf *m, int len)
+{
+	m_copydata(m, 0, len, chan->writebuf[chan->inwritebuf]);
+	chan->writen[chan->inwritebuf] = len;
+	dahdi_net_chan_xmit(chan);
+	chan->iface->stats.tx_packets++;
+	chan->iface->stats.tx_bytes += len;
+}
+
+/**
+ * Let a hardware HDLC controller know there is something to send
+ *
+ * Called without the channel lock held.
+ */
+static void
+dahdi_iface_tx_kick(struct dahdi_chan *chan)
+{
+	if ((chan->flags & DAHDI_FLAG_NOSTDTXRX) && chan->span->ops->hdlc_hard_xmit)
+		chan->span->ops->hdlc_hard_xmit(chan);
+}
+
+/**
+ * Move queued frames to the channel write buffers
+ */
+static void
+dahdi_iface_tx_task(void *context, int pending)
+{
+	struct dahdi_chan *chan = context;
+	struct dahdi_iface *iface;
+	unsigned long flags;
+	struct mbuf *m, *done = NULL;
+	int len;
+
+	if ((iface = chan->iface) == NULL)
+		return;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	while ((m = iface->tx_queue) != NULL &&
+	    dahdi_iface_tx_room(chan, iface, len = m_length(m, NULL))) {
+		if ((iface->tx_queue = m->m_nextpkt) == NULL)
+			iface->tx_queue_tail = &iface->tx_queue;
+		iface->tx_queue_len--;
+		iface->tx_queue_bytes -= len;
+		dahdi_iface_tx_put(chan, m, len);
+		m->m_nextpkt = done;
+		done = m;
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (done != NULL)
+		dahdi_iface_tx_kick(chan);
+	dahdi_iface_freem_list(done);
 }
 
 /**
  * Wake up transmitter
+ *
+ * Called with the channel lock held each time the line has finished
+ * sending a write buffer.
  */
 void
 dahdi_iface_wakeup_tx(struct dahdi_chan *chan)
 {
-	/* XXX not implemented */
+	struct dahdi_iface *iface;
+	int inflight;
+
+	if ((iface = chan->iface) == NULL)
+		return;
+
+	inflight = dahdi_iface_tx_inflight(chan);
+	if (iface->tx_queue != NULL && inflight == 0) {
+		/* starved: the line has nothing to send but flags */
+		iface->tx_limit += iface->tx_limit / 2;
+		if (iface->tx_limit > chan->numbufs * chan->blocksize)
+			iface->tx_limit = chan->numbufs * chan->blocksize;
+	} else if (inflight > iface->tx_limit / 2) {
+		/* more buffered than it takes to keep the line busy */
+		iface->tx_limit -= iface->tx_limit / 8;
+		if (iface->tx_limit < chan->blocksize)
+			iface->tx_limit = chan->blocksize;
+	}
+
+	if (iface->tx_queue != NULL)
+		taskqueue_enqueue_fast(iface->rx_taskqueue, &iface->tx_task);
 }
 
 /**
@@ -461,12 +868,30 @@ dahdi_iface_wakeup_tx(struct dahdi_chan *chan)
 static int
 ng_dahdi_iface_rcvmsg(struct ng_node *node, struct ng_item *item, struct ng_hook *lasthook)
 {
-	/* struct dahdi_iface *iface = NG_NODE_PRIVATE(node); */
+	struct dahdi_iface *iface = NG_NODE_PRIVATE(node);
 	struct ng_mesg *msg, *resp = NULL;
 	int error = 0;
 
 	NGI_GET_MSG(item, msg);
 	switch (msg->header.typecookie) {
+	case NGM_DAHDI_IFACE_COOKIE:
+		switch (msg->header.cmd) {
+		case NGM_DAHDI_IFACE_GET_STATS:
+			NG_MKRESPONSE(resp, msg, sizeof(iface->stats), M_NOWAIT);
+			if (resp == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			memcpy(resp->data, &iface->stats, sizeof(iface->stats));
+			break;
+		case NGM_DAHDI_IFACE_CLR_STATS:
+			memset(&iface->stats, 0, sizeof(iface->stats));
+			break;
+		default:
+			error = EINVAL;
+			break;
+		}
+		break;
 	case NGM_IFACE_COOKIE:
 		switch (msg->header.cmd) {
 		case NGM_IFACE_GET_IFNAME:
@@ -572,15 +997,14 @@ ng_dahdi_iface_rcvdata(struct ng_hook *hook, struct ng_item *item)
 	struct mbuf *m;
 	int retval = 0;
 	unsigned long flags;
-	unsigned char *data;
 	int data_len;
+	int sent = 0;
 
 	/* get mbuf */
 	NGI_GET_M(item, m);
 	NG_FREE_ITEM(item);
 	data_len = m_length(m, NULL);
 
-	/* see if we have any buffers */
 	spin_lock_irqsave(&ss->lock, flags);
 	if (data_len > ss->blocksize - 2) {
 		printf("dahdi_iface(%s): mbuf is too large (%d > %d)",
@@ -589,21 +1013,38 @@ ng_dahdi_iface_rcvdata(struct ng_hook *hook, struct ng_item *item)
 		retval = EINVAL;
 		goto out;
 	}
-	if (ss->inwritebuf < 0) {
-		/* no space */
+
+	/* straight to the write buffers if nothing is waiting */
+	if (iface->tx_queue == NULL && dahdi_iface_tx_room(ss, iface, data_len)) {
+		dahdi_iface_tx_put(ss, m, data_len);
+		sent = 1;
+		goto out;
+	}
+
+	if (iface->tx_queue_bytes + data_len > dahdi_iface_tx_queue) {
+		/* queue full: drop it, ng_iface hands ENOBUFS up the stack */
+		iface->stats.tx_dropped++;
+		atomic_add_long(&dahdi_iface_tx_drops, 1);
 		retval = ENOBUFS;
 		goto out;
 	}
 
-	/* we have a place to put this packet */
-	data = ss->writebuf[ss->inwritebuf];
-	m_copydata(m, 0, data_len, data);
-	ss->writen[ss->inwritebuf] = data_len;
-	dahdi_net_chan_xmit(ss);
+	/* wait for dahdi_iface_wakeup_tx() */
+	m->m_nextpkt = NULL;
+	*iface->tx_queue_tail = m;
+	iface->tx_queue_tail = &m->m_nextpkt;
+	iface->tx_queue_len++;
+	iface->tx_queue_bytes += data_len;
+	if (iface->tx_queue_bytes > iface->stats.tx_queue_peak)
+		iface->stats.tx_queue_peak = iface->tx_queue_bytes;
+	m = NULL;
 
 out:
 	spin_unlock_irqrestore(&ss->lock, flags);
 
+	if (sent)
+		dahdi_iface_tx_kick(ss);
+
 	/* free memory */
 	NG_FREE_M(m);
 	return (retval);
@@ -31,6 +31,50 @@
 #ifndef _NG_DAHDI_IFACE_H_
 #define _NG_DAHDI_IFACE_H_
 
+#define NGM_DAHDI_IFACE_COOKIE		1318339742
+
+/* Netgraph control messages */
+enum {
+	NGM_DAHDI_IFACE_GET_STATS = 1,	/* returns struct ng_dahdi_iface_stats */
+	NGM_DAHDI_IFACE_CLR_STATS,	/* clears the counters */
+};
+
+/**
+ * Interface counters
+ */
+struct ng_dahdi_iface_stats {
+	uint64_t rx_packets;		/**< frames sent up */
+	uint64_t rx_bytes;		/**< bytes sent up */
+	uint64_t rx_dropped;		/**< frames dropped for want of an mbuf */
+	uint64_t rx_errors;		/**< frames aborted by the receiver */
+	uint64_t rx_crc_errors;		/**< ... because of a bad FCS */
+	uint64_t rx_over_errors;	/**< ... because they did not fit */
+	uint64_t rx_frame_errors;	/**< ... because of an HDLC abort */
+	uint64_t rx_pool_hits;		/**< frames received straight into an mbuf */
+	uint64_t rx_pool_misses;	/**< frames that found the mbuf pool empty */
+	uint64_t tx_packets;		/**< frames given to the write buffers */
+	uint64_t tx_bytes;		/**< bytes given to the write buffers */
+	uint64_t tx_dropped;		/**< frames dropped with the queue full */
+	uint64_t tx_queue_peak;		/**< most bytes ever waiting in the queue */
+};
+
+#define NG_DAHDI_IFACE_STATS_TYPE_INFO	{			\
+	{ "rx_packets",		&ng_parse_uint64_type },	\
+	{ "rx_bytes",		&ng_parse_uint64_type },	\
+	{ "rx_dropped",		&ng_parse_uint64_type },	\
+	{ "rx_errors",		&ng_parse_uint64_type },	\
+	{ "rx_crc_errors",	&ng_parse_uint64_type },	\
+	{ "rx_over_errors",	&ng_parse_uint64_type },	\
+	{ "rx_frame_errors",	&ng_parse_uint64_type },	\
+	{ "rx_pool_hits",	&ng_parse_uint64_type },	\
+	{ "rx_pool_misses",	&ng_parse_uint64_type },	\
+	{ "tx_packets",		&ng_parse_uint64_type },	\
+	{ "tx_bytes",		&ng_parse_uint64_type },	\
+	{ "tx_dropped",		&ng_parse_uint64_type },	\
+	{ "tx_queue_peak",	&ng_parse_uint64_type },	\
+	{ NULL }						\
+}
+
 /**
  * Create a netgraph node and connect it to ng_iface instance
  *
@@ -48,6 +92,26 @@ void dahdi_iface_destroy(struct dahdi_chan *chan);
  */
 void dahdi_iface_rx(struct dahdi_chan *chan);
 
+/**
+ * Append bytes of a frame received by hardware HDLC
+ *
+ * @return number of bytes taken, or -1 if the frame has to go through the
+ * channel read buffers instead
+ */
+int dahdi_iface_hdlc_putbuf(struct dahdi_chan *chan, const unsigned char *rxb, int bytes);
+
+/**
+ * Finish a frame received by hardware HDLC
+ *
+ * @return 0 if the frame was in an mbuf, -1 if it is in the read buffers
+ */
+int dahdi_iface_hdlc_finish(struct dahdi_chan *chan);
+
+/**
+ * Drop a frame received by hardware HDLC
+ */
+void dahdi_iface_hdlc_abort(struct dahdi_chan *chan);
+
 /**
  * Abort receiving a data frame
  */
@@ -37,6 +37,8 @@
 #include <sys/kernel.h>
 #include <sys/malloc.h>
 #include <sys/module.h>
+#include <sys/sbuf.h>
+#include <sys/sysctl.h>
 
 #include <sys/conf.h>
 #include <sys/errno.h>
@@ -70,16 +72,47 @@ static struct dahdi_dummy *dahdi_d;
 static int debug = 0;
 static struct timeval basetime, curtime, sleeptime;
 
+/*
+ * How long each tick takes DAHDI, spans driven off ours included, and
+ * how often we fall behind.
+ */
+static struct {
+	unsigned long ticks;
+	unsigned long late;		/* Ticks run behind their time */
+	unsigned long missed;		/* Ticks given up on */
+	unsigned long last_ns;
+	unsigned long max_ns;
+	unsigned long long total_ns;
+} tick_stats;
+
+static __inline void
+dahdi_dummy_tick(void)
+{
+	struct timespec start, end;
+	unsigned long ns;
+
+	nanouptime(&start);
+	dahdi_receive(&dahdi_d->span);
+	dahdi_transmit(&dahdi_d->span);
+	nanouptime(&end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000UL +
+	    end.tv_nsec - start.tv_nsec;
+	tick_stats.ticks++;
+	tick_stats.last_ns = ns;
+	if (ns > tick_stats.max_ns)
+		tick_stats.max_ns = ns;
+	tick_stats.total_ns += ns;
+}
+
 static __inline void
 dahdi_dummy_timer(void *arg)
 {
 	int i, ticks;
 
 loop:
-	for (i = 0; i < hz / 100; i++) {
-		dahdi_receive(&dahdi_d->span);
-		dahdi_transmit(&dahdi_d->span);
-	}
+	for (i = 0; i < hz / 100; i++)
+		dahdi_dummy_tick();
 
 fixtime:
 	microtime(&curtime);
@@ -105,10 +138,14 @@ fixtime:
 		 * clock forward by a large amount.
 		 */
 		if (sleeptime.tv_sec < -1) {
+			tick_stats.missed += (-sleeptime.tv_sec * 100 -
+			    sleeptime.tv_usec / 10000) * (hz / 100);
 			basetime.tv_sec = curtime.tv_sec;
 			basetime.tv_usec = curtime.tv_usec;
 			goto fixtime;
 		}
+		if (sleeptime.tv_sec < 0)
+			tick_stats.late += hz / 100;
 		goto loop;
 	}
 	/*
@@ -130,6 +167,43 @@ fixtime:
 	dahdi_dummy_timer_handle = timeout(dahdi_dummy_timer, NULL, ticks);
 }
 
+static int
+dahdi_dummy_sysctl_stats(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf *sb;
+	int error;
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 128, req);
+	if (sb == NULL)
+		return (ENOMEM);
+	sbuf_printf(sb, "ticks %lu late %lu missed %lu last %luns max %luns "
+	    "avg %lluns\n", tick_stats.ticks, tick_stats.late,
+	    tick_stats.missed, tick_stats.last_ns, tick_stats.max_ns,
+	    tick_stats.ticks ? tick_stats.total_ns / tick_stats.ticks : 0);
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return (error);
+}
+
+static int
+dahdi_dummy_sysctl_reset(SYSCTL_HANDLER_ARGS)
+{
+	int error, reset = 0;
+
+	error = sysctl_handle_int(oidp, &reset, 0, req);
+	if (error || req->newptr == NULL)
+		return (error);
+	if (reset)
+		memset(&tick_stats, 0, sizeof(tick_stats));
+	return (0);
+}
+
+SYSCTL_NODE(_dahdi, OID_AUTO, dummy, CTLFLAG_RW, 0, "DAHDI Dummy Timing");
+SYSCTL_PROC(_dahdi_dummy, OID_AUTO, stats, CTLTYPE_STRING | CTLFLAG_RD,
+    NULL, 0, dahdi_dummy_sysctl_stats, "A", "Tick processing time");
+SYSCTL_PROC(_dahdi_dummy, OID_AUTO, reset_stats, CTLTYPE_INT | CTLFLAG_RW,
+    NULL, 0, dahdi_dummy_sysctl_reset, "I", "Set to clear the statistics");
+
 static int
 dahdi_dummy_initialize(struct dahdi_dummy *dahdi_d)
 {
@@ -325,8 +325,10 @@ dev_xmit(struct net_device *netdev, struct mbuf *m)
 	int error;
 	struct dahdi_netdev *ddev = netdev_priv(netdev);
 
-	if (ddev->upper == NULL)
+	if (ddev->upper == NULL) {
+		m_freem(m);
 		return;
+	}
 	NG_SEND_DATA_ONLY(error, ddev->upper, m);
 }
 
@@ -301,6 +301,12 @@ static struct proc_dir_entry *root_proc_entry;
 
 static int deftaps = 64;
 
+/* Average transmit amplitude (linear) below which the far end is idle */
+static int ec_idle_threshold = 16;
+/* Time (ms) the far end must stay idle before echo cancellation is bypassed.
+ * Must cover the longest tail so that echo still in flight is cancelled. */
+static int ec_idle_hangover = 256;
+
 int debug;
 #define DEBUG_MAIN	(1 << 0)
 #define DEBUG_RBS	(1 << 5)
@@ -1049,6 +1055,13 @@ static int dahdi_seq_show(struct seq_file *sfile, void *v)
 					chan->ec_factory->get_name(chan),
 					chan->ec_state ? "ACTIVE" : "INACTIVE");
 
+		/* Kept apart from the EC text above, which tools parse */
+		if (chan->ec_factory && chan->ec_state)
+			seq_printf(sfile, "(EC taps: %u+%u/%u) ",
+					chan->ec_state->status.active_start,
+					chan->ec_state->status.active_length,
+					chan->ec_state->status.tap_length);
+
 		seq_printf(sfile, "\n");
 	}
 	put_span(s);
@@ -1204,8 +1217,7 @@ void dahdi_qevent_lock(struct dahdi_chan *chan, int event)
 
 static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 {
-	int x;
-	unsigned int fcs = PPP_INITFCS;
+	unsigned int fcs;
 	unsigned char *data = ss->writebuf[inwritebuf];
 	int len = ss->writen[inwritebuf];
 
@@ -1213,8 +1225,7 @@ static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 	if (len < 2)
 		return;
 
-	for (x = 0; x < len - 2; x++)
-		fcs = PPP_FCS(fcs, data[x]);
+	fcs = fasthdlc_fcs(PPP_INITFCS, data, len - 2);
 
 	fcs ^= 0xffff;
 	/* Send out the FCS */
@@ -1998,15 +2009,13 @@ void dahdi_net_chan_destroy(struct dahdi_chan *ms)
 
 void dahdi_net_chan_xmit(struct dahdi_chan *ss)
 {
-	int x, oldbuf;
+	int oldbuf;
 	unsigned int fcs;
 	unsigned char *data = ss->writebuf[ss->inwritebuf];
 
 	ss->writeidx[ss->inwritebuf] = 0;
 	/* Calculate the FCS */
-	fcs = PPP_INITFCS;
-	for (x=0;x<ss->writen[ss->inwritebuf];x++)
-		fcs = PPP_FCS(fcs, data[x]);
+	fcs = fasthdlc_fcs(PPP_INITFCS, data, ss->writen[ss->inwritebuf]);
 	/* Invert it */
 	fcs ^= 0xffff;
 	/* Send it out LSB first */
@@ -2195,7 +2204,7 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 	 * 1 and never if we return 0
          */
 	struct dahdi_chan *ss = ppp->private;
-	int x,oldbuf;
+	int oldbuf;
 	unsigned int fcs;
 	unsigned char *data;
 	unsigned long flags;
@@ -2228,9 +2237,7 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 		ss->writeidx[ss->inwritebuf] = 0;
 
 		/* Calculate the FCS */
-		fcs = PPP_INITFCS;
-		for (x=0;x<skb->len + 2;x++)
-			fcs = PPP_FCS(fcs, data[x]);
+		fcs = fasthdlc_fcs(PPP_INITFCS, data, skb->len + 2);
 		/* Invert it */
 		fcs ^= 0xffff;
 
@@ -4666,41 +4673,37 @@ static const struct net_device_ops dahdi_netdev_ops = {
 };
 #endif
 
-static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
+static int __dahdi_chanconfig(struct file *file, struct dahdi_chanconfig *ch)
 {
 	int res = 0;
 	int y;
-	struct dahdi_chanconfig ch;
 	struct dahdi_chan *newmaster;
 	struct dahdi_chan *chan;
 	struct dahdi_chan *dacs_chan = NULL;
 	unsigned long flags;
 	int sigcap;
 
-	if (copy_from_user(&ch, (void __user *)data, sizeof(ch)))
-		return -EFAULT;
-
-	chan = chan_from_num(ch.chan);
+	chan = chan_from_num(ch->chan);
 	if (!chan) {
 		printk(KERN_NOTICE "%s: No channel for number %d\n",
-				__func__, ch.chan);
+				__func__, ch->chan);
 		return -EINVAL;
 	}
 
-	if (ch.sigtype == DAHDI_SIG_SLAVE) {
-		newmaster = chan_from_num(ch.master);
+	if (ch->sigtype == DAHDI_SIG_SLAVE) {
+		newmaster = chan_from_num(ch->master);
 		if (!newmaster) {
 			chan_notice(chan, "%s: slave channel without master.\n",
 					__func__);
 			return -EINVAL;
 		}
-		ch.sigtype = newmaster->sig;
-	} else if ((ch.sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
+		ch->sigtype = newmaster->sig;
+	} else if ((ch->sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
 		newmaster = chan;
-		dacs_chan = chan_from_num(ch.idlebits);
+		dacs_chan = chan_from_num(ch->idlebits);
 		if (!dacs_chan) {
 			chan_notice(chan, "%s: dacs channel not found: %d.\n",
-					__func__, ch.idlebits);
+					__func__, ch->idlebits);
 			return -EINVAL;
 		}
 	} else {
@@ -4730,7 +4733,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 		clear_bit(DAHDI_FLAGBIT_NETDEV, &chan->flags);
 	}
 #else
-	if (ch.sigtype == DAHDI_SIG_HDLCNET) {
+	if (ch->sigtype == DAHDI_SIG_HDLCNET) {
 		spin_unlock_irqrestore(&chan->lock, flags);
 		module_printk(KERN_WARNING, "DAHDI networking not supported by this build.\n");
 		return -ENOSYS;
@@ -4742,10 +4745,10 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	if (sigcap & DAHDI_SIG_CLEAR)
 		sigcap |= (DAHDI_SIG_HDLCRAW | DAHDI_SIG_HDLCFCS | DAHDI_SIG_HDLCNET | DAHDI_SIG_DACS);
 
-	if ((sigcap & ch.sigtype) != ch.sigtype) {
+	if ((sigcap & ch->sigtype) != ch->sigtype) {
 		if (debug) {
 			chan_notice(chan, "%s: bad sigtype. sigcap: %x, sigtype: %x.\n",
-					__func__, sigcap, ch.sigtype);
+					__func__, sigcap, ch->sigtype);
 		}
 		res = -EINVAL;
 	}
@@ -4761,12 +4764,12 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	}
 
 	if (!res) {
-		chan->sig = ch.sigtype;
+		chan->sig = ch->sigtype;
 		if (chan->sig == DAHDI_SIG_CAS)
-			chan->idlebits = ch.idlebits;
+			chan->idlebits = ch->idlebits;
 		else
 			chan->idlebits = 0;
-		if ((ch.sigtype & DAHDI_SIG_CLEAR) == DAHDI_SIG_CLEAR) {
+		if ((ch->sigtype & DAHDI_SIG_CLEAR) == DAHDI_SIG_CLEAR) {
 			/* Set clear channel flag if appropriate */
 			chan->flags &= ~DAHDI_FLAG_AUDIO;
 			chan->flags |= DAHDI_FLAG_CLEAR;
@@ -4775,21 +4778,21 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			chan->flags |= DAHDI_FLAG_AUDIO;
 			chan->flags &= ~DAHDI_FLAG_CLEAR;
 		}
-		if ((ch.sigtype & DAHDI_SIG_HDLCRAW) == DAHDI_SIG_HDLCRAW) {
+		if ((ch->sigtype & DAHDI_SIG_HDLCRAW) == DAHDI_SIG_HDLCRAW) {
 			/* Set the HDLC flag */
 			chan->flags |= DAHDI_FLAG_HDLC;
 		} else {
 			/* Clear the HDLC flag */
 			chan->flags &= ~DAHDI_FLAG_HDLC;
 		}
-		if ((ch.sigtype & DAHDI_SIG_HDLCFCS) == DAHDI_SIG_HDLCFCS) {
+		if ((ch->sigtype & DAHDI_SIG_HDLCFCS) == DAHDI_SIG_HDLCFCS) {
 			/* Set FCS to be calculated if appropriate */
 			chan->flags |= DAHDI_FLAG_FCS;
 		} else {
 			/* Clear FCS flag */
 			chan->flags &= ~DAHDI_FLAG_FCS;
 		}
-		if ((ch.sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
+		if ((ch->sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
 			if (unlikely(!dacs_chan)) {
 				spin_unlock_irqrestore(&chan->lock, flags);
 				chan_notice(chan, "%s: dacs but no dacs_chan\n",
@@ -4798,7 +4801,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			}
 			/* Setup conference properly */
 			chan->confmode = DAHDI_CONF_DIGITALMON;
-			chan->confna = ch.idlebits;
+			chan->confna = ch->idlebits;
 			chan->dacs_chan = dacs_chan;
 			res = dahdi_chan_dacs(chan, dacs_chan);
 		} else {
@@ -4809,7 +4812,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 		if (newmaster != chan) {
 			recalc_slaves(chan->master);
 		}
-		if ((ch.sigtype & DAHDI_SIG_HARDHDLC) == DAHDI_SIG_HARDHDLC) {
+		if ((ch->sigtype & DAHDI_SIG_HARDHDLC) == DAHDI_SIG_HARDHDLC) {
 			chan->flags &= ~DAHDI_FLAG_FCS;
 			chan->flags &= ~DAHDI_FLAG_HDLC;
 			chan->flags |= DAHDI_FLAG_NOSTDTXRX;
@@ -4817,7 +4820,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			chan->flags &= ~DAHDI_FLAG_NOSTDTXRX;
 		}
 
-		if ((ch.sigtype & DAHDI_SIG_MTP2) == DAHDI_SIG_MTP2)
+		if ((ch->sigtype & DAHDI_SIG_MTP2) == DAHDI_SIG_MTP2)
 			chan->flags |= DAHDI_FLAG_MTP2;
 		else
 			chan->flags &= ~DAHDI_FLAG_MTP2;
@@ -4827,7 +4830,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	 * the channel lock held. */
 	spin_unlock_irqrestore(&chan->lock, flags);
 	if (!res && chan->span->ops->chanconfig)
-		res = chan->span->ops->chanconfig(file, chan, ch.sigtype);
+		res = chan->span->ops->chanconfig(file, chan, ch->sigtype);
 	spin_lock_irqsave(&chan->lock, flags);
 
 
@@ -4859,7 +4862,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 				dev_to_hdlc(chan->hdlcnetdev->netdev)->xmit = dahdi_xmit;
 				spin_unlock_irqrestore(&chan->lock, flags);
 				/* Briefly restore interrupts while we register the device */
-				res = dahdi_register_hdlc_device(chan->hdlcnetdev->netdev, ch.netdev_name);
+				res = dahdi_register_hdlc_device(chan->hdlcnetdev->netdev, ch->netdev_name);
 				spin_lock_irqsave(&chan->lock, flags);
 			} else {
 				module_printk(KERN_NOTICE, "Unable to allocate hdlc: *shrug*\n");
@@ -4890,12 +4893,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 		module_printk(KERN_NOTICE, "Unable to register HDLC device for channel %s\n", chan->name);
 	if (!res) {
 		/* Setup default law */
-		chan->deflaw = ch.deflaw;
-		/* Copy back any modified settings */
-		spin_unlock_irqrestore(&chan->lock, flags);
-		if (copy_to_user((void __user *)data, &ch, sizeof(ch)))
-			return -EFAULT;
-		spin_lock_irqsave(&chan->lock, flags);
+		chan->deflaw = ch->deflaw;
 		/* And hangup */
 		dahdi_hangup(chan);
 		y = dahdi_q_sig(chan) & 0xff;
@@ -4911,6 +4909,30 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	return res;
 }
 
+static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
+{
+	struct dahdi_chanconfig ch;
+	int res;
+
+	if (copy_from_user(&ch, (void __user *)data, sizeof(ch)))
+		return -EFAULT;
+	res = __dahdi_chanconfig(file, &ch);
+	/* Copy back any modified settings */
+	if (!res && copy_to_user((void __user *)data, &ch, sizeof(ch)))
+		return -EFAULT;
+	return res;
+}
+
+/**
+ * dahdi_chanconfig() - DAHDI_CHANCONFIG for callers in the kernel.
+ * @ch:		The configuration, updated as the ioctl would.
+ */
+int dahdi_chanconfig(struct dahdi_chanconfig *ch)
+{
+	return __dahdi_chanconfig(NULL, ch);
+}
+EXPORT_SYMBOL(dahdi_chanconfig);
+
 /**
  * dahdi_ioctl_set_dialparms - Set the global dial parameters.
  * @data:	Pointer to user space that contains dahdi_dialparams.
@@ -5144,41 +5166,43 @@ static bool dahdi_is_hwec_available(const struct dahdi_chan *chan)
 	return true;
 }
 
-static int dahdi_ioctl_attach_echocan(unsigned long data)
+/**
+ * dahdi_attach_echocan() - DAHDI_ATTACH_ECHOCAN, also for callers in the
+ * kernel.
+ * @ae:		Channel number and echo canceler name; an empty name
+ *		detaches.
+ */
+int dahdi_attach_echocan(struct dahdi_attach_echocan *ae)
 {
 	unsigned long flags;
 	struct dahdi_chan *chan;
-	struct dahdi_attach_echocan ae;
 	const struct dahdi_echocan_factory *new = NULL, *old;
 
-	if (copy_from_user(&ae, (void __user *)data, sizeof(ae)))
-		return -EFAULT;
-
-	chan = chan_from_num(ae.chan);
+	chan = chan_from_num(ae->chan);
 	if (!chan)
 		return -EINVAL;
 
-	ae.echocan[sizeof(ae.echocan) - 1] = '\0';
+	ae->echocan[sizeof(ae->echocan) - 1] = '\0';
 	if (dahdi_is_hwec_available(chan)) {
 		if (hwec_overrides_swec) {
 			chan_dbg(GENERAL, chan,
 				"Using echocan '%s' instead of requested " \
-				"'%s'.\n", hwec_def_name, ae.echocan);
+				"'%s'.\n", hwec_def_name, ae->echocan);
 			/* If there is a hardware echocan available we'll
 			 * always use it instead of any configured software
 			 * echocan. This matches the behavior in dahdi 2.4.1.2
 			 * and earlier releases. */
-			strlcpy(ae.echocan, hwec_def_name, sizeof(ae.echocan));
+			strlcpy(ae->echocan, hwec_def_name, sizeof(ae->echocan));
 
-		} else if (strcasecmp(ae.echocan, hwec_def_name) != 0) {
+		} else if (strcasecmp(ae->echocan, hwec_def_name) != 0) {
 			chan_dbg(GENERAL, chan,
 				"Using '%s' on channel even though '%s' is " \
-				"available.\n", ae.echocan, hwec_def_name);
+				"available.\n", ae->echocan, hwec_def_name);
 		}
 	}
 
-	if (ae.echocan[0]) {
-		new = find_echocan(ae.echocan);
+	if (ae->echocan[0]) {
+		new = find_echocan(ae->echocan);
 		if (!new)
 			return -EINVAL;
 
@@ -5198,6 +5222,16 @@ static int dahdi_ioctl_attach_echocan(unsigned long data)
 
 	return 0;
 }
+EXPORT_SYMBOL(dahdi_attach_echocan);
+
+static int dahdi_ioctl_attach_echocan(unsigned long data)
+{
+	struct dahdi_attach_echocan ae;
+
+	if (copy_from_user(&ae, (void __user *)data, sizeof(ae)))
+		return -EFAULT;
+	return dahdi_attach_echocan(&ae);
+}
 
 static int dahdi_ioctl_sfconfig(unsigned long data)
 {
@@ -5471,9 +5505,8 @@ static int ioctl_dahdi_dial(struct dahdi_chan *chan, unsigned long data)
 	return rv;
 }
 
-static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
+static int __dahdi_setconf(struct file *file, struct dahdi_confinfo *conf)
 {
-	struct dahdi_confinfo conf;
 	struct dahdi_chan *chan;
 	struct dahdi_chan *conf_chan = NULL;
 	unsigned long flags;
@@ -5481,12 +5514,9 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	int oldconf;
 	enum {NONE, ENABLE_HWPREEC, DISABLE_HWPREEC} preec = NONE;
 
-	if (copy_from_user(&conf, (void __user *)data, sizeof(conf)))
-		return -EFAULT;
-
-	confmode = conf.confmode & DAHDI_CONF_MODE_MASK;
+	confmode = conf->confmode & DAHDI_CONF_MODE_MASK;
 
-	chan = (conf.chan) ? chan_from_num(conf.chan) :
+	chan = (conf->chan) ? chan_from_num(conf->chan) :
 			     chan_from_file(file);
 	if (!chan)
 		return -EINVAL;
@@ -5495,44 +5525,44 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 		return -EINVAL;
 
 	if ((DAHDI_CONF_DIGITALMON == confmode) ||
-	    is_monitor_mode(conf.confmode)) {
-		conf_chan = chan_from_num(conf.confno);
+	    is_monitor_mode(conf->confmode)) {
+		conf_chan = chan_from_num(conf->confno);
 		if (!conf_chan)
 			return -EINVAL;
 	} else {
 		/* make sure conf number makes sense, too */
-		if ((conf.confno < -1) || (conf.confno > DAHDI_MAX_CONF))
+		if ((conf->confno < -1) || (conf->confno > DAHDI_MAX_CONF))
 			return -EINVAL;
 	}
 
 	/* if taking off of any conf, must have 0 mode */
-	if ((!conf.confno) && conf.confmode)
+	if ((!conf->confno) && conf->confmode)
 		return -EINVAL;
 	/* likewise if 0 mode must have no conf */
-	if ((!conf.confmode) && conf.confno)
+	if ((!conf->confmode) && conf->confno)
 		return -EINVAL;
-	dahdi_check_conf(conf.confno);
-	conf.chan = chan->channo;  /* return with real channel # */
+	dahdi_check_conf(conf->confno);
+	conf->chan = chan->channo;  /* return with real channel # */
 	spin_lock_irqsave(&chan_lock, flags);
 	spin_lock(&chan->lock);
-	if (conf.confno == -1)
-		conf.confno = dahdi_first_empty_conference();
-	if ((conf.confno < 1) && (conf.confmode)) {
+	if (conf->confno == -1)
+		conf->confno = dahdi_first_empty_conference();
+	if ((conf->confno < 1) && (conf->confmode)) {
 		/* No more empty conferences */
 		spin_unlock(&chan->lock);
 		spin_unlock_irqrestore(&chan_lock, flags);
 		return -EBUSY;
 	}
 	  /* if changing confs, clear last added info */
-	if (conf.confno != chan->confna) {
+	if (conf->confno != chan->confna) {
 		memset(chan->conflast, 0, DAHDI_MAX_CHUNKSIZE);
 		memset(chan->conflast1, 0, DAHDI_MAX_CHUNKSIZE);
 		memset(chan->conflast2, 0, DAHDI_MAX_CHUNKSIZE);
 	}
 	oldconf = chan->confna;  /* save old conference number */
-	chan->confna = conf.confno;   /* set conference number */
+	chan->confna = conf->confno;   /* set conference number */
 	chan->conf_chan = conf_chan;
-	chan->confmode = conf.confmode;  /* set conference mode */
+	chan->confmode = conf->confmode;  /* set conference mode */
 	chan->_confn = 0;		     /* Clear confn */
 	if (chan->span && chan->span->ops->dacs) {
 		if ((confmode == DAHDI_CONF_DIGITALMON) &&
@@ -5546,14 +5576,14 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 		}
 	}
 	/* if we are going onto a conf */
-	if (conf.confno &&
+	if (conf->confno &&
 	    (confmode == DAHDI_CONF_CONF ||
 	     confmode == DAHDI_CONF_CONFANN ||
 	     confmode == DAHDI_CONF_CONFMON ||
 	     confmode == DAHDI_CONF_CONFANNMON ||
 	     confmode == DAHDI_CONF_REALANDPSEUDO)) {
 		/* Get alias */
-		chan->_confn = dahdi_get_conf_alias(conf.confno);
+		chan->_confn = dahdi_get_conf_alias(conf->confno);
 	}
 
 	spin_unlock(&chan->lock);
@@ -5601,11 +5631,35 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	}
 
 	dahdi_check_conf(oldconf);
-	if (copy_to_user((void __user *)data, &conf, sizeof(conf)))
-		return -EFAULT;
 	return 0;
 }
 
+static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
+{
+	struct dahdi_confinfo conf;
+	int res;
+
+	if (copy_from_user(&conf, (void __user *)data, sizeof(conf)))
+		return -EFAULT;
+	res = __dahdi_setconf(file, &conf);
+	if (!res && copy_to_user((void __user *)data, &conf, sizeof(conf)))
+		return -EFAULT;
+	return res;
+}
+
+/**
+ * dahdi_setconf() - DAHDI_SETCONF for callers in the kernel.
+ * @conf:	The conference, with a channel number in it; updated as
+ *		the ioctl would.
+ */
+int dahdi_setconf(struct dahdi_confinfo *conf)
+{
+	if (!conf->chan)
+		return -EINVAL;
+	return __dahdi_setconf(NULL, conf);
+}
+EXPORT_SYMBOL(dahdi_setconf);
+
 /**
  * dahdi_ioctl_confdiag() - Output debug info about conferences to console.
  *
@@ -6261,6 +6315,11 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		chan->ec_current = ec_current;
 		chan->ec_state = ec;
 		ec->status.mode = ECHO_MODE_ACTIVE;
+		ec->status.tap_length = ecp->tap_length;
+		if (!ec->status.active_length) {
+			ec->status.active_start = 0;
+			ec->status.active_length = ecp->tap_length;
+		}
 		if (!ec->features.CED_tx_detect) {
 			echo_can_disable_detector_init(&chan->ec_state->txecdis);
 		}
@@ -6276,6 +6335,21 @@ exit_with_free:
 	return ret;
 }
 
+/**
+ * dahdi_echocancel() - DAHDI_ECHOCANCEL for callers in the kernel.
+ * @chan:	An audio channel with an echo canceler attached.
+ * @taps:	Tail length in samples; 0 turns echo cancellation off.
+ */
+int dahdi_echocancel(struct dahdi_chan *chan, int taps)
+{
+	struct dahdi_echocanparams ecp = { .tap_length = taps };
+
+	if (!(chan->flags & DAHDI_FLAG_AUDIO))
+		return -EINVAL;
+	return ioctl_echocancel(chan, &ecp, NULL);
+}
+EXPORT_SYMBOL(dahdi_echocancel);
+
 static void set_echocan_fax_mode(struct dahdi_chan *chan, unsigned int channo, const char *reason, unsigned int enable)
 {
 	if (enable) {
@@ -6590,6 +6664,23 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			spin_unlock_irqrestore(&chan->lock, flags);
 		}
 		break;
+	case DAHDI_ECHOCANCEL_WINDOW:
+	{
+		struct dahdi_echocan_window win;
+
+		spin_lock_irqsave(&chan->lock, flags);
+		if (!chan->ec_state) {
+			spin_unlock_irqrestore(&chan->lock, flags);
+			return -EINVAL;
+		}
+		win.tap_length = chan->ec_state->status.tap_length;
+		win.active_start = chan->ec_state->status.active_start;
+		win.active_length = chan->ec_state->status.active_length;
+		spin_unlock_irqrestore(&chan->lock, flags);
+		if (copy_to_user((void __user *)data, &win, sizeof(win)))
+			return -EFAULT;
+		break;
+	}
 	case DAHDI_SETTXBITS:
 		if (chan->sig != DAHDI_SIG_CAS)
 			return -EINVAL;
@@ -7639,12 +7730,9 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 
 #ifndef CONFIG_DAHDI_NO_ECHOCAN_DISABLE
 	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_tx_detect) {
-		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-			if (echo_can_disable_detector_update(&ms->ec_state->txecdis, getlin[x])) {
-				set_echocan_fax_mode(ms, ss->channo, "CED tx detected", 1);
-				dahdi_qevent_nolock(ms, DAHDI_EVENT_TX_CED_DETECTED);
-				break;
-			}
+		if (echo_can_disable_detector_update(&ms->ec_state->txecdis, getlin, DAHDI_CHUNKSIZE)) {
+			set_echocan_fax_mode(ms, ss->channo, "CED tx detected", 1);
+			dahdi_qevent_nolock(ms, DAHDI_EVENT_TX_CED_DETECTED);
 		}
 	}
 #endif
@@ -8533,6 +8621,40 @@ static void process_echocan_events(struct dahdi_chan *chan)
 	}
 }
 
+/**
+ * ec_far_end_idle() - check whether echo cancellation can be bypassed
+ * @ec:		echo canceller state
+ * @txlins:	reference chunk (linear)
+ *
+ * Returns true if the transmit direction has been below ec_idle_threshold
+ * for at least ec_idle_hangover ms and the echo canceller is able to just
+ * keep its history updated.
+ */
+static inline bool ec_far_end_idle(struct dahdi_echocan_state *ec,
+				   const short *txlins)
+{
+	int x;
+	int energy = 0;
+
+	if (!ec_idle_threshold || !ec->ops->echocan_bypass)
+		return false;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		energy += abs(txlins[x]);
+
+	if (energy > ec_idle_threshold * DAHDI_CHUNKSIZE) {
+		ec->status.idle_samples = 0;
+		return false;
+	}
+
+	if (ec->status.idle_samples < DAHDI_MS_TO_SAMPLES(ec_idle_hangover)) {
+		ec->status.idle_samples += DAHDI_CHUNKSIZE;
+		return false;
+	}
+
+	return true;
+}
+
 /**
  * __dahdi_ec_chunk() - process echo for a single channel
  * @ss:		DAHDI channel
@@ -8596,15 +8718,24 @@ void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
 			if (ss->ec_state->ops->echocan_process) {
 				short rxlins[DAHDI_CHUNKSIZE], txlins[DAHDI_CHUNKSIZE];
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-					rxlins[x] = DAHDI_XLAW(preecchunk[x],
-							       ss);
+				for (x = 0; x < DAHDI_CHUNKSIZE; x++)
 					txlins[x] = DAHDI_XLAW(txchunk[x], ss);
-				}
-				ss->ec_state->ops->echocan_process(ss->ec_state, rxlins, txlins, DAHDI_CHUNKSIZE);
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-					rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
+				if (ec_far_end_idle(ss->ec_state, txlins)) {
+					/* Nothing to cancel, just keep the
+					 * reference history current */
+					ss->ec_state->ops->echocan_bypass(ss->ec_state, txlins, DAHDI_CHUNKSIZE);
+					if (rxchunk != preecchunk)
+						memcpy(rxchunk, preecchunk, DAHDI_CHUNKSIZE);
+				} else {
+					for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+						rxlins[x] = DAHDI_XLAW(preecchunk[x], ss);
+
+					ss->ec_state->ops->echocan_process(ss->ec_state, rxlins, txlins, DAHDI_CHUNKSIZE);
+
+					for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+						rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
+				}
 			} else if (ss->ec_state->ops->echocan_events)
 				ss->ec_state->ops->echocan_events(ss->ec_state);
 
@@ -8641,42 +8772,44 @@ void _dahdi_ec_span(struct dahdi_span *span)
 }
 EXPORT_SYMBOL(_dahdi_ec_span);
 
-/* return 0 if nothing detected, 1 if lack of tone, 2 if presence of tone */
-/* modifies buffer pointed to by 'amp' with notched-out values */
-static inline int sf_detect(struct sf_detect_state *s,
-                 short *amp,
-                 int samples,long p1, long p2, long p3)
-{
-int     i,rv = 0;
-long x,y;
-
 #define	SF_DETECT_SAMPLES (DAHDI_CHUNKSIZE * 5)
 #define	SF_DETECT_MIN_ENERGY 500
 #define	NB 14  /* number of bits to shift left */
 
-        /* determine energy level before filtering */
-        for(i = 0; i < samples; i++)
-        {
-                if (amp[i] < 0) s->e1 -= amp[i];
-                else s->e1 += amp[i];
-        }
+/* return 0 if nothing detected, 1 if lack of tone, 2 if presence of tone */
+/* notches the tone out of the chunk in 'amp' and re-encodes it into 'rxb'.
+   The energy level before filtering is summed up by the caller while it
+   decodes the chunk, and must already be added to ms->rd.e1 */
+static inline int sf_detect(struct dahdi_chan *ms, short *amp,
+			    unsigned char *rxb)
+{
+	struct sf_detect_state *s = &ms->rd;
+	const long p1 = ms->rxp1, p2 = ms->rxp2, p3 = ms->rxp3;
+	long x1 = s->x1, x2 = s->x2, y1 = s->y1, y2 = s->y2;
+	long e2 = 0;
+	long x, y;
+	int i, rv = 0;
+
 	/* do 2nd order IIR notch filter at given freq. and calculate
 	    energy */
-        for(i = 0; i < samples; i++)
-        {
-                x = amp[i] << NB;
-                y = s->x2 + (p1 * (s->x1 >> NB)) + x;
-                y += (p2 * (s->y2 >> NB)) +
-			(p3 * (s->y1 >> NB));
-                s->x2 = s->x1;
-                s->x1 = x;
-                s->y2 = s->y1;
-                s->y1 = y;
-                amp[i] = y >> NB;
-                if (amp[i] < 0) s->e2 -= amp[i];
-                else s->e2 += amp[i];
-        }
-	s->samps += i;
+	for (i = 0; i < DAHDI_CHUNKSIZE; i++) {
+		x = amp[i] << NB;
+		y = x2 + (p1 * (x1 >> NB)) + x;
+		y += (p2 * (y2 >> NB)) + (p3 * (y1 >> NB));
+		x2 = x1;
+		x1 = x;
+		y2 = y1;
+		y1 = y;
+		amp[i] = y >> NB;
+		rxb[i] = DAHDI_LIN2X(amp[i], ms);
+		e2 += abs(amp[i]);
+	}
+	s->x1 = x1;
+	s->x2 = x2;
+	s->y1 = y1;
+	s->y2 = y2;
+	s->e2 += e2;
+	s->samps += DAHDI_CHUNKSIZE;
 	/* if time to do determination */
 	if ((s->samps) >= SF_DETECT_SAMPLES)
 	{
@@ -8698,6 +8831,8 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 	/* Linear version of received data */
 	short putlin[DAHDI_CHUNKSIZE],k[DAHDI_CHUNKSIZE];
 	int x,r;
+	/* if doing rx tone decoding */
+	const bool sf = ms->rxp1 && ms->rxp2 && ms->rxp3;
 
 	if (ms->dialing) ms->afterdialingtimer = 50;
 	else if (ms->afterdialingtimer) ms->afterdialingtimer--;
@@ -8706,31 +8841,35 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 		rxb[0] = DAHDI_LIN2X(0, ms);
 		memset(&rxb[1], rxb[0], DAHDI_CHUNKSIZE - 1);  /* receive as silence if dialing */
 	}
-	for (x=0;x<DAHDI_CHUNKSIZE;x++) {
-		rxb[x] = ms->rxgain[rxb[x]];
-		putlin[x] = DAHDI_XLAW(rxb[x], ms);
+	if (sf) {
+		long e1 = 0;
+
+		/* Sum up the energy before the SF notch in the same pass */
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			rxb[x] = ms->rxgain[rxb[x]];
+			putlin[x] = DAHDI_XLAW(rxb[x], ms);
+			e1 += abs(putlin[x]);
+		}
+		ms->rd.e1 += e1;
+	} else {
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			rxb[x] = ms->rxgain[rxb[x]];
+			putlin[x] = DAHDI_XLAW(rxb[x], ms);
+		}
 	}
 
 #ifndef CONFIG_DAHDI_NO_ECHOCAN_DISABLE
 	if (ms->ec_state && (ms->ec_state->status.mode == ECHO_MODE_ACTIVE) && !ms->ec_state->features.CED_rx_detect) {
-		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-			if (echo_can_disable_detector_update(&ms->ec_state->rxecdis, putlin[x])) {
-				set_echocan_fax_mode(ms, ss->channo, "CED rx detected", 1);
-				dahdi_qevent_nolock(ms, DAHDI_EVENT_RX_CED_DETECTED);
-				break;
-			}
+		if (echo_can_disable_detector_update(&ms->ec_state->rxecdis, putlin, DAHDI_CHUNKSIZE)) {
+			set_echocan_fax_mode(ms, ss->channo, "CED rx detected", 1);
+			dahdi_qevent_nolock(ms, DAHDI_EVENT_RX_CED_DETECTED);
 		}
 	}
 #endif
 
-	/* if doing rx tone decoding */
-	if (ms->rxp1 && ms->rxp2 && ms->rxp3)
+	if (sf)
 	{
-		r = sf_detect(&ms->rd,putlin,DAHDI_CHUNKSIZE,ms->rxp1,
-			ms->rxp2,ms->rxp3);
-		/* Convert back */
-		for(x=0;x<DAHDI_CHUNKSIZE;x++)
-			rxb[x] = DAHDI_LIN2X(putlin[x], ms);
+		r = sf_detect(ms, putlin, rxb);
 		if (r) /* if something happened */
 		{
 			if (r != ms->rd.lastdetect)
@@ -8971,6 +9110,10 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & DAHDI_FLAG_HDLC) {
+				/* ms->infcs covers the frame up to here, the
+				   bytes after it are added in one go below */
+				int fcsidx = ms->readidx[ms->inreadbuf];
+
 				for (x=0;x<left;x++) {
 					/* Handle HDLC deframing */
 					fasthdlc_rx_load_nocheck(&ms->rxhdlc, *(rxb++));
@@ -8982,6 +9125,8 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 					else if (res & RETURN_COMPLETE_FLAG) {
 						/* Only count this if it's a non-empty frame */
 						if (ms->readidx[ms->inreadbuf]) {
+							ms->infcs = fasthdlc_fcs(ms->infcs, buf + fcsidx,
+										 ms->readidx[ms->inreadbuf] - fcsidx);
 							if ((ms->flags & DAHDI_FLAG_FCS) && (ms->infcs != PPP_GOODFCS)) {
 								abort = DAHDI_EVENT_BADFCS;
 							} else
@@ -8997,10 +9142,7 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 						abort = DAHDI_EVENT_ABORT;
 						break;
 					} else {
-						unsigned char rxc;
-						rxc = res;
-						ms->infcs = PPP_FCS(ms->infcs, rxc);
-						buf[ms->readidx[ms->inreadbuf]++] = rxc;
+						buf[ms->readidx[ms->inreadbuf]++] = res;
 						/* Pay attention to the possibility of an overrun */
 						if (ms->readidx[ms->inreadbuf] >= ms->blocksize) {
 							if (!ss->span->alarms)
@@ -9014,6 +9156,10 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 						}
 					}
 				}
+				/* The frame goes on in the next chunk */
+				if (!eof && !abort)
+					ms->infcs = fasthdlc_fcs(ms->infcs, buf + fcsidx,
+								 ms->readidx[ms->inreadbuf] - fcsidx);
 			} else {
 				/* Not HDLC */
 				memcpy(buf + ms->readidx[ms->inreadbuf], rxb, left);
@@ -9261,6 +9407,12 @@ static void __dahdi_hdlc_abort(struct dahdi_chan *ss, int event)
 {
 	if (ss->inreadbuf >= 0)
 		ss->readidx[ss->inreadbuf] = 0;
+#if defined(__FreeBSD__)
+	if (dahdi_have_netdev(ss)) {
+		dahdi_iface_hdlc_abort(ss);
+		dahdi_iface_abort(ss, event);
+	}
+#endif
 	if (test_bit(DAHDI_FLAGBIT_OPEN, &ss->flags) && !ss->span->alarms)
 		__qevent(ss->master, event);
 }
@@ -9279,6 +9431,16 @@ void dahdi_hdlc_putbuf(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 	int left;
 
 	spin_lock_irqsave(&ss->lock, flags);
+#if defined(__FreeBSD__)
+	/* Network frames go straight into an mbuf when there is one */
+	if (dahdi_have_netdev(ss) &&
+	    (left = dahdi_iface_hdlc_putbuf(ss, rxb, bytes)) >= 0) {
+		if (left < bytes)
+			__dahdi_hdlc_abort(ss, DAHDI_EVENT_OVERRUN);
+		spin_unlock_irqrestore(&ss->lock, flags);
+		return;
+	}
+#endif
 	if (ss->inreadbuf < 0) {
 #ifdef CONFIG_DAHDI_DEBUG
 		module_printk(KERN_NOTICE, "No place to receive HDLC frame\n");
@@ -9313,6 +9475,12 @@ void dahdi_hdlc_finish(struct dahdi_chan *ss)
 
 	spin_lock_irqsave(&ss->lock, flags);
 
+#if defined(__FreeBSD__)
+	if (dahdi_have_netdev(ss) && !dahdi_iface_hdlc_finish(ss)) {
+		spin_unlock_irqrestore(&ss->lock, flags);
+		return;
+	}
+#endif
 	if ((oldreadbuf = ss->inreadbuf) < 0) {
 #ifdef CONFIG_DAHDI_DEBUG
 		module_printk(KERN_NOTICE, "No buffers to finish\n");
@@ -9330,6 +9498,14 @@ void dahdi_hdlc_finish(struct dahdi_chan *ss)
 	}
 
 	ss->readn[ss->inreadbuf] = ss->readidx[ss->inreadbuf];
+#if defined(__FreeBSD__)
+	if (dahdi_have_netdev(ss)) {
+		/* Copied into an mbuf by the iface rx task */
+		dahdi_iface_rx(ss);
+		spin_unlock_irqrestore(&ss->lock, flags);
+		return;
+	}
+#endif
 	ss->inreadbuf = (ss->inreadbuf + 1) % ss->numbufs;
 	if (ss->inreadbuf == ss->outreadbuf) {
 		ss->inreadbuf = -1;
@@ -9394,6 +9570,10 @@ int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsigned int
 			    !dahdi_have_netdev(ss)) {
 				wake_up_interruptible(&ss->waitq);
 			}
+#if defined(__FreeBSD__)
+			if (dahdi_have_netdev(ss))
+				dahdi_iface_wakeup_tx(ss);
+#endif
 		}
 	} else {
 		res = -1;
@@ -10298,6 +10478,14 @@ MODULE_PARM_DESC(debug, "Sets debugging verbosity as a bitfield, to see"\
 		" this to 32");
 module_param(deftaps, int, 0644);
 
+module_param(ec_idle_threshold, int, 0644);
+MODULE_PARM_DESC(ec_idle_threshold, "Average transmit level below which "
+		 "software echo cancellation is bypassed (0 to disable).");
+
+module_param(ec_idle_hangover, int, 0644);
+MODULE_PARM_DESC(ec_idle_hangover, "Time in ms the transmit level must stay "
+		 "below ec_idle_threshold before echo cancellation is bypassed.");
+
 module_param(max_pseudo_channels, int, 0644);
 MODULE_PARM_DESC(max_pseudo_channels, "Maximum number of pseudo channels.");
 
@@ -32,6 +32,15 @@
 #include <linux/sched.h>
 #include <linux/interrupt.h>
 #include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#if defined(__FreeBSD__)
+#include <sys/smp.h>
+#include <sys/sbuf.h>
+#else
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#endif
 
 #include <dahdi/kernel.h>
 
@@ -58,24 +67,119 @@
  *         1                Current flags on span
  *				Bit    0: Yellow Alarm
  *	                        Bit    1: Sig bits present
- *				Bits 2-7: reserved for future use
+ *				Bit    2: Loopback
+ *				Bits 3-5: reserved for future use
+ *				Bit    6: Channel bitmap present
+ *				Bit    7: Sender takes a channel bitmap
  *         2-3		    16-bit counter value for detecting drops, network byte order.
  *         4-5		    Number of channels in the message, network byte order
  *         6...		    16-bit words, containing sig bits for each
  *                          four channels, least significant 4 bits being
  *                          the least significant channel, network byte order.
+ *         next		    If bit 6 is set, one bit per channel, the least
+ *                          significant bit of the first byte being the first
+ *                          channel, set for channels whose data follows.
  *         the rest	    data for each channel, all samples per channel
-                            before moving to the next.
+                            before moving to the next.  With bit 6 set, a
+                            channel not set in the bitmap has one byte
+                            here instead, which its whole chunk was.
+ *
+ * A channel is left out of the bitmap when its chunk is the same byte
+ * over and over, as idle channels' chunks are.  The byte goes on the
+ * wire, so the receiver plays out exactly what was sent whatever law
+ * either end uses.  Messages with a bitmap are only sent to spans whose
+ * own messages have bit 7 set, and only if idle_suppress is set.
  */
 
 #define DAHDI_DYNAMIC_FLAG_YELLOW_ALARM		(1 << 0)
 #define DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT	(1 << 1)
 #define DAHDI_DYNAMIC_FLAG_LOOPBACK		(1 << 2)
+/* DAHDI_DYNAMIC_FLAG_CHANMAP, _CHANMAP_OK and DAHDI_DYNAMIC_MSGLEN()
+   are in dahdi/kernel.h */
 
 #define ERR_NSAMP			(1 << 16)
 #define ERR_NCHAN			(1 << 17)
 #define ERR_LEN				(1 << 18)
 
+/*
+ * Received messages go through a small jitter buffer keyed on the
+ * counter in bytes 2-3.  Arrivals are still the clock: each one lets out
+ * every chunk that is jitter_depth or more behind the newest counter
+ * seen, so up to jitter_depth chunks are held back and a message may
+ * arrive up to jitter_depth - 1 places out of order.  Chunks that have
+ * not arrived when their turn comes are concealed by repeating the last
+ * one, fading it out over JB_FADE chunks.  Anything arriving after its
+ * turn, or twice, is dropped.  One arrival lets out at most JB_CATCHUP
+ * chunks, each a full tick of the span (and of all of them on the
+ * master); the rest of a bigger gap is skipped.
+ *
+ * With jitter_depth at 0 the buffer is off: every arrival is let out as
+ * it comes, one tick each, late or not, and the counters only feed the
+ * statistics.
+ */
+#define JB_MAX_DEPTH			16	/* chunks */
+#define JB_MAX_GAP			32	/* chunks; more than this is a resync */
+#define JB_CATCHUP			4	/* chunks let out per arrival */
+#define JB_FADE				4	/* chunks */
+
+struct dahdi_dynamic_jb {
+	int depth;
+	int synced;		/* playpos and head are valid */
+	unsigned short playpos;	/* Counter of the next chunk to let out */
+	unsigned short head;	/* Newest counter received */
+	int mask;		/* Slot count - 1 */
+	unsigned int slotsize;
+	int concealed;		/* Chunks concealed in a row */
+	unsigned char *last;	/* Last chunk let out on each channel */
+	unsigned char *slotbuf;
+	struct dahdi_dynamic_jbslot {
+		unsigned short seq;
+		unsigned short len;	/* 0 if empty */
+	} *slots;
+
+	struct {
+		unsigned long late;
+		unsigned long lost;
+		unsigned long reordered;
+		unsigned long duplicate;
+		unsigned long concealed;
+		unsigned long resync;
+	} stats;
+};
+
+/*
+ * With tx_workers set, spans are partitioned across that many transmit
+ * workers, each a thread bound to its own CPU.  A run queues all of
+ * them; each transmits its own spans, and the last one to finish
+ * flushes the drivers, so every flush() still follows all of the
+ * tick's transmit() calls.  A run that comes while the previous one is
+ * still going is skipped, and counted against the workers still busy.
+ * With tx_workers at 0 all spans are transmitted in the one run.
+ */
+#define DYNAMIC_MAX_WORKERS		16
+
+struct dahdi_dynamic_worker {
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	char name[16];
+	int cpu;
+	int nspans;		/* Spans assigned, under dspan_mutex */
+	int busy;		/* Queued and not finished */
+
+	struct {
+		unsigned long runs;
+		unsigned long skipped;
+		unsigned long last_ns;
+		unsigned long max_ns;
+		unsigned long long total_ns;
+	} stats;
+};
+
+static struct dahdi_dynamic_worker tx_worker[DYNAMIC_MAX_WORKERS];
+static int ntx_workers;
+static atomic_t tx_running;	/* A run is in progress */
+static atomic_t tx_remaining;	/* Workers yet to finish this run */
+
 static int dahdi_dynamic_init(void);
 static void dahdi_dynamic_cleanup(void);
 
@@ -124,6 +228,15 @@ rcu_read_unlock(void)
 
 static int debug = 0;
 
+/* Chunks held back to put reordered messages right, for new spans */
+static int jitter_depth = 0;
+
+/* Transmit workers, read at load */
+static int tx_workers = 0;
+
+/* Send idle channels as a single byte to spans that take it */
+static int idle_suppress = 0;
+
 static int hasmaster = 0;
 
 static void checkmaster(void)
@@ -161,14 +274,46 @@ static void checkmaster(void)
 		printk(KERN_INFO "TDMoX: No master.\n");
 }
 
+/* What a channel sends when it has nothing to say */
+static inline unsigned char dahdi_dynamic_idle_code(struct dahdi_chan *chan)
+{
+	if ((chan->flags & DAHDI_FLAG_CLEAR) || !chan->xlaw)
+		return 0xff;
+	return DAHDI_LIN2X(0, chan);
+}
+
+/* Whether a chunk is one byte over and over, and can go as just that */
+static int dahdi_dynamic_flat_chunk(const unsigned char *chunk)
+{
+	int x;
+
+	for (x = 1; x < DAHDI_CHUNKSIZE; x++) {
+		if (chunk[x] != chunk[0])
+			return 0;
+	}
+	return 1;
+}
+
 static void dahdi_dynamic_sendmessage(struct dahdi_dynamic *d)
 {
-	unsigned char *buf = d->msgbuf;
+	unsigned char *msg = NULL;
+	unsigned char *buf;
 	unsigned short bits;
+	unsigned char *map = NULL;
 	int msglen = 0;
 	int x;
 	int offset;
 
+	if (d->driver->get_txbuf) {
+		/* Header, one short of sigbits per 4 channels, room for a
+		   channel bitmap, then audio */
+		msg = d->driver->get_txbuf(d,
+			DAHDI_DYNAMIC_MSGLEN(d->span.channels));
+	}
+	if (!msg)
+		msg = d->msgbuf;
+	buf = msg;
+
 	/* Byte 0: Number of samples per channel */
 	*buf = DAHDI_CHUNKSIZE;
 	buf++; msglen++;
@@ -178,6 +323,9 @@ static void dahdi_dynamic_sendmessage(struct dahdi_dynamic *d)
 	if (d->span.alarms & DAHDI_ALARM_RED)
 		*buf |= DAHDI_DYNAMIC_FLAG_YELLOW_ALARM;
 	*buf |= DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT;
+	*buf |= DAHDI_DYNAMIC_FLAG_CHANMAP_OK;
+	if (idle_suppress && d->peer_chanmap)
+		*buf |= DAHDI_DYNAMIC_FLAG_CHANMAP;
 	buf++; msglen++;
 
 	/* Bytes 2-3: Transmit counter */
@@ -210,21 +358,50 @@ static void dahdi_dynamic_sendmessage(struct dahdi_dynamic *d)
 		buf++; msglen++;
 		buf++; msglen++;
 	}
+
+	if (msg[1] & DAHDI_DYNAMIC_FLAG_CHANMAP) {
+		/* Filled in as the channels are gone through */
+		map = buf;
+		memset(map, 0, (d->span.channels + 7) / 8);
+		buf += (d->span.channels + 7) / 8;
+		msglen += (d->span.channels + 7) / 8;
+	}
 	
 	for (x = 0; x < d->span.channels; x++) {
+		if (map) {
+			if (dahdi_dynamic_flat_chunk(d->chans[x]->writechunk)) {
+				*buf++ = d->chans[x]->writechunk[0];
+				msglen++;
+				continue;
+			}
+			map[x / 8] |= 1 << (x % 8);
+		}
 		memcpy(buf, d->chans[x]->writechunk, DAHDI_CHUNKSIZE);
 		buf += DAHDI_CHUNKSIZE;
 		msglen += DAHDI_CHUNKSIZE;
 	}
 	
-	d->driver->transmit(d, d->msgbuf, msglen);
+	d->driver->transmit(d, msg, msglen);
 	
 }
 
+static void dahdi_dynamic_flush(void)
+{
+	struct dahdi_dynamic_driver *drv;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(drv, &driver_list, list) {
+		/* Flush any traffic still pending in the driver */
+		if (drv->flush) {
+			drv->flush();
+		}
+	}
+	rcu_read_unlock();
+}
+
 static void __dahdi_dynamic_run(void)
 {
 	struct dahdi_dynamic *d;
-	struct dahdi_dynamic_driver *drv;
 
 	rcu_read_lock();
 	list_for_each_entry_rcu(d, &dspan_list, list) {
@@ -232,18 +409,120 @@ static void __dahdi_dynamic_run(void)
 		/* Handle all transmissions now */
 		dahdi_dynamic_sendmessage(d);
 	}
+	rcu_read_unlock();
 
-	list_for_each_entry_rcu(drv, &driver_list, list) {
-		/* Flush any traffic still pending in the driver */
-		if (drv->flush) {
-			drv->flush();
-		}
+	dahdi_dynamic_flush();
+}
+
+#if defined(__FreeBSD__)
+static inline unsigned long long dynamic_now_ns(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define dynamic_worker_wq(w) \
+	create_singlethread_workqueue_cpu((w)->name, (w)->cpu)
+#define dynamic_worker_queue(w)		queue_work((w)->wq, &(w)->work)
+#define dynamic_tx_claim()		atomic_cmpset_int(&tx_running, 0, 1)
+#define dynamic_tx_release()		atomic_store_rel_int(&tx_running, 0)
+#define dynamic_for_each_cpu(cpu)	CPU_FOREACH(cpu)
+#else
+#define dynamic_now_ns()		ktime_to_ns(ktime_get())
+#define dynamic_worker_wq(w) \
+	alloc_workqueue("%s", WQ_HIGHPRI, 1, (w)->name)
+#define dynamic_worker_queue(w) \
+	queue_work_on((w)->cpu, (w)->wq, &(w)->work)
+#define dynamic_tx_claim()		(atomic_cmpxchg(&tx_running, 0, 1) == 0)
+#define dynamic_tx_release() \
+	do { smp_mb__before_atomic(); atomic_set(&tx_running, 0); } while (0)
+#define dynamic_for_each_cpu(cpu)	for_each_online_cpu(cpu)
+#endif
+
+static void dahdi_dynamic_tx_work(struct work_struct *work)
+{
+	struct dahdi_dynamic_worker *w =
+		container_of(work, struct dahdi_dynamic_worker, work);
+	const int id = w - tx_worker;
+	struct dahdi_dynamic *d;
+	unsigned long long start = dynamic_now_ns();
+	unsigned long elapsed;
+
+	/* Spans are few enough that walking past the other workers' ones
+	   costs less than keeping a list per worker */
+	rcu_read_lock();
+	list_for_each_entry_rcu(d, &dspan_list, list) {
+		if (d->txworker != id)
+			continue;
+		dahdi_transmit(&d->span);
+		dahdi_dynamic_sendmessage(d);
 	}
 	rcu_read_unlock();
+
+	elapsed = dynamic_now_ns() - start;
+	w->stats.runs++;
+	w->stats.last_ns = elapsed;
+	w->stats.total_ns += elapsed;
+	if (elapsed > w->stats.max_ns)
+		w->stats.max_ns = elapsed;
+
+	if (atomic_dec_and_test(&tx_remaining)) {
+		/* The barrier: everyone has transmitted */
+		dahdi_dynamic_flush();
+		w->busy = 0;
+		dynamic_tx_release();
+	} else {
+		w->busy = 0;
+	}
+}
+
+static void dahdi_dynamic_run_workers(void)
+{
+	int x;
+
+	if (!dynamic_tx_claim()) {
+		for (x = 0; x < ntx_workers; x++) {
+			if (tx_worker[x].busy)
+				tx_worker[x].stats.skipped++;
+		}
+		return;
+	}
+
+	atomic_set(&tx_remaining, ntx_workers);
+	for (x = 0; x < ntx_workers; x++) {
+		tx_worker[x].busy = 1;
+		dynamic_worker_queue(&tx_worker[x]);
+	}
+}
+
+/* Spans sharing a tx_key go to the worker already transmitting the
+   others, the rest to the worker with the fewest spans. */
+static int dahdi_dynamic_pick_worker(struct dahdi_dynamic *d)
+{
+	struct dahdi_dynamic *t;
+	unsigned long key;
+	int x, best = 0;
+
+	if (d->driver->tx_key) {
+		key = d->driver->tx_key(d);
+		/* dspan_mutex keeps the list still */
+		list_for_each_entry(t, &dspan_list, list) {
+			if (t->driver == d->driver &&
+			    d->driver->tx_key(t) == key)
+				return t->txworker;
+		}
+	}
+	for (x = 1; x < ntx_workers; x++) {
+		if (tx_worker[x].nspans < tx_worker[best].nspans)
+			best = x;
+	}
+	return best;
 }
 
 #ifdef ENABLE_TASKLETS
-static void dahdi_dynamic_run(void)
+static void dahdi_dynamic_schedule(void)
 {
 	if (likely(!taskletpending)) {
 		taskletpending = 1;
@@ -254,22 +533,282 @@ static void dahdi_dynamic_run(void)
 	}
 }
 #else
-#define dahdi_dynamic_run __dahdi_dynamic_run
+#define dahdi_dynamic_schedule __dahdi_dynamic_run
 #endif
 
+static void dahdi_dynamic_run(void)
+{
+	if (ntx_workers)
+		dahdi_dynamic_run_workers();
+	else
+		dahdi_dynamic_schedule();
+}
+
 static inline struct dahdi_dynamic *dynamic_from_span(struct dahdi_span *span)
 {
 	return container_of(span, struct dahdi_dynamic, span);
 }
 
+/* Hand a message that has passed the checks in dahdi_dynamic_receive()
+   to the span's channels */
+static void dahdi_dynamic_unpack(struct dahdi_dynamic *dtd, const unsigned char *msg)
+{
+	struct dahdi_span *span = &dtd->span;
+	int nchans = span->channels;
+	int x, bits = 0, sig;
+	int sflags = msg[1];
+	const unsigned char *map = NULL;
+
+	msg += 6;
+
+	/* Record sigbits if present */
+	if (sflags & DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT) {
+		for (x=0;x<nchans;x++) {
+			if (!(x%4)) {
+				/* Get new bits */
+				bits = ntohs(*((unsigned short *)msg));
+				msg++;
+				msg++;
+			}
+			
+			/* Pick the right bits */
+			sig = (bits >> ((x % 4) << 2)) & 0xff;
+			
+			/* Update signalling if appropriate */
+			if (sig != span->chans[x]->rxsig)
+				dahdi_rbsbits(span->chans[x], sig);
+				
+		}
+	}
+	
+	if (sflags & DAHDI_DYNAMIC_FLAG_CHANMAP) {
+		map = msg;
+		msg += (nchans + 7) / 8;
+	}
+
+	/* Record data for channels, keeping a copy to conceal with */
+	for (x=0;x<nchans;x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+
+		if (map && !(map[x / 8] & (1 << (x % 8)))) {
+			/* The one byte the whole chunk was */
+			memset(chan->readchunk, *msg, DAHDI_CHUNKSIZE);
+			msg++;
+		} else {
+			memcpy(chan->readchunk, msg, DAHDI_CHUNKSIZE);
+			msg += DAHDI_CHUNKSIZE;
+		}
+		memcpy(dtd->jb->last + x * DAHDI_CHUNKSIZE, chan->readchunk,
+		       DAHDI_CHUNKSIZE);
+	}
+	dtd->jb->concealed = 0;
+}
+
+/* Make up a chunk for a message that never turned up.  Signalling is
+   left as it was. */
+static void dahdi_dynamic_conceal(struct dahdi_dynamic *dtd)
+{
+	struct dahdi_dynamic_jb *jb = dtd->jb;
+	struct dahdi_span *span = &dtd->span;
+	const unsigned char *last = jb->last;
+	int gain;
+	int x, y;
+
+	if (jb->concealed <= JB_FADE)
+		jb->concealed++;
+	jb->stats.concealed++;
+	gain = JB_FADE + 1 - jb->concealed;
+
+	for (x = 0; x < span->channels; x++, last += DAHDI_CHUNKSIZE) {
+		struct dahdi_chan *const chan = span->chans[x];
+
+		if ((chan->flags & DAHDI_FLAG_CLEAR) || !chan->xlaw ||
+		    gain <= 0) {
+			/* Repeating data helps no one; send idle */
+			memset(chan->readchunk, dahdi_dynamic_idle_code(chan),
+			       DAHDI_CHUNKSIZE);
+		} else if (gain == JB_FADE) {
+			memcpy(chan->readchunk, last, DAHDI_CHUNKSIZE);
+		} else {
+			for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+				chan->readchunk[y] = DAHDI_LIN2X(
+					DAHDI_XLAW(last[y], chan) * gain / JB_FADE,
+					chan);
+			}
+		}
+	}
+}
+
+/* Let the next chunk out to DAHDI: 'msg' if it is the one whose turn it
+   is, else what the jitter buffer holds for it, else a concealed one. */
+static void dahdi_dynamic_jb_next(struct dahdi_dynamic *dtd, unsigned short seq,
+				  const unsigned char *msg, int master)
+{
+	struct dahdi_dynamic_jb *jb = dtd->jb;
+	struct dahdi_dynamic_jbslot *slot = &jb->slots[jb->playpos & jb->mask];
+
+	rcu_read_lock();
+	if (jb->playpos == seq) {
+		dahdi_dynamic_unpack(dtd, msg);
+	} else if (slot->len && slot->seq == jb->playpos) {
+		dahdi_dynamic_unpack(dtd, jb->slotbuf +
+				     (jb->playpos & jb->mask) * jb->slotsize);
+	} else {
+		jb->stats.lost++;
+		dahdi_dynamic_conceal(dtd);
+	}
+	slot->len = 0;
+	jb->playpos++;
+	rcu_read_unlock();
+
+	dahdi_ec_span(&dtd->span);
+	dahdi_receive(&dtd->span);
+
+	/* If this is our master span, then run everything */
+	if (master)
+		dahdi_dynamic_run();
+}
+
+static void dahdi_dynamic_jb_put(struct dahdi_dynamic *dtd, unsigned short seq,
+				 const unsigned char *msg, int msglen, int master)
+{
+	struct dahdi_dynamic_jb *jb = dtd->jb;
+	struct dahdi_dynamic_jbslot *slot;
+	short ahead;
+	int due, x;
+
+	if (unlikely(!jb->synced)) {
+		jb->playpos = jb->head = seq;
+		jb->synced = 1;
+	}
+
+	if (!jb->depth) {
+		/* Straight through, one tick per arrival */
+		ahead = (short)(seq - jb->playpos);
+		if (ahead < 0) {
+			/* Still let out, without moving the count back */
+			jb->stats.late++;
+			x = jb->playpos;
+			jb->playpos = seq;
+			dahdi_dynamic_jb_next(dtd, seq, msg, master);
+			jb->playpos = x;
+			return;
+		}
+		jb->stats.lost += ahead;
+		jb->playpos = jb->head = seq;
+		dahdi_dynamic_jb_next(dtd, seq, msg, master);
+		return;
+	}
+
+	ahead = (short)(seq - jb->playpos);
+	if (unlikely(ahead > JB_MAX_GAP || ahead < -JB_MAX_GAP)) {
+		/* The far end restarted, or we lost too much to care; what
+		   is still held back is dropped */
+		if (ahead > 0)
+			jb->stats.lost += ahead;
+		jb->stats.resync++;
+		for (x = 0; x <= jb->mask; x++)
+			jb->slots[x].len = 0;
+		jb->playpos = jb->head = seq;
+		ahead = 0;
+	}
+
+	if (ahead < 0) {
+		/* Its turn has passed */
+		jb->stats.late++;
+		return;
+	}
+
+	slot = &jb->slots[seq & jb->mask];
+	if (slot->len && slot->seq == seq) {
+		jb->stats.duplicate++;
+		return;
+	}
+
+	if ((short)(seq - jb->head) > 0)
+		jb->head = seq;
+	else if (seq != jb->head)
+		jb->stats.reordered++;
+
+	/* Chunks due out to make room in the ring for this one, or to hold
+	   back no more than depth; past JB_CATCHUP the oldest are skipped
+	   rather than all played out from here at once */
+	due = (short)(seq - jb->playpos) - jb->mask;
+	x = (short)(jb->head - jb->playpos) - jb->depth + 1;
+	if (x > due)
+		due = x;
+	for (; due > JB_CATCHUP && jb->playpos != seq; due--) {
+		jb->slots[jb->playpos & jb->mask].len = 0;
+		jb->stats.lost++;
+		jb->playpos++;
+	}
+
+	/* Make room in the ring if this is past its end */
+	while ((short)(seq - jb->playpos) > jb->mask)
+		dahdi_dynamic_jb_next(dtd, seq, msg, master);
+
+	if ((short)(jb->head - seq) < jb->depth) {
+		/* Not its turn yet */
+		memcpy(jb->slotbuf + (seq & jb->mask) * jb->slotsize, msg, msglen);
+		slot->seq = seq;
+		slot->len = msglen;
+	}
+
+	while ((short)(jb->head - jb->playpos) >= jb->depth)
+		dahdi_dynamic_jb_next(dtd, seq, msg, master);
+}
+
+static struct dahdi_dynamic_jb *dahdi_dynamic_jb_alloc(int nchans, int msgsize)
+{
+	struct dahdi_dynamic_jb *jb;
+	unsigned int slots;
+
+	jb = kzalloc(sizeof(*jb), GFP_KERNEL);
+	if (!jb)
+		return NULL;
+
+	jb->depth = jitter_depth;
+	if (jb->depth < 0)
+		jb->depth = 0;
+	if (jb->depth > JB_MAX_DEPTH)
+		jb->depth = JB_MAX_DEPTH;
+	/* Enough slots for depth messages plus the one coming in */
+	for (slots = 1; slots <= jb->depth; slots <<= 1)
+		;
+	jb->mask = slots - 1;
+	jb->slotsize = msgsize;
+
+	jb->last = kzalloc(nchans * DAHDI_CHUNKSIZE, GFP_KERNEL);
+	jb->slots = kzalloc(slots * sizeof(*jb->slots), GFP_KERNEL);
+	jb->slotbuf = kmalloc(slots * msgsize, GFP_KERNEL);
+	if (!jb->last || !jb->slots || !jb->slotbuf) {
+		kfree(jb->last);
+		kfree(jb->slots);
+		kfree(jb->slotbuf);
+		kfree(jb);
+		return NULL;
+	}
+	return jb;
+}
+
+static void dahdi_dynamic_jb_free(struct dahdi_dynamic_jb *jb)
+{
+	if (!jb)
+		return;
+	kfree(jb->last);
+	kfree(jb->slots);
+	kfree(jb->slotbuf);
+	kfree(jb);
+}
+
 void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msglen)
 {
 	struct dahdi_dynamic *dtd = dynamic_from_span(span);
 	int newerr=0;
 	int sflags;
 	int xlen;
-	int x, bits, sig;
 	int nchans, master;
+	int x;
 	int newalarm;
 	unsigned short rxpos, rxcnt;
 
@@ -318,13 +857,29 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 
 	/* Start with header */
 	xlen = 6;
-	/* Add samples of audio */
-	xlen += nchans * DAHDI_CHUNKSIZE;
 	/* If RBS info is there, add that */
 	if (sflags & DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT) {
 		/* Account for sigbits -- one short per 4 channels*/
 		xlen += ((nchans + 3) / 4) * 2;
 	}
+	if (sflags & DAHDI_DYNAMIC_FLAG_CHANMAP) {
+		/* Bitmap, then samples for the channels set in it and one
+		   byte for each of the rest */
+		const unsigned char *map = msg + xlen - 6;
+
+		xlen += (nchans + 7) / 8;
+		if (likely(xlen <= msglen)) {
+			for (x = 0; x < nchans; x++) {
+				if (map[x / 8] & (1 << (x % 8)))
+					xlen += DAHDI_CHUNKSIZE;
+				else
+					xlen++;
+			}
+		}
+	} else {
+		/* Add samples of audio */
+		xlen += nchans * DAHDI_CHUNKSIZE;
+	}
 
 	if (unlikely(xlen != msglen)) {
 		rcu_read_unlock();
@@ -335,35 +890,8 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		return;
 	}
 
-	bits = 0;
-
-	/* Record sigbits if present */
-	if (sflags & DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT) {
-		for (x=0;x<nchans;x++) {
-			if (!(x%4)) {
-				/* Get new bits */
-				bits = ntohs(*((unsigned short *)msg));
-				msg++;
-				msg++;
-			}
-			
-			/* Pick the right bits */
-			sig = (bits >> ((x % 4) << 2)) & 0xff;
-			
-			/* Update signalling if appropriate */
-			if (sig != span->chans[x]->rxsig)
-				dahdi_rbsbits(span->chans[x], sig);
-				
-		}
-	}
-	
-	/* Record data for channels */
-	for (x=0;x<nchans;x++) {
-		memcpy(span->chans[x]->readchunk, msg, DAHDI_CHUNKSIZE);
-		msg += DAHDI_CHUNKSIZE;
-	}
-
 	master = dtd->master;
+	dtd->peer_chanmap = !!(sflags & DAHDI_DYNAMIC_FLAG_CHANMAP_OK);
 	
 	rxcnt = dtd->rxcnt;
 	dtd->rxcnt = rxpos+1;
@@ -385,15 +913,10 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 	}
 
 	/* note if we had a missing packet */
-	if (unlikely(rxpos != rxcnt))
-		printk(KERN_NOTICE "Span %s: Expected seq no %d, but received %d instead\n", span->name, rxcnt, rxpos);
-
-	dahdi_ec_span(span);
-	dahdi_receive(span);
+	if (unlikely(rxpos != rxcnt) && debug)
+		printk(KERN_DEBUG "Span %s: Expected seq no %d, but received %d instead\n", span->name, rxcnt, rxpos);
 
-	/* If this is our master span, then run everything */
-	if (master)
-		dahdi_dynamic_run();
+	dahdi_dynamic_jb_put(dtd, rxpos, msg - 6, msglen, master);
 }
 EXPORT_SYMBOL(dahdi_dynamic_receive);
 
@@ -421,6 +944,7 @@ static void dahdi_dynamic_release(struct kref *kref)
 	}
 
 	kfree(d->msgbuf);
+	dahdi_dynamic_jb_free(d->jb);
 
 	for (x = 0; x < d->span.channels; x++)
 		kfree(d->chans[x]);
@@ -496,6 +1020,9 @@ static int _destroy_dynamic(struct dahdi_dynamic_span *dds)
 	list_del_rcu(&d->list);
 	write_unlock_irqrestore(&dspan_lock, flags);
 
+	if (ntx_workers)
+		tx_worker[d->txworker].nspans--;
+
 	/* One since we've removed the item from the list... */
 	dynamic_put(d);
 	/* ...and one for find_dynamic. */
@@ -611,7 +1138,7 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 	}
 
 	/* Allocate message buffer with sample space and header space */
-	bufsize = dds->numchans * DAHDI_CHUNKSIZE + dds->numchans / 4 + 48;
+	bufsize = DAHDI_DYNAMIC_MSGLEN(dds->numchans);
 
 	d->msgbuf = kzalloc(bufsize, GFP_KERNEL);
 
@@ -619,6 +1146,14 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 		dynamic_put(d);
 		return -ENOMEM;
 	}
+
+	/* Each slot holds the largest message dahdi_dynamic_receive() takes */
+	d->jb = dahdi_dynamic_jb_alloc(dds->numchans,
+			DAHDI_DYNAMIC_MSGLEN(dds->numchans));
+	if (!d->jb) {
+		dynamic_put(d);
+		return -ENOMEM;
+	}
 	
 	/* Setup parameters properly assuming we're going to be okay. */
 	strlcpy(d->dname, dds->driver, sizeof(d->dname));
@@ -695,6 +1230,11 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 
 	x = d->span.spanno;
 
+	if (ntx_workers) {
+		d->txworker = dahdi_dynamic_pick_worker(d);
+		tx_worker[d->txworker].nspans++;
+	}
+
 	/* Transfer our reference to the dspan_list.  Do not touch d after
 	 * this point. It also must remain on the list while registered. */
 	write_lock_irqsave(&dspan_lock, flags);
@@ -716,6 +1256,12 @@ static int create_dynamic(struct dahdi_dynamic_span *dds)
 	return ret;
 }
 
+int dahdi_dynamic_create(struct dahdi_dynamic_span *dds)
+{
+	return create_dynamic(dds);
+}
+EXPORT_SYMBOL(dahdi_dynamic_create);
+
 #ifdef ENABLE_TASKLETS
 static void dahdi_dynamic_tasklet(unsigned long data)
 {
@@ -800,6 +1346,8 @@ void dahdi_dynamic_unregister_driver(struct dahdi_dynamic_driver *dri)
 			write_lock_irqsave(&dspan_lock, flags);
 			list_del_rcu(&d->list);
 			write_unlock_irqrestore(&dspan_lock, flags);
+			if (ntx_workers)
+				tx_worker[d->txworker].nspans--;
 			dynamic_put(d);
 		}
 	}
@@ -843,8 +1391,134 @@ static void check_for_red_alarm(unsigned long ignored)
 	mod_timer(&alarmcheck, jiffies + 1 * HZ);
 }
 
+#if defined(__FreeBSD__)
+#define stats_printf	sbuf_printf
+typedef struct sbuf stats_buf;
+#else
+#define stats_printf	seq_printf
+typedef struct seq_file stats_buf;
+#endif
+
+static void dahdi_dynamic_show(stats_buf *buf)
+{
+	struct dahdi_dynamic *d;
+	int x;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(d, &dspan_list, list) {
+		const struct dahdi_dynamic_jb *jb = d->jb;
+
+		stats_printf(buf, "%s: depth %d late %lu lost %lu "
+			     "reordered %lu duplicate %lu concealed %lu "
+			     "resync %lu\n",
+			     d->span.name, jb->depth, jb->stats.late,
+			     jb->stats.lost, jb->stats.reordered,
+			     jb->stats.duplicate, jb->stats.concealed,
+			     jb->stats.resync);
+	}
+	rcu_read_unlock();
+
+	for (x = 0; x < ntx_workers; x++) {
+		const struct dahdi_dynamic_worker *w = &tx_worker[x];
+
+		stats_printf(buf, "worker %d: cpu %d spans %d runs %lu "
+			     "skipped %lu last %luns max %luns total %lluns\n",
+			     x, w->cpu, w->nspans, w->stats.runs,
+			     w->stats.skipped, w->stats.last_ns,
+			     w->stats.max_ns, w->stats.total_ns);
+	}
+}
+
+#if defined(__FreeBSD__)
+static int
+dahdi_dynamic_sysctl_stats(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf *sb;
+	int error;
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 128, req);
+	if (sb == NULL)
+		return (ENOMEM);
+	dahdi_dynamic_show(sb);
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return (error);
+}
+#elif defined(CONFIG_PROC_FS)
+static int dahdi_dynamic_proc_show(struct seq_file *sfile, void *v)
+{
+	dahdi_dynamic_show(sfile);
+	return 0;
+}
+
+static int dahdi_dynamic_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dahdi_dynamic_proc_show, NULL);
+}
+
+static const struct file_operations dahdi_dynamic_proc_ops = {
+	.owner		= THIS_MODULE,
+	.open		= dahdi_dynamic_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+static void dahdi_dynamic_stop_workers(void)
+{
+	int x;
+
+	for (x = 0; x < ntx_workers; x++) {
+		flush_workqueue(tx_worker[x].wq);
+		destroy_workqueue(tx_worker[x].wq);
+	}
+	ntx_workers = 0;
+}
+
+static void dahdi_dynamic_start_workers(void)
+{
+#if defined(__FreeBSD__)
+	const int cpus = mp_ncpus;
+#else
+	const int cpus = num_online_cpus();
+#endif
+	int n = tx_workers;
+	int cpu;
+
+	if (n > cpus)
+		n = cpus;
+	if (n > DYNAMIC_MAX_WORKERS)
+		n = DYNAMIC_MAX_WORKERS;
+
+	/* One worker to a CPU, which need not be numbered from 0 up */
+	dynamic_for_each_cpu(cpu) {
+		struct dahdi_dynamic_worker *w;
+
+		if (ntx_workers >= n)
+			break;
+		w = &tx_worker[ntx_workers];
+		INIT_WORK(&w->work, dahdi_dynamic_tx_work);
+		w->cpu = cpu;
+		snprintf(w->name, sizeof(w->name), "dahdi_dyn_tx/%d",
+			 ntx_workers);
+		w->wq = dynamic_worker_wq(w);
+		if (!w->wq) {
+			printk(KERN_NOTICE "TDMoX: Unable to start transmit "
+			       "worker %d, transmitting serially\n",
+			       ntx_workers);
+			dahdi_dynamic_stop_workers();
+			return;
+		}
+		ntx_workers++;
+	}
+	if (ntx_workers)
+		printk(KERN_INFO "TDMoX: %d transmit workers\n", ntx_workers);
+}
+
 static int dahdi_dynamic_init(void)
 {
+	dahdi_dynamic_start_workers();
 	dahdi_set_dynamic_ioctl(dahdi_dynamic_ioctl);
 
 	/* Start process to check for RED ALARM */
@@ -856,6 +1530,9 @@ static int dahdi_dynamic_init(void)
 	mod_timer(&alarmcheck, jiffies + 1 * HZ);
 #ifdef ENABLE_TASKLETS
 	tasklet_init(&dahdi_dynamic_tlet, dahdi_dynamic_tasklet, 0);
+#endif
+#if !defined(__FreeBSD__) && defined(CONFIG_PROC_FS)
+	proc_create("dahdi/dynamic", 0444, NULL, &dahdi_dynamic_proc_ops);
 #endif
 	printk(KERN_INFO "DAHDI Dynamic Span support LOADED\n");
 	return 0;
@@ -871,6 +1548,10 @@ static void dahdi_dynamic_cleanup(void)
 #endif
 	dahdi_set_dynamic_ioctl(NULL);
 	del_timer(&alarmcheck);
+	dahdi_dynamic_stop_workers();
+#if !defined(__FreeBSD__) && defined(CONFIG_PROC_FS)
+	remove_proc_entry("dahdi/dynamic", NULL);
+#endif
 	printk(KERN_INFO "DAHDI Dynamic Span support unloaded\n");
 }
 
@@ -879,12 +1560,19 @@ SYSCTL_NODE(_dahdi, OID_AUTO, dynamic, CTLFLAG_RW, 0, "DAHDI Dynamic Span Suppor
 #define MODULE_PARAM_PREFIX "dahdi.dynamic"
 #define MODULE_PARAM_PARENT _dahdi_dynamic
 
+SYSCTL_PROC(_dahdi_dynamic, OID_AUTO, stats, CTLTYPE_STRING | CTLFLAG_RD,
+    NULL, 0, dahdi_dynamic_sysctl_stats, "A",
+    "Jitter buffer and transmit worker statistics");
+
 LINUX_DEV_MODULE(dahdi_dynamic);
 MODULE_VERSION(dahdi_dynamic, 1);
 MODULE_DEPEND(dahdi_dynamic, dahdi, 1, 1, 1);
 #endif /* __FreeBSD__ */
 
 module_param(debug, int, 0600);
+module_param(jitter_depth, int, 0644);
+module_param(tx_workers, int, 0444);
+module_param(idle_suppress, int, 0644);
 
 MODULE_DESCRIPTION("DAHDI Dynamic Span Support");
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
@@ -32,6 +32,7 @@
 #include <linux/netdevice.h>
 #if !defined(__FreeBSD__)
 #include <linux/notifier.h>
+#include <linux/rcupdate.h>
 #endif
 
 #include <dahdi/kernel.h>
@@ -61,25 +62,113 @@ static struct ztdeth {
 	char ethdev[IFNAMSIZ];
 	struct net_device *dev;
 	struct ztdeth *next;
+	struct ztdeth *hnext;	/* Next in the same ztdeth_hash bucket */
+	/* Packet the next message is built in, only touched by the span's
+	   transmit path.  txdev is the device it was set up for. */
+	struct net_device *txdev;
+#if defined(__FreeBSD__)
+	struct mbuf *txm;
+#else
+	struct sk_buff *txskb;
+#endif
 } *zdevs = NULL;
 
+#if defined(__FreeBSD__)
+/* txm holds the ethernet and ztdeth headers, followed by the message */
+#define ZTDETH_TX_HDRLEN	(sizeof(struct ether_header) + sizeof(struct ztdeth_header))
+#define ZTDETH_TXM_MSG(m)	(mtod(m, u8 *) + ZTDETH_TX_HDRLEN)
+#endif
+
+/* The receive path finds its span in ztdeth_hash without taking zlock.
+   It is changed under zlock as well as zhash_lock, and entries are only
+   freed once no reader can still see them. */
+#define ZTDETH_HASH_BITS	6
+#define ZTDETH_HASH_SIZE	(1 << ZTDETH_HASH_BITS)
+
+static struct ztdeth *ztdeth_hash[ZTDETH_HASH_SIZE];
+
+#if defined(__FreeBSD__)
+static DEFINE_RWLOCK(zhash_lock);
+
+#define synchronize_rcu()
+#define rcu_dereference(p)		(p)
+#define rcu_assign_pointer(p, v)	((p) = (v))
+
+static inline void
+rcu_read_lock(void)
+{
+	read_lock(&zhash_lock);
+}
+
+static inline void
+rcu_read_unlock(void)
+{
+	read_unlock(&zhash_lock);
+}
+
+#define zhash_write_lock()		write_lock(&zhash_lock)
+#define zhash_write_unlock()		write_unlock(&zhash_lock)
+#else
+#define zhash_write_lock()
+#define zhash_write_unlock()
+#endif /* __FreeBSD__ */
+
+/* Frames from a MAC and subaddr we have no span for */
+static unsigned int lookup_misses;
+
+static inline unsigned int ztdeth_hashfn(const unsigned char *addr, unsigned short subaddr)
+{
+	/* The first half of the MAC tends to be the same for all of them */
+	unsigned int h = (addr[3] << 16) | (addr[4] << 8) | addr[5];
+
+	h ^= subaddr;
+	h ^= h >> ZTDETH_HASH_BITS;
+	h ^= h >> (2 * ZTDETH_HASH_BITS);
+	return h & (ZTDETH_HASH_SIZE - 1);
+}
+
+/* Called with zlock held */
+static void ztdeth_hash_add(struct ztdeth *z)
+{
+	unsigned int h = ztdeth_hashfn(z->addr, z->subaddr);
+
+	z->hnext = ztdeth_hash[h];
+	rcu_assign_pointer(ztdeth_hash[h], z);
+}
+
+/* Called with zlock held */
+static void ztdeth_hash_del(struct ztdeth *z)
+{
+	struct ztdeth **p = &ztdeth_hash[ztdeth_hashfn(z->addr, z->subaddr)];
+
+	for (; *p; p = &(*p)->hnext) {
+		if (*p == z) {
+			rcu_assign_pointer(*p, z->hnext);
+			break;
+		}
+	}
+}
+
 static struct dahdi_span *ztdeth_getspan(unsigned char *addr, unsigned short subaddr)
 {
-	unsigned long flags;
 	struct ztdeth *z;
 	struct dahdi_span *span = NULL;
-	spin_lock_irqsave(&zlock, flags);
-	z = zdevs;
-	while(z) {
+
+	rcu_read_lock();
+	z = rcu_dereference(ztdeth_hash[ztdeth_hashfn(addr, subaddr)]);
+	for (; z; z = rcu_dereference(z->hnext)) {
 		if (!memcmp(addr, z->addr, ETH_ALEN) &&
-			z->subaddr == subaddr)
+			z->subaddr == subaddr) {
+			span = z->span;
 			break;
-		z = z->next;
+		}
 	}
-	if (z)
-		span = z->span;
-	spin_unlock_irqrestore(&zlock, flags);
-	if (!span || !test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags))
+	rcu_read_unlock();
+	if (!span) {
+		lookup_misses++;
+		return NULL;
+	}
+	if (!test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags))
 		return NULL;
 	return span;
 }
@@ -161,6 +250,82 @@ static int ztdeth_notifier(struct notifier_block *block, unsigned long event, vo
 	return 0;
 }
 
+#if defined(__FreeBSD__)
+static u8 *ztdeth_get_txbuf(struct dahdi_dynamic *dyn, size_t msglen)
+{
+	struct ztdeth *z = dyn->pvt;
+	struct ether_header *eh;
+	struct ztdeth_header *zh;
+	unsigned long flags;
+	struct net_device *dev;
+	struct mbuf *m;
+
+	if (ZTDETH_TX_HDRLEN + msglen > MCLBYTES)
+		return NULL;
+
+	spin_lock_irqsave(&zlock, flags);
+	dev = z->dev;
+	spin_unlock_irqrestore(&zlock, flags);
+	if (!dev)
+		return NULL;
+
+	/* What went out last tick is a copy sharing txm's cluster.  Once the
+	   stack has freed it the cluster is ours again and is reused as is,
+	   headers included.  Otherwise leave it to the stack and start a
+	   new one. */
+	m = z->txm;
+	if (m != NULL && (z->txdev != dev || !M_WRITABLE(m))) {
+		m_freem(m);
+		m = z->txm = NULL;
+	}
+	if (m == NULL) {
+		m = m_getcl(M_NOWAIT, MT_DATA, M_PKTHDR);
+		if (m == NULL)
+			return NULL;
+		eh = mtod(m, struct ether_header *);
+		bcopy(z->addr, &eh->ether_dhost, sizeof(eh->ether_dhost));
+		bcopy(dev->dev_addr, &eh->ether_shost, sizeof(eh->ether_shost));
+		eh->ether_type = __constant_htons(ETH_P_DAHDI_DETH);
+		zh = (struct ztdeth_header *)(eh + 1);
+		zh->subaddr = z->subaddr;
+		z->txm = m;
+		z->txdev = dev;
+	}
+	return ZTDETH_TXM_MSG(m);
+}
+#else /* !__FreeBSD__ */
+static u8 *ztdeth_get_txbuf(struct dahdi_dynamic *dyn, size_t msglen)
+{
+	struct ztdeth *z = dyn->pvt;
+	unsigned long flags;
+	struct net_device *dev;
+
+	spin_lock_irqsave(&zlock, flags);
+	dev = z->dev;
+	spin_unlock_irqrestore(&zlock, flags);
+	if (!dev)
+		return NULL;
+
+	/* dev_queue_xmit() consumes the skb, so there is nothing to reuse;
+	   just have the message built in it rather than copied there. */
+	if (z->txskb && z->txdev != dev) {
+		dev_kfree_skb_any(z->txskb);
+		z->txskb = NULL;
+	}
+	if (!z->txskb) {
+		z->txskb = dev_alloc_skb(msglen + dev->hard_header_len + sizeof(struct ztdeth_header) + 32);
+		if (!z->txskb)
+			return NULL;
+		/* Reserve header space */
+		skb_reserve(z->txskb, dev->hard_header_len + sizeof(struct ztdeth_header));
+		z->txdev = dev;
+	}
+	if (skb_tailroom(z->txskb) < msglen)
+		return NULL;
+	return z->txskb->data;
+}
+#endif /* !__FreeBSD__ */
+
 static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 {
 	struct ztdeth *z;
@@ -191,6 +356,17 @@ static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 		dev = z->dev;
 		spin_unlock_irqrestore(&zlock, flags);
 #if defined(__FreeBSD__)
+		if (z->txm != NULL && msg == ZTDETH_TXM_MSG(z->txm) &&
+		    dev == z->txdev) {
+			/* Built in place.  Send a copy sharing the cluster and
+			   keep txm for the next tick. */
+			z->txm->m_pkthdr.len = z->txm->m_len = ZTDETH_TX_HDRLEN + msglen;
+			m = m_copypacket(z->txm, M_NOWAIT);
+			if (m != NULL)
+				dev_xmit(dev, m);
+			return;
+		}
+
 		MGETHDR(m, M_NOWAIT, MT_DATA);
 		if (m != NULL) {
 			if (sizeof(eh) + sizeof(zh) + msglen >= MINCLSIZE) {
@@ -211,14 +387,22 @@ static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 			dev_xmit(dev, m);
 		}
 #else /* !__FreeBSD__ */
-		skb = dev_alloc_skb(msglen + dev->hard_header_len + sizeof(struct ztdeth_header) + 32);
-		if (skb) {
-			/* Reserve header space */
-			skb_reserve(skb, dev->hard_header_len + sizeof(struct ztdeth_header));
-
-			/* Copy message body */
-			memcpy(skb_put(skb, msglen), msg, msglen);
+		if (z->txskb && msg == z->txskb->data && dev == z->txdev) {
+			/* Built in place */
+			skb = z->txskb;
+			z->txskb = NULL;
+			skb_put(skb, msglen);
+		} else {
+			skb = dev_alloc_skb(msglen + dev->hard_header_len + sizeof(struct ztdeth_header) + 32);
+			if (skb) {
+				/* Reserve header space */
+				skb_reserve(skb, dev->hard_header_len + sizeof(struct ztdeth_header));
 
+				/* Copy message body */
+				memcpy(skb_put(skb, msglen), msg, msglen);
+			}
+		}
+		if (skb) {
 			/* Throw on header */
 			zh = (struct ztdeth_header *)skb_push(skb, sizeof(struct ztdeth_header));
 			zh->subaddr = subaddr;
@@ -356,6 +540,7 @@ static void ztdeth_destroy(struct dahdi_dynamic *dyn)
 	struct ztdeth *z = dyn->pvt;
 	unsigned long flags;
 	struct ztdeth *prev=NULL, *cur;
+	zhash_write_lock();
 	spin_lock_irqsave(&zlock, flags);
 	cur = zdevs;
 	while(cur) {
@@ -364,14 +549,23 @@ static void ztdeth_destroy(struct dahdi_dynamic *dyn)
 				prev->next = cur->next;
 			else
 				zdevs = cur->next;
+			ztdeth_hash_del(cur);
 			break;
 		}
 		prev = cur;
 		cur = cur->next;
 	}
 	spin_unlock_irqrestore(&zlock, flags);
+	zhash_write_unlock();
 	if (cur == z) {	/* Successfully removed */
 		printk(KERN_INFO "TDMoE: Removed interface for %s\n", z->span->name);
+		/* Let anyone still looking at it in ztdeth_getspan() finish */
+		synchronize_rcu();
+#if defined(__FreeBSD__)
+		m_freem(z->txm);
+#else
+		kfree_skb(z->txskb);
+#endif
 		kfree(z);
 	}
 }
@@ -471,11 +665,14 @@ static int ztdeth_create(struct dahdi_dynamic *dyn, const char *addr)
 		sprintf(src + strlen(src), "%02x", z->dev->dev_addr[5]);
 		printk(KERN_INFO "TDMoE: Added new interface for %s at %s (addr=%s, src=%s, subaddr=%d)\n", span->name, z->dev->name, addr, src, ntohs(z->subaddr));
 
+		zhash_write_lock();
 		spin_lock_irqsave(&zlock, flags);
 		z->next = zdevs;
 		zdevs = z;
+		ztdeth_hash_add(z);
 		dyn->pvt = z;
 		spin_unlock_irqrestore(&zlock, flags);
+		zhash_write_unlock();
 	}
 	return (z) ? 0 : -ENOMEM;
 }
@@ -487,6 +684,7 @@ static struct dahdi_dynamic_driver ztd_eth = {
 	.create = ztdeth_create,
 	.destroy = ztdeth_destroy,
 	.transmit = ztdeth_transmit,
+	.get_txbuf = ztdeth_get_txbuf,
 	.flush = ztdeth_flush,
 };
 
@@ -520,6 +718,10 @@ static void __exit ztdeth_exit(void)
 }
 
 #if defined(__FreeBSD__)
+SYSCTL_NODE(_dahdi, OID_AUTO, dynamic_eth, CTLFLAG_RW, 0, "DAHDI Dynamic TDMoE Support");
+#define MODULE_PARAM_PREFIX "dahdi.dynamic_eth"
+#define MODULE_PARAM_PARENT _dahdi_dynamic_eth
+
 LINUX_DEV_MODULE(dahdi_dynamic_eth);
 MODULE_VERSION(dahdi_dynamic_eth, 1);
 MODULE_DEPEND(dahdi_dynamic_eth, dahdi, 1, 1, 1);
@@ -527,6 +729,8 @@ MODULE_DEPEND(dahdi_dynamic_eth, dahdi_dynamic, 1, 1, 1);
 MODULE_DEPEND(dahdi_dynamic_eth, ng_dahdi_netdev, 1, 1, 1);
 #endif /* __FreeBSD__ */
 
+module_param(lookup_misses, uint, 0444);
+
 MODULE_DESCRIPTION("DAHDI Dynamic TDMoE Support");
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
 MODULE_LICENSE("GPL v2");
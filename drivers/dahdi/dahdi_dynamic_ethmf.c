@@ -62,11 +62,42 @@
 #endif
 
 #define ETH_P_ZTDETH			0xd00d
-#define ETHMF_MAX_PER_SPAN_GROUP	8
+#define ETHMF_MAX_PER_SPAN_GROUP	64
 #define ETHMF_MAX_GROUPS		16
 #define ETHMF_FLAG_IGNORE_CHAN0	(1 << 3)
+#define ETHMF_FLAG_COMPACT		(1 << 4)
+#define ETHMF_FLAG_COMPACT_OK		(1 << 5)
+/* Cleared on the way in; our frames always carry every channel, so the
+   core's idle suppression is not offered either */
+#define ETHMF_FLAGS	(ETHMF_FLAG_IGNORE_CHAN0 | ETHMF_FLAG_COMPACT | \
+			 ETHMF_FLAG_COMPACT_OK | DAHDI_DYNAMIC_FLAG_CHANMAP_OK)
 #define ETHMF_MAX_SPANS			4
 #define ETHMF_MAX_CHANNELS		31
+#define ETHMF_MIN_FRAME			1500	/* Ethernet MTU */
+#define ETHMF_MAX_FRAME			9000	/* Jumbo frame MTU */
+#define ETHMF_HEADROOM			64
+#define ETHMF_POOL_MAX			64
+
+/*
+ * A multi-span frame has 0x8000 | base << 8 | count as its subaddr, and
+ * carries spans base to base + count - 1 of the group.  The base is 0
+ * unless the group needs more than one frame.
+ *
+ * The original layout has the 6 byte headers of all spans, then 16 bytes
+ * of RBS for each, then each span's audio padded to 32 channels
+ * (ETHMF_LEGACY_SPAN_LEN in all), and receivers take at most
+ * ETHMF_MAX_SPANS spans of it.  Frames with ETHMF_FLAG_COMPACT set in
+ * the first span's flags are instead just the spans' TDMoX messages one
+ * after the other, unpadded.  They are only sent to a peer whose own
+ * frames carry ETHMF_FLAG_COMPACT_OK, and can fill up to max_frame.
+ *
+ * Receivers of the original layout know nothing of the base and take the
+ * spans of a frame as subaddrs 0 up, so they get a single frame, of the
+ * first ETHMF_MAX_SPANS subaddrs up to the first that is missing or still
+ * delayed.  A group of more spans, or with gaps, needs both ends to take
+ * compact frames.
+ */
+#define ETHMF_LEGACY_SPAN_LEN		(6 + 16 + 32 * 8)
 
 struct ztdeth_header {
 	unsigned short subaddr;
@@ -86,13 +117,22 @@ static atomic_t errcount = ATOMIC_INIT(0);
 /* Whether or not we are in shutdown */
 static atomic_t shutdown = ATOMIC_INIT(0);
 
-#if defined(__FreeBSD__)
-static char g_padding[ETHMF_MAX_CHANNELS * 8];
-static char g_padding_ignore[8];
-#else
+#if !defined(__FreeBSD__)
 static struct sk_buff_head skbs;
 #endif
 
+/* Largest frame to send, less the ethernet header */
+static int max_frame = ETHMF_MIN_FRAME;
+
+/* Pack frames without padding for peers that take it */
+static int compact = 1;
+
+/* Packets kept for each new group */
+static int pool_size = 16;
+
+/* Frames sent without a free packet in the pool */
+static unsigned int pool_misses;
+
 #ifdef USE_PROC_FS
 struct ethmf_group {
 	unsigned int hash_addr;
@@ -136,6 +176,36 @@ struct ztdeth {
 	atomic_t no_front_padding;
 	/* counter to pseudo lock the rcvbuf */
 	atomic_t refcnt;
+	/* the group this span is in */
+	struct ethmf_peer *peer;
+
+	struct list_head list;
+};
+
+/*
+ * The spans sharing a destination MAC address, which go out together.
+ */
+struct ethmf_peer {
+	unsigned char addr[ETH_ALEN];
+	unsigned int addr_hash;
+	/* Peer has said it takes compact frames */
+	atomic_t compact;
+	/* Spans by subaddr */
+	struct ztdeth *spans[ETHMF_MAX_PER_SPAN_GROUP];
+	int nslots;		/* Highest subaddr + 1 */
+	int nspans;
+	int legacy_clamped;	/* Warned of spans left out for the layout */
+	/* Frames are built in these and a reference sent, so that they
+	   come back to us once the stack is done with them */
+	int npool;
+	struct {
+#if defined(__FreeBSD__)
+		struct mbuf *m;
+#else
+		struct sk_buff *skb;
+#endif
+		int size;
+	} pool[ETHMF_POOL_MAX];
 
 	struct list_head list;
 };
@@ -171,6 +241,11 @@ rcu_read_unlock(void)
  */
 static _LIST_HEAD(ethmf_list);
 
+/**
+ * The groups of the spans in ethmf_list
+ */
+static _LIST_HEAD(ethmf_peers);
+
 static inline void ethmf_errors_inc(void)
 {
 #ifdef USE_PROC_FS
@@ -196,64 +271,165 @@ static inline int hashaddr_to_index(unsigned int hash_addr)
 #endif
 
 /**
- * Find the Ztdeth Struct and DAHDI span for a given MAC address and subaddr.
+ * Find the group for a given MAC address.
  *
  * NOTE: RCU read lock must already be held.
  */
-static inline void find_ethmf(const unsigned char *addr,
-	const unsigned short subaddr, struct ztdeth **ze,
-	struct dahdi_span **span)
+static inline struct ethmf_peer *find_ethmf_peer(const unsigned char *addr)
 {
-	struct ztdeth *z;
+	struct ethmf_peer *p;
 
-	list_for_each_entry_rcu(z, &ethmf_list, list) {
-		if (!atomic_read(&z->delay)) {
-			if (!memcmp(addr, z->addr, ETH_ALEN)
-					&& z->subaddr == subaddr) {
-				*ze = z;
-				*span = z->span;
-				return;
-			}
-		}
+	list_for_each_entry_rcu(p, &ethmf_peers, list) {
+		if (!memcmp(addr, p->addr, ETH_ALEN))
+			return p;
 	}
-
-	/* no results */
-	*ze = NULL;
-	*span = NULL;
+	return NULL;
 }
 
 /**
- * Determines if all spans are ready for transmit. If all spans are ready,
- * we return the number of spans which indeed are ready and populate the
- * array of pointers to those spans..
+ * Determines if all spans of a group are ready for transmit.
  *
  * NOTE: RCU read lock must already be held.
  */
-static inline int ethmf_trx_spans_ready(unsigned int addr_hash, struct ztdeth *(*ready_spans)[ETHMF_MAX_PER_SPAN_GROUP])
+static inline int ethmf_trx_spans_ready(const struct ethmf_peer *p)
 {
-	struct ztdeth *t;
-	int span_count = 0, spans_ready = 0;
-
-	list_for_each_entry_rcu(t, &ethmf_list, list) {
-		if (!atomic_read(&t->delay) && t->addr_hash == addr_hash) {
-			++span_count;
-			if (atomic_read(&t->ready)) {
-				short subaddr = ntohs(t->subaddr);
-				if (subaddr < ETHMF_MAX_PER_SPAN_GROUP) {
-					(*ready_spans)[subaddr] = t;
-					++spans_ready;
-				} else {
-					printk(KERN_ERR "More than %d spans per multi-frame group are not currently supported.",
-						ETHMF_MAX_PER_SPAN_GROUP);
-				}
-			}
+	int x, spans_ready = 0;
+
+	for (x = 0; x < p->nslots; x++) {
+		const struct ztdeth *t = p->spans[x];
+
+		if (!t || atomic_read(&t->delay))
+			continue;
+		if (!atomic_read(&t->ready))
+			return 0;
+		++spans_ready;
+	}
+	return spans_ready;
+}
+
+static inline int ethmf_max_frame(void)
+{
+	int len = max_frame;
+
+	if (len < ETHMF_MIN_FRAME)
+		len = ETHMF_MIN_FRAME;
+	if (len > ETHMF_MAX_FRAME)
+		len = ETHMF_MAX_FRAME;
+	return len;
+}
+
+/**
+ * Hand one span's message from a received frame to the core.  hdr is
+ * its 6 byte header, rbs its signalling bits and audio its samples.
+ */
+static void ethmf_rcv_span(struct ztdeth *z, const unsigned char *hdr,
+			   const unsigned char *rbs, const unsigned char *audio)
+{
+	unsigned int channels = hdr[5];
+	unsigned int rbslen = ((channels + 3) / 4) * 2;
+
+	if (atomic_dec_and_test(&z->refcnt) == 0) {
+		memcpy(z->rcvbuf, hdr, 6); /* TDM Header */
+		/* Remove our flags since ztdynamic may not understand them */
+		z->rcvbuf[1] &= ~ETHMF_FLAGS;
+		memcpy(z->rcvbuf + 6, rbs, rbslen); /* RBS Header */
+		memcpy(z->rcvbuf + 6 + rbslen, audio, channels * 8); /* Payload */
+
+		dahdi_dynamic_receive(z->span, z->rcvbuf,
+			6 + rbslen + channels * 8);
+	} else {
+		ethmf_errors_inc();
+		printk(KERN_INFO "TDMoE span overflow detected. Span %d was dropped.", ntohs(z->subaddr));
+	}
+	atomic_inc(&z->refcnt);
+}
+
+/**
+ * Receive the spans of a frame in the original, padded layout.
+ */
+static void ethmf_rcv_legacy(struct ethmf_peer *p, int base, int num_spans,
+			     const unsigned char *data, unsigned int len)
+{
+	int span_index;
+	unsigned int channels, flags, skip;
+	struct ztdeth *z;
+
+	if (unlikely(22 * num_spans > len)) {
+		ethmf_errors_inc();
+		return;
+	}
+
+	for (span_index = 0; span_index < num_spans; span_index++) {
+		const unsigned char *hdr = data + 6 * span_index;
+
+		z = p->spans[base + span_index];
+		if (unlikely(!z || atomic_read(&z->delay))) {
+			/* The recv'd span does not belong to us */
+			continue;
 		}
+
+		flags = hdr[1];
+		channels = hdr[5];
+		if (unlikely(hdr[0] != 8 || channels > ETHMF_MAX_CHANNELS || channels == 0)) {
+			ethmf_errors_inc();
+			continue;
+		}
+
+		/*
+		 * If we ignore channel zero we must skip the first eight bytes
+		 */
+		if (flags & ETHMF_FLAG_IGNORE_CHAN0) {
+			skip = 8;
+
+			/* Additionally, now we will transmit with front padding */
+			atomic_set(&z->no_front_padding, 0);
+		} else {
+			skip = 0;
+
+			/* Disable front padding if we recv'd a packet without it */
+			atomic_set(&z->no_front_padding, 1);
+		}
+
+		/* 256 == 32*8; if padding lengths change, this must be modified */
+		if (unlikely(22 * num_spans + 256 * span_index + skip +
+			     channels * 8 > len)) {
+			ethmf_errors_inc();
+			break;
+		}
+		ethmf_rcv_span(z, hdr, data + 6 * num_spans + 16 * span_index,
+			data + 22 * num_spans + 256 * span_index + skip);
 	}
+}
 
-	if (span_count && spans_ready && span_count == spans_ready) {
-		return spans_ready;
+/**
+ * Receive the spans of a compact frame: their messages back to back.
+ */
+static void ethmf_rcv_compact(struct ethmf_peer *p, int base, int num_spans,
+			      const unsigned char *data, unsigned int len)
+{
+	int span_index;
+	unsigned int channels, rbslen, msglen;
+	struct ztdeth *z;
+
+	for (span_index = 0; span_index < num_spans; span_index++) {
+		if (unlikely(len < 6))
+			break;
+		channels = data[5];
+		rbslen = ((channels + 3) / 4) * 2;
+		msglen = 6 + rbslen + channels * 8;
+		if (unlikely(msglen > len || data[0] != 8 || data[4] != 0 ||
+			     channels > ETHMF_MAX_CHANNELS || channels == 0)) {
+			ethmf_errors_inc();
+			break;
+		}
+
+		z = p->spans[base + span_index];
+		if (likely(z && !atomic_read(&z->delay)))
+			ethmf_rcv_span(z, data, data + 6, data + 6 + rbslen);
+
+		data += msglen;
+		len -= msglen;
 	}
-	return 0;
 }
 
 /**
@@ -267,14 +443,12 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 		struct packet_type *pt, struct net_device *orig_dev)
 #endif /* !__FreeBSD__ */
 {
-	int num_spans = 0, span_index = 0;
+	int num_spans, base;
 	unsigned char *src_addr;
 	unsigned char *data;
-	struct dahdi_span *span;
-	struct ztdeth *z = NULL;
+	unsigned int len;
+	struct ethmf_peer *p;
 	struct ztdeth_header *zh;
-	unsigned int samples, channels, rbslen, flags;
-	unsigned int skip = 0;
 
 #if defined(__FreeBSD__)
 	if (msglen < sizeof(*zh))
@@ -288,14 +462,16 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 	if (ntohs(zh->subaddr) & 0x8000) {
 		/* got a multi-span frame */
 		num_spans = ntohs(zh->subaddr) & 0xFF;
+		base = (ntohs(zh->subaddr) >> 8) & 0x7F;
 
-		/* Currently max of 4 spans supported */
-		if (unlikely(num_spans > ETHMF_MAX_SPANS)) {
+		if (unlikely(!num_spans ||
+			     base + num_spans > ETHMF_MAX_PER_SPAN_GROUP)) {
 			goto out;
 		}
 
 #if defined(__FreeBSD__)
 		data = msg + sizeof(*zh);
+		len = msglen - sizeof(*zh);
 		src_addr = eh->ether_shost;
 #else /* !__FreeBSD__ */
 		skb_pull(skb, sizeof(struct ztdeth_header));
@@ -307,78 +483,34 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 			skb_linearize(skb, GFP_KERNEL);
 #endif
 		data = (unsigned char *) skb->data;
+		len = skb->len;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 9)
 		src_addr = eth_hdr(skb)->h_source;
 #else
 		src_addr = skb->mac.ethernet->h_source;
 #endif
 #endif /* !__FreeBSD__ */
+		if (unlikely(len < 6))
+			goto out;
 
 		rcu_read_lock();
-		do {
-			find_ethmf(src_addr, htons(span_index), &z, &span);
-			if (unlikely(!z || !span)) {
-				/* The recv'd span does not belong to us */
-				/* ethmf_errors_inc(); */
-				++span_index;
-				continue;
-			}
-
-			samples = data[(span_index * 6)] & 0xFF;
-			flags = data[((span_index * 6) + 1)] & 0xFF;
-			channels = data[((span_index * 6) + 5)] & 0xFF;
-			rbslen = ((channels + 3) / 4) * 2;
-
-			if (unlikely(samples != 8 || channels > ETHMF_MAX_CHANNELS || channels == 0)) {
-				ethmf_errors_inc();
-				++span_index;
-				continue;
-			}
+		p = find_ethmf_peer(src_addr);
+		if (unlikely(!p || atomic_read(&shutdown))) {
+			rcu_read_unlock();
+			goto out;
+		}
 
-			if (atomic_dec_and_test(&z->refcnt) == 0) {
-				memcpy(z->rcvbuf, data + 6*span_index, 6); /* TDM Header */
-				/*
-				 * If we ignore channel zero we must skip the first eight bytes and
-				 * ensure that ztdynamic doesn't get confused by this new flag
-				 */
-				if (flags & ETHMF_FLAG_IGNORE_CHAN0) {
-					skip = 8;
-
-					/* Remove this flag since ztdynamic may not understand it */
-					z->rcvbuf[1] = flags & ~(ETHMF_FLAG_IGNORE_CHAN0);
-
-					/* Additionally, now we will transmit with front padding */
-					atomic_set(&z->no_front_padding, 0);
-				} else {
-					/* Disable front padding if we recv'd a packet without it */
-					atomic_set(&z->no_front_padding, 1);
-				}
-				memcpy(z->rcvbuf + 6, data + 6*num_spans + 16
-					*span_index, rbslen); /* RBS Header */
-
-				/* 256 == 32*8; if padding lengths change, this must be modified */
-				memcpy(z->rcvbuf + 6 + rbslen, data + 6*num_spans + 16
-					*num_spans + (256)*span_index + skip, channels
-					* 8); /* Payload */
-
-				dahdi_dynamic_receive(span, z->rcvbuf, 6 + rbslen
-					+ channels*8);
-			} else {
-				ethmf_errors_inc();
-				printk(KERN_INFO "TDMoE span overflow detected. Span %d was dropped.", span_index);
-			}
-			atomic_inc(&z->refcnt);
+		atomic_set(&p->compact, !!(data[1] & ETHMF_FLAG_COMPACT_OK));
+		if (data[1] & ETHMF_FLAG_COMPACT)
+			ethmf_rcv_compact(p, base, num_spans, data, len);
+		else
+			ethmf_rcv_legacy(p, base, num_spans, data, len);
 
 #ifdef USE_PROC_FS
-			if (span_index == 0) {
-				atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].rxframecount));
-				atomic_add(skb->len + z->dev->hard_header_len +
-					sizeof(struct ztdeth_header),
-					&(ethmf_groups[hashaddr_to_index(z->addr_hash)].rxbytecount));
-			}
+		atomic_inc(&(ethmf_groups[hashaddr_to_index(p->addr_hash)].rxframecount));
+		atomic_add(skb->len + ETH_HLEN + sizeof(struct ztdeth_header),
+			&(ethmf_groups[hashaddr_to_index(p->addr_hash)].rxbytecount));
 #endif
-			++span_index;
-		} while (!atomic_read(&shutdown) && span_index < num_spans);
 		rcu_read_unlock();
 	}
 
@@ -427,191 +559,297 @@ static int ztdethmf_notifier(struct notifier_block *block, unsigned long event,
 	return 0;
 }
 
-static void ztdethmf_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+/**
+ * Lay out spans[0..n-1] of a group as a frame, after the ztdeth header.
+ * Returns the frame length, ztdeth header included.
+ */
+static int ethmf_build(unsigned char *out, struct ztdeth **spans, int n,
+		       int base, int use_compact)
 {
-	struct ztdeth *z = dyn->pvt, *ready_spans[ETHMF_MAX_PER_SPAN_GROUP];
-#if defined(__FreeBSD__)
-	struct mbuf *m;
-	struct ether_header eh;
-	struct ztdeth_header zh;
-#else
-	struct sk_buff *skb;
-	struct ztdeth_header *zh;
-	unsigned char addr[ETH_ALEN];
-#endif
-	unsigned short subaddr;
-	struct net_device *dev;
-	int spans_ready = 0, index = 0;
+	struct ztdeth_header *zh = (struct ztdeth_header *)out;
+	unsigned char *buf = out + sizeof(*zh);
+	unsigned char flags = compact ? ETHMF_FLAG_COMPACT_OK : 0;
+	int index, chan, rbs;
+
+	zh->subaddr = htons(0x8000 | (base << 8) | n);
+
+	if (use_compact) {
+		for (index = 0; index < n; index++) {
+			memcpy(buf, spans[index]->msgbuf, spans[index]->msgbuf_len);
+			buf[1] |= flags | ETHMF_FLAG_COMPACT;
+			buf += spans[index]->msgbuf_len;
+		}
+		return buf - out;
+	}
 
-	if (atomic_read(&shutdown))
-		return;
+	/* copy each spans header */
+	for (index = 0; index < n; index++) {
+		memcpy(buf, spans[index]->msgbuf, 6);
+		buf[1] |= flags;
+		if (!atomic_read(&(spans[index]->no_front_padding)))
+			buf[1] |= ETHMF_FLAG_IGNORE_CHAN0;
+		buf += 6;
+	}
 
-	rcu_read_lock();
+	/* copy each spans RBS payload */
+	for (index = 0; index < n; index++) {
+		rbs = ((spans[index]->real_channels + 3) / 4) * 2;
+		memcpy(buf, spans[index]->msgbuf + 6, rbs);
+		memset(buf + rbs, 0, 16 - rbs);
+		buf += 16;
+	}
 
-	if (unlikely(!z || !z->dev)) {
-		rcu_read_unlock();
-		return;
+	/* copy each spans data/voice payload, padded to 32 channels */
+	for (index = 0; index < n; index++) {
+		unsigned char *end = buf + 32 * 8;
+
+		chan = spans[index]->real_channels;
+		rbs = ((chan + 3) / 4) * 2;
+		if (!atomic_read(&(spans[index]->no_front_padding))) {
+			/* This adds an additional (padded) channel to our total */
+			memset(buf, 0xA5, 8); /* ETHMF_IGNORE_CHAN0 */
+			buf += 8;
+		}
+		memcpy(buf, spans[index]->msgbuf + 6 + rbs, chan * 8);
+		buf += chan * 8;
+		memset(buf, 0xDD, end - buf);
+		buf = end;
 	}
+	return buf - out;
+}
 
 #if defined(__FreeBSD__)
-	if (atomic_cmpset_int(&z->ready, 0, 1)) {
-		memcpy(z->msgbuf, msg, msglen);
-		z->msgbuf_len = msglen;
-	}
-#else /* !__FreeBSD__ */
-	if (!atomic_read(&z->ready)) {
-		if (atomic_inc_return(&z->ready) == 1) {
-			memcpy(z->msgbuf, msg, msglen);
-			z->msgbuf_len = msglen;
+static struct mbuf *ethmf_getbuf(int len)
+{
+	int size;
+
+	if (len <= MCLBYTES)
+		size = MCLBYTES;
+	else if (len <= MJUMPAGESIZE)
+		size = MJUMPAGESIZE;
+	else
+		size = MJUM9BYTES;
+	return m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR, size);
+}
+
+/**
+ * A packet from the pool with room for len bytes, or NULL.  Packets
+ * are ours again once the stack has freed the copy we sent.
+ */
+static struct mbuf *ethmf_pool_get(struct ethmf_peer *p, int len)
+{
+	struct mbuf *m;
+	int x;
+
+	for (x = 0; x < p->npool; x++) {
+		m = p->pool[x].m;
+		if (!M_WRITABLE(m))
+			continue;
+		if (p->pool[x].size < len) {
+			/* max_frame has grown since */
+			m = ethmf_getbuf(len);
+			if (m == NULL)
+				continue;
+			m_freem(p->pool[x].m);
+			p->pool[x].m = m;
+			p->pool[x].size = m->m_ext.ext_size;
 		}
+		return m;
 	}
-#endif /* !__FreeBSD__ */
-
-	spans_ready = ethmf_trx_spans_ready(z->addr_hash, &ready_spans);
-	if (spans_ready) {
-		int pad[ETHMF_MAX_SPANS], rbs[ETHMF_MAX_SPANS];
+	pool_misses++;
+	return NULL;
+}
 
-		dev = z->dev;
-#if defined(__FreeBSD__)
-		bcopy(z->addr, &eh.ether_dhost, sizeof(eh.ether_dhost));
-#else /* !__FreeBSD__ */
-		memcpy(addr, z->addr, sizeof(z->addr));
-#endif /* !__FreeBSD__ */
+static void ethmf_send(struct ethmf_peer *p, struct net_device *dev,
+		       struct ztdeth **spans, int n, int base,
+		       int use_compact, int len)
+{
+	struct ether_header *eh;
+	struct mbuf *m, *copy;
 
-		for (index = 0; index < spans_ready; index++) {
-			int chan = ready_spans[index]->real_channels;
-			/* By default we pad to 32 channels, but if
-			 * no_front_padding is false then we have a pad
-			 * in the front of 8 bytes, so this implies one
-			 * less channel
-			 */
-			if (atomic_read(&(ready_spans[index]->no_front_padding)))
-				pad[index] = (32 - chan)*8;
-			else
-				pad[index] = (ETHMF_MAX_CHANNELS - chan)*8;
-
-			rbs[index] = ((chan + 3) / 4) * 2;
+	len += sizeof(*eh) + sizeof(struct ztdeth_header);
+	m = copy = ethmf_pool_get(p, len);
+	if (m == NULL) {
+		m = ethmf_getbuf(len);
+		if (m == NULL) {
+			ethmf_errors_inc();
+			return;
 		}
+	}
 
-#if defined(__FreeBSD__)
-		MGETHDR(m, M_NOWAIT, MT_DATA);
+	eh = mtod(m, struct ether_header *);
+	bcopy(p->addr, &eh->ether_dhost, sizeof(eh->ether_dhost));
+	bcopy(dev->dev_addr, &eh->ether_shost, sizeof(eh->ether_shost));
+	eh->ether_type = __constant_htons(ETH_P_ZTDETH);
+	m->m_pkthdr.len = m->m_len = sizeof(*eh) +
+		ethmf_build((unsigned char *)(eh + 1), spans, n, base,
+			    use_compact);
+
+	if (copy != NULL) {
+		/* Send a copy sharing the pool's cluster */
+		m = m_copypacket(copy, M_NOWAIT);
 		if (m == NULL) {
-			rcu_read_unlock();
 			ethmf_errors_inc();
 			return;
 		}
-		MCLGET(m, M_NOWAIT);
+	}
 
-		/* copy ethernet header and reserve space for ztdeth header */
-		bcopy(dev->dev_addr, &eh.ether_shost, sizeof(eh.ether_shost));
-		eh.ether_type = __constant_htons(ETH_P_ZTDETH);
-		m_copyback(m, 0, sizeof(eh), (caddr_t) &eh);
-		m->m_pkthdr.len = m->m_len = sizeof(eh) + sizeof(zh);
+	/* send raw ethernet frame */
+	dev_xmit(dev, m);
+}
 #else /* !__FreeBSD__ */
-		/* Allocate the standard size for a 32-chan frame */
-		skb = dev_alloc_skb(1112 + dev->hard_header_len
-			+ sizeof(struct ztdeth_header) + 32);
+static struct sk_buff *ethmf_pool_get(struct ethmf_peer *p, int len)
+{
+	struct sk_buff *skb;
+	int x;
+
+	for (x = 0; x < p->npool; x++) {
+		skb = p->pool[x].skb;
+		/* Still in flight, or its data still shared by a clone */
+		if (skb_shared(skb) || skb_cloned(skb))
+			continue;
+		if (p->pool[x].size < len) {
+			/* max_frame has grown since */
+			skb = alloc_skb(len, GFP_ATOMIC);
+			if (!skb)
+				continue;
+			kfree_skb(p->pool[x].skb);
+			p->pool[x].skb = skb;
+			p->pool[x].size = len;
+		}
+		/* Start it over, and keep a reference for ourselves */
+		skb->data = skb->head;
+		skb_reset_tail_pointer(skb);
+		skb->len = 0;
+		return skb_get(skb);
+	}
+	pool_misses++;
+	return NULL;
+}
+
+static void ethmf_send(struct ethmf_peer *p, struct net_device *dev,
+		       struct ztdeth **spans, int n, int base,
+		       int use_compact, int len)
+{
+	struct sk_buff *skb;
+
+	len += sizeof(struct ztdeth_header);
+	skb = NULL;
+	if (dev->hard_header_len <= ETHMF_HEADROOM)
+		skb = ethmf_pool_get(p, ETHMF_HEADROOM + len);
+	if (!skb) {
+		skb = dev_alloc_skb(dev->hard_header_len + len);
 		if (unlikely(!skb)) {
-			rcu_read_unlock();
 			ethmf_errors_inc();
 			return;
 		}
+	}
 
-		/* Reserve header space */
-		skb_reserve(skb, dev->hard_header_len
-				+ sizeof(struct ztdeth_header));
-#endif /* !__FreeBSD__ */
+	/* Reserve header space */
+	skb_reserve(skb, dev->hard_header_len);
+	ethmf_build(skb_put(skb, len), spans, n, base, use_compact);
 
-		/* copy each spans header */
-		for (index = 0; index < spans_ready; index++) {
-			if (!atomic_read(&(ready_spans[index]->no_front_padding))) {
-				ready_spans[index]->msgbuf[1]
-					|= ETHMF_FLAG_IGNORE_CHAN0;
-			}
-#if defined(__FreeBSD__)
-			m_append(m, 6, ready_spans[index]->msgbuf);
+	/* Setup protocol type */
+	skb->protocol = __constant_htons(ETH_P_ZTDETH);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 22)
+	skb_set_network_header(skb, 0);
 #else
-			memcpy(skb_put(skb, 6), ready_spans[index]->msgbuf, 6);
+	skb->nh.raw = skb->data;
 #endif
-		}
-
-		/* copy each spans RBS payload */
-		for (index = 0; index < spans_ready; index++) {
-#if defined(__FreeBSD__)
-			m_append(m, 16, ready_spans[index]->msgbuf + 6);
+	skb->dev = dev;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
+	dev_hard_header(skb, dev, ETH_P_ZTDETH, p->addr, dev->dev_addr, skb->len);
 #else
-			memcpy(skb_put(skb, 16), ready_spans[index]->msgbuf + 6,
-				rbs[index]);
+	if (dev->hard_header)
+		dev->hard_header(skb, dev, ETH_P_ZTDETH, p->addr,
+				dev->dev_addr, skb->len);
 #endif
-		}
+	/* queue frame for delivery */
+	skb_queue_tail(&skbs, skb);
+}
+#endif /* !__FreeBSD__ */
 
-		/* copy each spans data/voice payload */
-		for (index = 0; index < spans_ready; index++) {
-			int chan = ready_spans[index]->real_channels;
-			if (!atomic_read(&(ready_spans[index]->no_front_padding))) {
-				/* This adds an additional (padded) channel to our total */
-#if defined(__FreeBSD__)
-				m_append(m, sizeof(g_padding_ignore), g_padding_ignore);
-#else
-				memset(skb_put(skb, 8), 0xA5, 8); /* ETHMF_IGNORE_CHAN0 */
-#endif
-			}
-#if defined(__FreeBSD__)
-			m_append(m, chan * 8, ready_spans[index]->msgbuf + (6 + rbs[index]));
-#else
-			memcpy(skb_put(skb, chan*8), ready_spans[index]->msgbuf
-					+ (6 + rbs[index]), chan*8);
-#endif
-			if (pad[index] > 0) {
-#if defined(__FreeBSD__)
-				m_append(m, pad[index], g_padding);
-#else
-				memset(skb_put(skb, pad[index]), 0xDD, pad[index]);
-#endif
-			}
+static void ztdethmf_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+{
+	struct ztdeth *z = dyn->pvt, *t;
+	struct ethmf_peer *p;
+	struct net_device *dev;
+	int base, n, len, size, room, most, last, use_compact;
 
-			/* mark span as ready for new data/voice */
-			atomic_set(&(ready_spans[index]->ready), 0);
-		}
+	if (atomic_read(&shutdown))
+		return;
 
-		subaddr = htons((unsigned short)(0x8000 | (unsigned char)(spans_ready & 0xFF)));
-#if defined(__FreeBSD__)
-		/* copy ztdeth header */
-		zh.subaddr = subaddr;
-		m_copyback(m, sizeof(eh), sizeof(zh), (caddr_t) &zh);
+	rcu_read_lock();
 
-		/* send raw ethernet frame */
-		dev_xmit(dev, m);
-#else /* !__FreeBSD__ */
-		/* Throw on header */
-		zh = (struct ztdeth_header *)skb_push(skb,
-				sizeof(struct ztdeth_header));
-		zh->subaddr = subaddr;
+	if (unlikely(!z || !z->dev)) {
+		rcu_read_unlock();
+		return;
+	}
 
-		/* Setup protocol type */
-		skb->protocol = __constant_htons(ETH_P_ZTDETH);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 22)
-		skb_set_network_header(skb, 0);
-#else
-		skb->nh.raw = skb->data;
-#endif
-		skb->dev = dev;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
-		dev_hard_header(skb, dev, ETH_P_ZTDETH, addr, dev->dev_addr, skb->len);
-#else
-		if (dev->hard_header)
-			dev->hard_header(skb, dev, ETH_P_ZTDETH, addr,
-					dev->dev_addr, skb->len);
-#endif
-		/* queue frame for delivery */
-		if (dev) {
-			skb_queue_tail(&skbs, skb);
+#if defined(__FreeBSD__)
+	if (atomic_cmpset_int(&z->ready, 0, 1)) {
+		memcpy(z->msgbuf, msg, msglen);
+		z->msgbuf_len = msglen;
+	}
+#else /* !__FreeBSD__ */
+	if (!atomic_read(&z->ready)) {
+		if (atomic_inc_return(&z->ready) == 1) {
+			memcpy(z->msgbuf, msg, msglen);
+			z->msgbuf_len = msglen;
 		}
+	}
 #endif /* !__FreeBSD__ */
+
+	p = z->peer;
+	if (!ethmf_trx_spans_ready(p)) {
+		rcu_read_unlock();
+		return;
+	}
+
+	dev = z->dev;
+	use_compact = compact && atomic_read(&p->compact);
+	room = ethmf_max_frame() - sizeof(struct ztdeth_header);
+	most = use_compact ? 0xFF : ETHMF_MAX_SPANS;
+	last = p->nslots;
+	if (!use_compact && last > ETHMF_MAX_SPANS) {
+		last = ETHMF_MAX_SPANS;
+		if (!p->legacy_clamped) {
+			p->legacy_clamped = 1;
+			printk(KERN_WARNING "TDMoE Multiframe: peer does not "
+			       "take compact frames, only sending subaddrs "
+			       "0 to %d of its group\n", ETHMF_MAX_SPANS - 1);
+		}
+	}
+
+	/* Runs of consecutive spans, as many to a frame as fit */
+	for (base = 0; base < last; base += n ? n : 1) {
+		len = 0;
+		for (n = 0; n < most && base + n < last; n++) {
+			t = p->spans[base + n];
+			if (!t || atomic_read(&t->delay))
+				break;
+			size = use_compact ? t->msgbuf_len : ETHMF_LEGACY_SPAN_LEN;
+			if (len + size > room)
+				break;
+			len += size;
+		}
+		if (n) {
+			ethmf_send(p, dev, &p->spans[base], n, base,
+				   use_compact, len);
 #ifdef USE_PROC_FS
-		atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].txframecount));
-		atomic_add(skb->len, &(ethmf_groups[hashaddr_to_index(z->addr_hash)].txbytecount));
+			atomic_inc(&(ethmf_groups[hashaddr_to_index(p->addr_hash)].txframecount));
+			atomic_add(len, &(ethmf_groups[hashaddr_to_index(p->addr_hash)].txbytecount));
 #endif
+		}
+		/* Anything after a gap would land on the wrong subaddrs */
+		if (!use_compact)
+			break;
+	}
+
+	/* mark spans as ready for new data/voice */
+	for (base = 0; base < p->nslots; base++) {
+		if (p->spans[base])
+			atomic_set(&p->spans[base]->ready, 0);
 	}
 
 	rcu_read_unlock();
@@ -638,38 +876,97 @@ static struct packet_type ztdethmf_ptype = {
 	.func = ztdethmf_rcv,			/* Receiver */
 };
 
+static void ethmf_peer_free(struct ethmf_peer *p)
+{
+	int x;
+
+	for (x = 0; x < p->npool; x++) {
+#if defined(__FreeBSD__)
+		m_freem(p->pool[x].m);
+#else
+		kfree_skb(p->pool[x].skb);
+#endif
+	}
+	kfree(p);
+}
+
+/**
+ * A new group, with its pool filled for frames of max_frame.
+ */
+static struct ethmf_peer *ethmf_peer_alloc(const unsigned char *addr,
+					   unsigned int addr_hash)
+{
+	struct ethmf_peer *p;
+	int len = ETHMF_HEADROOM + ethmf_max_frame();
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return NULL;
+	memcpy(p->addr, addr, ETH_ALEN);
+	p->addr_hash = addr_hash;
+
+	while (p->npool < pool_size && p->npool < ETHMF_POOL_MAX) {
+#if defined(__FreeBSD__)
+		struct mbuf *m = ethmf_getbuf(len);
+
+		if (m == NULL)
+			break;
+		p->pool[p->npool].m = m;
+		p->pool[p->npool].size = m->m_ext.ext_size;
+#else
+		struct sk_buff *skb = alloc_skb(len, GFP_KERNEL);
+
+		if (!skb)
+			break;
+		p->pool[p->npool].skb = skb;
+		p->pool[p->npool].size = len;
+#endif
+		p->npool++;
+	}
+	return p;
+}
+
 static void ztdethmf_destroy(struct dahdi_dynamic *dyn)
 {
 	struct ztdeth *z = dyn->pvt;
+	struct ethmf_peer *p = z->peer;
 	unsigned long flags;
+	int x;
 
 	atomic_set(&shutdown, 1);
 	synchronize_rcu();
 
 	spin_lock_irqsave(&ethmf_lock, flags);
 	list_del_rcu(&z->list);
+	p->spans[ntohs(z->subaddr)] = NULL;
+	p->nslots = 0;
+	for (x = 0; x < ETHMF_MAX_PER_SPAN_GROUP; x++) {
+		if (p->spans[x])
+			p->nslots = x + 1;
+	}
+	if (--p->nspans == 0)
+		list_del_rcu(&p->list);
+	else
+		p = NULL;
 	spin_unlock_irqrestore(&ethmf_lock, flags);
 	synchronize_rcu();
 #if defined(USE_PROC_FS)
 	atomic_dec(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].spans));
 #endif
 
-	if (z) { /* Successfully removed */
-		printk(KERN_INFO "Removed interface for %s\n",
-			z->span->name);
-		kfree(z->msgbuf);
-		kfree(z);
-	} else {
-		if (z && z->span && z->span->name) {
-			printk(KERN_ERR "Cannot find interface for %s\n",
-				z->span->name);
-		}
-	}
+	if (p)
+		ethmf_peer_free(p);
+
+	printk(KERN_INFO "Removed interface for %s\n", z->span->name);
+	kfree(z->msgbuf);
+	kfree(z->rcvbuf);
+	kfree(z);
 }
 
 static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 {
 	struct ztdeth *z;
+	struct ethmf_peer *peer, *new_peer = NULL;
 	char src[256];
 	char *src_ptr;
 	int x, bufsize, num_matched;
@@ -682,6 +979,7 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 	if (span->channels > ETHMF_MAX_CHANNELS) {
 		printk(KERN_ERR "span %s, %d channels, but max %d channels supported\n",
 		    span->name, span->channels, ETHMF_MAX_CHANNELS);
+		return -EINVAL;
 	}
 	z = kmalloc(sizeof(struct ztdeth), GFP_KERNEL);
 	if (!z)
@@ -728,11 +1026,42 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 		kfree(z);
 		return -EINVAL;
 	}
+	if (z->subaddr >= ETHMF_MAX_PER_SPAN_GROUP) {
+		printk(KERN_ERR "TDMoE Multiframe: subaddr %d, but max %d spans per group supported\n",
+			z->subaddr, ETHMF_MAX_PER_SPAN_GROUP);
+		kfree(z->msgbuf);
+		kfree(z->rcvbuf);
+		kfree(z);
+		return -EINVAL;
+	}
 	z->span = span;
 	z->subaddr = htons(z->subaddr);
 	z->addr_hash = crc32_le(0, z->addr, ETH_ALEN);
 	z->real_channels = span->channels;
 
+	/* Creation is serialized by the core, so the group can't appear
+	   between here and adding the span to it */
+	rcu_read_lock();
+	peer = find_ethmf_peer(z->addr);
+	rcu_read_unlock();
+	if (!peer) {
+		peer = new_peer = ethmf_peer_alloc(z->addr, z->addr_hash);
+		if (!peer) {
+			kfree(z->msgbuf);
+			kfree(z->rcvbuf);
+			kfree(z);
+			return -ENOMEM;
+		}
+	} else if (peer->spans[ntohs(z->subaddr)]) {
+		printk(KERN_ERR "TDMoE Multiframe: subaddr %d already in use\n",
+			ntohs(z->subaddr));
+		kfree(z->msgbuf);
+		kfree(z->rcvbuf);
+		kfree(z);
+		return -EBUSY;
+	}
+	z->peer = peer;
+
 	src[0] = '\0';
 	for (x = 0; x < 5; x++)
 		sprintf(src + strlen(src), "%02x:", z->dev->dev_addr[x]);
@@ -741,12 +1070,21 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 	printk(KERN_INFO "TDMoEmf: Added new interface for %s at %s "
 		"(addr=%s, src=%s, subaddr=%d)\n", span->name, z->dev->name,
 		addr, src, ntohs(z->subaddr));
+	if (ntohs(z->subaddr) >= ETHMF_MAX_SPANS)
+		printk(KERN_NOTICE "TDMoEmf: subaddr %d is only sent to a "
+			"peer that takes compact frames\n", ntohs(z->subaddr));
 
 	atomic_set(&z->ready, 0);
 	atomic_set(&z->refcnt, 0);
 
 	spin_lock_irqsave(&ethmf_lock, flags);
 	list_add_rcu(&z->list, &ethmf_list);
+	if (new_peer)
+		list_add_rcu(&new_peer->list, &ethmf_peers);
+	peer->spans[ntohs(z->subaddr)] = z;
+	if (ntohs(z->subaddr) >= peer->nslots)
+		peer->nslots = ntohs(z->subaddr) + 1;
+	peer->nspans++;
 	spin_unlock_irqrestore(&ethmf_lock, flags);
 #if defined(USE_PROC_FS)
 	atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].spans));
@@ -759,6 +1097,14 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 	return 0;
 }
 
+/* The spans of a group go out in the same frames */
+static unsigned long ztdethmf_tx_key(struct dahdi_dynamic *dyn)
+{
+	struct ztdeth *z = dyn->pvt;
+
+	return (unsigned long)z->peer;
+}
+
 static struct dahdi_dynamic_driver ztd_ethmf = {
 	.owner = THIS_MODULE,
 	.name = "ethmf",
@@ -767,6 +1113,7 @@ static struct dahdi_dynamic_driver ztd_ethmf = {
 	.destroy = ztdethmf_destroy,
 	.transmit = ztdethmf_transmit,
 	.flush = ztdethmf_flush,
+	.tx_key = ztdethmf_tx_key,
 };
 
 static struct notifier_block ztdethmf_nblock = {
@@ -891,10 +1238,7 @@ static int __init ztdethmf_init(void)
 	register_netdevice_notifier(&ztdethmf_nblock);
 	dahdi_dynamic_register_driver(&ztd_ethmf);
 
-#if defined(__FreeBSD__)
-	memset(g_padding, 0xdd, sizeof(g_padding));
-	memset(g_padding_ignore, 0xa5, sizeof(g_padding_ignore));
-#else
+#if !defined(__FreeBSD__)
 	skb_queue_head_init(&skbs);
 #endif
 
@@ -925,6 +1269,10 @@ static void __exit ztdethmf_exit(void)
 }
 
 #if defined(__FreeBSD__)
+SYSCTL_NODE(_dahdi, OID_AUTO, dynamic_ethmf, CTLFLAG_RW, 0, "DAHDI Dynamic TDMoEmf Support");
+#define MODULE_PARAM_PREFIX "dahdi.dynamic_ethmf"
+#define MODULE_PARAM_PARENT _dahdi_dynamic_ethmf
+
 LINUX_DEV_MODULE(dahdi_dynamic_ethmf);
 MODULE_VERSION(dahdi_dynamic_ethmf, 1);
 MODULE_DEPEND(dahdi_dynamic_ethmf, dahdi, 1, 1, 1);
@@ -932,6 +1280,11 @@ MODULE_DEPEND(dahdi_dynamic_ethmf, dahdi_dynamic, 1, 1, 1);
 MODULE_DEPEND(dahdi_dynamic_ethmf, ng_dahdi_netdev, 1, 1, 1);
 #endif /* __FreeBSD__ */
 
+module_param(max_frame, int, 0644);
+module_param(compact, int, 0644);
+module_param(pool_size, int, 0644);
+module_param(pool_misses, uint, 0444);
+
 MODULE_DESCRIPTION("DAHDI Dynamic TDMoEmf Support");
 MODULE_AUTHOR("Joseph Benden <joe@thrallingpenguin.com>");
 #ifdef MODULE_LICENSE
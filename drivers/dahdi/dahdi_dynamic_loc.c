@@ -12,7 +12,8 @@
  * Address syntax : 
  * <key>:<id>[:<monitor id>]
  *
- * As of now, keys and ids are single digit only
+ * Keys are up to four hex digits, ids a single one.  Keys from 1000 hex
+ * up are kept for the benchmark below and refused in configured spans.
  *
  * One span may have up to one "normal" peer, and one "monitor" peer
  * 
@@ -29,6 +30,24 @@
  * Contrary to TDMoE, no frame loss can occur.
  *
  * See bug #2021 for more details
+ *
+ * Benchmark mode: with bench_pairs set at load, that many pairs of
+ * bench_channels channel spans are created (keys 1000 hex and up) and looped
+ * back to each other, their audio channels carrying noise.  Optionally
+ * bench_conf channels at a time of the first span of each pair are put in
+ * a conference, bench_echocan is attached to and enabled on every audio
+ * channel, and with bench_hdlc the last channel of each span runs HDLC.
+ * With bench_check set the pairs carry no noise and only idle traffic
+ * between channels of different laws instead: on the first span of each
+ * pair they alternate between mu-law and A-law audio, and on the second
+ * they are clear.  Every chunk received is compared with the one its
+ * peer sent, and any that differ are counted in bench_check_errors.  This
+ * needs dahdi_dynamic's jitter_depth at 0, so that each message is played
+ * out as it arrives, and its idle_suppress set for the idle channels to
+ * leave the bitmap.
+ * The spans cannot provide timing, so they run off whatever the master is,
+ * dahdi_dummy on a machine without hardware; its dahdi.dummy.stats sysctl
+ * has the per-tick processing time and missed ticks.
  * 
  */
 
@@ -68,6 +87,8 @@
 struct dahdi_dynamic_local {
 	unsigned short key;
 	unsigned short id;
+	int bench;
+	u32 noise;
 	struct dahdi_dynamic_local *monitor_rx_peer;
 	struct dahdi_dynamic_local *peer;
 	struct dahdi_span *span;
@@ -77,6 +98,72 @@ struct dahdi_dynamic_local {
 static DEFINE_SPINLOCK(local_lock);
 static _LIST_HEAD(dynamic_local_list);
 
+/* Keys from here on are the benchmark's */
+#define LOC_BENCH_KEY		0x1000
+#define LOC_BENCH_MAX_PAIRS	4096
+
+/* Set while dahdi_dynamic_local_bench() creates its spans, the only
+   time a benchmark key is accepted */
+static int bench_setup;
+
+static int bench_pairs = 0;
+static int bench_channels = 24;
+static int bench_conf = 0;
+#if defined(__FreeBSD__)
+static char bench_echocan[16] = "";
+#else
+static char *bench_echocan = "";
+#endif
+static int bench_taps = 128;
+static int bench_hdlc = 0;
+static int bench_check = 0;
+static int bench_check_errors;
+
+/* Put noise on a benchmark span's audio channels, so that conferences and
+   echo cancelers have something to work on.  Messages with a channel
+   bitmap are left alone. */
+static void dahdi_dynamic_local_noise(struct dahdi_dynamic_local *d,
+				      struct dahdi_dynamic *dyn,
+				      u8 *msg, size_t msglen)
+{
+	const int nchans = dyn->span.channels;
+	u32 noise = d->noise;
+	int x, y;
+
+	if (msg[1] & DAHDI_DYNAMIC_FLAG_CHANMAP)
+		return;
+	msg += msglen - nchans * DAHDI_CHUNKSIZE;
+	for (x = 0; x < nchans; x++, msg += DAHDI_CHUNKSIZE) {
+		if (!(dyn->chans[x]->flags & DAHDI_FLAG_AUDIO))
+			continue;
+		for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+			noise = noise * 1103515245 + 12345;
+			msg[y] = noise >> 24;
+		}
+	}
+	d->noise = noise;
+}
+
+/* Compare what the peer span just received with what 'dyn' sent */
+static void dahdi_dynamic_local_check(struct dahdi_dynamic *dyn,
+				      struct dahdi_span *peer)
+{
+	int x;
+
+	if (peer->channels != dyn->span.channels)
+		return;
+	for (x = 0; x < peer->channels; x++) {
+		if (!memcmp(dyn->chans[x]->writechunk,
+			    peer->chans[x]->readchunk, DAHDI_CHUNKSIZE))
+			continue;
+		if (!bench_check_errors++)
+			printk(KERN_NOTICE "TDMoL: %s channel %d received "
+			       "%02x where %s sent %02x\n", peer->name, x + 1,
+			       peer->chans[x]->readchunk[0], dyn->span.name,
+			       dyn->chans[x]->writechunk[0]);
+	}
+}
+
 static void
 dahdi_dynamic_local_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 {
@@ -84,9 +171,14 @@ dahdi_dynamic_local_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 	unsigned long flags;
 
 	spin_lock_irqsave(&local_lock, flags);
+	if (d && d->bench && !bench_check)
+		dahdi_dynamic_local_noise(d, dyn, msg, msglen);
 	if (d && d->peer && d->peer->span) {
-		if (test_bit(DAHDI_FLAGBIT_REGISTERED, &d->peer->span->flags))
+		if (test_bit(DAHDI_FLAGBIT_REGISTERED, &d->peer->span->flags)) {
 			dahdi_dynamic_receive(d->peer->span, msg, msglen);
+			if (d->bench && bench_check)
+				dahdi_dynamic_local_check(dyn, d->peer->span);
+		}
 	}
 	if (d && d->monitor_rx_peer && d->monitor_rx_peer->span) {
 		if (test_bit(DAHDI_FLAGBIT_REGISTERED,
@@ -157,23 +249,31 @@ static int dahdi_dynamic_local_create(struct dahdi_dynamic *dyn,
 {
 	struct dahdi_dynamic_local *d, *l;
 	unsigned long flags;
-	int key = -1, id = -1, monitor = -1;
+	int key = 0, id = -1, monitor = -1;
 	struct dahdi_span *const span = &dyn->span;
+	const char *p;
 
-	if (strlen(address) >= 3) {
-		if (address[1] != ':')
+	for (p = address; p - address < 4 && digit2int(*p) >= 0; p++)
+		key = key * 16 + digit2int(*p);
+	if (p == address || p[0] != ':')
+		goto INVALID_ADDRESS;
+	id = digit2int(p[1]);
+	if (id == -1)
+		goto INVALID_ADDRESS;
+	p += 2;
+	if (*p) {
+		if (p[0] != ':' || p[2])
 			goto INVALID_ADDRESS;
-		key = digit2int(address[0]);
-		id = digit2int(address[2]);
-	} 
-	if (strlen (address) == 5) {
-		if (address[3] != ':')
+		monitor = digit2int(p[1]);
+		if (monitor == -1)
 			goto INVALID_ADDRESS;
-		monitor = digit2int(address[4]);
 	}
 
-	if (key == -1 || id == -1)
+	if (key >= LOC_BENCH_KEY && !bench_setup) {
+		printk(KERN_NOTICE "TDMoL: Keys from %x up are reserved for "
+		       "the benchmark\n", LOC_BENCH_KEY);
 		goto INVALID_ADDRESS;
+	}
 
 	d = kzalloc(sizeof(*d), GFP_KERNEL);
 	if (!d)
@@ -182,6 +282,8 @@ static int dahdi_dynamic_local_create(struct dahdi_dynamic *dyn,
 	d->key = key;
 	d->id = id;
 	d->span = span;
+	d->bench = bench_setup;
+	d->noise = key * 2 + id;
 
 	spin_lock_irqsave(&local_lock, flags);
 	/* Add this peer to any existing spans with same key
@@ -243,6 +345,13 @@ INVALID_ADDRESS:
 	return -EINVAL;
 }
 
+/* Transmitting feeds the peer span, which may be another worker's, so
+   keep all local spans together */
+static unsigned long dahdi_dynamic_local_tx_key(struct dahdi_dynamic *dyn)
+{
+	return 0;
+}
+
 static struct dahdi_dynamic_driver dahdi_dynamic_local = {
 	.owner = THIS_MODULE,
 	.name = "loc",
@@ -250,11 +359,146 @@ static struct dahdi_dynamic_driver dahdi_dynamic_local = {
 	.create = dahdi_dynamic_local_create,
 	.destroy = dahdi_dynamic_local_destroy,
 	.transmit = dahdi_dynamic_local_transmit,
+	.tx_key = dahdi_dynamic_local_tx_key,
 };
 
+static struct dahdi_span *dahdi_dynamic_local_find(int key, int id)
+{
+	struct dahdi_dynamic_local *l;
+	struct dahdi_span *span = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&local_lock, flags);
+	list_for_each_entry(l, &dynamic_local_list, node) {
+		if (l->key == key && l->id == id) {
+			span = l->span;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&local_lock, flags);
+	return span;
+}
+
+/* Configure the channels of a benchmark span.  'conf' and 'members' carry
+   the conference being filled from one span to the next. */
+static int dahdi_dynamic_local_bench_span(struct dahdi_span *span, int side,
+					  int *conf, int *members)
+{
+	int x, res;
+
+	for (x = 0; x < span->channels; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		struct dahdi_chanconfig ch;
+		struct dahdi_confinfo ci;
+		struct dahdi_attach_echocan ae;
+
+		if (!chan->channo) {
+			printk(KERN_NOTICE "TDMoL: %s was not assigned; "
+			       "benchmark channels left unconfigured\n",
+			       span->name);
+			return 0;
+		}
+
+		memset(&ch, 0, sizeof(ch));
+		ch.chan = chan->channo;
+		if (bench_check) {
+			/* Laws that do not agree on what idle is */
+			ch.sigtype = side ? DAHDI_SIG_CLEAR : DAHDI_SIG_EM;
+			ch.deflaw = (x & 1) ? DAHDI_LAW_ALAW : DAHDI_LAW_MULAW;
+		} else if (bench_hdlc && x == span->channels - 1) {
+			ch.sigtype = DAHDI_SIG_HDLCFCS;
+		} else {
+			ch.sigtype = DAHDI_SIG_EM;
+		}
+		res = dahdi_chanconfig(&ch);
+		if (res)
+			return res;
+		if (ch.sigtype != DAHDI_SIG_EM || bench_check)
+			continue;
+
+		if (bench_echocan[0]) {
+			memset(&ae, 0, sizeof(ae));
+			ae.chan = chan->channo;
+			strlcpy(ae.echocan, bench_echocan, sizeof(ae.echocan));
+			res = dahdi_attach_echocan(&ae);
+			if (!res)
+				res = dahdi_echocancel(chan, bench_taps);
+			if (res)
+				return res;
+		}
+
+		if (bench_conf > 0 && side == 0) {
+			if (!*members) {
+				*conf = *conf % DAHDI_MAX_CONF + 1;
+				*members = bench_conf;
+			}
+			(*members)--;
+			ci.chan = chan->channo;
+			ci.confno = *conf;
+			ci.confmode = DAHDI_CONF_CONF | DAHDI_CONF_TALKER |
+				      DAHDI_CONF_LISTENER;
+			res = dahdi_setconf(&ci);
+			if (res)
+				return res;
+		}
+	}
+	return 0;
+}
+
+static int dahdi_dynamic_local_bench(void)
+{
+	struct dahdi_dynamic_span dds;
+	struct dahdi_span *span;
+	int conf = 0, members = 0;
+	int pair, side, res;
+
+	if (bench_pairs > LOC_BENCH_MAX_PAIRS)
+		bench_pairs = LOC_BENCH_MAX_PAIRS;
+
+	for (pair = 0; pair < bench_pairs; pair++) {
+		for (side = 0; side < 2; side++) {
+			memset(&dds, 0, sizeof(dds));
+			strlcpy(dds.driver, "loc", sizeof(dds.driver));
+			snprintf(dds.addr, sizeof(dds.addr), "%x:%d",
+				 LOC_BENCH_KEY + pair, side);
+			dds.numchans = bench_channels;
+			bench_setup = 1;
+			res = dahdi_dynamic_create(&dds);
+			bench_setup = 0;
+			if (res < 0)
+				return res;
+
+			span = dahdi_dynamic_local_find(LOC_BENCH_KEY + pair,
+							side);
+			if (!span)
+				return -ENODEV;
+			res = dahdi_dynamic_local_bench_span(span, side,
+							     &conf, &members);
+			if (res)
+				return res;
+		}
+	}
+	printk(KERN_INFO "TDMoL: Benchmark running on %d pairs of "
+	       "%d channel spans%s\n", bench_pairs, bench_channels,
+	       bench_check ? ", checking mixed law idle traffic" : "");
+	return 0;
+}
+
 static int __init dahdi_dynamic_local_init(void)
 {
+	int res;
+
 	dahdi_dynamic_register_driver(&dahdi_dynamic_local);
+	if (bench_pairs > 0) {
+		res = dahdi_dynamic_local_bench();
+		if (res) {
+			printk(KERN_NOTICE "TDMoL: Unable to set up the "
+			       "benchmark (%d)\n", res);
+			/* Takes down whatever spans were made */
+			dahdi_dynamic_unregister_driver(&dahdi_dynamic_local);
+			return res;
+		}
+	}
 	return 0;
 }
 
@@ -264,12 +508,25 @@ static void __exit dahdi_dynamic_local_exit(void)
 }
 
 #if defined(__FreeBSD__)
+SYSCTL_NODE(_dahdi, OID_AUTO, dynamic_loc, CTLFLAG_RW, 0, "DAHDI Dynamic Local Support");
+#define MODULE_PARAM_PREFIX "dahdi.dynamic_loc"
+#define MODULE_PARAM_PARENT _dahdi_dynamic_loc
+
 LINUX_DEV_MODULE(dahdi_dynamic_loc);
 MODULE_VERSION(dahdi_dynamic_loc, 1);
 MODULE_DEPEND(dahdi_dynamic_loc, dahdi, 1, 1, 1);
 MODULE_DEPEND(dahdi_dynamic_loc, dahdi_dynamic, 1, 1, 1);
 #endif /* __FreeBSD__ */
 
+module_param(bench_pairs, int, 0444);
+module_param(bench_channels, int, 0444);
+module_param(bench_conf, int, 0444);
+module_param(bench_echocan, charp, 0444);
+module_param(bench_taps, int, 0444);
+module_param(bench_hdlc, int, 0444);
+module_param(bench_check, int, 0444);
+module_param(bench_check_errors, int, 0444);
+
 module_init(dahdi_dynamic_local_init);
 module_exit(dahdi_dynamic_local_exit);
 
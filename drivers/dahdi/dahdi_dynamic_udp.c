@@ -0,0 +1,955 @@
+/*
+ * Dynamic Span Interface for DAHDI (UDP Interface)
+ *
+ * Carries the same messages as TDMoE, but in UDP datagrams over IPv4 or
+ * IPv6, so that dynamic spans are not limited to one Ethernet segment.
+ *
+ * Address syntax :
+ * [<local port>/]<host>:<port>[/<subaddr>]
+ *
+ * <host> is a dotted IPv4 address or an IPv6 address in brackets.  The
+ * local port defaults to the 'port' module parameter; all spans using a
+ * local port share one socket per address family.  As with TDMoE, both
+ * ends of a span must use the same subaddr.
+ *
+ * Every tick the messages of all spans going to the same peer through
+ * the same local port are sent as one datagram:
+ *
+ *         Byte #:          Meaning
+ *         0-1              Span subaddr, network byte order
+ *         2-3              Message length, network byte order
+ *         4...             The message, as described in dahdi_dynamic.c
+ *
+ * repeated for each span.  Each peer has a ring of UDP_TXQ_MAX such
+ * datagrams, allocated as its spans are created, that the tick builds
+ * into in place; a work queue then sends what each peer has queued, one
+ * datagram at a time.  Received datagrams are read, up to rx_budget at a
+ * time, from a work queue the socket schedules.
+ *
+ * Example : two spans wired back to back over loopback
+ *
+ *   dynamic=udp,4000/127.0.0.1:4001/1,24,1
+ *   dynamic=udp,4001/127.0.0.1:4000/1,24,0
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/kmod.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#if defined(__FreeBSD__)
+#include <sys/mbuf.h>
+#include <sys/protosw.h>
+#include <sys/socket.h>
+#include <sys/socketvar.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#else
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/inet.h>
+#include <linux/net.h>
+#include <net/sock.h>
+#endif
+
+#include <dahdi/kernel.h>
+
+#define UDP_REC_HDRLEN		4	/* subaddr and length */
+#define UDP_MAX_DGRAM		65535
+#define UDP_TXQ_MAX		16	/* datagrams per peer, one being built */
+
+/* Local port for addresses that do not give one */
+static int port = 53261;
+
+/* Datagrams read per run of a socket's receive work */
+static int rx_budget = 32;
+
+/* Datagrams we could not make sense of, or had no span for.  Bumped
+   from the socket callbacks and the tick on any CPU, so atomic. */
+static atomic_t rx_errors = ATOMIC_INIT(0);
+
+/* Datagrams we could not build or send */
+static atomic_t tx_errors = ATOMIC_INIT(0);
+
+union udp_addr {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+};
+
+/**
+ * struct udp_sock - A bound socket, shared by all peers on a local port
+ */
+struct udp_sock {
+	struct list_head node;
+	int family;
+	unsigned short port;
+	int refcnt;
+#if defined(__FreeBSD__)
+	struct socket *so;
+#else
+	struct socket *sock;
+	void (*saved_data_ready)(struct sock *sk);
+#endif
+	struct work_struct rx_work;
+	unsigned char *rxbuf;
+};
+
+/**
+ * struct udp_peer - The far end of one or more spans
+ * @txbuf:	Ring of UDP_TXQ_MAX datagrams of @txsize bytes each.  The
+ *		tick builds into the one at @txhead; those from @txtail up
+ *		to it wait for udp_tx_work.
+ * @txnext:	Bigger ring for when spans were added, that udp_flush()
+ *		moves to once the old one has been sent.
+ * @txold:	Ring moved from, for udp_tx_work to free.
+ */
+struct udp_peer {
+	struct list_head node;
+	struct udp_sock *us;
+	union udp_addr addr;
+	struct list_head spans;
+	unsigned char *txrec;	/* Record handed out by get_txbuf() */
+	unsigned char *txbuf;
+	size_t txsize;
+	int txlen[UDP_TXQ_MAX];
+	int txhead;
+	int txtail;
+	unsigned char *txnext;
+	size_t txnext_size;
+	unsigned char *txold;
+	size_t maxlen;		/* Room for a message from each span */
+};
+
+struct udp_span {
+	struct list_head node;
+	struct udp_peer *peer;
+	unsigned short subaddr;	/* Network byte order */
+	size_t msgsize;		/* Largest message the span sends */
+	struct dahdi_span *span;
+};
+
+/* The lists are changed with both held.  The tick path only takes
+   udp_lock; the work queues only take udp_list_lock, and may sleep. */
+static DEFINE_SPINLOCK(udp_lock);
+#if defined(__FreeBSD__)
+static DEFINE_RWLOCK(udp_list_lock);
+#define udp_list_read_lock()	read_lock(&udp_list_lock)
+#define udp_list_read_unlock()	read_unlock(&udp_list_lock)
+#define udp_list_write_lock()	write_lock(&udp_list_lock)
+#define udp_list_write_unlock()	write_unlock(&udp_list_lock)
+#else
+static DEFINE_MUTEX(udp_list_lock);
+#define udp_list_read_lock()	mutex_lock(&udp_list_lock)
+#define udp_list_read_unlock()	mutex_unlock(&udp_list_lock)
+#define udp_list_write_lock()	mutex_lock(&udp_list_lock)
+#define udp_list_write_unlock()	mutex_unlock(&udp_list_lock)
+#endif
+
+static _LIST_HEAD(udp_socks);
+static _LIST_HEAD(udp_peers);
+
+/* The works sleep on socket and list locks, so they get their own
+   thread rather than schedule_work() */
+static struct workqueue_struct *udp_wq;
+
+static void udp_tx_work_fn(struct work_struct *work);
+static DECLARE_WORK(udp_tx_work, udp_tx_work_fn);
+
+static int udp_addr_equal(const union udp_addr *a, const union udp_addr *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family)
+		return 0;
+	if (a->sa.sa_family == AF_INET)
+		return a->sin.sin_port == b->sin.sin_port &&
+		       a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+	return a->sin6.sin6_port == b->sin6.sin6_port &&
+	       !memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr,
+		       sizeof(a->sin6.sin6_addr));
+}
+
+static int udp_addr_len(const union udp_addr *a)
+{
+	return a->sa.sa_family == AF_INET ? sizeof(a->sin) : sizeof(a->sin6);
+}
+
+/*
+ * Receiving side.
+ */
+
+/* Called with udp_list_lock held */
+static void udp_input(struct udp_sock *us, const union udp_addr *from,
+		      unsigned char *data, int len)
+{
+	struct udp_peer *p;
+	struct udp_span *s;
+	unsigned short subaddr;
+	int reclen;
+
+	list_for_each_entry(p, &udp_peers, node) {
+		if (p->us == us && udp_addr_equal(&p->addr, from))
+			break;
+	}
+	if (&p->node == &udp_peers) {
+		atomic_inc(&rx_errors);
+		return;
+	}
+
+	while (len >= UDP_REC_HDRLEN) {
+		subaddr = *((unsigned short *)data);
+		reclen = ntohs(*((unsigned short *)(data + 2)));
+		data += UDP_REC_HDRLEN;
+		len -= UDP_REC_HDRLEN;
+		if (reclen > len)
+			break;
+
+		list_for_each_entry(s, &p->spans, node) {
+			if (s->subaddr != subaddr)
+				continue;
+			if (test_bit(DAHDI_FLAGBIT_REGISTERED, &s->span->flags))
+				dahdi_dynamic_receive(s->span, data, reclen);
+			break;
+		}
+		if (&s->node == &p->spans)
+			atomic_inc(&rx_errors);
+
+		data += reclen;
+		len -= reclen;
+	}
+	if (len)
+		atomic_inc(&rx_errors);
+}
+
+#if defined(__FreeBSD__)
+static int udp_upcall(struct socket *so, void *arg, int waitflag)
+{
+	struct udp_sock *us = arg;
+
+	queue_work(udp_wq, &us->rx_work);
+	return (SU_OK);
+}
+
+static void udp_rx_work_fn(struct work_struct *work)
+{
+	struct udp_sock *us = container_of(work, struct udp_sock, rx_work);
+	struct sockaddr *from;
+	struct mbuf *m;
+	struct uio uio;
+	unsigned char *data;
+	int flags, len, n;
+
+	udp_list_read_lock();
+	for (n = 0; n < rx_budget; n++) {
+		memset(&uio, 0, sizeof(uio));
+		uio.uio_resid = UDP_MAX_DGRAM;
+		uio.uio_td = curthread;
+		flags = MSG_DONTWAIT;
+		from = NULL;
+		m = NULL;
+		if (soreceive(us->so, &from, &uio, &m, NULL, &flags) || !m) {
+			free(from, M_SONAME);
+			break;
+		}
+
+		/* One cluster is the usual case; read that in place */
+		len = m_length(m, NULL);
+		if (m->m_len == len) {
+			data = mtod(m, unsigned char *);
+		} else {
+			m_copydata(m, 0, len, us->rxbuf);
+			data = us->rxbuf;
+		}
+		if (from && from->sa_len <= sizeof(union udp_addr))
+			udp_input(us, (union udp_addr *)from, data, len);
+		else
+			atomic_inc(&rx_errors);
+
+		m_freem(m);
+		free(from, M_SONAME);
+	}
+	udp_list_read_unlock();
+
+	/* Come back for the rest */
+	if (n == rx_budget)
+		queue_work(udp_wq, &us->rx_work);
+}
+#else /* !__FreeBSD__ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+static void udp_data_ready(struct sock *sk, int bytes)
+#else
+static void udp_data_ready(struct sock *sk)
+#endif
+{
+	struct udp_sock *us;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	us = sk->sk_user_data;
+	if (us)
+		queue_work(udp_wq, &us->rx_work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void udp_rx_work_fn(struct work_struct *work)
+{
+	struct udp_sock *us = container_of(work, struct udp_sock, rx_work);
+	union udp_addr from;
+	struct msghdr msg;
+	struct kvec iov;
+	int len, n;
+
+	udp_list_read_lock();
+	for (n = 0; n < rx_budget; n++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &from;
+		msg.msg_namelen = sizeof(from);
+		iov.iov_base = us->rxbuf;
+		iov.iov_len = UDP_MAX_DGRAM;
+		len = kernel_recvmsg(us->sock, &msg, &iov, 1, UDP_MAX_DGRAM,
+				     MSG_DONTWAIT);
+		if (len < 0)
+			break;
+		udp_input(us, &from, us->rxbuf, len);
+	}
+	udp_list_read_unlock();
+
+	/* Come back for the rest */
+	if (n == rx_budget)
+		queue_work(udp_wq, &us->rx_work);
+}
+#endif /* !__FreeBSD__ */
+
+/*
+ * Transmitting side.
+ */
+
+/* Make room for a record with a message of len bytes at the end of the
+   peer's datagram, and return where it goes. */
+static unsigned char *udp_reserve(struct udp_peer *p, size_t len)
+{
+	const int used = p->txlen[p->txhead];
+
+	if (!p->txbuf || used + UDP_REC_HDRLEN + len > p->txsize)
+		return NULL;
+	return p->txbuf + p->txhead * p->txsize + used;
+}
+
+/* Finish the record udp_reserve() returned */
+static void udp_commit(struct udp_peer *p, unsigned char *rec,
+		       unsigned short subaddr, size_t len)
+{
+	*((unsigned short *)rec) = subaddr;
+	*((unsigned short *)(rec + 2)) = htons(len);
+	p->txlen[p->txhead] += UDP_REC_HDRLEN + len;
+}
+
+static u8 *udp_get_txbuf(struct dahdi_dynamic *dyn, size_t msglen)
+{
+	struct udp_span *s = dyn->pvt;
+	struct udp_peer *p = s->peer;
+
+	p->txrec = udp_reserve(p, msglen);
+	return p->txrec ? p->txrec + UDP_REC_HDRLEN : NULL;
+}
+
+static void udp_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+{
+	struct udp_span *s = dyn->pvt;
+	struct udp_peer *p = s->peer;
+	unsigned char *rec = p->txrec;
+
+	p->txrec = NULL;
+	if (!rec || msg != rec + UDP_REC_HDRLEN) {
+		/* Not built in place */
+		rec = udp_reserve(p, msglen);
+		if (!rec) {
+			/* A span just added has no room until udp_flush()
+			   moves to the bigger ring */
+			if (!p->txnext)
+				atomic_inc(&tx_errors);
+			return;
+		}
+		memcpy(rec + UDP_REC_HDRLEN, msg, msglen);
+	}
+	udp_commit(p, rec, s->subaddr, msglen);
+}
+
+/* Called in interrupt context at the end of each tick: queue what each
+   peer has this tick, and have udp_tx_work send it all. */
+static int udp_flush(void)
+{
+	struct udp_peer *p;
+	unsigned long flags;
+	int queued = 0;
+	int next;
+
+	spin_lock_irqsave(&udp_lock, flags);
+	list_for_each_entry(p, &udp_peers, node) {
+		if (p->txnext && !p->txold && p->txtail == p->txhead) {
+			/* Nothing left for udp_tx_work in the old ring: take
+			   this tick's datagram over to the new one */
+			memcpy(p->txnext, p->txbuf + p->txhead * p->txsize,
+			       p->txlen[p->txhead]);
+			p->txlen[0] = p->txlen[p->txhead];
+			p->txold = p->txbuf;
+			p->txbuf = p->txnext;
+			p->txsize = p->txnext_size;
+			p->txnext = NULL;
+			p->txhead = p->txtail = 0;
+			queued++;
+		}
+		if (!p->txlen[p->txhead])
+			continue;
+		next = (p->txhead + 1) % UDP_TXQ_MAX;
+		if (next == p->txtail) {
+			/* udp_tx_work is too far behind */
+			atomic_inc(&tx_errors);
+			p->txlen[p->txhead] = 0;
+			continue;
+		}
+		p->txhead = next;
+		p->txlen[next] = 0;
+		queued++;
+	}
+	spin_unlock_irqrestore(&udp_lock, flags);
+
+	if (queued)
+		queue_work(udp_wq, &udp_tx_work);
+	return 0;
+}
+
+static int udp_send(struct udp_peer *p, unsigned char *data, int len)
+{
+#if defined(__FreeBSD__)
+	struct uio uio;
+	struct iovec iov;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	memset(&uio, 0, sizeof(uio));
+	uio.uio_iov = &iov;
+	uio.uio_iovcnt = 1;
+	uio.uio_resid = len;
+	uio.uio_segflg = UIO_SYSSPACE;
+	uio.uio_rw = UIO_WRITE;
+	uio.uio_td = curthread;
+	return -sosend(p->us->so, &p->addr.sa, &uio, NULL, NULL,
+		       MSG_DONTWAIT, curthread);
+#else
+	struct msghdr msg;
+	struct kvec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &p->addr;
+	msg.msg_namelen = udp_addr_len(&p->addr);
+	msg.msg_flags = MSG_DONTWAIT;
+	iov.iov_base = data;
+	iov.iov_len = len;
+	return kernel_sendmsg(p->us->sock, &msg, &iov, 1, len);
+#endif
+}
+
+static void udp_tx_work_fn(struct work_struct *work)
+{
+	struct udp_peer *p;
+	unsigned long flags;
+	unsigned char *old;
+	int x, end;
+
+	udp_list_read_lock();
+	list_for_each_entry(p, &udp_peers, node) {
+		spin_lock_irqsave(&udp_lock, flags);
+		old = p->txold;
+		p->txold = NULL;
+		x = p->txtail;
+		end = p->txhead;
+		spin_unlock_irqrestore(&udp_lock, flags);
+		kfree(old);
+
+		/* udp_flush() leaves the ring alone while any are queued */
+		if (x == end)
+			continue;
+		for (; x != end; x = (x + 1) % UDP_TXQ_MAX) {
+			if (udp_send(p, p->txbuf + x * p->txsize,
+				     p->txlen[x]) < 0)
+				atomic_inc(&tx_errors);
+		}
+
+		spin_lock_irqsave(&udp_lock, flags);
+		p->txtail = end;
+		spin_unlock_irqrestore(&udp_lock, flags);
+	}
+	udp_list_read_unlock();
+}
+
+/*
+ * Sockets.
+ */
+
+static int udp_sock_open(struct udp_sock *us)
+{
+	union udp_addr local;
+	int one = 1;
+	int res;
+#if defined(__FreeBSD__)
+	struct sockopt sopt;
+#endif
+
+	memset(&local, 0, sizeof(local));
+	local.sa.sa_family = us->family;
+	if (us->family == AF_INET)
+		local.sin.sin_port = htons(us->port);
+	else
+		local.sin6.sin6_port = htons(us->port);
+
+	us->rxbuf = kmalloc(UDP_MAX_DGRAM, GFP_KERNEL);
+	if (!us->rxbuf)
+		return -ENOMEM;
+	INIT_WORK(&us->rx_work, udp_rx_work_fn);
+
+#if defined(__FreeBSD__)
+	local.sa.sa_len = udp_addr_len(&local);
+	res = -socreate(us->family, &us->so, SOCK_DGRAM, IPPROTO_UDP,
+			curthread->td_ucred, curthread);
+	if (res)
+		goto err_free;
+	if (us->family == AF_INET6) {
+		/* Leave IPv4 to the AF_INET socket on this port */
+		memset(&sopt, 0, sizeof(sopt));
+		sopt.sopt_dir = SOPT_SET;
+		sopt.sopt_level = IPPROTO_IPV6;
+		sopt.sopt_name = IPV6_V6ONLY;
+		sopt.sopt_val = &one;
+		sopt.sopt_valsize = sizeof(one);
+		sosetopt(us->so, &sopt);
+	}
+	res = -sobind(us->so, &local.sa, curthread);
+	if (res) {
+		soclose(us->so);
+		goto err_free;
+	}
+	SOCKBUF_LOCK(&us->so->so_rcv);
+	soupcall_set(us->so, SO_RCV, udp_upcall, us);
+	SOCKBUF_UNLOCK(&us->so->so_rcv);
+#else /* !__FreeBSD__ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	res = sock_create_kern(&init_net, us->family, SOCK_DGRAM, IPPROTO_UDP,
+			       &us->sock);
+#else
+	res = sock_create_kern(us->family, SOCK_DGRAM, IPPROTO_UDP, &us->sock);
+#endif
+	if (res)
+		goto err_free;
+	if (us->family == AF_INET6) {
+		/* Leave IPv4 to the AF_INET socket on this port */
+		kernel_setsockopt(us->sock, IPPROTO_IPV6, IPV6_V6ONLY,
+				  (char *)&one, sizeof(one));
+	}
+	res = kernel_bind(us->sock, &local.sa, udp_addr_len(&local));
+	if (res) {
+		sock_release(us->sock);
+		goto err_free;
+	}
+	write_lock_bh(&us->sock->sk->sk_callback_lock);
+	us->saved_data_ready = us->sock->sk->sk_data_ready;
+	us->sock->sk->sk_user_data = us;
+	us->sock->sk->sk_data_ready = udp_data_ready;
+	write_unlock_bh(&us->sock->sk->sk_callback_lock);
+#endif /* !__FreeBSD__ */
+	return 0;
+
+err_free:
+	printk(KERN_NOTICE "TDMoUDP: Unable to bind to %s port %d (%d)\n",
+	       us->family == AF_INET ? "IPv4" : "IPv6", us->port, res);
+	kfree(us->rxbuf);
+	return res;
+}
+
+static void udp_sock_close(struct udp_sock *us)
+{
+#if defined(__FreeBSD__)
+	SOCKBUF_LOCK(&us->so->so_rcv);
+	soupcall_clear(us->so, SO_RCV);
+	SOCKBUF_UNLOCK(&us->so->so_rcv);
+#else
+	write_lock_bh(&us->sock->sk->sk_callback_lock);
+	us->sock->sk->sk_user_data = NULL;
+	us->sock->sk->sk_data_ready = us->saved_data_ready;
+	write_unlock_bh(&us->sock->sk->sk_callback_lock);
+#endif
+	cancel_work_sync(&us->rx_work);
+#if defined(__FreeBSD__)
+	soclose(us->so);
+#else
+	sock_release(us->sock);
+#endif
+	kfree(us->rxbuf);
+	kfree(us);
+}
+
+/* Called with udp_list_lock held for writing */
+static struct udp_sock *udp_sock_get(int family, unsigned short lport)
+{
+	struct udp_sock *us;
+
+	list_for_each_entry(us, &udp_socks, node) {
+		if (us->family == family && us->port == lport) {
+			us->refcnt++;
+			return us;
+		}
+	}
+
+	us = kzalloc(sizeof(*us), GFP_KERNEL);
+	if (!us)
+		return NULL;
+	us->family = family;
+	us->port = lport;
+	us->refcnt = 1;
+	if (udp_sock_open(us)) {
+		kfree(us);
+		return NULL;
+	}
+	list_add(&us->node, &udp_socks);
+	return us;
+}
+
+/* Called with udp_list_lock held for writing.  Returns the socket if
+   that was the last reference; udp_sock_close() it once the lock is
+   dropped, as its receive work needs the lock to finish. */
+static struct udp_sock *udp_sock_put(struct udp_sock *us)
+{
+	if (--us->refcnt)
+		return NULL;
+	list_del(&us->node);
+	return us;
+}
+
+/*
+ * Spans.
+ */
+
+static int udp_parse_port(const char *s, unsigned short *res)
+{
+	unsigned long v = 0;
+
+	if (!*s)
+		return -EINVAL;
+	for (; *s; s++) {
+		if (*s < '0' || *s > '9')
+			return -EINVAL;
+		v = v * 10 + (*s - '0');
+		if (v > 65535)
+			return -EINVAL;
+	}
+	*res = v;
+	return 0;
+}
+
+/* Parse <host>:<port> */
+static int udp_parse_peer(char *s, union udp_addr *addr)
+{
+	unsigned short pport;
+	char *host = s, *p;
+
+	memset(addr, 0, sizeof(*addr));
+	if (*s == '[') {
+		host = s + 1;
+		p = strchr(host, ']');
+		if (!p || p[1] != ':')
+			return -EINVAL;
+		*p = '\0';
+		p += 2;
+		addr->sa.sa_family = AF_INET6;
+	} else {
+		p = strrchr(s, ':');
+		if (!p)
+			return -EINVAL;
+		*p++ = '\0';
+		addr->sa.sa_family = AF_INET;
+	}
+	if (udp_parse_port(p, &pport))
+		return -EINVAL;
+
+#if defined(__FreeBSD__)
+	addr->sa.sa_len = udp_addr_len(addr);
+	if (inet_pton(addr->sa.sa_family, host, addr->sa.sa_family == AF_INET ?
+		      (void *)&addr->sin.sin_addr :
+		      (void *)&addr->sin6.sin6_addr) != 1)
+		return -EINVAL;
+#else
+	if (addr->sa.sa_family == AF_INET ?
+	    !in4_pton(host, -1, (u8 *)&addr->sin.sin_addr, -1, NULL) :
+	    !in6_pton(host, -1, (u8 *)&addr->sin6.sin6_addr, -1, NULL))
+		return -EINVAL;
+#endif
+	if (addr->sa.sa_family == AF_INET)
+		addr->sin.sin_port = htons(pport);
+	else
+		addr->sin6.sin6_port = htons(pport);
+	return 0;
+}
+
+static void udp_peer_free(struct udp_peer *p)
+{
+	kfree(p->txbuf);
+	kfree(p->txnext);
+	kfree(p->txold);
+	kfree(p);
+}
+
+static void udp_destroy(struct dahdi_dynamic *dyn)
+{
+	struct udp_span *s = dyn->pvt;
+	struct udp_peer *p = s->peer;
+	struct udp_sock *us = NULL;
+	unsigned long flags;
+	int last;
+
+	udp_list_write_lock();
+	spin_lock_irqsave(&udp_lock, flags);
+	list_del(&s->node);
+	/* The ring stays as big as it is */
+	p->maxlen -= UDP_REC_HDRLEN + s->msgsize;
+	last = list_empty(&p->spans);
+	if (last)
+		list_del(&p->node);
+	dyn->pvt = NULL;
+	spin_unlock_irqrestore(&udp_lock, flags);
+	if (last)
+		us = udp_sock_put(p->us);
+	udp_list_write_unlock();
+
+	printk(KERN_INFO "TDMoUDP: Removed interface for %s\n", s->span->name);
+
+	/* Off the lists, nothing else can reach the peer */
+	if (last)
+		udp_peer_free(p);
+	if (us)
+		udp_sock_close(us);
+	kfree(s);
+}
+
+static int udp_create(struct dahdi_dynamic *dyn, const char *address)
+{
+	struct dahdi_span *const span = &dyn->span;
+	struct udp_span *s, *t;
+	struct udp_peer *p;
+	struct udp_sock *us = NULL;
+	union udp_addr addr;
+	unsigned short lport = port, subaddr = 0;
+	char tmp[256], *peer, *sub, *slash;
+	unsigned char *ring = NULL, *prev;
+	size_t maxlen;
+	unsigned long flags;
+	int newpeer = 0;
+	int res;
+
+	/* [<local port>/]<host>:<port>[/<subaddr>] */
+	strlcpy(tmp, address, sizeof(tmp));
+	peer = tmp;
+	sub = NULL;
+	slash = strchr(tmp, '/');
+	if (slash) {
+		*slash = '\0';
+		if (strchr(tmp, ':')) {
+			/* <host>:<port>/<subaddr> */
+			sub = slash + 1;
+		} else {
+			if (udp_parse_port(tmp, &lport))
+				goto invalid;
+			peer = slash + 1;
+			sub = strchr(peer, '/');
+			if (sub)
+				*sub++ = '\0';
+		}
+	}
+	if (udp_parse_peer(peer, &addr))
+		goto invalid;
+	if (sub && udp_parse_port(sub, &subaddr))
+		goto invalid;
+	subaddr = htons(subaddr);
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+	s->subaddr = subaddr;
+	s->span = span;
+	s->msgsize = DAHDI_DYNAMIC_MSGLEN(span->channels);
+
+	udp_list_write_lock();
+	list_for_each_entry(p, &udp_peers, node) {
+		if (p->us->family == addr.sa.sa_family &&
+		    p->us->port == lport && udp_addr_equal(&p->addr, &addr))
+			break;
+	}
+	if (&p->node != &udp_peers) {
+		list_for_each_entry(t, &p->spans, node) {
+			if (t->subaddr == subaddr) {
+				printk(KERN_NOTICE "TDMoUDP: Subaddr %d already in use for %s\n",
+				       ntohs(subaddr), address);
+				res = -EEXIST;
+				goto err;
+			}
+		}
+	} else {
+		p = kzalloc(sizeof(*p), GFP_KERNEL);
+		if (!p) {
+			res = -ENOMEM;
+			goto err;
+		}
+		p->us = udp_sock_get(addr.sa.sa_family, lport);
+		if (!p->us) {
+			kfree(p);
+			res = -EADDRNOTAVAIL;
+			goto err;
+		}
+		p->addr = addr;
+		INIT_LIST_HEAD(&p->spans);
+		newpeer = 1;
+	}
+
+	/* The tick only ever builds into the ring, so grow it now */
+	maxlen = p->maxlen + UDP_REC_HDRLEN + s->msgsize;
+	if (maxlen > UDP_MAX_DGRAM) {
+		printk(KERN_NOTICE "TDMoUDP: No room for %s in datagrams to %s\n",
+		       span->name, address);
+		res = -E2BIG;
+		goto err_peer;
+	}
+	if (maxlen > (p->txnext ? p->txnext_size : p->txsize)) {
+		ring = kmalloc(UDP_TXQ_MAX * maxlen, GFP_KERNEL);
+		if (!ring) {
+			res = -ENOMEM;
+			goto err_peer;
+		}
+	}
+
+	s->peer = p;
+	spin_lock_irqsave(&udp_lock, flags);
+	p->maxlen = maxlen;
+	if (ring && newpeer) {
+		p->txbuf = ring;
+		p->txsize = maxlen;
+		ring = NULL;
+	} else if (ring) {
+		/* udp_flush() moves to it between ticks; free any smaller
+		   one it has not got to yet */
+		prev = p->txnext;
+		p->txnext = ring;
+		p->txnext_size = maxlen;
+		ring = prev;
+	}
+	list_add_tail(&s->node, &p->spans);
+	if (newpeer)
+		list_add(&p->node, &udp_peers);
+	dyn->pvt = s;
+	spin_unlock_irqrestore(&udp_lock, flags);
+	udp_list_write_unlock();
+	kfree(ring);
+
+	printk(KERN_INFO "TDMoUDP: Added new interface for %s at %s (local port %d, subaddr %d)\n",
+	       span->name, address, lport, ntohs(subaddr));
+	return 0;
+
+err_peer:
+	if (newpeer) {
+		us = udp_sock_put(p->us);
+		kfree(p);
+	}
+err:
+	udp_list_write_unlock();
+	if (us)
+		udp_sock_close(us);
+	kfree(s);
+	return res;
+
+invalid:
+	printk(KERN_NOTICE "TDMoUDP: Invalid address '%s'\n", address);
+	return -EINVAL;
+}
+
+/* The spans of a peer build one datagram between them */
+static unsigned long udp_tx_key(struct dahdi_dynamic *dyn)
+{
+	struct udp_span *s = dyn->pvt;
+
+	return (unsigned long)s->peer;
+}
+
+static struct dahdi_dynamic_driver dahdi_dynamic_udp = {
+	.owner = THIS_MODULE,
+	.name = "udp",
+	.desc = "UDP",
+	.create = udp_create,
+	.destroy = udp_destroy,
+	.transmit = udp_transmit,
+	.get_txbuf = udp_get_txbuf,
+	.flush = udp_flush,
+	.tx_key = udp_tx_key,
+};
+
+static int __init dahdi_dynamic_udp_init(void)
+{
+	udp_wq = create_singlethread_workqueue("dahdi_dynamic_udp");
+	if (!udp_wq)
+		return -ENOMEM;
+	dahdi_dynamic_register_driver(&dahdi_dynamic_udp);
+	return 0;
+}
+
+static void __exit dahdi_dynamic_udp_exit(void)
+{
+	dahdi_dynamic_unregister_driver(&dahdi_dynamic_udp);
+	flush_workqueue(udp_wq);
+	destroy_workqueue(udp_wq);
+}
+
+#if defined(__FreeBSD__)
+SYSCTL_NODE(_dahdi, OID_AUTO, dynamic_udp, CTLFLAG_RW, 0, "DAHDI Dynamic UDP Support");
+#define MODULE_PARAM_PREFIX "dahdi.dynamic_udp"
+#define MODULE_PARAM_PARENT _dahdi_dynamic_udp
+
+SYSCTL_INT(_dahdi_dynamic_udp, OID_AUTO, rx_errors, CTLFLAG_RD,
+    __DEVOLATILE(int *, &rx_errors), 0,
+    "Datagrams received that could not be used");
+SYSCTL_INT(_dahdi_dynamic_udp, OID_AUTO, tx_errors, CTLFLAG_RD,
+    __DEVOLATILE(int *, &tx_errors), 0,
+    "Datagrams that could not be built or sent");
+
+LINUX_DEV_MODULE(dahdi_dynamic_udp);
+MODULE_VERSION(dahdi_dynamic_udp, 1);
+MODULE_DEPEND(dahdi_dynamic_udp, dahdi, 1, 1, 1);
+MODULE_DEPEND(dahdi_dynamic_udp, dahdi_dynamic, 1, 1, 1);
+#endif /* __FreeBSD__ */
+
+module_param(port, int, 0644);
+module_param(rx_budget, int, 0644);
+#if !defined(__FreeBSD__)
+static int udp_param_get_errors(char *buf, const struct kernel_param *kp)
+{
+	return sprintf(buf, "%d\n", atomic_read((atomic_t *)kp->arg));
+}
+
+static const struct kernel_param_ops udp_errors_ops = {
+	.get = udp_param_get_errors,
+};
+
+module_param_cb(rx_errors, &udp_errors_ops, &rx_errors, 0444);
+module_param_cb(tx_errors, &udp_errors_ops, &tx_errors, 0444);
+#endif
+
+MODULE_DESCRIPTION("DAHDI Dynamic UDP Support");
+MODULE_LICENSE("GPL v2");
+
+module_init(dahdi_dynamic_udp_init);
+module_exit(dahdi_dynamic_udp_exit);
@@ -101,6 +101,15 @@ static int aggressive;
 #define AGGRESSIVE_HCNTR 160		/* in samples, so 160 samples = 20ms */
 
 
+/* Adaptive tail window: every TAIL_WINDOW_PERIOD samples the coefficients
+ * are scanned and filtering is restricted to the taps that hold echo
+ * energy. If cancellation stays poor the whole tail is used again.
+ */
+#define TAIL_WINDOW_PERIOD 8000		/* in samples, so 8000 samples = 1s */
+#define TAIL_WINDOW_ALIGN 16		/* CONVOLVE2 works on blocks of 16 */
+#define TAIL_WINDOW_MARGIN 32		/* taps kept around the echo */
+#define TAIL_WINDOW_FLOOR_SHIFT 5	/* taps below max/32 (-30db) are empty */
+
 /***************************************************************/
 /* The following knobs are not implemented in the current code */
 
@@ -143,6 +152,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_bypass(struct dahdi_echocan_state *ec, const short *iref, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
 static const char *name = "KB1";
@@ -163,6 +173,7 @@ static const struct dahdi_echocan_ops my_ops = {
 	.echocan_process = echo_can_process,
 	.echocan_traintap = echo_can_traintap,
 	.echocan_NLP_toggle = echocan_NLP_toggle,
+	.echocan_bypass = echo_can_bypass,
 };
 
 struct ec_pvt {
@@ -219,6 +230,18 @@ struct ec_pvt {
 	/* Index of the sample containing the max_y_tilde value */
 	int max_y_tilde_pos;
 
+	/* Active tap window */
+	/* ----------------- */
+	/* First coefficient used for filtering and adaptation */
+	int win_start;
+	/* Number of coefficients used */
+	int win_len;
+	/* Samples left until the window is re-evaluated */
+	int win_timer;
+	/* Samples with good / poor cancellation in the current period */
+	int win_good;
+	int win_bad;
+
 #ifdef MEC2_STATS
 	/* Storage for performance statistics */
 	int cntr_nearend_speech_frames;
@@ -298,6 +321,11 @@ static inline void init_cc(struct ec_pvt *pvt, int N, int maxy, int maxu)
 	/* Allocate a buffer for the reference signal power computation */
 	init_cb_s(&pvt->y_tilde_s, pvt->N_d, ptr);
 
+	/* Filter over the whole tail until we know where the echo is */
+	pvt->win_start = 0;
+	pvt->win_len = pvt->N_d;
+	pvt->win_timer = TAIL_WINDOW_PERIOD;
+
 	/* Reset the absolute time index */
 	pvt->i_d = (int)0;
   
@@ -334,6 +362,81 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 	kfree(pvt);
 }
 
+static void set_tail_window(struct ec_pvt *pvt, int start, int len)
+{
+	pvt->win_start = start;
+	pvt->win_len = len;
+	pvt->dahdi.status.active_start = start;
+	pvt->dahdi.status.active_length = len;
+}
+
+static void shrink_tail_window(struct ec_pvt *pvt)
+{
+	int k;
+	int max = 0;
+	int first = -1;
+	int last = -1;
+
+	for (k = 0; k < pvt->N_d; k++) {
+		if (abs(pvt->a_i[k]) > max)
+			max = abs(pvt->a_i[k]);
+	}
+	if (!max)
+		return;
+
+	max >>= TAIL_WINDOW_FLOOR_SHIFT;
+	for (k = 0; k < pvt->N_d; k++) {
+		if (abs(pvt->a_i[k]) > max) {
+			if (first < 0)
+				first = k;
+			last = k;
+		}
+	}
+
+	first -= TAIL_WINDOW_MARGIN;
+	if (first < 0)
+		first = 0;
+	first &= ~(TAIL_WINDOW_ALIGN - 1);
+	last += TAIL_WINDOW_MARGIN + TAIL_WINDOW_ALIGN;
+	last &= ~(TAIL_WINDOW_ALIGN - 1);
+	if (last > pvt->N_d)
+		last = pvt->N_d;
+
+	/* Whatever is left outside the window is noise */
+	for (k = 0; k < first; k++)
+		pvt->a_i[k] = pvt->a_s[k] = 0;
+	for (k = last; k < pvt->N_d; k++)
+		pvt->a_i[k] = pvt->a_s[k] = 0;
+
+	set_tail_window(pvt, first, last - first);
+}
+
+static inline void update_tail_window(struct ec_pvt *pvt)
+{
+	/* Only judge the canceller while the far end is talking alone */
+	if (!pvt->HCNTR_d && (pvt->Ly_i > MIN_UPDATE_THRESH_I)) {
+		if ((pvt->Lu_i << 3) < pvt->Ly_i)
+			pvt->win_good++;
+		else if ((pvt->Lu_i << 1) > pvt->Ly_i)
+			pvt->win_bad++;
+	}
+
+	if (--pvt->win_timer > 0)
+		return;
+	pvt->win_timer = TAIL_WINDOW_PERIOD;
+
+	if (pvt->win_bad > pvt->win_good) {
+		/* Diverged or the echo path moved, use the whole tail */
+		if (pvt->win_len != pvt->N_d)
+			set_tail_window(pvt, 0, pvt->N_d);
+	} else if (pvt->win_good > (TAIL_WINDOW_PERIOD >> 2)) {
+		shrink_tail_window(pvt);
+	}
+
+	pvt->win_good = 0;
+	pvt->win_bad = 0;
+}
+
 static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 {
 	/* Declare local variables that are used more than once */
@@ -371,9 +474,9 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
  
 
 	/* eq. (2): compute r in fixed-point */
-	rs = CONVOLVE2(pvt->a_s,
-		       pvt->y_s.buf_d + pvt->y_s.idx_d,
-		       pvt->N_d);
+	rs = CONVOLVE2(pvt->a_s + pvt->win_start,
+		       pvt->y_s.buf_d + pvt->y_s.idx_d + pvt->win_start,
+		       pvt->win_len);
 	rs >>= 15;
 
 	/* eq. (3): compute the output value (see figure 3) and the error
@@ -499,7 +602,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			pvt->avg_Lu_i_ok = pvt->avg_Lu_i_ok + pvt->Lu_i;
 			++pvt->cntr_coeff_updates;
 #endif
-			for (k = 0; k < pvt->N_d; k++) {
+			for (k = pvt->win_start; k < pvt->win_start + pvt->win_len; k++) {
 				/* eq. (7): compute an expectation over M_d samples */
 				int grad2;
 				grad2 = CONVOLVE2(pvt->u_s.buf_d + pvt->u_s.idx_d,
@@ -608,6 +711,8 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	}
 #endif
 
+	update_tail_window(pvt);
+
 	/* Increment the sample index and return the corrected sample */
 	pvt->i_d++;
 	return u;
@@ -626,6 +731,36 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 	}
 }
 
+/* Far end is idle: only keep the far-end history and its power estimates
+ * current so that the filter can resume where it left off. */
+static void echo_can_bypass(struct dahdi_echocan_state *ec, const short *iref, u32 size)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	u32 x;
+
+	for (x = 0; x < size; x++, iref++) {
+		pvt->y_tilde_i -= abs(get_cc_s(&pvt->y_s, (1 << DEFAULT_ALPHA_YT_I) - 1)) >> DEFAULT_ALPHA_YT_I;
+		pvt->y_tilde_i += abs(*iref) >> DEFAULT_ALPHA_ST_I;
+		add_cc_s(&pvt->y_s, *iref);
+
+		add_cc_s(&pvt->y_tilde_s, pvt->y_tilde_i);
+
+		pvt->Ly_i -= abs(get_cc_s(&pvt->y_s, (1 << DEFAULT_SIGMA_LY_I) - 1));
+		pvt->Ly_i += abs(*iref);
+		if (pvt->Ly_i < DEFAULT_CUTOFF_I)
+			pvt->Ly_i = DEFAULT_CUTOFF_I;
+
+		if (pvt->y_tilde_i > pvt->max_y_tilde) {
+			pvt->max_y_tilde = pvt->y_tilde_i;
+			pvt->max_y_tilde_pos = pvt->N_d - 1;
+		} else if (--pvt->max_y_tilde_pos < 0) {
+			pvt->max_y_tilde = MAX16(pvt->y_tilde_s.buf_d + pvt->y_tilde_s.idx_d, pvt->N_d, &pvt->max_y_tilde_pos);
+		}
+
+		pvt->i_d++;
+	}
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
@@ -645,7 +780,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
 		maxu = (1 << DEFAULT_SIGMA_LU_I);
 
-	size = sizeof(*ec) +
+	size = sizeof(*pvt) +
 		4 + 						/* align */
 		sizeof(int) * ecp->tap_length +			/* a_i */
 		sizeof(short) * ecp->tap_length + 		/* a_s */
@@ -677,6 +812,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 	}
 
 	init_cc(pvt, ecp->tap_length, maxy, maxu);
+	set_tail_window(pvt, 0, pvt->N_d);
 	/* Non-linear processor - a fancy way to say "zap small signals, to avoid
 	   accumulating noise". */
 	pvt->use_nlp = TRUE;
@@ -81,6 +81,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_bypass(struct dahdi_echocan_state *ec, const short *iref, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
 static const char *name = "SEC";
@@ -100,6 +101,7 @@ static const struct dahdi_echocan_ops my_ops = {
 	.echocan_free = echo_can_free,
 	.echocan_process = echo_can_process,
 	.echocan_traintap = echo_can_traintap,
+	.echocan_bypass = echo_can_bypass,
 	.echocan_NLP_toggle = echocan_NLP_toggle,
 };
 
@@ -157,10 +159,10 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 
 	pvt->taps = ecp->tap_length;
 	pvt->tap_mask = ecp->tap_length - 1;
-	pvt->tx_history = (int16_t *) (pvt + sizeof(*pvt));
-	pvt->fir_taps = (int32_t *) (pvt + sizeof(*pvt) +
+	pvt->tx_history = (int16_t *) ((char *) pvt + sizeof(*pvt));
+	pvt->fir_taps = (int32_t *) ((char *) pvt + sizeof(*pvt) +
 				     ecp->tap_length * 2 * sizeof(int16_t));
-	pvt->fir_taps_short = (int16_t *) (pvt + sizeof(*pvt) +
+	pvt->fir_taps_short = (int16_t *) ((char *) pvt + sizeof(*pvt) +
 					   ecp->tap_length * sizeof(int32_t) +
 					   ecp->tap_length * 2 * sizeof(int16_t));
 	pvt->rx_power_threshold = 10000000;
@@ -302,6 +304,20 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 	}
 }
 
+/* Far end is idle: only keep the transmit history current */
+static void echo_can_bypass(struct dahdi_echocan_state *ec, const short *iref, u32 size)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	u32 x;
+
+	for (x = 0; x < size; x++, iref++) {
+		pvt->tx_history[pvt->curr_pos] = *iref;
+		pvt->tx_history[pvt->curr_pos + pvt->taps] = *iref;
+		pvt->tx_power += ((abs(*iref) - pvt->tx_power) >> 5);
+		pvt->curr_pos = (pvt->curr_pos - 1) & pvt->tap_mask;
+	}
+}
+
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val)
 {
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
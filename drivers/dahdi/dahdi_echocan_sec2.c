@@ -77,6 +77,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_bypass(struct dahdi_echocan_state *ec, const short *iref, u32 size);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static const char *name = "SEC2";
 static const char *ec_name(const struct dahdi_chan *chan) { return name; }
@@ -91,6 +92,7 @@ static const struct dahdi_echocan_ops my_ops = {
 	.echocan_free = echo_can_free,
 	.echocan_process = echo_can_process,
 	.echocan_traintap = echo_can_traintap,
+	.echocan_bypass = echo_can_bypass,
 };
 
 struct ec_pvt {
@@ -152,8 +154,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 	pvt->taps = ecp->tap_length;
 	pvt->curr_pos = ecp->tap_length - 1;
 	pvt->tap_mask = ecp->tap_length - 1;
-	pvt->fir_taps32 = (int32_t *) (pvt + sizeof(*pvt));
-	pvt->fir_taps16 = (int16_t *) (pvt + sizeof(*pvt) + ecp->tap_length * sizeof(int32_t));
+	pvt->fir_taps32 = (int32_t *) ((char *) pvt + sizeof(*pvt));
+	pvt->fir_taps16 = (int16_t *) ((char *) pvt + sizeof(*pvt) + ecp->tap_length * sizeof(int32_t));
 	/* Create FIR filter */
 	fir16_create(&pvt->fir_state, pvt->fir_taps16, pvt->taps);
 	pvt->rx_power_threshold = 10000000;
@@ -304,6 +306,21 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 	}
 }
 
+/* Far end is idle: only keep the transmit history current */
+static void echo_can_bypass(struct dahdi_echocan_state *ec, const short *iref, u32 size)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	u32 x;
+
+	for (x = 0; x < size; x++, iref++) {
+		fir16_push(&pvt->fir_state, *iref);
+		pvt->tx_power += ((abs(*iref) - pvt->tx_power) >> 5);
+		if (pvt->curr_pos <= 0)
+			pvt->curr_pos = pvt->taps;
+		pvt->curr_pos--;
+	}
+}
+
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val)
 {
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
@@ -32,11 +32,16 @@
 #include <linux/sched.h>
 #include <linux/interrupt.h>
 #include <linux/mm.h>
+#include <linux/semaphore.h>
 #if defined(__FreeBSD__)
 #include <sys/filio.h>
+#include <sys/sbuf.h>
 #else
 #include <linux/vmalloc.h>
 #include <linux/page-flags.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include <asm/io.h>
 #endif
 
@@ -53,6 +58,62 @@ static _LIST_HEAD(registration_list);
 static _LIST_HEAD(active_list);
 static DEFINE_SPINLOCK(translock);
 
+struct tc_latency {
+	unsigned long last_ns;
+	unsigned long max_ns;
+	unsigned long long total_ns;
+};
+
+/* Protected by the translock */
+static struct dahdi_tc_stats {
+	unsigned long allocated;	/* DAHDI_TC_ALLOCATE that got a channel */
+	unsigned long busy;		/* ...that found them all busy */
+	unsigned long nodev;		/* ...that found no transcoder for it */
+	unsigned long refiled;		/* Free channels on the wrong list */
+	unsigned long software;		/* Allocated on a software transcoder */
+	struct tc_latency search;	/* Finding a free channel */
+	struct tc_latency allocate;	/* The whole of DAHDI_TC_ALLOCATE */
+} tc_stats;
+
+#if defined(__FreeBSD__)
+static inline unsigned long long tc_now_ns(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#else
+#define tc_now_ns()	ktime_to_ns(ktime_get())
+#endif
+
+/* Channels one file can hold with DAHDI_TC_BATCH_ALLOCATE */
+#define DAHDI_TC_BATCH_MAX	1024
+/* The longest DAHDI_TC_BATCH will wait for a frame, in ms */
+#define DAHDI_TC_BATCH_TIMEOUT	10000
+
+struct dahdi_tc_batch {
+	struct semaphore sem;
+	/* Woken when any of the channels has a frame ready */
+	wait_queue_head_t ready;
+	unsigned int top;	/* One past the highest slot in use */
+	unsigned int next;	/* Where the next retrieve starts looking */
+	struct dahdi_transcoder_channel *chans[DAHDI_TC_BATCH_MAX];
+};
+
+/* Keeps a batch file's wait queue around while a channel is waking it */
+static DEFINE_SPINLOCK(tc_batch_lock);
+
+static void tc_latency_add(struct tc_latency *l, unsigned long long start)
+{
+	unsigned long ns = tc_now_ns() - start;
+
+	l->last_ns = ns;
+	if (ns > l->max_ns)
+		l->max_ns = ns;
+	l->total_ns += ns;
+}
+
 EXPORT_SYMBOL(dahdi_transcoder_register);
 EXPORT_SYMBOL(dahdi_transcoder_unregister);
 EXPORT_SYMBOL(dahdi_transcoder_alert);
@@ -73,9 +134,14 @@ struct dahdi_transcoder *dahdi_transcoder_alloc(int numchans)
 	INIT_LIST_HEAD(&tc->registration_list_node);
 	INIT_LIST_HEAD(&tc->active_list_node);
 	tc->numchannels = numchans;
+	INIT_LIST_HEAD(&tc->free_unbuilt);
+	for (x = 0; x < DAHDI_TC_POOLS; x++)
+		INIT_LIST_HEAD(&tc->pools[x].free);
+	INIT_LIST_HEAD(&tc->free_other);
 	for (x=0; x < tc->numchannels; x++) {
 		init_waitqueue_head(&tc->channels[x].ready);
 		tc->channels[x].parent = tc;
+		INIT_LIST_HEAD(&tc->channels[x].free_node);
 	}
 
 	WARN_ON(!dahdi_transcode_fops);
@@ -102,11 +168,77 @@ static int is_on_list(struct list_head *entry, struct list_head *head)
 	return 0;
 }
 
+/* The free list for channels built for 'fmts', or not built if that is
+ * 0.  Without 'create', NULL if there is no list for them yet.  Should be
+ * called with the translock held. */
+static struct list_head *
+tc_free_list(struct dahdi_transcoder *tc, u32 fmts, int create)
+{
+	int i, empty = -1;
+
+	if (!fmts)
+		return &tc->free_unbuilt;
+	for (i = 0; i < DAHDI_TC_POOLS; i++) {
+		if (tc->pools[i].fmts == fmts)
+			return &tc->pools[i].free;
+		if (empty < 0 && list_empty(&tc->pools[i].free))
+			empty = i;
+	}
+	if (!create)
+		return NULL;
+	if (empty >= 0) {
+		tc->pools[empty].fmts = fmts;
+		return &tc->pools[empty].free;
+	}
+	return &tc->free_other;
+}
+
+static inline u32 tc_chan_fmts(struct dahdi_transcoder_channel *chan)
+{
+	return dahdi_tc_is_built(chan) ? chan->built_fmts : 0;
+}
+
+/* Put a channel that is no longer busy on its transcoder's free lists.
+ * Should be called with the translock held. */
+static void tc_free_push(struct dahdi_transcoder_channel *chan)
+{
+	struct dahdi_transcoder *tc = chan->parent;
+
+	if (!list_empty(&chan->free_node))
+		return;
+	list_add_tail(&chan->free_node,
+		      tc_free_list(tc, tc_chan_fmts(chan), 1));
+	tc->nfree++;
+}
+
+/* Move a free channel that was built or torn down since it was filed */
+static void tc_free_refile(struct dahdi_transcoder_channel *chan)
+{
+	list_move_tail(&chan->free_node,
+		       tc_free_list(chan->parent, tc_chan_fmts(chan), 1));
+	tc_stats.refiled++;
+}
+
+static struct dahdi_transcoder_channel *
+tc_free_take(struct dahdi_transcoder_channel *chan)
+{
+	list_del_init(&chan->free_node);
+	chan->parent->nfree--;
+	dahdi_tc_set_busy(chan);
+	return chan;
+}
+
 /* Register a transcoder */
 int dahdi_transcoder_register(struct dahdi_transcoder *tc)
 {
+	int x;
+
 	spin_lock(&translock);
 	BUG_ON(is_on_list(&tc->registration_list_node, &registration_list));
+	for (x = 0; x < tc->numchannels; x++) {
+		if (!dahdi_tc_is_busy(&tc->channels[x]))
+			tc_free_push(&tc->channels[x]);
+	}
 	list_add_tail(&tc->registration_list_node, &registration_list);
 	list_add_tail(&tc->active_list_node, &active_list);
 	spin_unlock(&translock);
@@ -123,6 +255,7 @@ int dahdi_transcoder_register(struct dahdi_transcoder *tc)
 int dahdi_transcoder_unregister(struct dahdi_transcoder *tc) 
 {
 	int res = -EINVAL;
+	int x;
 
 	/* \todo Perhaps we should check to make sure there isn't a channel
 	 * that is still in use? */
@@ -136,6 +269,13 @@ int dahdi_transcoder_unregister(struct dahdi_transcoder *tc)
 	}
 	list_del_init(&tc->registration_list_node);
 	list_del_init(&tc->active_list_node);
+	INIT_LIST_HEAD(&tc->free_unbuilt);
+	for (x = 0; x < DAHDI_TC_POOLS; x++)
+		INIT_LIST_HEAD(&tc->pools[x].free);
+	INIT_LIST_HEAD(&tc->free_other);
+	for (x = 0; x < tc->numchannels; x++)
+		INIT_LIST_HEAD(&tc->channels[x].free_node);
+	tc->nfree = 0;
 	spin_unlock(&translock);
 
 	printk(KERN_INFO "Unregistered codec translator '%s' with %d " \
@@ -149,7 +289,15 @@ int dahdi_transcoder_unregister(struct dahdi_transcoder *tc)
 /* Alert a transcoder */
 int dahdi_transcoder_alert(struct dahdi_transcoder_channel *chan)
 {
+	unsigned long flags;
+
 	wake_up_interruptible(&chan->ready);
+	if (dahdi_tc_is_batch(chan)) {
+		spin_lock_irqsave(&tc_batch_lock, flags);
+		if (chan->batch_ready)
+			wake_up_interruptible_all(chan->batch_ready);
+		spin_unlock_irqrestore(&tc_batch_lock, flags);
+	}
 	return 0;
 }
 
@@ -174,7 +322,12 @@ static void dtc_release(struct dahdi_transcoder_channel *chan)
 	if (chan->parent && chan->parent->release) {
 		chan->parent->release(chan);
 	}
+	spin_lock(&translock);
 	dahdi_tc_clear_busy(chan);
+	/* Unless the transcoder went away meanwhile */
+	if (is_on_list(&chan->parent->active_list_node, &active_list))
+		tc_free_push(chan);
+	spin_unlock(&translock);
 }
 
 static int dahdi_tc_release(struct inode *inode, struct file *file)
@@ -189,34 +342,42 @@ static int dahdi_tc_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
-/* Find a free channel on the transcoder and mark it busy. */
+/* Find a free channel on the transcoder and mark it busy: one already built
+ * for the formats if there is one, else one not built yet. */
 static inline struct dahdi_transcoder_channel *
 get_free_channel(struct dahdi_transcoder *tc,
 	const struct dahdi_transcoder_formats *fmts)
 {
+	const u32 want = fmts->srcfmt | fmts->dstfmt;
 	struct dahdi_transcoder_channel *chan;
-	int i;
+	struct list_head *list;
 	/* Should be called with the translock held. */
 #ifdef CONFIG_SMP
 	WARN_ON(!spin_is_locked(&translock));
 #endif
 
-	for (i = 0; i < tc->numchannels; i++) {
-		chan = &tc->channels[i];
-		if (!dahdi_tc_is_busy(chan)) {
-			if (!dahdi_tc_is_built(chan)) {
-				dahdi_tc_set_busy(chan);
-				return chan;
-			} else {
-				/* If the channel is already built, we must
-				 * make sure that it can support the formats
-				 * that we're interested in. */
-				if ((fmts->srcfmt|fmts->dstfmt) == chan->built_fmts) {
-					dahdi_tc_set_busy(chan);
-					return chan;
-				}
-			}
-		}
+	list = tc_free_list(tc, want, 0);
+	while (list && !list_empty(list)) {
+		chan = list_first_entry(list, struct dahdi_transcoder_channel,
+					free_node);
+		if (tc_chan_fmts(chan) == want)
+			return tc_free_take(chan);
+		tc_free_refile(chan);
+	}
+
+	while (!list_empty(&tc->free_unbuilt)) {
+		chan = list_first_entry(&tc->free_unbuilt,
+					struct dahdi_transcoder_channel,
+					free_node);
+		if (!dahdi_tc_is_built(chan) || chan->built_fmts == want)
+			return tc_free_take(chan);
+		tc_free_refile(chan);
+	}
+
+	/* Only when there are more kinds of channels than pools */
+	list_for_each_entry(chan, &tc->free_other, free_node) {
+		if (!dahdi_tc_is_built(chan) || chan->built_fmts == want)
+			return tc_free_take(chan);
 	}
 	return NULL;
 }
@@ -235,9 +396,17 @@ __find_free_channel(struct list_head *list, const struct dahdi_transcoder_format
 	struct dahdi_transcoder *tc;
 	struct dahdi_transcoder_channel *chan = NULL;
 	unsigned int match = 0;
-
-	list_for_each_entry(tc, list, active_list_node) {
-		if ((tc->dstfmts & fmts->dstfmt) && (tc->srcfmts & fmts->srcfmt)) {
+	int soft;
+
+	/* Hardware first; software transcoders only take the overflow and
+	 * the formats no hardware does. */
+	for (soft = 0; soft < 2; soft++) {
+		list_for_each_entry(tc, list, active_list_node) {
+			if (!!(tc->flags & DAHDI_TRANSCODER_SOFTWARE) != soft)
+				continue;
+			if (!(tc->dstfmts & fmts->dstfmt) ||
+			    !(tc->srcfmts & fmts->srcfmt))
+				continue;
 			/* We found a transcoder that can handle our formats.
 			 * Now look for an available channel. */
 			match = 1; 
@@ -256,19 +425,40 @@ __find_free_channel(struct list_head *list, const struct dahdi_transcoder_format
 	return ((match) ? -EBUSY : -ENODEV);
 }
 
+static int dahdi_tc_find(const struct dahdi_transcoder_formats *fmts,
+			 struct dahdi_transcoder_channel **pchan,
+			 unsigned long long start)
+{
+	int res;
+
+	spin_lock(&translock);
+	res = __find_free_channel(&active_list, fmts, pchan);
+	tc_latency_add(&tc_stats.search, start);
+	if (!res) {
+		tc_stats.allocated++;
+		if ((*pchan)->parent->flags & DAHDI_TRANSCODER_SOFTWARE)
+			tc_stats.software++;
+	} else if (res == -EBUSY)
+		tc_stats.busy++;
+	else
+		tc_stats.nodev++;
+	spin_unlock(&translock);
+	return res;
+}
+
 static long dahdi_tc_allocate(struct file *file, unsigned long data)
 {
 	int res;
 	struct dahdi_transcoder_channel *chan = NULL;
 	struct dahdi_transcoder_formats fmts;
+	unsigned long long start;
 	
 	if (copy_from_user(&fmts, (__user const void *) data, sizeof(fmts))) {
 		return -EFAULT;
 	}
 
-	spin_lock(&translock);
-	res = __find_free_channel(&active_list, &fmts, &chan);
-	spin_unlock(&translock);
+	start = tc_now_ns();
+	res = dahdi_tc_find(&fmts, &chan, start);
 	if (res)
 		return res;
 
@@ -308,10 +498,14 @@ static long dahdi_tc_allocate(struct file *file, unsigned long data)
 	}
 
 	/* Actually reset the transcoder channel */
-	if (chan->parent->allocate)
-		return chan->parent->allocate(chan);
+	if (!chan->parent->allocate)
+		return -EINVAL;
+	res = chan->parent->allocate(chan);
 
-	return -EINVAL;
+	spin_lock(&translock);
+	tc_latency_add(&tc_stats.allocate, start);
+	spin_unlock(&translock);
+	return res;
 }
 
 static long dahdi_tc_getinfo(unsigned long data)
@@ -376,6 +570,320 @@ static ssize_t dahdi_tc_read(FOP_READ_ARGS_DECL)
 	}
 }
 
+static struct file_operations dahdi_tc_batch_fops;
+
+static void dahdi_tc_batch_put(struct dahdi_transcoder_channel *chan)
+{
+#if !defined(__FreeBSD__)
+	struct module *owner = chan->parent->fops.owner;
+#endif
+	unsigned long flags;
+
+	clear_bit(DAHDI_TC_FLAG_BATCH, &chan->flags);
+	spin_lock_irqsave(&tc_batch_lock, flags);
+	chan->batch_ready = NULL;
+	spin_unlock_irqrestore(&tc_batch_lock, flags);
+	dtc_release(chan);
+#if !defined(__FreeBSD__)
+	module_put(owner);
+#endif
+}
+
+/* The first DAHDI_TC_BATCH_ALLOCATE turns the file into a batch file,
+ * which holds up to DAHDI_TC_BATCH_MAX channels, each known by its slot. */
+static long dahdi_tc_batch_allocate(struct file *file, unsigned long data)
+{
+	struct dahdi_tc_batch *b = file->private_data;
+	struct dahdi_transcoder_batch_alloc ba;
+	struct dahdi_transcoder_channel *chan = NULL;
+	unsigned long long start;
+	unsigned int slot;
+	int res;
+
+	if (copy_from_user(&ba, (__user const void *) data, sizeof(ba)))
+		return -EFAULT;
+
+	if (file->f_op != &dahdi_tc_batch_fops) {
+		/* Already holding a channel from DAHDI_TC_ALLOCATE */
+		if (b)
+			return -EBUSY;
+		b = kzalloc(sizeof(*b), GFP_KERNEL);
+		if (!b)
+			return -ENOMEM;
+		sema_init(&b->sem, 1);
+		init_waitqueue_head(&b->ready);
+		file->private_data = b;
+		file->f_op = &dahdi_tc_batch_fops;
+	}
+
+	down(&b->sem);
+	for (slot = 0; slot < DAHDI_TC_BATCH_MAX; slot++) {
+		if (!b->chans[slot])
+			break;
+	}
+	if (slot == DAHDI_TC_BATCH_MAX) {
+		res = -ENOSPC;
+		goto out;
+	}
+
+	start = tc_now_ns();
+	res = dahdi_tc_find(&ba.fmts, &chan, start);
+	if (res)
+		goto out;
+	BUG_ON(!chan->parent);
+
+	if (!chan->parent->submit || !chan->parent->retrieve ||
+	    !chan->parent->allocate) {
+		dtc_release(chan);
+		res = -ENOSYS;
+		goto out;
+	}
+#if !defined(__FreeBSD__)
+	if (!try_module_get(chan->parent->fops.owner)) {
+		dtc_release(chan);
+		res = -EINVAL;
+		goto out;
+	}
+#endif
+
+	chan->srcfmt = ba.fmts.srcfmt;
+	chan->dstfmt = ba.fmts.dstfmt;
+	/* Frames are collected with DAHDI_TC_BATCH, never waited on */
+	dahdi_tc_set_nonblock(chan);
+	chan->batch_ready = &b->ready;
+	set_bit(DAHDI_TC_FLAG_BATCH, &chan->flags);
+
+	res = chan->parent->allocate(chan);
+	if (res) {
+		dahdi_tc_batch_put(chan);
+		goto out;
+	}
+
+	spin_lock(&translock);
+	tc_latency_add(&tc_stats.allocate, start);
+	spin_unlock(&translock);
+
+	b->chans[slot] = chan;
+	if (slot >= b->top)
+		b->top = slot + 1;
+	ba.chan = slot;
+	if (copy_to_user((__user void *) data, &ba, sizeof(ba))) {
+		b->chans[slot] = NULL;
+		dahdi_tc_batch_put(chan);
+		res = -EFAULT;
+	}
+out:
+	up(&b->sem);
+	return res;
+}
+
+static long dahdi_tc_batch_release(struct file *file, unsigned long data)
+{
+	struct dahdi_tc_batch *b = file->private_data;
+	struct dahdi_transcoder_channel *chan;
+	int slot;
+
+	if (copy_from_user(&slot, (__user const void *) data, sizeof(slot)))
+		return -EFAULT;
+	if (slot < 0 || slot >= DAHDI_TC_BATCH_MAX)
+		return -EINVAL;
+
+	down(&b->sem);
+	chan = b->chans[slot];
+	b->chans[slot] = NULL;
+	up(&b->sem);
+
+	if (!chan)
+		return -EINVAL;
+	dahdi_tc_batch_put(chan);
+	return 0;
+}
+
+/* Called without b->sem from the wait and from poll.  A channel released
+ * meanwhile still belongs to its transcoder, so its flags can be read. */
+static int dahdi_tc_batch_pending(struct dahdi_tc_batch *b)
+{
+	struct dahdi_transcoder_channel *chan;
+	unsigned int slot;
+
+	for (slot = 0; slot < b->top; slot++) {
+		chan = b->chans[slot];
+		if (chan && dahdi_tc_is_data_waiting(chan))
+			return 1;
+	}
+	return 0;
+}
+
+/* Fill up to 'room' frames of 'vec' from the channels with frames waiting,
+ * starting after the channel the last call stopped at so that a busy
+ * channel cannot starve the rest.  Should be called with b->sem held. */
+static int dahdi_tc_batch_collect(struct dahdi_tc_batch *b,
+				  struct dahdi_transcoder_frame __user *vec,
+				  unsigned int room, unsigned int *count)
+{
+	struct dahdi_transcoder_channel *chan;
+	struct dahdi_transcoder_frame f;
+	unsigned int n, slot;
+	ssize_t res;
+
+	for (n = 0; n < b->top && *count < room; n++) {
+		slot = (b->next + n) % b->top;
+		chan = b->chans[slot];
+		if (!chan)
+			continue;
+		while (*count < room && dahdi_tc_is_data_waiting(chan)) {
+			if (copy_from_user(&f, &vec[*count], sizeof(f)))
+				return -EFAULT;
+			res = chan->parent->retrieve(chan,
+				(void __user *)(unsigned long) f.buf, f.len);
+			if (res == -EAGAIN)
+				break;
+			f.chan = slot;
+			f.len = (res < 0) ? 0 : res;
+			f.status = (res < 0) ? res : 0;
+			if (copy_to_user(&vec[*count], &f, sizeof(f)))
+				return -EFAULT;
+			(*count)++;
+			if (res < 0)
+				break;
+		}
+		b->next = slot + 1;
+	}
+	return 0;
+}
+
+/* Submit the frames in the submit vector, each on its own channel, then
+ * collect whatever transcoded frames are ready, waiting up to the timeout
+ * for the first if there are none.  The wait is made without b->sem, so
+ * the file can still be used from other threads meanwhile. */
+static long dahdi_tc_batch(struct file *file, unsigned long data)
+{
+	struct dahdi_tc_batch *b = file->private_data;
+	struct dahdi_transcoder_batch req;
+	struct dahdi_transcoder_frame __user *vec;
+	struct dahdi_transcoder_channel *chan;
+	struct dahdi_transcoder_frame f;
+	unsigned int x, count = 0;
+	ssize_t res = 0;
+
+	if (copy_from_user(&req, (__user const void *) data, sizeof(req)))
+		return -EFAULT;
+	if (req.timeout > DAHDI_TC_BATCH_TIMEOUT)
+		req.timeout = DAHDI_TC_BATCH_TIMEOUT;
+
+	down(&b->sem);
+	vec = (struct dahdi_transcoder_frame __user *)(unsigned long) req.submit;
+	for (x = 0; x < req.nsubmit; x++) {
+		if (copy_from_user(&f, &vec[x], sizeof(f))) {
+			res = -EFAULT;
+			goto out;
+		}
+		chan = (f.chan < DAHDI_TC_BATCH_MAX) ? b->chans[f.chan] : NULL;
+		if (chan) {
+			res = chan->parent->submit(chan,
+				(const void __user *)(unsigned long) f.buf,
+				f.len);
+		} else {
+			res = -EINVAL;
+		}
+		f.status = (res < 0) ? res : 0;
+		if (copy_to_user(&vec[x].status, &f.status, sizeof(f.status))) {
+			res = -EFAULT;
+			goto out;
+		}
+	}
+
+	vec = (struct dahdi_transcoder_frame __user *)(unsigned long)
+		req.retrieve;
+	res = dahdi_tc_batch_collect(b, vec, req.nretrieve, &count);
+	if (!res && !count && req.nretrieve && req.timeout) {
+		up(&b->sem);
+		wait_event_interruptible_timeout(b->ready,
+			dahdi_tc_batch_pending(b),
+			(req.timeout * HZ + 999) / 1000);
+		down(&b->sem);
+		res = dahdi_tc_batch_collect(b, vec, req.nretrieve, &count);
+	}
+	if (res)
+		goto out;
+
+	req.nretrieve = count;
+	if (copy_to_user((__user void *) data, &req, sizeof(req)))
+		res = -EFAULT;
+out:
+	up(&b->sem);
+	return res;
+}
+
+static long dahdi_tc_batch_unlocked_ioctl(struct file *file, unsigned int cmd,
+					  unsigned long data)
+{
+	switch (cmd) {
+	case DAHDI_TC_BATCH:
+		return dahdi_tc_batch(file, data);
+	case DAHDI_TC_BATCH_ALLOCATE:
+		return dahdi_tc_batch_allocate(file, data);
+	case DAHDI_TC_BATCH_RELEASE:
+		return dahdi_tc_batch_release(file, data);
+	case DAHDI_TC_GETINFO:
+		return dahdi_tc_getinfo(data);
+	case DAHDI_TC_ALLOCATE:
+		return -EBUSY;
+#if defined(__FreeBSD__)
+	case FIONBIO:
+	case FIOASYNC:
+		return 0;
+#endif
+	default:
+		return -EINVAL;
+	}
+}
+
+#ifndef HAVE_UNLOCKED_IOCTL
+static int dahdi_tc_batch_ioctl(struct inode *inode, struct file *file,
+				unsigned int cmd, unsigned long data)
+{
+	return (int)dahdi_tc_batch_unlocked_ioctl(file, cmd, data);
+}
+#endif
+
+static int dahdi_tc_batch_file_release(struct inode *inode, struct file *file)
+{
+	struct dahdi_tc_batch *b = file->private_data;
+	unsigned int slot;
+
+	for (slot = 0; slot < b->top; slot++) {
+		if (b->chans[slot])
+			dahdi_tc_batch_put(b->chans[slot]);
+	}
+#if defined(__FreeBSD__)
+	sema_destroy(&b->sem);
+#endif
+	kfree(b);
+	return 0;
+}
+
+static ssize_t dahdi_tc_batch_write(FOP_WRITE_ARGS_DECL)
+{
+	/* Frames go through DAHDI_TC_BATCH on a batch file */
+	return -EINVAL;
+}
+
+static ssize_t dahdi_tc_batch_read(FOP_READ_ARGS_DECL)
+{
+	return -EINVAL;
+}
+
+static unsigned int dahdi_tc_batch_poll(struct file *file,
+					struct poll_table_struct *wait_table)
+{
+	struct dahdi_tc_batch *b = file->private_data;
+
+	poll_wait(file, &b->ready, wait_table);
+
+	return POLLOUT | (dahdi_tc_batch_pending(b) ? POLLIN : 0);
+}
+
 static long dahdi_tc_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
 	switch (cmd) {
@@ -383,6 +891,8 @@ static long dahdi_tc_unlocked_ioctl(struct file *file, unsigned int cmd, unsigne
 		return dahdi_tc_allocate(file, data);
 	case DAHDI_TC_GETINFO:
 		return dahdi_tc_getinfo(data);
+	case DAHDI_TC_BATCH_ALLOCATE:
+		return dahdi_tc_batch_allocate(file, data);
 	case DAHDI_TRANSCODE_OP:
 		/* This is a deprecated call from the previous transcoder
 		 * interface, which was all routed through the dahdi_ioctl in
@@ -437,6 +947,86 @@ static unsigned int dahdi_tc_poll(struct file *file, struct poll_table_struct *w
 	return ret;
 }
 
+#if defined(__FreeBSD__)
+#define stats_printf	sbuf_printf
+typedef struct sbuf stats_buf;
+#else
+#define stats_printf	seq_printf
+typedef struct seq_file stats_buf;
+#endif
+
+static void dahdi_tc_show_latency(stats_buf *buf, const char *name,
+				  const struct tc_latency *l,
+				  unsigned long count)
+{
+	stats_printf(buf, "%s: last %luns max %luns avg %lluns\n", name,
+		     l->last_ns, l->max_ns, count ? l->total_ns / count : 0);
+}
+
+static void dahdi_tc_show(stats_buf *buf)
+{
+	struct dahdi_transcoder *tc;
+	struct dahdi_tc_stats stats;
+	int ntc = 0, nchans = 0, nfree = 0;
+	unsigned long searches;
+
+	/* Copy it all out first; no printing under a spinlock */
+	spin_lock(&translock);
+	list_for_each_entry(tc, &registration_list, registration_list_node) {
+		ntc++;
+		nchans += tc->numchannels;
+		nfree += tc->nfree;
+	}
+	memcpy(&stats, &tc_stats, sizeof(stats));
+	spin_unlock(&translock);
+
+	stats_printf(buf, "transcoders %d channels %d free %d\n",
+		     ntc, nchans, nfree);
+	stats_printf(buf, "allocated %lu (software %lu) busy %lu nodev %lu "
+		     "refiled %lu\n", stats.allocated, stats.software,
+		     stats.busy, stats.nodev, stats.refiled);
+	searches = stats.allocated + stats.busy + stats.nodev;
+	dahdi_tc_show_latency(buf, "search", &stats.search, searches);
+	dahdi_tc_show_latency(buf, "allocate", &stats.allocate,
+			      stats.allocated);
+}
+
+#if defined(__FreeBSD__)
+static int
+dahdi_tc_sysctl_stats(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf *sb;
+	int error;
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 128, req);
+	if (sb == NULL)
+		return (ENOMEM);
+	dahdi_tc_show(sb);
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return (error);
+}
+#elif defined(CONFIG_PROC_FS)
+static int dahdi_tc_proc_show(struct seq_file *sfile, void *v)
+{
+	dahdi_tc_show(sfile);
+	return 0;
+}
+
+static int dahdi_tc_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dahdi_tc_proc_show, NULL);
+}
+
+static const struct file_operations dahdi_tc_proc_ops = {
+	.owner		= THIS_MODULE,
+	.open		= dahdi_tc_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
 static struct file_operations __dahdi_transcode_fops = {
 	.owner =   THIS_MODULE,
 	.open =    dahdi_tc_open,
@@ -451,6 +1041,19 @@ static struct file_operations __dahdi_transcode_fops = {
 	.poll =    dahdi_tc_poll,
 };
 
+static struct file_operations dahdi_tc_batch_fops = {
+	.owner =   THIS_MODULE,
+	.release = dahdi_tc_batch_file_release,
+#ifdef HAVE_UNLOCKED_IOCTL
+	.unlocked_ioctl  = dahdi_tc_batch_unlocked_ioctl,
+#else
+	.ioctl   = dahdi_tc_batch_ioctl,
+#endif
+	.read =    dahdi_tc_batch_read,
+	.write =   dahdi_tc_batch_write,
+	.poll =    dahdi_tc_batch_poll,
+};
+
 static struct dahdi_chardev transcode_chardev = {
 	.name = "transcode",
 	.minor = DAHDI_TRANSCODE,
@@ -469,6 +1072,9 @@ static int dahdi_transcode_init(void)
 
 	if ((res = dahdi_register_chardev(&transcode_chardev)))
 		return res;
+#if !defined(__FreeBSD__) && defined(CONFIG_PROC_FS)
+	proc_create("dahdi/transcode", 0444, NULL, &dahdi_tc_proc_ops);
+#endif
 
 	printk(KERN_INFO "%s: Loaded.\n", THIS_MODULE->name);
 	return 0;
@@ -476,6 +1082,9 @@ static int dahdi_transcode_init(void)
 
 static void dahdi_transcode_cleanup(void)
 {
+#if !defined(__FreeBSD__) && defined(CONFIG_PROC_FS)
+	remove_proc_entry("dahdi/transcode", NULL);
+#endif
 	dahdi_unregister_chardev(&transcode_chardev);
 
 	dahdi_transcode_fops = NULL;
@@ -488,6 +1097,10 @@ SYSCTL_NODE(_dahdi, OID_AUTO, transcode, CTLFLAG_RW, 0, "DAHDI Transcoder Suppor
 #define MODULE_PARAM_PREFIX "dahdi.transcode"
 #define MODULE_PARAM_PARENT _dahdi_transcode
 
+SYSCTL_PROC(_dahdi_transcode, OID_AUTO, stats, CTLTYPE_STRING | CTLFLAG_RD,
+    NULL, 0, dahdi_tc_sysctl_stats, "A",
+    "Transcoder channel allocation statistics");
+
 LINUX_DEV_MODULE(dahdi_transcode);
 MODULE_VERSION(dahdi_transcode, 1);
 MODULE_DEPEND(dahdi_transcode, dahdi, 1, 1, 1);
@@ -0,0 +1,414 @@
+/*
+ * Software transcoder for DAHDI
+ *
+ * Registers a transcoder, like the TC400M's, for the formats that are
+ * cheap enough to do on the host: G.711 mu-law and A-law, signed linear
+ * and G.726 at 32kbps, in any direction between them.  The transcode
+ * layer only hands out its channels once no hardware transcoder has one
+ * free, or for pairs of formats no hardware does, so /dev/dahdi/transcode
+ * takes the overflow instead of the caller doing it in userspace.  It
+ * also makes the transcoder interface testable with no hardware at all.
+ *
+ * Frames are transcoded as they are written; the result is read back
+ * whole or in part, as a stream of bytes.  G.726 is packed as RFC 3551
+ * has it, the first sample in the low four bits of each byte.  Signed
+ * linear is in host byte order.
+ *
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/semaphore.h>
+#if !defined(__FreeBSD__)
+#include <asm/uaccess.h>
+#endif
+
+#include <dahdi/kernel.h>
+
+#include "g726.h"
+
+#define SOFT_FORMATS	(DAHDI_FORMAT_ULAW | DAHDI_FORMAT_ALAW | \
+			 DAHDI_FORMAT_SLINEAR | DAHDI_FORMAT_G726)
+
+/* The largest frame written at once: 60ms of signed linear */
+#define SOFT_MAXFRAME	960
+/* Transcoded data not yet read; writes past it fail with -EAGAIN */
+#define SOFT_OUTBUF	(4 * SOFT_MAXFRAME)
+
+static int channels = 64;
+static int debug;
+
+struct soft_pvt {
+	struct semaphore sem;	/* Everything below */
+	struct g726_state g726;
+	int nibble;		/* G.726 code waiting for its byte, or -1 */
+	size_t outlen;
+	u8 in[SOFT_MAXFRAME];
+	u8 out[SOFT_OUTBUF];
+};
+
+static struct dahdi_transcoder *soft_tc;
+static struct soft_pvt *soft_pvts;
+
+/* Samples in 'len' bytes of 'fmt' */
+static size_t soft_samples(u32 fmt, size_t len)
+{
+	switch (fmt) {
+	case DAHDI_FORMAT_SLINEAR:
+		return len / 2;
+	case DAHDI_FORMAT_G726:
+		return len * 2;
+	default:
+		return len;
+	}
+}
+
+/* Bytes of 'fmt' that 'samples' come to at most */
+static size_t soft_bytes(u32 fmt, size_t samples)
+{
+	switch (fmt) {
+	case DAHDI_FORMAT_SLINEAR:
+		return samples * 2;
+	case DAHDI_FORMAT_G726:
+		return (samples + 1) / 2;
+	default:
+		return samples;
+	}
+}
+
+static void soft_put(struct soft_pvt *p, u32 fmt, short s)
+{
+	int code;
+
+	switch (fmt) {
+	case DAHDI_FORMAT_ULAW:
+		p->out[p->outlen++] = DAHDI_LIN2MU(s);
+		break;
+	case DAHDI_FORMAT_ALAW:
+		p->out[p->outlen++] = DAHDI_LIN2A(s);
+		break;
+	case DAHDI_FORMAT_SLINEAR:
+		memcpy(&p->out[p->outlen], &s, sizeof(s));
+		p->outlen += sizeof(s);
+		break;
+	case DAHDI_FORMAT_G726:
+		code = g726_encode(&p->g726, s);
+		if (p->nibble < 0) {
+			p->nibble = code;
+		} else {
+			p->out[p->outlen++] = p->nibble | (code << 4);
+			p->nibble = -1;
+		}
+		break;
+	}
+}
+
+/* Transcode the 'len' bytes in p->in onto the end of p->out.  Should be
+ * called with p->sem held. */
+static int soft_transcode(struct dahdi_transcoder_channel *dtc, size_t len)
+{
+	struct soft_pvt *p = dtc->pvt;
+	const u8 *in = p->in;
+	size_t x;
+	short s;
+
+	if (soft_bytes(dtc->dstfmt, soft_samples(dtc->srcfmt, len)) >
+	    SOFT_OUTBUF - p->outlen)
+		return -EAGAIN;
+
+	switch (dtc->srcfmt) {
+	case DAHDI_FORMAT_ULAW:
+		for (x = 0; x < len; x++)
+			soft_put(p, dtc->dstfmt, DAHDI_MULAW(in[x]));
+		break;
+	case DAHDI_FORMAT_ALAW:
+		for (x = 0; x < len; x++)
+			soft_put(p, dtc->dstfmt, DAHDI_ALAW(in[x]));
+		break;
+	case DAHDI_FORMAT_SLINEAR:
+		for (x = 0; x + 1 < len; x += 2) {
+			memcpy(&s, &in[x], sizeof(s));
+			soft_put(p, dtc->dstfmt, s);
+		}
+		break;
+	case DAHDI_FORMAT_G726:
+		/* The decoder state is the encoder's: one of the two
+		 * formats is always not G.726 */
+		for (x = 0; x < len; x++) {
+			soft_put(p, dtc->dstfmt,
+				 g726_decode(&p->g726, in[x] & 0x0f));
+			soft_put(p, dtc->dstfmt,
+				 g726_decode(&p->g726, in[x] >> 4));
+		}
+		break;
+	}
+	return 0;
+}
+
+static int soft_check_frame(struct dahdi_transcoder_channel *dtc,
+			    size_t count)
+{
+	if (!dahdi_tc_is_built(dtc))
+		return -EAGAIN;
+	if (!count || count > SOFT_MAXFRAME)
+		return -EINVAL;
+	if (dtc->srcfmt == DAHDI_FORMAT_SLINEAR && (count & 1))
+		return -EINVAL;
+	return 0;
+}
+
+/* Let the reader know there is something for it */
+static void soft_ready(struct dahdi_transcoder_channel *dtc)
+{
+	dahdi_tc_set_data_waiting(dtc);
+	dahdi_transcoder_alert(dtc);
+}
+
+/* Take up to 'count' bytes off the front of p->out.  Should be called with
+ * p->sem held. */
+static void soft_consume(struct dahdi_transcoder_channel *dtc, size_t count)
+{
+	struct soft_pvt *p = dtc->pvt;
+
+	p->outlen -= count;
+	if (p->outlen)
+		memmove(p->out, &p->out[count], p->outlen);
+	else
+		dahdi_tc_clear_data_waiting(dtc);
+}
+
+static ssize_t soft_write(FOP_WRITE_ARGS_DECL)
+{
+	struct dahdi_transcoder_channel *dtc = file->private_data;
+	struct soft_pvt *p = dtc->pvt;
+	int res;
+
+	res = soft_check_frame(dtc, count);
+	if (res)
+		return res;
+
+	down(&p->sem);
+#if defined(__FreeBSD__)
+	res = -uiomove(p->in, count, uio);
+#else
+	res = copy_from_user(p->in, frame, count) ? -EFAULT : 0;
+#endif
+	if (!res)
+		res = soft_transcode(dtc, count);
+	up(&p->sem);
+	if (res)
+		return res;
+
+	soft_ready(dtc);
+	return count;
+}
+
+static ssize_t soft_read(FOP_READ_ARGS_DECL)
+{
+	struct dahdi_transcoder_channel *dtc = file->private_data;
+	struct soft_pvt *p = dtc->pvt;
+	size_t len;
+	int res;
+
+	down(&p->sem);
+	while (!p->outlen) {
+		up(&p->sem);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		res = wait_event_interruptible(dtc->ready,
+				dahdi_tc_is_data_waiting(dtc));
+#if !defined(__FreeBSD__)
+		if (-ERESTARTSYS == res)
+			return -EINTR;
+#endif
+		down(&p->sem);
+	}
+
+	len = (count < p->outlen) ? count : p->outlen;
+#if defined(__FreeBSD__)
+	res = -uiomove(p->out, len, uio);
+#else
+	res = copy_to_user(frame, p->out, len) ? -EFAULT : 0;
+#endif
+	if (!res)
+		soft_consume(dtc, len);
+	up(&p->sem);
+
+	return res ? res : len;
+}
+
+/* DAHDI_TC_BATCH */
+static ssize_t soft_submit(struct dahdi_transcoder_channel *dtc,
+			   const void __user *frame, size_t count)
+{
+	struct soft_pvt *p = dtc->pvt;
+	int res;
+
+	res = soft_check_frame(dtc, count);
+	if (res)
+		return res;
+
+	down(&p->sem);
+	res = copy_from_user(p->in, frame, count) ? -EFAULT : 0;
+	if (!res)
+		res = soft_transcode(dtc, count);
+	up(&p->sem);
+	if (res)
+		return res;
+
+	soft_ready(dtc);
+	return count;
+}
+
+static ssize_t soft_retrieve(struct dahdi_transcoder_channel *dtc,
+			     void __user *frame, size_t count)
+{
+	struct soft_pvt *p = dtc->pvt;
+	size_t len;
+	int res;
+
+	down(&p->sem);
+	if (!p->outlen) {
+		up(&p->sem);
+		return -EAGAIN;
+	}
+	len = (count < p->outlen) ? count : p->outlen;
+	res = copy_to_user(frame, p->out, len) ? -EFAULT : 0;
+	if (!res)
+		soft_consume(dtc, len);
+	up(&p->sem);
+
+	return res ? res : len;
+}
+
+static int soft_allocate(struct dahdi_transcoder_channel *dtc)
+{
+	struct soft_pvt *p = dtc->pvt;
+
+	if (dtc->srcfmt == dtc->dstfmt ||
+	    !(dtc->srcfmt & SOFT_FORMATS) || !(dtc->dstfmt & SOFT_FORMATS))
+		return -EINVAL;
+
+	down(&p->sem);
+	g726_init(&p->g726);
+	p->nibble = -1;
+	p->outlen = 0;
+	dahdi_tc_clear_data_waiting(dtc);
+	up(&p->sem);
+
+	dtc->built_fmts = dtc->srcfmt | dtc->dstfmt;
+	dahdi_tc_set_built(dtc);
+	if (debug) {
+		printk(KERN_DEBUG "dahdi_transcode_soft: channel %p "
+		       "%08x -> %08x\n", dtc, dtc->srcfmt, dtc->dstfmt);
+	}
+	return 0;
+}
+
+static int soft_release(struct dahdi_transcoder_channel *dtc)
+{
+	struct soft_pvt *p = dtc->pvt;
+
+	/* Nothing to tear down; unbuilt, it can be had for any formats */
+	dahdi_tc_clear_built(dtc);
+	down(&p->sem);
+	p->outlen = 0;
+	dahdi_tc_clear_data_waiting(dtc);
+	up(&p->sem);
+	return 0;
+}
+
+static void soft_free(void)
+{
+#if defined(__FreeBSD__)
+	int x;
+
+	for (x = 0; x < channels; x++)
+		sema_destroy(&soft_pvts[x].sem);
+#endif
+	kfree(soft_pvts);
+	dahdi_transcoder_free(soft_tc);
+}
+
+static int __init dahdi_transcode_soft_init(void)
+{
+	int x, res;
+
+	if (channels <= 0)
+		return -EINVAL;
+
+	soft_pvts = kzalloc(sizeof(*soft_pvts) * channels, GFP_KERNEL);
+	if (!soft_pvts)
+		return -ENOMEM;
+	soft_tc = dahdi_transcoder_alloc(channels);
+	if (!soft_tc) {
+		kfree(soft_pvts);
+		return -ENOMEM;
+	}
+
+	strlcpy(soft_tc->name, "Software", sizeof(soft_tc->name));
+	soft_tc->srcfmts = SOFT_FORMATS;
+	soft_tc->dstfmts = SOFT_FORMATS;
+	soft_tc->flags = DAHDI_TRANSCODER_SOFTWARE;
+	soft_tc->allocate = soft_allocate;
+	soft_tc->release = soft_release;
+	soft_tc->submit = soft_submit;
+	soft_tc->retrieve = soft_retrieve;
+	soft_tc->fops.owner = THIS_MODULE;
+	soft_tc->fops.read = soft_read;
+	soft_tc->fops.write = soft_write;
+	for (x = 0; x < channels; x++) {
+		sema_init(&soft_pvts[x].sem, 1);
+		soft_tc->channels[x].pvt = &soft_pvts[x];
+	}
+
+	res = dahdi_transcoder_register(soft_tc);
+	if (res) {
+		soft_free();
+		return res;
+	}
+	return 0;
+}
+
+static void __exit dahdi_transcode_soft_exit(void)
+{
+	dahdi_transcoder_unregister(soft_tc);
+	soft_free();
+}
+
+#if defined(__FreeBSD__)
+SYSCTL_NODE(_dahdi, OID_AUTO, transcode_soft, CTLFLAG_RW, 0, "DAHDI Software Transcoder");
+#define MODULE_PARAM_PREFIX "dahdi.transcode_soft"
+#define MODULE_PARAM_PARENT _dahdi_transcode_soft
+
+LINUX_DEV_MODULE(dahdi_transcode_soft);
+MODULE_VERSION(dahdi_transcode_soft, 1);
+MODULE_DEPEND(dahdi_transcode_soft, dahdi, 1, 1, 1);
+MODULE_DEPEND(dahdi_transcode_soft, dahdi_transcode, 1, 1, 1);
+#endif /* __FreeBSD__ */
+
+module_param(channels, int, S_IRUGO);
+module_param(debug, int, S_IRUGO | S_IWUSR);
+
+MODULE_DESCRIPTION("DAHDI Software Transcoder");
+MODULE_LICENSE("GPL v2");
+
+module_init(dahdi_transcode_soft_init);
+module_exit(dahdi_transcode_soft_exit);
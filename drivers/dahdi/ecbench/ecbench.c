@@ -0,0 +1,557 @@
+/*
+ * Offline benchmark for the DAHDI software echo cancelers.
+ *
+ * Links the dahdi_echocan_*.c sources unmodified (see the shim/ directory)
+ * and runs each of them over synthesized or recorded 8 kHz PCM the way the
+ * DAHDI core would, one DAHDI_CHUNKSIZE chunk at a time. For every canceler,
+ * tail length and scenario it reports the echo return loss enhancement
+ * (ERLE), the time to converge and the processing cost per sample.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dahdi/kernel.h>
+
+#define SAMPLE_RATE	8000
+#define BLOCK		160		/* 20ms measurement blocks */
+#define CONV_BLOCKS	10		/* blocks above target to call it converged */
+#define MIN_ECHO_POWER	(32 * 32)	/* per sample, below this a block is not scored */
+#define MAX_FACTORIES	8
+#define MAX_PARAMS	8
+
+/* Same defaults as the module parameters in dahdi-base.c */
+#define IDLE_THRESHOLD	16
+#define IDLE_HANGOVER	256
+
+int ecbench_verbose;
+
+int ecbench_init_jpah(void);
+int ecbench_init_kb1(void);
+int ecbench_init_mg2(void);
+int ecbench_init_sec(void);
+int ecbench_init_sec2(void);
+
+static int (* const ec_inits[])(void) = {
+	ecbench_init_jpah,
+	ecbench_init_kb1,
+	ecbench_init_mg2,
+	ecbench_init_sec,
+	ecbench_init_sec2,
+};
+
+static const struct dahdi_echocan_factory *factories[MAX_FACTORIES];
+static int num_factories;
+
+int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+	if (num_factories == MAX_FACTORIES)
+		return -ENOMEM;
+	factories[num_factories++] = ec;
+	return 0;
+}
+
+void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+}
+
+enum scenario {
+	SCEN_SINGLE,		/* far end talking only */
+	SCEN_DOUBLE,		/* near end joins in for the middle fifth */
+	SCEN_FAX,		/* 2100 Hz answer tone with phase reversals */
+	SCEN_FILE,		/* far/near recordings given on the command line */
+};
+
+static const char * const scenario_names[] = {
+	[SCEN_SINGLE] = "single",
+	[SCEN_DOUBLE] = "double",
+	[SCEN_FAX] = "fax",
+	[SCEN_FILE] = "file",
+};
+
+struct signals {
+	size_t len;
+	short *far;		/* transmit direction, the echo canceler's reference */
+	short *near;		/* near end talker without echo, NULL if unknown */
+	short *rx;		/* what the echo canceler sees: near + echo */
+	unsigned char *dt;	/* 1 where the near end talks */
+};
+
+struct result {
+	double erle;		/* dB, far end only blocks in the second half */
+	double dt_erle;		/* dB, double talk blocks */
+	int conv_ms;		/* -1 if the target was never held */
+	double ns_per_sample;
+};
+
+static struct {
+	int delay_ms;
+	double erl_db;
+	double target_db;
+	int seconds;
+	bool bypass;
+	struct dahdi_echocanparam params[MAX_PARAMS];
+	int param_count;
+} opts = {
+	.delay_ms = 5,
+	.erl_db = 10.0,
+	.target_db = 20.0,
+	.seconds = 10,
+};
+
+/* Small deterministic generator, so runs are comparable across builds */
+static unsigned int seed;
+
+static int noise(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int) ((seed >> 16) & 0x7fff) - 0x4000;
+}
+
+static short saturate(double v)
+{
+	if (v > 32767.0)
+		return 32767;
+	if (v < -32768.0)
+		return -32768;
+	return (short) lrint(v);
+}
+
+/*
+ * Speech-like signal: coloured noise switched into talkspurts of roughly
+ * a second, with a syllabic envelope, at about -20 dBm0.
+ */
+static void make_talker(short *out, size_t len, unsigned int s)
+{
+	double lp = 0.0, bp = 0.0, env;
+	size_t n;
+
+	seed = s;
+	for (n = 0; n < len; n++) {
+		size_t t = n % (SAMPLE_RATE * 13 / 10);
+
+		lp += 0.35 * (noise() - lp);
+		bp = lp - 0.6 * bp;
+		if (t < SAMPLE_RATE)
+			env = 0.55 + 0.45 * sin(2.0 * M_PI * 4.0 * n / SAMPLE_RATE);
+		else
+			env = 0.0;
+		out[n] = saturate(bp * env * 0.45);
+	}
+}
+
+/* CED: 2100 Hz at -12 dBm0 with a phase reversal every 450ms */
+static void make_ced(short *out, size_t len)
+{
+	size_t n;
+
+	for (n = 0; n < len; n++) {
+		double phase = 2.0 * M_PI * 2100.0 * n / SAMPLE_RATE;
+
+		if ((n / (SAMPLE_RATE * 450 / 1000)) & 1)
+			phase += M_PI;
+		out[n] = saturate(5800.0 * sin(phase));
+	}
+}
+
+/* Hybrid echo path: a short dispersive response after a bulk delay */
+static void add_echo(struct signals *sig)
+{
+	static const double h[] = { 0.55, -0.35, 0.22, -0.12, 0.06, -0.03 };
+	double gain = pow(10.0, -opts.erl_db / 20.0);
+	size_t delay = DAHDI_MS_TO_SAMPLES(opts.delay_ms);
+	size_t n, k;
+
+	for (n = 0; n < sig->len; n++) {
+		double echo = 0.0;
+
+		for (k = 0; k < sizeof(h) / sizeof(h[0]); k++) {
+			if (n >= delay + k)
+				echo += h[k] * sig->far[n - delay - k];
+		}
+		sig->rx[n] = saturate(sig->near[n] + gain * echo);
+	}
+}
+
+static int synthesize(struct signals *sig, enum scenario scen)
+{
+	size_t n;
+
+	sig->len = (size_t) opts.seconds * SAMPLE_RATE;
+	sig->far = calloc(sig->len, sizeof(short));
+	sig->near = calloc(sig->len, sizeof(short));
+	sig->rx = calloc(sig->len, sizeof(short));
+	sig->dt = calloc(sig->len, 1);
+	if (!sig->far || !sig->near || !sig->rx || !sig->dt)
+		return -ENOMEM;
+
+	if (scen == SCEN_FAX)
+		make_ced(sig->far, sig->len);
+	else
+		make_talker(sig->far, sig->len, 1);
+
+	if (scen == SCEN_DOUBLE) {
+		size_t from = sig->len * 2 / 5, to = sig->len * 3 / 5;
+
+		make_talker(sig->near + from, to - from, 2);
+		memset(sig->dt + from, 1, to - from);
+	}
+
+	/* Line noise floor around -66 dBm0 */
+	seed = 3;
+	for (n = 0; n < sig->len; n++)
+		sig->near[n] = saturate(sig->near[n] + noise() / 2048.0);
+
+	add_echo(sig);
+	return 0;
+}
+
+static short *load_raw(const char *path, size_t *len)
+{
+	FILE *f;
+	short *buf;
+	long size;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(size > 0 ? size : 1);
+	if (buf)
+		*len = fread(buf, sizeof(short), size / sizeof(short), f);
+	fclose(f);
+	return buf;
+}
+
+/*
+ * Recordings: the far file is the transmit direction, the near file is
+ * the receive direction as it came back from the line, echo included.
+ * The clean near end is unknown, so every block with enough echo is
+ * scored as if it were single talk.
+ */
+static int load_files(struct signals *sig, const char *far, const char *near)
+{
+	size_t far_len = 0, near_len = 0;
+
+	sig->far = load_raw(far, &far_len);
+	sig->rx = load_raw(near, &near_len);
+	if (!sig->far || !sig->rx)
+		return -ENOENT;
+	sig->len = (far_len < near_len ? far_len : near_len) & ~(DAHDI_CHUNKSIZE - 1);
+	sig->near = NULL;
+	sig->dt = calloc(sig->len ? sig->len : 1, 1);
+	return sig->dt ? 0 : -ENOMEM;
+}
+
+static void free_signals(struct signals *sig)
+{
+	free(sig->far);
+	free(sig->near);
+	free(sig->rx);
+	free(sig->dt);
+	memset(sig, 0, sizeof(*sig));
+}
+
+/* The same test the core's __dahdi_ec_chunk() makes before bypassing */
+static bool far_end_idle(struct dahdi_echocan_state *ec, const short *tx)
+{
+	int x, energy = 0;
+
+	if (!opts.bypass || !ec->ops->echocan_bypass)
+		return false;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		energy += abs(tx[x]);
+
+	if (energy > IDLE_THRESHOLD * DAHDI_CHUNKSIZE) {
+		ec->status.idle_samples = 0;
+		return false;
+	}
+
+	if (ec->status.idle_samples < DAHDI_MS_TO_SAMPLES(IDLE_HANGOVER)) {
+		ec->status.idle_samples += DAHDI_CHUNKSIZE;
+		return false;
+	}
+
+	return true;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int run(const struct dahdi_echocan_factory *f, unsigned int taps,
+	       const struct signals *sig, struct result *res)
+{
+	struct {
+		struct dahdi_echocanparams ecp;
+		struct dahdi_echocanparam params[MAX_PARAMS];
+	} p;
+	struct dahdi_echocan_state *ec;
+	short *out;
+	double start, elapsed;
+	double st_echo = 0, st_res = 0, dt_echo = 0, dt_res = 0;
+	size_t n, b;
+	int streak = 0, res_err;
+
+	memset(&p, 0, sizeof(p));
+	p.ecp.tap_length = taps;
+	p.ecp.param_count = opts.param_count;
+	memcpy(p.params, opts.params, sizeof(opts.params));
+
+	res_err = f->echocan_create(NULL, &p.ecp, p.params, &ec);
+	if (res_err)
+		return res_err;
+	ec->status.mode = ECHO_MODE_ACTIVE;
+	ec->status.tap_length = taps;
+
+	out = malloc(sig->len * sizeof(short));
+	if (!out) {
+		ec->ops->echocan_free(NULL, ec);
+		return -ENOMEM;
+	}
+	memcpy(out, sig->rx, sig->len * sizeof(short));
+
+	start = now_ns();
+	for (n = 0; n + DAHDI_CHUNKSIZE <= sig->len; n += DAHDI_CHUNKSIZE) {
+		ec->events.all = 0;
+		if (far_end_idle(ec, &sig->far[n]))
+			ec->ops->echocan_bypass(ec, &sig->far[n], DAHDI_CHUNKSIZE);
+		else
+			ec->ops->echocan_process(ec, &out[n], &sig->far[n], DAHDI_CHUNKSIZE);
+	}
+	elapsed = now_ns() - start;
+
+	ec->ops->echocan_free(NULL, ec);
+
+	res->ns_per_sample = elapsed / sig->len;
+	res->conv_ms = -1;
+
+	for (b = 0; b + BLOCK <= sig->len; b += BLOCK) {
+		double echo = 0, residual = 0, erle;
+		bool dt = false;
+
+		for (n = b; n < b + BLOCK; n++) {
+			int clean = sig->near ? sig->near[n] : 0;
+			double e = sig->rx[n] - clean;
+			double r = out[n] - clean;
+
+			echo += e * e;
+			residual += r * r;
+			dt |= sig->dt[n];
+		}
+
+		if (echo < (double) MIN_ECHO_POWER * BLOCK)
+			continue;
+
+		if (dt) {
+			dt_echo += echo;
+			dt_res += residual;
+			continue;
+		}
+
+		erle = 10.0 * log10(echo / (residual + 1.0));
+		if (res->conv_ms < 0) {
+			if (erle >= opts.target_db) {
+				if (++streak == CONV_BLOCKS)
+					res->conv_ms = (b / BLOCK + 1 - CONV_BLOCKS) * BLOCK / 8;
+			} else {
+				streak = 0;
+			}
+		}
+
+		if (b >= sig->len / 2) {
+			st_echo += echo;
+			st_res += residual;
+		}
+	}
+
+	res->erle = st_echo ? 10.0 * log10(st_echo / (st_res + 1.0)) : NAN;
+	res->dt_erle = dt_echo ? 10.0 * log10(dt_echo / (dt_res + 1.0)) : NAN;
+
+	free(out);
+	return 0;
+}
+
+static void print_db(double v)
+{
+	if (isnan(v))
+		printf("  %8s", "-");
+	else
+		printf("  %8.1f", v);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -e name[,name...]   echo cancelers to run (default: all)\n"
+		"  -t taps[,taps...]   tail lengths (default: 128,256,512,1024)\n"
+		"  -s scenario         single, double, fax or all (default: all)\n"
+		"  -f far.raw          transmit direction recording (s16, 8 kHz)\n"
+		"  -n near.raw         receive direction recording, echo included\n"
+		"  -d ms               echo path delay (default: %d)\n"
+		"  -l dB               echo return loss of the path (default: %.0f)\n"
+		"  -c dB               ERLE that counts as converged (default: %.0f)\n"
+		"  -T seconds          length of synthesized signals (default: %d)\n"
+		"  -p name=value       parameter for echocan_create (repeatable)\n"
+		"  -b                  bypass while the far end is idle, as the core does\n"
+		"  -v                  show canceler messages\n",
+		prog, opts.delay_ms, opts.erl_db, opts.target_db, opts.seconds);
+	exit(1);
+}
+
+static bool in_list(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *s;
+
+	if (!list)
+		return true;
+	for (s = list; s; s = strchr(s, ',') ? strchr(s, ',') + 1 : NULL) {
+		if (!strncasecmp(s, name, len) && (s[len] == ',' || !s[len]))
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int default_taps[] = { 128, 256, 512, 1024 };
+	unsigned int taps[16];
+	int num_taps = 0;
+	const char *ec_list = NULL, *scen_arg = "all";
+	const char *far_file = NULL, *near_file = NULL;
+	struct signals sig;
+	int c, i, t, s;
+
+	while ((c = getopt(argc, argv, "e:t:s:f:n:d:l:c:T:p:bv")) != -1) {
+		switch (c) {
+		case 'e':
+			ec_list = optarg;
+			break;
+		case 't': {
+			char *tok = strtok(optarg, ",");
+
+			for (; tok && num_taps < 16; tok = strtok(NULL, ","))
+				taps[num_taps++] = strtoul(tok, NULL, 0);
+			break;
+		}
+		case 's':
+			scen_arg = optarg;
+			break;
+		case 'f':
+			far_file = optarg;
+			break;
+		case 'n':
+			near_file = optarg;
+			break;
+		case 'd':
+			opts.delay_ms = atoi(optarg);
+			break;
+		case 'l':
+			opts.erl_db = atof(optarg);
+			break;
+		case 'c':
+			opts.target_db = atof(optarg);
+			break;
+		case 'T':
+			opts.seconds = atoi(optarg);
+			break;
+		case 'p': {
+			struct dahdi_echocanparam *p = &opts.params[opts.param_count];
+			char *eq = strchr(optarg, '=');
+
+			if (!eq || opts.param_count == MAX_PARAMS)
+				usage(argv[0]);
+			*eq = '\0';
+			strncpy(p->name, optarg, sizeof(p->name) - 1);
+			p->value = strtol(eq + 1, NULL, 0);
+			opts.param_count++;
+			break;
+		}
+		case 'b':
+			opts.bypass = true;
+			break;
+		case 'v':
+			ecbench_verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!!far_file != !!near_file || opts.seconds <= 0)
+		usage(argv[0]);
+
+	if (!num_taps) {
+		for (; num_taps < 4; num_taps++)
+			taps[num_taps] = default_taps[num_taps];
+	}
+
+	for (i = 0; i < (int) (sizeof(ec_inits) / sizeof(ec_inits[0])); i++)
+		ec_inits[i]();
+
+	printf("%-6s %5s  %-7s  %8s  %8s  %8s  %9s\n", "echo", "taps",
+	       "signal", "ERLE", "DT-ERLE", "conv ms", "ns/sample");
+
+	for (s = SCEN_SINGLE; s <= SCEN_FILE; s++) {
+		if (far_file ? s != SCEN_FILE :
+		    s == SCEN_FILE || (strcmp(scen_arg, "all") && strcmp(scen_arg, scenario_names[s])))
+			continue;
+
+		memset(&sig, 0, sizeof(sig));
+		if (s == SCEN_FILE ? load_files(&sig, far_file, near_file) : synthesize(&sig, s)) {
+			fprintf(stderr, "Unable to set up the %s signals\n", scenario_names[s]);
+			return 1;
+		}
+
+		for (i = 0; i < num_factories; i++) {
+			const char *name = factories[i]->get_name(NULL);
+
+			if (!in_list(ec_list, name))
+				continue;
+
+			for (t = 0; t < num_taps; t++) {
+				struct result res;
+				int err;
+
+				err = run(factories[i], taps[t], &sig, &res);
+				printf("%-6s %5u  %-7s", name, taps[t], scenario_names[s]);
+				if (err) {
+					printf("  create failed: %s\n", strerror(-err));
+					continue;
+				}
+				print_db(res.erle);
+				print_db(res.dt_erle);
+				if (res.conv_ms < 0)
+					printf("  %8s", "never");
+				else
+					printf("  %8d", res.conv_ms);
+				printf("  %9.1f\n", res.ns_per_sample);
+			}
+		}
+
+		free_signals(&sig);
+	}
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * The echo canceler half of <dahdi/kernel.h> and <dahdi/user.h>, for
+ * building the software echo cancelers into ecbench.
+ *
+ * Keep the structures below in step with include/dahdi/kernel.h; the
+ * cancelers only ever touch the fields declared here.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _ECBENCH_DAHDI_KERNEL_H
+#define _ECBENCH_DAHDI_KERNEL_H
+
+#include <linux/kernel.h>
+
+#define DAHDI_CHUNKSIZE		 8
+#define DAHDI_MS_TO_SAMPLES(ms) ((ms) * 8)
+
+#define module_printk(level, fmt, args...) \
+		printk(level "%s: " fmt, ECBENCH_MODNAME, ## args)
+
+#define __ECBENCH_STR(x)	#x
+#define _ECBENCH_STR(x)		__ECBENCH_STR(x)
+#define ECBENCH_MODNAME		"dahdi_echocan_" _ECBENCH_STR(ECBENCH_NAME)
+
+struct dahdi_echocanparam {
+	char name[16];
+	__s32 value;
+};
+
+struct dahdi_echocanparams {
+	__u32 tap_length;
+	__u32 param_count;
+	struct dahdi_echocanparam params[0];
+};
+
+/* The core's CED detector state is never touched by the cancelers. */
+typedef struct {
+	int unused;
+} echo_can_disable_detector_state_t;
+
+struct dahdi_chan;
+struct dahdi_echocan_state;
+
+struct dahdi_echocan_features {
+	u32 CED_tx_detect:1;
+	u32 CED_rx_detect:1;
+	u32 CNG_tx_detect:1;
+	u32 CNG_rx_detect:1;
+	u32 NLP_toggle:1;
+	u32 NLP_automatic:1;
+};
+
+struct dahdi_echocan_ops {
+	void (*echocan_free)(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
+	void (*echocan_process)(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+	void (*echocan_events)(struct dahdi_echocan_state *ec);
+	int (*echocan_traintap)(struct dahdi_echocan_state *ec, int pos, short val);
+	void (*echocan_NLP_toggle)(struct dahdi_echocan_state *ec, unsigned int enable);
+	void (*echocan_bypass)(struct dahdi_echocan_state *ec, const short *iref, u32 size);
+};
+
+struct dahdi_echocan_factory {
+	const char *(*get_name)(const struct dahdi_chan *chan);
+	struct module *owner;
+	int (*echocan_create)(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
+			      struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
+};
+
+int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec);
+void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec);
+
+enum dahdi_echocan_mode {
+	__ECHO_MODE_MUTE = 1 << 8,
+	ECHO_MODE_IDLE = 0,
+	ECHO_MODE_PRETRAINING = 1 | __ECHO_MODE_MUTE,
+	ECHO_MODE_STARTTRAINING = 2 | __ECHO_MODE_MUTE,
+	ECHO_MODE_AWAITINGECHO = 3 | __ECHO_MODE_MUTE,
+	ECHO_MODE_TRAINING = 4 | __ECHO_MODE_MUTE,
+	ECHO_MODE_ACTIVE = 5,
+	ECHO_MODE_FAX = 6,
+};
+
+struct dahdi_echocan_state {
+	const struct dahdi_echocan_ops *ops;
+	echo_can_disable_detector_state_t txecdis;
+	echo_can_disable_detector_state_t rxecdis;
+	struct dahdi_echocan_features features;
+	struct {
+		enum dahdi_echocan_mode mode;
+		u32 last_train_tap;
+		u32 pretrain_timer;
+		u32 idle_samples;
+		u32 tap_length;
+		u32 active_start;
+		u32 active_length;
+	} status;
+	union dahdi_echocan_events {
+		u32 all;
+		struct {
+			u32 CED_tx_detected:1;
+			u32 CED_rx_detected:1;
+			u32 CNG_tx_detected:1;
+			u32 CNG_rx_detected:1;
+			u32 NLP_auto_disabled:1;
+			u32 NLP_auto_enabled:1;
+		} bit;
+	} events;
+};
+
+#endif /* _ECBENCH_DAHDI_KERNEL_H */
@@ -0,0 +1,6 @@
+/* Userspace stand-in for <linux/errno.h>, see kernel.h in this directory. */
+#ifdef __linux__
+/* The C library's <errno.h> pulls in the real one for the E* values */
+#include_next <linux/errno.h>
+#endif
+#include <linux/kernel.h>
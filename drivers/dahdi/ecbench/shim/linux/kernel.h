@@ -0,0 +1,92 @@
+/*
+ * Userspace stand-ins for the few kernel interfaces the software echo
+ * cancelers use, so that ecbench can link them unmodified.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _ECBENCH_LINUX_KERNEL_H
+#define _ECBENCH_LINUX_KERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int32_t s32;
+typedef uint32_t __u32;
+typedef int32_t __s32;
+
+#define KERN_ERR	""
+#define KERN_WARNING	""
+#define KERN_NOTICE	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+
+extern int ecbench_verbose;
+
+#define printk(fmt, args...) \
+	do { if (ecbench_verbose) fprintf(stderr, fmt, ## args); } while (0)
+
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, int flags)
+{
+	return calloc(1, size);
+}
+
+#define kfree(p)	free(p)
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define __init
+#define __exit
+
+struct module;
+#define THIS_MODULE	((struct module *) NULL)
+
+#define S_IRUGO		0444
+#define S_IWUSR		0200
+
+#define module_param(name, type, perm) \
+	static __attribute__((unused)) void *__ecbench_param_ ## name = &name
+#define MODULE_DESCRIPTION(s)
+#define MODULE_AUTHOR(s)
+#define MODULE_LICENSE(s)
+
+/* The FreeBSD module glue in each canceler. */
+#define SYSCTL_NODE(parent, nbr, name, access, handler, descr)
+#define LINUX_DEV_MODULE(name)
+#define MODULE_VERSION(name, ver)
+#define MODULE_DEPEND(name, dep, min, pref, max)
+
+/*
+ * Each canceler is compiled with -DECBENCH_NAME=<name>; its module_init()
+ * becomes ecbench_init_<name>(), which the harness calls to have it
+ * register its factory.
+ */
+#define __ECBENCH_PASTE(a, b)	a ## b
+#define _ECBENCH_PASTE(a, b)	__ECBENCH_PASTE(a, b)
+
+#define module_init(fn) \
+	int _ECBENCH_PASTE(ecbench_init_, ECBENCH_NAME)(void) { return fn(); }
+#define module_exit(fn) \
+	void _ECBENCH_PASTE(ecbench_exit_, ECBENCH_NAME)(void) { fn(); }
+
+#endif /* _ECBENCH_LINUX_KERNEL_H */
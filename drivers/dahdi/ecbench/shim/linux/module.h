@@ -0,0 +1,2 @@
+/* Userspace stand-in for <linux/module.h>, see kernel.h in this directory. */
+#include <linux/kernel.h>
@@ -33,17 +33,23 @@
 #define TRUE (!FALSE)
 #endif
 
+/* Elliptic notch */
+/* This is actually centred at 2095Hz, but gets the balance we want, due
+   to the asymmetric walls of the notch */
+#define ECDIS_NOTCH_GAIN	((int32_t) (-0.7600000*32768.0))
+#define ECDIS_NOTCH_A1		((int32_t) (-0.1183852*32768.0))
+#define ECDIS_NOTCH_A2		((int32_t) (-0.5104039*32768.0))
+#define ECDIS_NOTCH_B1		((int32_t) ( 0.1567596*32768.0))
+#define ECDIS_NOTCH_B2		((int32_t) ( 1.0000000*32768.0))
+
 static inline void echo_can_disable_detector_init (echo_can_disable_detector_state_t *det)
 {
-    /* Elliptic notch */
-    /* This is actually centred at 2095Hz, but gets the balance we want, due
-       to the asymmetric walls of the notch */
     biquad2_init (&det->notch,
-    	     	  (int32_t) (-0.7600000*32768.0),
-    	    	  (int32_t) (-0.1183852*32768.0),
-    	    	  (int32_t) (-0.5104039*32768.0),
-    	    	  (int32_t) ( 0.1567596*32768.0),
-    	    	  (int32_t) ( 1.0000000*32768.0));
+    	     	  ECDIS_NOTCH_GAIN,
+    	    	  ECDIS_NOTCH_A1,
+    	    	  ECDIS_NOTCH_A2,
+    	    	  ECDIS_NOTCH_B1,
+    	    	  ECDIS_NOTCH_B2);
 
     det->channel_level = 0;
     det->notch_level = 0;    
@@ -54,52 +60,80 @@ static inline void echo_can_disable_detector_init (echo_can_disable_detector_sta
 }
 /*- End of function --------------------------------------------------------*/
 
+/*
+ * Run a chunk of samples through the detector. The notch coefficients are
+ * the same for every channel, so they are used as constants here and the
+ * filter and level state is kept in locals for the whole chunk, instead of
+ * going through the state structure on every sample. Stops at the first
+ * sample that produces a hit, like the per sample loops it replaces did.
+ */
 static inline int echo_can_disable_detector_update (echo_can_disable_detector_state_t *det,
-						    int16_t amp)
+						    const int16_t *amp, int len)
 {
+	int32_t z0, z1 = det->notch.z1, z2 = det->notch.z2;
+	int channel_level = det->channel_level;
+	int notch_level = det->notch_level;
+	int tone_cycle_duration = det->tone_cycle_duration;
+	int tone_present = det->tone_present;
+	int good_cycles = det->good_cycles;
+	int hit = det->hit;
 	int16_t notched;
+	int x;
 
-    	notched = biquad2 (&det->notch, amp);
-    	/* Estimate the overall energy in the channel, and the energy in
-	   the notch (i.e. overall channel energy - tone energy => noise).
-	   Use abs instead of multiply for speed (is it really faster?).
-	   Damp the overall energy a little more for a stable result.
-	   Damp the notch energy a little less, so we don't damp out the
-	   blip every time the phase reverses */
-        det->channel_level += ((abs(amp) - det->channel_level) >> 5);
-	det->notch_level += ((abs(notched) - det->notch_level) >> 4);
-	if (det->channel_level >= 70) {
-		/* There is adequate energy in the channel. Is it mostly at 2100Hz? */
-		if (det->notch_level*6 < det->channel_level) {
-			det->tone_cycle_duration++;
-			/* The notch says yes, so we have the tone. */
-			if (!det->tone_present) {
+	for (x = 0; x < len && !hit; x++) {
+		z0 = amp[x]*ECDIS_NOTCH_GAIN + z1*ECDIS_NOTCH_A1 + z2*ECDIS_NOTCH_A2;
+		notched = (z0 + z1*ECDIS_NOTCH_B1 + z2*ECDIS_NOTCH_B2) >> 15;
+		z2 = z1;
+		z1 = z0 >> 15;
+
+		/* Estimate the overall energy in the channel, and the energy in
+		   the notch (i.e. overall channel energy - tone energy => noise).
+		   Use abs instead of multiply for speed (is it really faster?).
+		   Damp the overall energy a little more for a stable result.
+		   Damp the notch energy a little less, so we don't damp out the
+		   blip every time the phase reverses */
+		channel_level += ((abs(amp[x]) - channel_level) >> 5);
+		notch_level += ((abs(notched) - notch_level) >> 4);
+		if (channel_level < 70) {
+			tone_present = FALSE;
+			tone_cycle_duration = 0;
+			good_cycles = 0;
+		} else if (notch_level*6 < channel_level) {
+			/* There is adequate energy in the channel, and the
+			   notch says it is mostly at 2100Hz, so we have the tone. */
+			tone_cycle_duration++;
+			if (!tone_present) {
 				/* Do we get a kick every 450+-25ms? */
-				if ((det->tone_cycle_duration >= (425 * 8)) &&
-				    (det->tone_cycle_duration <= (475 * 8))) {
+				if ((tone_cycle_duration >= (425 * 8)) &&
+				    (tone_cycle_duration <= (475 * 8))) {
 					/* It's ANS/PR (CED with polarity reversals), so wait
 					   for at least three cycles before returning a hit. */
-					det->good_cycles++;
-					if (det->good_cycles > 2)
-						det->hit = TRUE;
+					good_cycles++;
+					if (good_cycles > 2)
+						hit = TRUE;
 				}
-				det->tone_cycle_duration = 0;
-				det->tone_present = TRUE;
-			} else if (det->tone_cycle_duration >= 600 * 8) {
+				tone_cycle_duration = 0;
+				tone_present = TRUE;
+			} else if (tone_cycle_duration >= 600 * 8) {
 				/* It's ANS (CED without polarity reversals)
 				   so return a hit. */
-				det->hit = TRUE;
+				hit = TRUE;
 			}
 		} else {
-			det->tone_present = FALSE;
+			tone_present = FALSE;
 		}
-	} else {
-		det->tone_present = FALSE;
-		det->tone_cycle_duration = 0;
-		det->good_cycles = 0;
 	}
 
-	return  det->hit;
+	det->notch.z1 = z1;
+	det->notch.z2 = z2;
+	det->channel_level = channel_level;
+	det->notch_level = notch_level;
+	det->tone_cycle_duration = tone_cycle_duration;
+	det->tone_present = tone_present;
+	det->good_cycles = good_cycles;
+	det->hit = hit;
+
+	return hit;
 }
 /*- End of function --------------------------------------------------------*/
 /*- End of file ------------------------------------------------------------*/
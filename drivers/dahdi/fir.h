@@ -84,6 +84,15 @@ static inline int16_t fir16 (fir16_state_t *fir, int16_t sample)
 }
 /*- End of function --------------------------------------------------------*/
 
+static inline void fir16_push (fir16_state_t *fir, int16_t sample)
+{
+    fir->history[fir->curr_pos] = sample;
+    if (fir->curr_pos <= 0)
+    	fir->curr_pos = fir->taps;
+    fir->curr_pos--;
+}
+/*- End of function --------------------------------------------------------*/
+
 static inline void fir32_create (fir32_state_t *fir,
 			         int32_t *coeffs,
     	    	    	         int taps)
@@ -0,0 +1,331 @@
+/*
+ * g726.h - G.726 ADPCM at 32kbps (what was G.721), in integer arithmetic
+ *
+ * After the Sun Microsystems reference implementation of the CCITT
+ * G.721/G.723 ADPCM coders, which was placed in the public domain, as
+ * also used by Asterisk's codec_g726.
+ *
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _DAHDI_G726_H
+#define _DAHDI_G726_H
+
+struct g726_state {
+	long yl;	/* Locked or steady state step size multiplier */
+	int yu;		/* Unlocked or non-steady state step size multiplier */
+	int dms;	/* Short term energy estimate */
+	int dml;	/* Long term energy estimate */
+	int ap;		/* Linear weighting coefficient of yl and yu */
+	int a[2];	/* Coefficients of the pole portion of the predictor */
+	int b[6];	/* Coefficients of the zero portion of the predictor */
+	int pk[2];	/* Signs of the previous two partially reconstructed
+			   samples */
+	short dq[6];	/* Previous six quantized difference samples, in
+			   the internal floating point format */
+	short sr[2];	/* Previous two reconstructed samples, likewise */
+	int td;		/* Delayed tone detect */
+};
+
+static const short g726_power2[15] = {
+	1, 2, 4, 8, 0x10, 0x20, 0x40, 0x80,
+	0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000
+};
+
+/* Quantizer decision levels, log2 of the difference signal */
+static const short g726_qtab[7] = { -124, 80, 178, 246, 300, 349, 400 };
+/* Log of the quantized difference signal for each code */
+static const short g726_dqlntab[16] = {
+	-2048, 4, 135, 213, 273, 323, 373, 425,
+	425, 373, 323, 273, 213, 135, 4, -2048
+};
+/* Scale factor multipliers, already shifted left by 5 */
+static const int g726_witab[16] = {
+	-384, 576, 1312, 2048, 3584, 6336, 11360, 35904,
+	35904, 11360, 6336, 3584, 2048, 1312, 576, -384
+};
+/* Transition detector inputs for the adaptation speed control */
+static const short g726_fitab[16] = {
+	0, 0, 0, 0x200, 0x200, 0x200, 0x600, 0xE00,
+	0xE00, 0x600, 0x200, 0x200, 0x200, 0, 0, 0
+};
+
+static inline void g726_init(struct g726_state *s)
+{
+	int x;
+
+	memset(s, 0, sizeof(*s));
+	s->yl = 34816;
+	s->yu = 544;
+	for (x = 0; x < 2; x++)
+		s->sr[x] = 32;
+	for (x = 0; x < 6; x++)
+		s->dq[x] = 32;
+}
+
+/* Index of the first entry in 'table' greater than 'val' */
+static inline int g726_quan(int val, const short *table, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (val < table[i])
+			break;
+	}
+	return i;
+}
+
+/* Multiply a predictor coefficient by a sample in floating point format */
+static inline int g726_fmult(int an, int srn)
+{
+	int anmag, anexp, anmant;
+	int wanexp, wanmant;
+	int retval;
+
+	anmag = (an > 0) ? an : ((-an) & 0x1FFF);
+	anexp = g726_quan(anmag, g726_power2, 15) - 6;
+	anmant = (anmag == 0) ? 32 :
+		 (anexp >= 0) ? anmag >> anexp : anmag << -anexp;
+	wanexp = anexp + ((srn >> 6) & 0xF) - 13;
+	wanmant = (anmant * (srn & 077) + 0x30) >> 4;
+	retval = (wanexp >= 0) ? ((wanmant << wanexp) & 0x7FFF) :
+				 (wanmant >> -wanexp);
+	return ((an ^ srn) < 0) ? -retval : retval;
+}
+
+static inline int g726_predictor_zero(struct g726_state *s)
+{
+	int i, sezi = 0;
+
+	for (i = 0; i < 6; i++)
+		sezi += g726_fmult(s->b[i] >> 2, s->dq[i]);
+	return sezi;
+}
+
+static inline int g726_predictor_pole(struct g726_state *s)
+{
+	return g726_fmult(s->a[1] >> 2, s->sr[1]) +
+	       g726_fmult(s->a[0] >> 2, s->sr[0]);
+}
+
+static inline int g726_step_size(struct g726_state *s)
+{
+	int y, dif, al;
+
+	if (s->ap >= 256)
+		return s->yu;
+
+	y = s->yl >> 6;
+	dif = s->yu - y;
+	al = s->ap >> 2;
+	if (dif > 0)
+		y += (dif * al) >> 6;
+	else if (dif < 0)
+		y += (dif * al + 0x3F) >> 6;
+	return y;
+}
+
+/* The code for difference 'd' at step size 'y' */
+static inline int g726_quantize(int d, int y)
+{
+	int dqm, exp, mant, dl, dln, i;
+
+	dqm = (d < 0) ? -d : d;
+	exp = g726_quan(dqm >> 1, g726_power2, 15);
+	mant = ((dqm << 7) >> exp) & 0x7F;
+	dl = (exp << 7) + mant;
+	dln = dl - (y >> 2);
+	i = g726_quan(dln, g726_qtab, 7);
+	if (d < 0)
+		return 15 - i;
+	if (i == 0)
+		return 15;
+	return i;
+}
+
+/* The quantized difference signal for a code, in sign-magnitude */
+static inline int g726_reconstruct(int sign, int dqln, int y)
+{
+	int dql, dex, dqt, dq;
+
+	dql = dqln + (y >> 2);
+	if (dql < 0)
+		return sign ? -0x8000 : 0;
+	dex = (dql >> 7) & 15;
+	dqt = 128 + (dql & 127);
+	dq = (dqt << 7) >> (14 - dex);
+	return sign ? (dq - 0x8000) : dq;
+}
+
+/* The float format of the predictor's delay lines */
+static inline short g726_float(int mag, int neg)
+{
+	int exp;
+
+	if (mag == 0)
+		return neg ? 0xFC20 : 0x20;
+	exp = g726_quan(mag, g726_power2, 15);
+	return (exp << 6) + ((mag << 6) >> exp) - (neg ? 0x400 : 0);
+}
+
+static void g726_update(struct g726_state *s, int y, int i, int dq, int sr,
+			int dqsez)
+{
+	int wi = g726_witab[i], fi = g726_fitab[i];
+	int pk0, mag, ylint, ylfrac, thr, dqthr;
+	int tr, pks1, fa1, a2p = 0, a1ul;
+	int x;
+
+	pk0 = (dqsez < 0) ? 1 : 0;
+	mag = dq & 0x7FFF;
+
+	/* TRANS: transition detector */
+	ylint = s->yl >> 15;
+	ylfrac = (s->yl >> 10) & 0x1F;
+	thr = (ylint > 9) ? 31 << 10 : (32 + ylfrac) << ylint;
+	dqthr = (thr + (thr >> 1)) >> 1;
+	tr = (s->td && mag > dqthr) ? 1 : 0;
+
+	/* Quantizer scale factor adaptation */
+	s->yu = y + ((wi - y) >> 5);
+	if (s->yu < 544)
+		s->yu = 544;
+	else if (s->yu > 5120)
+		s->yu = 5120;
+	s->yl += s->yu + ((-s->yl) >> 6);
+
+	if (tr) {
+		s->a[0] = s->a[1] = 0;
+		for (x = 0; x < 6; x++)
+			s->b[x] = 0;
+	} else {
+		pks1 = pk0 ^ s->pk[0];
+
+		/* UPA2 */
+		a2p = s->a[1] - (s->a[1] >> 7);
+		if (dqsez != 0) {
+			fa1 = pks1 ? s->a[0] : -s->a[0];
+			if (fa1 < -8191)
+				a2p -= 0x100;
+			else if (fa1 > 8191)
+				a2p += 0xFF;
+			else
+				a2p += fa1 >> 5;
+
+			if (pk0 ^ s->pk[1]) {
+				if (a2p <= -12160)
+					a2p = -12288;
+				else if (a2p >= 12416)
+					a2p = 12288;
+				else
+					a2p -= 0x80;
+			} else if (a2p <= -12416) {
+				a2p = -12288;
+			} else if (a2p >= 12160) {
+				a2p = 12288;
+			} else {
+				a2p += 0x80;
+			}
+		}
+		s->a[1] = a2p;
+
+		/* UPA1 */
+		s->a[0] -= s->a[0] >> 8;
+		if (dqsez != 0)
+			s->a[0] += pks1 ? -192 : 192;
+		/* LIMD */
+		a1ul = 15360 - a2p;
+		if (s->a[0] < -a1ul)
+			s->a[0] = -a1ul;
+		else if (s->a[0] > a1ul)
+			s->a[0] = a1ul;
+
+		/* UPB */
+		for (x = 0; x < 6; x++) {
+			s->b[x] -= s->b[x] >> 8;
+			if (mag)
+				s->b[x] += ((dq ^ s->dq[x]) >= 0) ? 128 : -128;
+		}
+	}
+
+	for (x = 5; x > 0; x--)
+		s->dq[x] = s->dq[x - 1];
+	s->dq[0] = g726_float(mag, dq < 0);
+
+	s->sr[1] = s->sr[0];
+	if (sr <= -32768)
+		s->sr[0] = 0xFC20;
+	else
+		s->sr[0] = g726_float((sr < 0) ? -sr : sr, sr < 0);
+
+	s->pk[1] = s->pk[0];
+	s->pk[0] = pk0;
+
+	/* TONE */
+	s->td = (!tr && a2p < -11776) ? 1 : 0;
+
+	/* Adaptation speed control */
+	s->dms += (fi - s->dms) >> 5;
+	s->dml += ((fi << 2) - s->dml) >> 7;
+	if (tr)
+		s->ap = 256;
+	else if (y < 1536 || s->td ||
+		 abs((s->dms << 2) - s->dml) >= (s->dml >> 3))
+		s->ap += (0x200 - s->ap) >> 4;
+	else
+		s->ap += (-s->ap) >> 4;
+}
+
+/* Encode one 16 bit linear sample into a 4 bit code */
+static inline int g726_encode(struct g726_state *s, short sample)
+{
+	int sl, sezi, sez, se, d, y, i, dq, sr;
+
+	sl = sample >> 2;	/* 14 bit dynamic range */
+	sezi = g726_predictor_zero(s);
+	sez = sezi >> 1;
+	se = (sezi + g726_predictor_pole(s)) >> 1;
+	d = sl - se;
+	y = g726_step_size(s);
+	i = g726_quantize(d, y);
+	dq = g726_reconstruct(i & 8, g726_dqlntab[i], y);
+	sr = (dq < 0) ? se - (dq & 0x3FFF) : se + dq;
+	g726_update(s, y, i, dq, sr, sr + sez - se);
+	return i;
+}
+
+/* Decode one 4 bit code into a 16 bit linear sample */
+static inline short g726_decode(struct g726_state *s, int i)
+{
+	int sezi, sez, se, y, dq, sr;
+
+	i &= 0x0F;
+	sezi = g726_predictor_zero(s);
+	sez = sezi >> 1;
+	se = (sezi + g726_predictor_pole(s)) >> 1;
+	y = g726_step_size(s);
+	dq = g726_reconstruct(i & 8, g726_dqlntab[i], y);
+	sr = (dq < 0) ? se - (dq & 0x3FFF) : se + dq;
+	g726_update(s, y, i, dq, sr, sr - se + sez);
+
+	sr <<= 2;
+	if (sr > 32767)
+		return 32767;
+	if (sr < -32768)
+		return -32768;
+	return sr;
+}
+
+#endif /* _DAHDI_G726_H */
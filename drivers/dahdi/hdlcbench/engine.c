@@ -0,0 +1,120 @@
+/*
+ * The HDLC transmit and receive loops of __dahdi_getbuf_chunk() and
+ * __putbuf_chunk(), reduced to what drives fasthdlc.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define FAST_HDLC_NEED_TABLES
+#include <dahdi/fasthdlc.h>
+
+#include "hdlcbench.h"
+
+void engine_init(void)
+{
+	fasthdlc_precalc();
+}
+
+unsigned int engine_fcs(unsigned int fcs, const unsigned char *data, int len)
+{
+	return fasthdlc_fcs(fcs, data, len);
+}
+
+/*
+ * Send the frames back to back, each followed by a closing flag and
+ * 'idle' bytes of flag fill, the way the core sends a write buffer.
+ * Returns the number of bytes written to 'out'.
+ */
+size_t engine_tx(int mode, const struct hdlcbench_frames *f,
+		 unsigned char *out, size_t outlen)
+{
+	struct fasthdlc_state h;
+	const unsigned char *buf = f->data;
+	size_t o = 0;
+	int n, x;
+
+	fasthdlc_init(&h, mode);
+	/* The line idles with flags before the first frame */
+	fasthdlc_tx_frame_nocheck(&h);
+
+	for (n = 0; n < f->count; n++) {
+		for (x = 0; x < f->len[n] && o < outlen; o++) {
+			if (fasthdlc_tx_need_data(&h))
+				fasthdlc_tx_load_nocheck(&h, buf[x++]);
+			out[o] = fasthdlc_tx_run_nocheck(&h);
+		}
+		buf += f->len[n];
+		fasthdlc_tx_frame_nocheck(&h);
+		for (x = 0; x < f->idle && o < outlen; x++, o++) {
+			if (fasthdlc_tx_need_data(&h))
+				fasthdlc_tx_frame_nocheck(&h);
+			out[o] = fasthdlc_tx_run_nocheck(&h);
+		}
+	}
+	return o;
+}
+
+/*
+ * Feed the line bytes through the receiver, storing what each
+ * fasthdlc_rx_run() call returned.
+ */
+void engine_rx(int mode, const unsigned char *in, size_t len, int *res)
+{
+	struct fasthdlc_state h;
+	size_t x;
+
+	fasthdlc_init(&h, mode);
+
+	for (x = 0; x < len; x++) {
+		fasthdlc_rx_load_nocheck(&h, in[x]);
+		res[x] = fasthdlc_rx_run(&h);
+	}
+}
+
+/*
+ * A span's worth of channels, each with a transmit and a receive state.
+ */
+void *engine_chans_alloc(int mode, int count)
+{
+	struct fasthdlc_state *h;
+	int x;
+
+	h = malloc(count * 2 * sizeof(*h));
+	for (x = 0; h && x < count * 2; x++)
+		fasthdlc_init(&h[x], mode);
+	return h;
+}
+
+/*
+ * One tick: every channel sends and receives DAHDI_CHUNKSIZE (8) bytes,
+ * the way the core services a span. Channel c takes its payload from
+ * tx + c * stride and its line bytes from rx + c * stride.
+ */
+void engine_chans_tick(void *chans, int count, const unsigned char *tx,
+		       const unsigned char *rx, size_t stride,
+		       unsigned char *out, int *res)
+{
+	struct fasthdlc_state *h = chans;
+	int c, x;
+
+	for (c = 0; c < count; c++, tx += stride, rx += stride) {
+		struct fasthdlc_state *txh = &h[c * 2], *rxh = &h[c * 2 + 1];
+		int tx_idx = 0;
+
+		for (x = 0; x < 8; x++) {
+			if (fasthdlc_tx_need_data(txh))
+				fasthdlc_tx_load_nocheck(txh, tx[tx_idx++]);
+			*(out++) = fasthdlc_tx_run_nocheck(txh);
+		}
+		for (x = 0; x < 8; x++) {
+			fasthdlc_rx_load_nocheck(rxh, rx[x]);
+			*(res++) = fasthdlc_rx_run(rxh);
+		}
+	}
+}
@@ -0,0 +1,465 @@
+/*
+ * Check the HDLC engine in <dahdi/fasthdlc.h> and measure its throughput.
+ *
+ * Every traffic pattern is framed by the transmitter and fed back through
+ * the receiver, and the frames must come back out intact. The receiver is
+ * also run over line garbage, where every result must still be a data
+ * byte or one of the return flags. Then both directions are timed.
+ *
+ * The timings above run with the tables hot in the cache. The last test
+ * is closer to a span in the kernel: a tick of DAHDI_CHUNKSIZE bytes for
+ * each of many channels, with the cache flushed between ticks the way the
+ * rest of the interrupt handler and the system would flush it.
+ *
+ * fasthdlc_fcs() is checked against the published CRC-16/X.25 check
+ * values and a byte at a time reference, whole and in pieces, and timed
+ * against that reference.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hdlcbench.h"
+
+/* enum fasthdlc_mode */
+#define MODE_64		0
+#define MODE_56		1
+#define MODE_16		2
+
+/* fasthdlc_rx_run() return flags */
+#define RETURN_COMPLETE_FLAG	(0x1000)
+#define RETURN_DISCARD_FLAG	(0x2000)
+#define RETURN_EMPTY_FLAG	(0x4000)
+
+enum traffic {
+	TRAFFIC_RANDOM,		/* random payloads, 16-260 bytes */
+	TRAFFIC_FLAGS,		/* LAPD supervisory sized frames in lots of flag fill */
+	TRAFFIC_ONES,		/* mostly 0xff, 0x7e and 0x7f, stuffing on every byte */
+	TRAFFIC_COUNT,
+};
+
+static const char * const traffic_names[] = {
+	[TRAFFIC_RANDOM] = "random",
+	[TRAFFIC_FLAGS] = "flags",
+	[TRAFFIC_ONES] = "ones",
+};
+
+static const struct {
+	int mode;
+	const char *name;
+} modes[] = {
+	{ MODE_64, "64k" },
+	{ MODE_56, "56k" },
+	{ MODE_16, "16k" },
+};
+
+struct traffic_buf {
+	struct hdlcbench_frames f;
+	unsigned char *data;
+	int *len;
+	size_t payload;
+};
+
+static void make_traffic(struct traffic_buf *t, enum traffic type, size_t payload)
+{
+	static const unsigned char ones[] = { 0xff, 0xff, 0x7e, 0x7f, 0xfe, 0x3f };
+	size_t x, n = 0;
+
+	t->data = malloc(payload + 260);
+	t->len = malloc((payload / 3 + 1) * sizeof(int));
+	if (!t->data || !t->len) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	srand(type + 1);
+	t->payload = 0;
+	while (t->payload < payload) {
+		int len;
+
+		switch (type) {
+		case TRAFFIC_FLAGS:
+			len = 3 + rand() % 4;
+			break;
+		default:
+			len = 16 + rand() % 245;
+			break;
+		}
+		for (x = t->payload; x < t->payload + len; x++) {
+			if (type == TRAFFIC_ONES && rand() % 8)
+				t->data[x] = ones[rand() % sizeof(ones)];
+			else
+				t->data[x] = rand();
+		}
+		t->len[n++] = len;
+		t->payload += len;
+	}
+
+	t->f.data = t->data;
+	t->f.len = t->len;
+	t->f.count = n;
+	t->f.idle = (type == TRAFFIC_FLAGS) ? 30 : rand() % 4;
+}
+
+/* Worst case line bytes for a payload: all stuffed, and 2 bit modes */
+static size_t line_size(const struct traffic_buf *t)
+{
+	return (t->payload * 10 / 8 + (size_t) t->f.count * (t->f.idle + 4)) * 4 + 16;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Put the received frames back together and compare them to what was sent */
+static int check_frames(const struct traffic_buf *t, const int *res, size_t len)
+{
+	size_t x, off = 0, pos = 0;
+	int n = 0;
+
+	for (x = 0; x < len && n < t->f.count; x++) {
+		if (res[x] & RETURN_EMPTY_FLAG)
+			continue;
+		if (res[x] & RETURN_DISCARD_FLAG)
+			return -1;
+		if (res[x] & RETURN_COMPLETE_FLAG) {
+			if (!pos)
+				continue;
+			if (pos != (size_t) t->len[n])
+				return -1;
+			off += pos;
+			pos = 0;
+			n++;
+			continue;
+		}
+		if (pos >= (size_t) t->len[n] || t->data[off + pos] != (unsigned char) res[x])
+			return -1;
+		pos++;
+	}
+	/* The last frame may still be waiting for its closing flag */
+	return n >= t->f.count - 1 ? 0 : -1;
+}
+
+/* Everything the receiver returned must be a byte or a single flag */
+static int check_garbage(const int *res, size_t len)
+{
+	size_t x;
+
+	for (x = 0; x < len; x++) {
+		switch (res[x]) {
+		case RETURN_COMPLETE_FLAG:
+		case RETURN_DISCARD_FLAG:
+		case RETURN_EMPTY_FLAG:
+			break;
+		default:
+			if (res[x] & ~0xff)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+#define PPP_INITFCS	0xffff
+#define PPP_GOODFCS	0xf0b8
+
+/* The byte at a time FCS, as PPP_FCS() does it */
+static unsigned short fcstab[256];
+
+static void fcs_ref_init(void)
+{
+	unsigned int x, fcs, b;
+
+	for (x = 0; x < 256; x++) {
+		fcs = x;
+		for (b = 0; b < 8; b++)
+			fcs = (fcs & 1) ? (fcs >> 1) ^ 0x8408 : fcs >> 1;
+		fcstab[x] = fcs;
+	}
+}
+
+static unsigned int fcs_ref(unsigned int fcs, const unsigned char *data, int len)
+{
+	while (len-- > 0)
+		fcs = (fcs >> 8) ^ fcstab[(fcs ^ *(data++)) & 0xff];
+	return fcs;
+}
+
+/*
+ * Check fasthdlc_fcs(). Returns the number of failures; the timings are
+ * nanoseconds per byte for frames of 'len' bytes.
+ */
+static int check_fcs(int len, int reps, double *ns_ref, double *ns_fcs)
+{
+	static const struct {
+		const char *data;
+		unsigned int fcs;
+	} vectors[] = {
+		{ "", 0x0000 },
+		{ "123456789", 0x906e },
+		{ "A", 0xa3f5 },
+	};
+	unsigned char buf[1024 + 8];
+	volatile unsigned int sink = 0;
+	unsigned int fcs;
+	int x, y, off, failed = 0;
+	double t0;
+
+	for (x = 0; x < (int) (sizeof(vectors) / sizeof(vectors[0])); x++) {
+		fcs = engine_fcs(PPP_INITFCS, (const unsigned char *) vectors[x].data,
+				strlen(vectors[x].data)) ^ 0xffff;
+		if (fcs != vectors[x].fcs) {
+			printf("FCS of \"%s\" is %04x, should be %04x\n",
+			       vectors[x].data, fcs, vectors[x].fcs);
+			failed++;
+		}
+	}
+
+	for (x = 0; x < (int) sizeof(buf); x++)
+		buf[x] = rand();
+	/* Every length at every alignment, and in two pieces split anywhere */
+	for (off = 0; off < 4; off++) {
+		for (x = 0; x <= 64; x++) {
+			fcs = fcs_ref(PPP_INITFCS, buf + off, x);
+			if (engine_fcs(PPP_INITFCS, buf + off, x) != fcs) {
+				printf("FCS of %d bytes at offset %d is wrong\n", x, off);
+				failed++;
+			}
+			for (y = 0; y <= x; y++) {
+				if (engine_fcs(engine_fcs(PPP_INITFCS, buf + off, y),
+					       buf + off + y, x - y) != fcs) {
+					printf("FCS of %d bytes split after %d is wrong\n", x, y);
+					failed++;
+				}
+			}
+			/* A frame followed by its FCS checks out as PPP_GOODFCS */
+			fcs ^= 0xffff;
+			buf[off + x] = fcs & 0xff;
+			buf[off + x + 1] = fcs >> 8;
+			if (engine_fcs(PPP_INITFCS, buf + off, x + 2) != PPP_GOODFCS) {
+				printf("FCS of %d bytes does not check out\n", x);
+				failed++;
+			}
+			buf[off + x] = rand();
+			buf[off + x + 1] = rand();
+		}
+	}
+
+	if (len > (int) sizeof(buf))
+		len = sizeof(buf);
+	reps *= (1 << 20) / len;
+	t0 = now_ns();
+	for (x = 0; x < reps; x++)
+		sink += fcs_ref(x & 0xffff, buf, len);
+	*ns_ref = (now_ns() - t0) / reps / len;
+	t0 = now_ns();
+	for (x = 0; x < reps; x++)
+		sink += engine_fcs(x & 0xffff, buf, len);
+	*ns_fcs = (now_ns() - t0) / reps / len;
+
+	return failed;
+}
+
+#define FLUSH_SIZE	(8 << 20)
+
+/* Evict everything from the caches that the engines might have left there */
+static void flush_cache(volatile unsigned char *buf)
+{
+	size_t x;
+
+	for (x = 0; x < FLUSH_SIZE; x += 64)
+		buf[x]++;
+}
+
+/*
+ * Run 'ticks' ticks of 'chans' channels, flushing the cache before each.
+ * Each channel transmits its own slice of 'tx' and receives its own slice
+ * of 'rx'. Returns nanoseconds per tick.
+ */
+static double cold_ticks(int mode, int chans, int ticks,
+			 const unsigned char *tx, const unsigned char *rx,
+			 size_t len)
+{
+	void *h = engine_chans_alloc(mode, chans);
+	unsigned char *flush = calloc(1, FLUSH_SIZE);
+	unsigned char *out = malloc(chans * 8);
+	int *res = malloc(chans * 8 * sizeof(int));
+	size_t stride = (len / chans) & ~7;
+	double t0, ns = 0;
+	int x;
+
+	if (!h || !flush || !out || !res || stride <= 8) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (x = 0; x < ticks; x++) {
+		size_t off = (x * 8) % (stride - 8);
+
+		flush_cache(flush);
+		t0 = now_ns();
+		engine_chans_tick(h, chans, tx + off, rx + off, stride, out, res);
+		ns += now_ns() - t0;
+	}
+
+	free(h);
+	free(flush);
+	free(out);
+	free(res);
+	return ns / ticks;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t payload = 1 << 20;
+	int reps = 5, chans = 31, ticks = 2000;
+	int c, m, t, r, failed = 0;
+
+	while ((c = getopt(argc, argv, "s:r:c:t:")) != -1) {
+		switch (c) {
+		case 's':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'c':
+			chans = atoi(optarg);
+			break;
+		case 't':
+			ticks = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s payload bytes] [-r repetitions] "
+				"[-c channels] [-t ticks]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!payload || reps <= 0 || chans <= 0 || ticks <= 0)
+		return 1;
+
+	engine_init();
+	fcs_ref_init();
+
+	printf("%-4s %-7s %10s  %10s %10s\n", "mode", "traffic",
+	       "line bytes", "tx", "rx");
+
+	for (t = 0; t < TRAFFIC_COUNT; t++) {
+		struct traffic_buf tb;
+		unsigned char *line, *line2, *garbage;
+		int *res;
+		size_t size, len, x;
+
+		make_traffic(&tb, t, payload);
+		size = line_size(&tb);
+		line = malloc(size);
+		line2 = malloc(size);
+		garbage = malloc(size);
+		res = malloc(size * sizeof(int));
+		if (!line || !line2 || !garbage || !res) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		for (x = 0; x < size; x++)
+			garbage[x] = rand();
+
+		for (m = 0; m < (int) (sizeof(modes) / sizeof(modes[0])); m++) {
+			double t0, tx_ns = 0, rx_ns = 0;
+
+			len = engine_tx(modes[m].mode, &tb.f, line, size);
+			engine_rx(modes[m].mode, line, len, res);
+			if (check_frames(&tb, res, len)) {
+				printf("%-4s %-7s frames did not come back intact\n",
+				       modes[m].name, traffic_names[t]);
+				failed = 1;
+				continue;
+			}
+
+			engine_rx(modes[m].mode, garbage, size, res);
+			if (check_garbage(res, size)) {
+				printf("%-4s %-7s a good frame came out of line garbage\n",
+				       modes[m].name, traffic_names[t]);
+				failed = 1;
+				continue;
+			}
+
+			for (r = 0; r < reps; r++) {
+				t0 = now_ns();
+				engine_tx(modes[m].mode, &tb.f, line2, size);
+				tx_ns += now_ns() - t0;
+				t0 = now_ns();
+				engine_rx(modes[m].mode, line, len, res);
+				rx_ns += now_ns() - t0;
+			}
+
+			/* Line throughput in Mbit/s */
+			printf("%-4s %-7s %10zu  %10.1f %10.1f\n",
+			       modes[m].name, traffic_names[t], len,
+			       len * 8e3 * reps / tx_ns, len * 8e3 * reps / rx_ns);
+		}
+
+		free(tb.data);
+		free(tb.len);
+		free(line);
+		free(line2);
+		free(garbage);
+		free(res);
+	}
+
+	if (!failed)
+		printf("(throughput in Mbit/s of line data)\n");
+
+	printf("\n%-4s %-7s %8s  %10s\n", "mode", "traffic", "channels", "ns/tick");
+	for (t = 0; t < TRAFFIC_COUNT; t++) {
+		struct traffic_buf tb;
+		unsigned char *line;
+		size_t size, len;
+
+		make_traffic(&tb, t, payload);
+		size = line_size(&tb);
+		line = malloc(size);
+		if (!line) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		for (m = 0; m < (int) (sizeof(modes) / sizeof(modes[0])); m++) {
+			len = engine_tx(modes[m].mode, &tb.f, line, size);
+			if (len > tb.payload)
+				len = tb.payload;
+			printf("%-4s %-7s %8d  %10.0f\n",
+			       modes[m].name, traffic_names[t], chans,
+			       cold_ticks(modes[m].mode, chans, ticks, tb.data,
+					  line, len));
+		}
+		free(tb.data);
+		free(tb.len);
+		free(line);
+	}
+	printf("(nanoseconds per tick, cache flushed before each)\n");
+
+	printf("\n%-6s %10s %10s\n", "frame", "PPP_FCS", "fasthdlc");
+	for (c = 8; c <= 512; c *= 4) {
+		double ns_ref, ns_fcs;
+
+		if (check_fcs(c, reps, &ns_ref, &ns_fcs)) {
+			failed = 1;
+			break;
+		}
+		printf("%-6d %10.2f %10.2f\n", c, ns_ref, ns_fcs);
+	}
+	if (!failed)
+		printf("(FCS nanoseconds per byte)\n");
+
+	return failed;
+}
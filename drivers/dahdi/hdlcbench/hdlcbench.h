@@ -0,0 +1,30 @@
+/*
+ * Shared between hdlcbench.c and engine.c
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _HDLCBENCH_H
+#define _HDLCBENCH_H
+
+struct hdlcbench_frames {
+	const unsigned char *data;	/* all payloads, back to back */
+	const int *len;			/* payload length of each frame */
+	int count;
+	int idle;			/* bytes of flag fill after each frame */
+};
+
+void engine_init(void);
+unsigned int engine_fcs(unsigned int fcs, const unsigned char *data, int len);
+size_t engine_tx(int mode, const struct hdlcbench_frames *f,
+		 unsigned char *out, size_t outlen);
+void engine_rx(int mode, const unsigned char *in, size_t len, int *res);
+void *engine_chans_alloc(int mode, int count);
+void engine_chans_tick(void *chans, int count, const unsigned char *tx,
+		       const unsigned char *rx, size_t stride,
+		       unsigned char *out, int *res);
+
+#endif /* _HDLCBENCH_H */
@@ -204,8 +204,8 @@ EXPORT_SYMBOL(dahdi_fifo_alloc);
 #define in_interrupt()	0
 #define barrier()
 
-struct vbb *
-voicebus_alloc(struct voicebus *vb, int malloc_flags)
+static struct vbb *
+vb_new_vbb(struct voicebus *vb)
 {
 	struct vbb *vbb;
 	int res;
@@ -221,22 +221,25 @@ voicebus_alloc(struct voicebus *vb, int malloc_flags)
 	if (res) {
 		if (printk_ratelimit())
 			printf("voicebus: Can't load DMA map\n");
+		bus_dmamem_free(vb->dma_tag, vbb, dma_map);
+		bus_dmamap_destroy(vb->dma_tag, dma_map);
 		return NULL;
 	}
 	return vbb;
 }
 
-void
-voicebus_free(struct voicebus *vb, struct vbb *vbb)
+static void
+vb_delete_vbb(struct voicebus *vb, struct vbb *vbb)
 {
 	bus_dmamap_t dma_map = vbb->dma_map;
 
+	bus_dmamap_unload(vb->dma_tag, dma_map);
 	bus_dmamem_free(vb->dma_tag, vbb, dma_map);
 	bus_dmamap_destroy(vb->dma_tag, dma_map);
 }
 #else /* !__FreeBSD__ */
-struct vbb *
-voicebus_alloc(struct voicebus *vb, int malloc_flags)
+static struct vbb *
+vb_new_vbb(struct voicebus *vb)
 {
 	struct vbb *vbb;
 	dma_addr_t dma_addr;
@@ -244,16 +247,100 @@ voicebus_alloc(struct voicebus *vb, int malloc_flags)
 	vbb = dma_pool_alloc(vb->pool, GFP_KERNEL, &dma_addr);
 	if (vbb)
 		vbb->dma_addr = dma_addr;
+	return vbb;
+}
+
+static void
+vb_delete_vbb(struct voicebus *vb, struct vbb *vbb)
+{
+	dma_pool_free(vb->pool, vbb, vbb->dma_addr);
+}
+#endif /* !__FreeBSD__ */
+
+/**
+ * voicebus_alloc() - Take a frame off the free list.
+ *
+ * All the frames a card uses are allocated and mapped for DMA once, by
+ * vb_alloc_vbbs(), so this never calls into the allocator and is safe from
+ * the interrupt and tasklet paths.  @malloc_flags is no longer used.
+ * Returns NULL when the list is empty.
+ */
+struct vbb *
+voicebus_alloc(struct voicebus *vb, int malloc_flags)
+{
+	struct vbb *vbb = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vb->free_lock, flags);
+	if (likely(!list_empty(&vb->free_vbbs))) {
+		vbb = list_entry(vb->free_vbbs.next, struct vbb, entry);
+		list_del(&vbb->entry);
+		if (--vb->free_count < vb->free_min)
+			vb->free_min = vb->free_count;
+	} else {
+		vb->alloc_failures++;
+	}
+	spin_unlock_irqrestore(&vb->free_lock, flags);
+	return vbb;
 }
 EXPORT_SYMBOL(voicebus_alloc);
 
+/**
+ * voicebus_free() - Put a frame back on the free list.
+ *
+ * The most recently used frames are handed out first.
+ */
 void
 voicebus_free(struct voicebus *vb, struct vbb *vbb)
 {
-	dma_pool_free(vb->pool, vbb, vbb->dma_addr);
+	unsigned long flags;
+
+	spin_lock_irqsave(&vb->free_lock, flags);
+	list_add(&vbb->entry, &vb->free_vbbs);
+	vb->free_count++;
+	spin_unlock_irqrestore(&vb->free_lock, flags);
 }
 EXPORT_SYMBOL(voicebus_free);
-#endif /* !__FreeBSD__ */
+
+/* Adds frames to the free list until the card has 'count' of them.  Only
+ * called in process context, from __voicebus_init() and
+ * voicebus_set_minlatency(). */
+static int
+vb_alloc_vbbs(struct voicebus *vb, unsigned int count)
+{
+	struct vbb *vbb;
+	unsigned long flags;
+
+	while (vb->vbb_count < count) {
+		vbb = vb_new_vbb(vb);
+		if (!vbb)
+			return -ENOMEM;
+		voicebus_free(vb, vbb);
+		spin_lock_irqsave(&vb->free_lock, flags);
+		++vb->vbb_count;
+		++vb->free_min;
+		spin_unlock_irqrestore(&vb->free_lock, flags);
+	}
+	return 0;
+}
+
+/* Frees the frames on the free list, which should by now be all of them. */
+static void
+vb_free_vbbs(struct voicebus *vb)
+{
+	struct vbb *vbb;
+	unsigned int freed = 0;
+
+	while (!list_empty(&vb->free_vbbs)) {
+		vbb = list_entry(vb->free_vbbs.next, struct vbb, entry);
+		list_del(&vbb->entry);
+		vb_delete_vbb(vb, vbb);
+		++freed;
+	}
+	WARN_ON(freed != vb->vbb_count);
+	vb->free_count = 0;
+	vb->vbb_count = 0;
+}
 
 /* In memory structure shared by the host and the adapter. */
 struct voicebus_descriptor {
@@ -414,6 +501,19 @@ vb_initialize_rx_descriptors(struct voicebus *vb)
 		vb, &vb->rxd, VOICEBUS_SFRAME_SIZE);
 }
 
+/* Adds the current latency to the history.  Called with the lock held. */
+static void
+__vb_latency_record(struct voicebus *vb)
+{
+	struct voicebus_latency *l = &vb->latency;
+	unsigned int i = l->history_next++ % VOICEBUS_LATENCY_HISTORY;
+
+	l->history[i].when = jiffies;
+	l->history[i].latency = vb->min_tx_buffer_count;
+	if (vb->min_tx_buffer_count > l->peak)
+		l->peak = vb->min_tx_buffer_count;
+}
+
 /*! \brief  Use to set the minimum number of buffers queued to the hardware
  * before enabling interrupts.
  */
@@ -435,8 +535,18 @@ voicebus_set_minlatency(struct voicebus *vb, unsigned int ms)
 		dev_warn(&vb->pdev->dev, MESSAGE, ms, VOICEBUS_DEFAULT_LATENCY);
 		return -EINVAL;
 	}
+	/* The free list only has frames for VOICEBUS_DEFAULT_MAXLATENCY. */
+	if (ms > VOICEBUS_DEFAULT_MAXLATENCY &&
+	    vb_alloc_vbbs(vb, VOICEBUS_VBB_COUNT +
+			  ms - VOICEBUS_DEFAULT_MAXLATENCY))
+		return -ENOMEM;
 	spin_lock_irqsave(&vb->lock, flags);
 	vb->min_tx_buffer_count = ms;
+	vb->latency.floor = ms;
+	vb->latency.peak = ms;
+	vb->latency.decay = VOICEBUS_LATENCY_DECAY;
+	vb->latency.stamp = jiffies;
+	__vb_latency_record(vb);
 	spin_unlock_irqrestore(&vb->lock, flags);
 	return 0;
 }
@@ -455,6 +565,95 @@ voicebus_current_latency(struct voicebus *vb)
 }
 EXPORT_SYMBOL(voicebus_current_latency);
 
+/**
+ * voicebus_latency_report() - Describe the latency and its recent changes.
+ *
+ * Fills @buf with the current, minimum, maximum and highest latency, the
+ * underrun and change counts, the last few latencies with how long ago
+ * they were set, and how many of the card's frames are free.  Returns the
+ * length of the text.
+ */
+int
+voicebus_latency_report(struct voicebus *vb, char *buf, size_t size)
+{
+	struct voicebus_latency l;
+	unsigned int current_latency, max_latency;
+	unsigned int vbb_count, free_count, free_min, alloc_failures;
+	unsigned long flags;
+	unsigned long now = jiffies;
+	unsigned int n, i;
+	int len;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	memcpy(&l, &vb->latency, sizeof(l));
+	current_latency = vb->min_tx_buffer_count;
+	max_latency = vb->max_latency;
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	spin_lock_irqsave(&vb->free_lock, flags);
+	vbb_count = vb->vbb_count;
+	free_count = vb->free_count;
+	free_min = vb->free_min;
+	alloc_failures = vb->alloc_failures;
+	spin_unlock_irqrestore(&vb->free_lock, flags);
+
+	len = snprintf(buf, size, "current %u ms min %u ms max %u ms "
+		       "peak %u ms%s\n", current_latency, l.floor, max_latency,
+		       l.peak, voicebus_is_latency_locked(vb) ? " (locked)" : "");
+	len += snprintf(buf + len, size - len, "underruns %u increases %u "
+			"decreases %u decay %u s, last change %lu s ago\n",
+			l.underruns, l.increases, l.decreases, l.decay,
+			(now - l.stamp) / HZ);
+	len += snprintf(buf + len, size - len, "history:");
+	n = (l.history_next < VOICEBUS_LATENCY_HISTORY) ?
+		l.history_next : VOICEBUS_LATENCY_HISTORY;
+	for (i = l.history_next - n; i != l.history_next; i++) {
+		len += snprintf(buf + len, size - len, " %u ms (%lu s ago)",
+			l.history[i % VOICEBUS_LATENCY_HISTORY].latency,
+			(now - l.history[i % VOICEBUS_LATENCY_HISTORY].when) /
+			HZ);
+	}
+	len += snprintf(buf + len, size - len, "\n");
+	len += snprintf(buf + len, size - len, "frames %u free %u fewest free %u "
+			"out of frames %u\n", vbb_count, free_count, free_min,
+			alloc_failures);
+	return len;
+}
+EXPORT_SYMBOL(voicebus_latency_report);
+
+#if defined(__FreeBSD__)
+static int
+vb_sysctl_latency(SYSCTL_HANDLER_ARGS)
+{
+	struct voicebus *vb = arg1;
+	char buf[512];
+	int len;
+
+	len = voicebus_latency_report(vb, buf, sizeof(buf));
+	return (SYSCTL_OUT(req, buf, len + 1));
+}
+#endif
+
+/*
+ * An underrun puts off the next drop in latency and, when it comes within
+ * the wait after the last drop, doubles the wait.
+ */
+static void
+vb_note_underrun(struct voicebus *vb)
+{
+	struct voicebus_latency *l = &vb->latency;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	l->underruns++;
+	if (l->decreases && time_before(jiffies, l->dropped + l->decay * HZ)) {
+		l->decay = (l->decay * 2 < VOICEBUS_MAX_LATENCY_DECAY) ?
+			   l->decay * 2 : VOICEBUS_MAX_LATENCY_DECAY;
+	}
+	l->stamp = jiffies;
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
 
 /*!
  * \brief Read one of the hardware control registers without acquiring locks.
@@ -613,7 +812,7 @@ static void vb_cleanup_rx_descriptors(struct voicebus *vb)
 			d->buffer1 = 0;
 			BUG_ON(!dl->pending[i]);
 			vbb = dl->pending[i];
-			list_add_tail(&vbb->entry, &vb->free_rx);
+			voicebus_free(vb, vbb);
 			dl->pending[i] = NULL;
 		}
 		d->des0 &= ~OWN_BIT;
@@ -639,7 +838,6 @@ static void vb_cleanup_descriptors(struct voicebus *vb,
 static void
 vb_free_descriptors(struct voicebus *vb, struct voicebus_descriptor_list *dl)
 {
-	struct vbb *vbb;
 	if (NULL == dl->desc) {
 		WARN_ON(1);
 		return;
@@ -653,11 +851,6 @@ vb_free_descriptors(struct voicebus *vb, struct voicebus_descriptor_list *dl)
 		(sizeof(struct voicebus_descriptor)+dl->padding)*DRING_SIZE,
 		dl->desc, dl->desc_dma);
 #endif /* !__FreeBSD__ */
-	while (!list_empty(&vb->free_rx)) {
-		vbb = list_entry(vb->free_rx.next, struct vbb, entry);
-		list_del(&vbb->entry);
-		voicebus_free(vb, vbb);
-	}
 }
 
 /*!
@@ -832,7 +1025,7 @@ vb_submit_rxb(struct voicebus *vb, struct vbb *vbb)
 	if (unlikely(d->buffer1)) {
 		/* Do not overwrite a buffer that is still in progress. */
 		WARN_ON(1);
-		list_add_tail(&vbb->entry, &vb->free_rx);
+		voicebus_free(vb, vbb);
 		return -EBUSY;
 	}
 
@@ -921,12 +1114,7 @@ static void setup_descriptors(struct voicebus *vb)
 	vb_setctl(vb, 0x0018, (u32)vb->rxd.desc_dma);
 
 	for (i = 0; i < DRING_SIZE; ++i) {
-		if (list_empty(&vb->free_rx)) {
-			vbb = voicebus_alloc(vb, GFP_KERNEL);
-		} else {
-			vbb = list_entry(vb->free_rx.next, struct vbb, entry);
-			list_del(&vbb->entry);
-		}
+		vbb = voicebus_alloc(vb, GFP_KERNEL);
 		if (unlikely(NULL == vbb))
 			BUG_ON(1);
 		list_add_tail(&vbb->entry, &buffers);
@@ -1321,6 +1509,9 @@ voicebus_release(struct voicebus *vb)
 {
 	set_bit(VOICEBUS_SHUTDOWN, &vb->flags);
 
+#if defined(__FreeBSD__)
+	sysctl_ctx_free(&vb->sysctl_ctx);
+#endif
 #ifdef VOICEBUS_NET_DEBUG
 	vb_net_unregister(vb);
 #endif
@@ -1356,6 +1547,8 @@ voicebus_release(struct voicebus *vb)
 	/* Cleanup memory and software resources. */
 	vb_free_descriptors(vb, &vb->txd);
 	vb_free_descriptors(vb, &vb->rxd);
+	vb_free_vbbs(vb);
+	spin_lock_destroy(&vb->free_lock);
 	spin_lock_destroy(&vb->lock);
 	if (vb->idle_vbb_dma_addr) {
 #if defined(__FreeBSD__)
@@ -1398,11 +1591,14 @@ vb_increase_latency(struct voicebus *vb, unsigned int increase,
 	struct vbb *n;
 #endif
 	int i;
+	unsigned long flags;
 	_LIST_HEAD(local);
 
 	if (0 == increase)
 		return;
 
+	vb_note_underrun(vb);
+
 	if (test_bit(VOICEBUS_LATENCY_LOCKED, &vb->flags))
 		return;
 
@@ -1439,7 +1635,46 @@ vb_increase_latency(struct voicebus *vb, unsigned int increase,
 
 	/* Set the new latency (but we want to ensure that there aren't any
 	 * printks to the console, so we don't call the function) */
+	spin_lock_irqsave(&vb->lock, flags);
 	vb->min_tx_buffer_count += increase;
+	if (increase) {
+		vb->latency.increases++;
+		__vb_latency_record(vb);
+	}
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+/**
+ * vb_decrease_latency() - Give back 1 ms of latency after a quiet spell.
+ *
+ * Once there has not been an underrun (or a change in latency) for
+ * latency.decay seconds, one of the completed transmit buffers is not sent
+ * again, leaving a millisecond less queued ahead of the hardware.
+ */
+static void
+vb_decrease_latency(struct voicebus *vb, struct list_head *buffers)
+{
+	struct voicebus_latency *l = &vb->latency;
+	struct vbb *vbb;
+	unsigned long flags;
+
+	if (likely(time_before(jiffies, l->stamp + l->decay * HZ)))
+		return;
+
+	if (vb->min_tx_buffer_count <= l->floor || list_empty(buffers) ||
+	    test_bit(VOICEBUS_LATENCY_LOCKED, &vb->flags))
+		return;
+
+	vbb = list_entry(buffers->next, struct vbb, entry);
+	list_del(&vbb->entry);
+	voicebus_free(vb, vbb);
+
+	spin_lock_irqsave(&vb->lock, flags);
+	vb->min_tx_buffer_count--;
+	l->decreases++;
+	l->stamp = l->dropped = jiffies;
+	__vb_latency_record(vb);
+	spin_unlock_irqrestore(&vb->lock, flags);
 }
 
 static void vb_schedule_deferred(struct voicebus *vb)
@@ -1556,6 +1791,9 @@ static void vb_tasklet_hx8(unsigned long data)
 
 	/* Prep all the new buffers for transmit before actually sending any
 	 * of them. */
+	if (likely(!hardunderrun))
+		vb_decrease_latency(vb, &buffers);
+
 	handle_transmit(vb, &buffers);
 
 	if (unlikely(hardunderrun))
@@ -1681,6 +1919,9 @@ static void vb_tasklet_normal(unsigned long data)
 	while (--count && !list_empty(&vb->tx_complete))
 		list_move_tail(vb->tx_complete.next, &buffers);
 
+	if (likely(!softunderrun))
+		vb_decrease_latency(vb, &buffers);
+
 	/* Prep all the new buffers for transmit before actually sending any
 	 * of them. */
 	handle_transmit(vb, &buffers);
@@ -1817,6 +2058,7 @@ static void handle_hardunderrun(struct work_struct *work)
 		return;
 
 	voicebus_stop(vb);
+	vb_note_underrun(vb);
 
 	if (!test_bit(VOICEBUS_SHUTDOWN, &vb->flags)) {
 
@@ -1967,9 +2209,14 @@ __voicebus_init(struct voicebus *vb, const char *board_name,
 	vb->mode = mode;
 
 	vb->min_tx_buffer_count = VOICEBUS_DEFAULT_LATENCY;
+	vb->latency.floor = VOICEBUS_DEFAULT_LATENCY;
+	vb->latency.peak = VOICEBUS_DEFAULT_LATENCY;
+	vb->latency.decay = VOICEBUS_LATENCY_DECAY;
+	vb->latency.stamp = jiffies;
 
 	INIT_LIST_HEAD(&vb->tx_complete);
-	INIT_LIST_HEAD(&vb->free_rx);
+	spin_lock_init(&vb->free_lock);
+	INIT_LIST_HEAD(&vb->free_vbbs);
 
 #if defined(CONFIG_VOICEBUS_TIMER)
 	init_timer(&vb->timer);
@@ -2041,6 +2288,12 @@ __voicebus_init(struct voicebus *vb, const char *board_name,
 	}
 #endif
 
+	retval = vb_alloc_vbbs(vb, VOICEBUS_VBB_COUNT);
+	if (retval) {
+		dev_err(&vb->pdev->dev, "Can't allocate voicebus frames\n");
+		goto cleanup;
+	}
+
 #if defined(__FreeBSD__)
 	retval = dahdi_dma_allocate(vb->pdev->dev.device, VOICEBUS_SFRAME_SIZE,
 	    &vb->idle_vbb_dma_tag, &vb->idle_vbb_dma_map, (void **) &vb->idle_vbb, &vb->idle_vbb_dma_addr);
@@ -2114,12 +2367,22 @@ __voicebus_init(struct voicebus *vb, const char *board_name,
 
 #ifdef VOICEBUS_NET_DEBUG
 	vb_net_register(vb, board_name);
+#endif
+#if defined(__FreeBSD__)
+	sysctl_ctx_init(&vb->sysctl_ctx);
+	SYSCTL_ADD_PROC(&vb->sysctl_ctx,
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(vb->pdev->dev.device)),
+	    OID_AUTO, "latency", CTLTYPE_STRING | CTLFLAG_RD, vb, 0,
+	    vb_sysctl_latency, "A", "Transmit latency and its recent changes");
 #endif
 	return retval;
 cleanup:
 
 	tasklet_kill(&vb->tasklet);
 
+	/* Nothing has been put on the rings yet. */
+	vb_free_vbbs(vb);
+
 #if defined(__FreeBSD__)
 #if !defined(CONFIG_VOICEBUS_TIMER)
 	if (vb->irq_handle != NULL) {
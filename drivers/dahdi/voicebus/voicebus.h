@@ -35,6 +35,12 @@
 #define VOICEBUS_DEFAULT_LATENCY	3U
 #define VOICEBUS_DEFAULT_MAXLATENCY	25U
 #define VOICEBUS_MAXLATENCY_BUMP	6U
+/* Seconds without an underrun before the latency is dropped by 1 ms.  The
+ * wait doubles, up to VOICEBUS_MAX_LATENCY_DECAY, every time an underrun
+ * follows a drop within it. */
+#define VOICEBUS_LATENCY_DECAY		10U
+#define VOICEBUS_MAX_LATENCY_DECAY	640U
+#define VOICEBUS_LATENCY_HISTORY	8
 
 #define VOICEBUS_SFRAME_SIZE 1004U
 
@@ -42,6 +48,11 @@
 #define DRING_SIZE	(1 << 7)  /* Must be a power of 2 */
 #define DRING_MASK	(DRING_SIZE-1)
 
+/* Frames allocated for each card: a receive ring's worth, the most transmit
+ * latency voicebus_set_maxlatency() allows, and a few for the hx8 boot
+ * commands.  voicebus_set_minlatency() adds more for a higher minimum. */
+#define VOICEBUS_VBB_COUNT	(DRING_SIZE + VOICEBUS_DEFAULT_MAXLATENCY + 8)
+
 /* Define CONFIG_VOICEBUS_SYSFS to create some attributes under the pci device.
  * This is disabled by default because it hasn't been tested on the full range
  * of supported kernels. */
@@ -127,6 +138,33 @@ struct voicebus_descriptor_list {
 #define VOICEBUS_LATENCY_LOCKED			3
 #define VOICEBUS_HARD_UNDERRUN			4
 
+/**
+ * struct voicebus_latency - How the transmit latency got where it is.
+ *
+ * @floor:	The latency set by voicebus_set_minlatency(), which it is
+ *		never dropped below.
+ * @peak:	The highest latency since the last voicebus_set_minlatency().
+ * @stamp:	When (in jiffies) the last underrun or change in latency was.
+ * @dropped:	When the latency was last dropped.
+ * @decay:	Seconds from @stamp before the next drop.
+ * @history:	The last changes, oldest first from @history_next.
+ */
+struct voicebus_latency {
+	unsigned int		floor;
+	unsigned int		peak;
+	unsigned int		underruns;
+	unsigned int		increases;
+	unsigned int		decreases;
+	unsigned long		stamp;
+	unsigned long		dropped;
+	unsigned int		decay;
+	struct {
+		unsigned long	when;
+		unsigned int	latency;
+	} history[VOICEBUS_LATENCY_HISTORY];
+	unsigned int		history_next;
+};
+
 /**
  * voicebus_mode
  *
@@ -189,8 +227,17 @@ struct voicebus {
 	unsigned long		flags;
 	unsigned int		min_tx_buffer_count;
 	unsigned int		max_latency;
+	struct voicebus_latency	latency;	/* Under the lock */
+#if defined(__FreeBSD__)
+	struct sysctl_ctx_list	sysctl_ctx;
+#endif
 	struct list_head	tx_complete;
-	struct list_head	free_rx;
+	spinlock_t		free_lock;
+	struct list_head	free_vbbs;	/* Under the free_lock */
+	unsigned int		vbb_count;	/* Frames the card owns */
+	unsigned int		free_count;
+	unsigned int		free_min;	/* Fewest ever on free_vbbs */
+	unsigned int		alloc_failures;
 	struct dma_pool		*pool;
 
 #ifdef VOICEBUS_NET_DEBUG
@@ -216,6 +263,7 @@ void voicebus_quiesce(struct voicebus *vb);
 int voicebus_transmit(struct voicebus *vb, struct vbb *vbb);
 int voicebus_set_minlatency(struct voicebus *vb, unsigned int milliseconds);
 int voicebus_current_latency(struct voicebus *vb);
+int voicebus_latency_report(struct voicebus *vb, char *buf, size_t size);
 
 static inline int voicebus_init(struct voicebus *vb, const char *board_name)
 {
@@ -35,11 +35,15 @@
 #include <linux/timer.h>
 #include <linux/if_ether.h>
 #if defined(__FreeBSD__)
+#include <sys/sbuf.h>
 #include <vm/uma.h>
 #else /* !__FreeBSD__ */
 #include <linux/ip.h>
 #include <linux/udp.h>
 #include <linux/etherdevice.h>
+#include <linux/ktime.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #endif /* !__FreeBSD__ */
 
 #include <stdbool.h>
@@ -206,6 +210,18 @@ ip_fast_csum(const void *iph, unsigned int ihl)
  * the card every 10 ms. */
 #define POLLING_CALL_THRESHOLD 40
 
+/* Interrupt coalescing.  When receive interrupts come faster than
+ * 'coalesce' a second, or one of them finds 'rx_budget' packets waiting,
+ * the card is switched over to the polling timer.  The interrupt handler
+ * takes at most 'rx_budget' packets off the receive ring and leaves the
+ * rest to the timer, which always empties it: with HZ at 100 a capped
+ * poll could fall behind the card.  It goes back to an interrupt per
+ * packet once COALESCE_IDLE_TICKS polls in a row have found under half
+ * the per tick rate. */
+#define COALESCE_IDLE_TICKS	(HZ / 10)
+/* Packets per receive ring pass: none, then powers of two up to 64 and over */
+#define BATCH_BUCKETS	8
+
 #define INVALID 999 /* Used to mark invalid channels, commands, etc.. */
 #define MAX_CHANNEL_PACKETS  5
 
@@ -232,6 +248,8 @@ ip_fast_csum(const void *iph, unsigned int ihl)
 #define DTE_DEBUG_NETWORK_EARLY	(1 << 6) /* 64 */
 
 static int debug;
+static int coalesce = 8000;
+static int rx_budget = 64;
 #if defined(__FreeBSD__)
 static char mode[8];
 #else
@@ -442,9 +460,54 @@ free_cmd(struct tcb *cmd)
 	__free_cmd(cmd);
 }
 
+/* Latency histograms: under 262us, then doubling up to 268ms and over */
+#define LAT_BUCKETS	12
+#define LAT_SHIFT	18
+/* Frames a channel can have out on the DTE and still be timed */
+#define LAT_INFLIGHT	16
+
+struct latency_stats {
+	unsigned int hist[LAT_BUCKETS];
+	unsigned int count;
+	unsigned long max_ns;
+	unsigned long long total_ns;
+};
+
 struct channel_stats {
 	atomic_t packets_sent;
 	atomic_t packets_received;
+	/* The rest is under the channel's lock.  G.723.1 and G.729 frames
+	 * do not hold as many samples as the frames they are made from, so
+	 * frames are matched up by the count of samples through the channel:
+	 * a frame that comes back is timed from the frame that sent its last
+	 * sample.  The send times wait in a FIFO with the sample count at the
+	 * end of each frame. */
+	struct {
+		unsigned long long ns;
+		u32 end;
+	} sent[LAT_INFLIGHT];
+	unsigned int sent_in;
+	unsigned int sent_out;
+	u32 samples_in;		/* Samples sent to the DTE */
+	u32 samples_out;	/* ...and received back */
+	unsigned int unmatched;	/* Send times pushed out of the FIFO */
+	struct latency_stats latency;
+};
+
+struct card_stats {
+	atomic_t retransmits;	/* Commands the watchdog sent again */
+	atomic_t ring_retries;	/* Timed out while still on the tx ring */
+	atomic_t timeouts;	/* Commands given up on */
+	atomic_t tx_ring_full;	/* Left on cmd_list for want of room */
+	atomic_t irq_passes;	/* Receive ring passes from the interrupt */
+	atomic_t poll_passes;	/* ...and from the polling timer */
+	atomic_t coalesced;	/* Switched to polling for the load */
+	atomic_t uncoalesced;	/* ...and back to interrupts */
+	spinlock_t lock;	/* latency */
+	struct latency_stats latency;
+	/* Under the rx_lock */
+	unsigned int batch_hist[BATCH_BUCKETS];
+	unsigned int budget_spent;	/* Passes that left packets behind */
 };
 
 struct channel_pvt {
@@ -480,6 +543,7 @@ struct wcdte {
 #define DTE_READY	1
 #define DTE_SHUTDOWN	2
 #define DTE_POLLING	3
+#define DTE_COALESCING	4	/* Polling because of the packet rate */
 	unsigned long flags;
 
 	/* This is a device-global list of commands that are waiting to be
@@ -521,6 +585,13 @@ struct wcdte {
 
 	struct work_struct deferred_work;
 
+	struct card_stats stats;
+#if defined(__FreeBSD__)
+	struct sysctl_ctx_list sysctl_ctx;
+#elif defined(CONFIG_PROC_FS)
+	char proc_name[20];
+#endif
+
 #ifndef WITHOUT_NETDEV
 	/*
 	 * This section contains the members necessary for exporting the
@@ -541,6 +612,10 @@ struct wcdte {
 #if defined(__FreeBSD__) || HZ > 100
 	unsigned long jiffies_at_last_poll;
 #endif
+	/* Receive interrupts in the current tick, for the coalescing */
+	unsigned long jiffies_at_last_irq;
+	unsigned int irqs_this_tick;
+	unsigned int idle_ticks;	/* Quiet polls while coalescing */
 };
 
 #ifndef WITHOUT_NETDEV
@@ -567,6 +642,114 @@ static inline int wctc4xxp_is_ready(struct wcdte *wc)
 	return test_bit(DTE_READY, &wc->flags);
 }
 
+#if defined(__FreeBSD__)
+static inline unsigned long long wctc4xxp_now_ns(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#else
+#define wctc4xxp_now_ns()	ktime_to_ns(ktime_get())
+#endif
+
+static void latency_add(struct latency_stats *l, unsigned long ns)
+{
+	unsigned long v = ns >> LAT_SHIFT;
+	int b = 0;
+
+	while (v && b < LAT_BUCKETS - 1) {
+		v >>= 1;
+		b++;
+	}
+	l->hist[b]++;
+	l->count++;
+	if (ns > l->max_ns)
+		l->max_ns = ns;
+	l->total_ns += ns;
+}
+
+/* Samples of audio in a frame of 'len' bytes in 'fmt' */
+static unsigned int
+wctc4xxp_frame_samples(unsigned int fmt, const u8 *data, size_t len)
+{
+	/* Bytes of a G.723.1 frame, by the low two bits of its first */
+	static const u8 g723_bytes[4] = {G723_6K_BYTES, G723_5K_BYTES,
+					 G723_SID_BYTES, 1};
+	unsigned int samples = 0;
+	size_t size;
+
+	switch (fmt) {
+	case DAHDI_FORMAT_G723_1:
+		while (len) {
+			size = g723_bytes[data[0] & 3];
+			if (size > len)
+				break;
+			samples += G723_SAMPLES;
+			data += size;
+			len -= size;
+		}
+		return samples;
+	case DAHDI_FORMAT_G729A:
+		/* 10 bytes to 80 samples; a 2 byte SID frame counts as one */
+		return (len + 9) / 10 * 80;
+	default:
+		return len;
+	}
+}
+
+/* Note when a frame of 'samples' went out on the channel */
+static void wctc4xxp_frame_sent(struct channel_pvt *cpvt, unsigned int samples)
+{
+	struct channel_stats *st = &cpvt->stats;
+	unsigned long long now = wctc4xxp_now_ns();
+	unsigned long flags;
+	unsigned int x;
+
+	spin_lock_irqsave(&cpvt->lock, flags);
+	if (st->sent_in - st->sent_out == LAT_INFLIGHT) {
+		/* Whatever came of it never made it back; start after it */
+		x = st->sent_out++ % LAT_INFLIGHT;
+		if ((s32)(st->sent[x].end - st->samples_out) > 0)
+			st->samples_out = st->sent[x].end;
+		st->unmatched++;
+	}
+	st->samples_in += samples;
+	x = st->sent_in++ % LAT_INFLIGHT;
+	st->sent[x].ns = now;
+	st->sent[x].end = st->samples_in;
+	spin_unlock_irqrestore(&cpvt->lock, flags);
+}
+
+/* How long the frame of 'samples' that just came back on the channel was
+ * out for, or 0 if there was no send time waiting for it.  Should be
+ * called with the channel's lock held. */
+static unsigned long
+wctc4xxp_frame_received(struct channel_pvt *cpvt, unsigned int samples)
+{
+	struct channel_stats *st = &cpvt->stats;
+	unsigned long ns;
+	unsigned int x;
+
+	st->samples_out += samples;
+	/* Frames sent entirely before this one are done with */
+	while (st->sent_in != st->sent_out &&
+	       (s32)(st->sent[st->sent_out % LAT_INFLIGHT].end -
+		     st->samples_out) < 0)
+		st->sent_out++;
+	if (st->sent_in == st->sent_out)
+		return 0;
+
+	x = st->sent_out % LAT_INFLIGHT;
+	ns = wctc4xxp_now_ns() - st->sent[x].ns;
+	/* The sent frame may carry on into the next one back */
+	if (st->sent[x].end == st->samples_out)
+		st->sent_out++;
+	latency_add(&st->latency, ns);
+	return ns;
+}
+
 #define DTE_FORMAT_ULAW   0x00
 #define DTE_FORMAT_G723_1 0x04
 #define DTE_FORMAT_ALAW   0x08
@@ -1908,6 +2091,7 @@ wctc4xxp_transmit_cmd(struct wcdte *wc, struct tcb *cmd)
 		 * ring. */
 		wctc4xxp_remove_from_response_list(wc, cmd);
 		wctc4xxp_add_to_command_list(wc, cmd);
+		atomic_inc(&wc->stats.tx_ring_full);
 	} else if (0 == res) {
 		wctc4xxp_transmit_demand_poll(wc);
 	} else {
@@ -1978,9 +2162,9 @@ wctc4xxp_cleanup_channel_private(struct wcdte *wc,
 	spin_lock_irqsave(&cpvt->lock, flags);
 	list_splice_init(&cpvt->rx_queue, &local_list);
 	dahdi_tc_clear_data_waiting(dtc);
+	memset(&cpvt->stats, 0, sizeof(cpvt->stats));
 	spin_unlock_irqrestore(&cpvt->lock, flags);
 
-	memset(&cpvt->stats, 0, sizeof(cpvt->stats));
 	list_for_each_entry_safe(cmd, temp, &local_list, node) {
 		list_del(&cmd->node);
 		free_cmd(cmd);
@@ -2167,7 +2351,10 @@ wctc4xxp_operation_release(struct dahdi_transcoder_channel *dtc)
 
 #if !defined(CONFIG_WCTC4XXP_POLLING)
 	if (atomic_read(&wc->open_channels) < POLLING_CALL_THRESHOLD) {
-		if (test_bit(DTE_POLLING, &wc->flags))
+		/* The polling timer hands back to interrupts by itself when
+		 * it is polling for the packet rate. */
+		if (test_bit(DTE_POLLING, &wc->flags) &&
+		    !test_bit(DTE_COALESCING, &wc->flags))
 			wctc4xxp_disable_polling(wc);
 	}
 #endif
@@ -2244,12 +2431,16 @@ get_ready_cmd(struct dahdi_transcoder_channel *dtc)
 	return cmd;
 }
 
+/* Moves at most 'budget' packets (all of them if 0) from the receive ring to
+ * the rx_list. */
 static int
-wctc4xxp_handle_receive_ring(struct wcdte *wc)
+wctc4xxp_handle_receive_ring(struct wcdte *wc, unsigned int budget)
 {
 	struct tcb *cmd;
 	unsigned long flags;
 	unsigned int count = 0;
+	unsigned int v;
+	int b = 0;
 
 	/* If we can't grab this lock, another thread must already be checking
 	 * the receive ring...so we should just finish up, and we'll try again
@@ -2267,7 +2458,8 @@ wctc4xxp_handle_receive_ring(struct wcdte *wc)
 #endif
 #endif /* !__FreeBSD__ */
 
-	while ((cmd = wctc4xxp_retrieve(wc->rxd))) {
+	while ((!budget || count < budget) &&
+	       (cmd = wctc4xxp_retrieve(wc->rxd))) {
 		++count;
 		spin_lock(&wc->rx_list_lock);
 		list_add_tail(&cmd->node, &wc->rx_list);
@@ -2284,22 +2476,68 @@ wctc4xxp_handle_receive_ring(struct wcdte *wc)
 			}
 		}
 	}
+
+	for (v = count; v && b < BATCH_BUCKETS - 1; v >>= 1)
+		b++;
+	wc->stats.batch_hist[b]++;
+	if (budget && count == budget)
+		wc->stats.budget_spent++;
 	spin_unlock_irqrestore(&wc->rx_lock, flags);
 	return count;
 }
 
-static void
+static inline unsigned int
+wctc4xxp_rx_budget(void)
+{
+	return (rx_budget > 0 && rx_budget < DRING_SIZE) ? rx_budget : 0;
+}
+
+/* Receive interrupts a tick over which the card is better off polled */
+static inline unsigned int
+wctc4xxp_coalesce_per_tick(void)
+{
+	return (coalesce > HZ) ? coalesce / HZ : 1;
+}
+
+static int
 __wctc4xxp_polling(struct wcdte *wc)
 {
-	if (wctc4xxp_handle_receive_ring(wc))
+	int count;
+
+	atomic_inc(&wc->stats.poll_passes);
+	count = wctc4xxp_handle_receive_ring(wc, 0);
+	if (count)
 		schedule_work(&wc->deferred_work);
+	return count;
 }
 
 static void
 wctc4xxp_polling(unsigned long data)
 {
 	struct wcdte *wc = (struct wcdte *)data;
-	__wctc4xxp_polling(wc);
+	int count;
+
+	count = __wctc4xxp_polling(wc);
+
+#if !defined(CONFIG_WCTC4XXP_POLLING)
+	/* Go back to interrupts when the rate has been low for a while,
+	 * unless there are enough channels open to poll anyway. */
+	if (test_bit(DTE_COALESCING, &wc->flags)) {
+		if (count <= wctc4xxp_coalesce_per_tick() / 2)
+			++wc->idle_ticks;
+		else
+			wc->idle_ticks = 0;
+		if (wc->idle_ticks >= COALESCE_IDLE_TICKS || !coalesce) {
+			clear_bit(DTE_COALESCING, &wc->flags);
+			atomic_inc(&wc->stats.uncoalesced);
+			if (atomic_read(&wc->open_channels) <
+			    POLLING_CALL_THRESHOLD) {
+				wctc4xxp_disable_polling(wc);
+				return;
+			}
+		}
+	}
+#endif
 	if (test_bit(DTE_POLLING, &wc->flags))
 		mod_timer(&wc->polling, jiffies + 1);
 }
@@ -2396,14 +2634,13 @@ wctc4xxp_read(FOP_READ_ARGS_DECL)
 	return returned_bytes;
 }
 
-/* Called with a frame in the srcfmt to be transcoded into the dstfmt. */
-static ssize_t
-wctc4xxp_write(FOP_WRITE_ARGS_DECL)
+/* Check a frame of 'count' bytes in the srcfmt before it is queued on the
+ * channel, and advance the channel's timestamp for it. */
+static int
+wctc4xxp_check_frame(struct dahdi_transcoder_channel *dtc, size_t count)
 {
-	struct dahdi_transcoder_channel *dtc = file->private_data;
 	struct channel_pvt *cpvt = dtc->pvt;
 	struct wcdte *wc = cpvt->wc;
-	struct tcb *cmd;
 
 	BUG_ON(!cpvt);
 	BUG_ON(!wc);
@@ -2446,28 +2683,25 @@ wctc4xxp_write(FOP_WRITE_ARGS_DECL)
 		/* Same for ulaw and alaw */
 		cpvt->timestamp += G729_SAMPLES;
 	}
+	return 0;
+}
+
+/* Send a frame that has been copied into 'cmd' off to the DTE. */
+static void
+wctc4xxp_send_frame(struct dahdi_transcoder_channel *dtc, struct tcb *cmd,
+		    size_t count)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wcdte *wc = cpvt->wc;
 
-	cmd = wctc4xxp_create_rtp_cmd(wc, dtc, count);
-	if (!cmd)
-		return -ENOMEM;
-	/* Copy the data directly from user space into the command buffer. */
-#if defined(__FreeBSD__)
-	if (uiomove(((struct rtp_packet *) cmd->data)->payload, count, uio)) {
-#else
-	if (copy_from_user(&((struct rtp_packet *)(cmd->data))->payload[0],
-		frame, count)) {
-#endif
-		dev_err(&wc->pdev->dev,
-			"Failed to copy packet from userspace.\n");
-		free_cmd(cmd);
-		return -EFAULT;
-	}
 	cpvt->seqno += 1;
 
 	DTE_DEBUG(DTE_DEBUG_RTP_TX,
 	    "Sending packet of %zu byte on channel (%p).\n", count, dtc);
 
 	atomic_inc(&cpvt->stats.packets_sent);
+	wctc4xxp_frame_sent(cpvt, wctc4xxp_frame_samples(dtc->srcfmt,
+			((struct rtp_packet *)cmd->data)->payload, count));
 	wctc4xxp_transmit_cmd(wc, cmd);
 
 	if (test_bit(DTE_POLLING, &wc->flags)) {
@@ -2480,11 +2714,106 @@ wctc4xxp_write(FOP_WRITE_ARGS_DECL)
 		}
 #endif
 	}
+}
+
+/* Called with a frame in the srcfmt to be transcoded into the dstfmt. */
+static ssize_t
+wctc4xxp_write(FOP_WRITE_ARGS_DECL)
+{
+	struct dahdi_transcoder_channel *dtc = file->private_data;
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wcdte *wc = cpvt->wc;
+	struct tcb *cmd;
+	int res;
+
+	res = wctc4xxp_check_frame(dtc, count);
+	if (res)
+		return res;
 
+	cmd = wctc4xxp_create_rtp_cmd(wc, dtc, count);
+	if (!cmd)
+		return -ENOMEM;
+	/* Copy the data directly from user space into the command buffer. */
+#if defined(__FreeBSD__)
+	if (uiomove(((struct rtp_packet *) cmd->data)->payload, count, uio)) {
+#else
+	if (copy_from_user(&((struct rtp_packet *)(cmd->data))->payload[0],
+		frame, count)) {
+#endif
+		dev_err(&wc->pdev->dev,
+			"Failed to copy packet from userspace.\n");
+		free_cmd(cmd);
+		return -EFAULT;
+	}
+	wctc4xxp_send_frame(dtc, cmd, count);
 
 	return count;
 }
 
+/* DAHDI_TC_BATCH: the same as a write, from a frame in a batch */
+static ssize_t
+wctc4xxp_batch_submit(struct dahdi_transcoder_channel *dtc,
+			const void __user *frame, size_t count)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wcdte *wc = cpvt->wc;
+	struct tcb *cmd;
+	int res;
+
+	res = wctc4xxp_check_frame(dtc, count);
+	if (res)
+		return res;
+
+	cmd = wctc4xxp_create_rtp_cmd(wc, dtc, count);
+	if (!cmd)
+		return -ENOMEM;
+	if (copy_from_user(((struct rtp_packet *) cmd->data)->payload,
+			   frame, count)) {
+		free_cmd(cmd);
+		return -EFAULT;
+	}
+	wctc4xxp_send_frame(dtc, cmd, count);
+
+	return count;
+}
+
+/* DAHDI_TC_BATCH: one transcoded frame, if there is one waiting */
+static ssize_t
+wctc4xxp_batch_retrieve(struct dahdi_transcoder_channel *dtc,
+			void __user *frame, size_t count)
+{
+	struct channel_pvt *cpvt = dtc->pvt;
+	struct wcdte *wc = cpvt->wc;
+	struct rtp_packet *packet;
+	struct tcb *cmd;
+	ssize_t payload_bytes;
+
+	if (unlikely(test_bit(DTE_SHUTDOWN, &wc->flags)))
+		return -EIO;
+
+	cmd = get_ready_cmd(dtc);
+	if (!cmd)
+		return -EAGAIN;
+
+	packet = cmd->data;
+	payload_bytes = be16_to_cpu(packet->udphdr.len) -
+				sizeof(struct rtphdr) - sizeof(struct udphdr);
+	if (count < payload_bytes) {
+		free_cmd(cmd);
+		return -EFBIG;
+	}
+
+	atomic_inc(&cpvt->stats.packets_received);
+
+	if (copy_to_user(frame, packet->payload, payload_bytes)) {
+		free_cmd(cmd);
+		return -EFAULT;
+	}
+	free_cmd(cmd);
+
+	return payload_bytes;
+}
+
 static void
 wctc4xxp_send_ack(struct wcdte *wc, u8 seqno, __be16 channel)
 {
@@ -2717,6 +3046,9 @@ queue_rtp_packet(struct wcdte *wc, struct tcb *cmd)
 	struct channel_pvt *cpvt;
 	struct rtp_packet *packet = cmd->data;
 	unsigned long flags;
+	unsigned long ns;
+	unsigned int samples;
+	int payload_bytes;
 
 	if (unlikely(ip_fast_csum((void *)(&packet->iphdr),
 		packet->iphdr.ihl))) {
@@ -2752,12 +3084,25 @@ queue_rtp_packet(struct wcdte *wc, struct tcb *cmd)
 		return;
 	}
 
+	payload_bytes = be16_to_cpu(packet->udphdr.len) -
+			sizeof(struct rtphdr) - sizeof(struct udphdr);
+	if (payload_bytes > (int)(cmd->data_len - sizeof(*packet)))
+		payload_bytes = cmd->data_len - sizeof(*packet);
+	samples = (payload_bytes > 0) ? wctc4xxp_frame_samples(dtc->dstfmt,
+				packet->payload, payload_bytes) : 0;
+
 	cpvt = dtc->pvt;
 	spin_lock_irqsave(&cpvt->lock, flags);
 	list_add_tail(&cmd->node, &cpvt->rx_queue);
 	dahdi_tc_set_data_waiting(dtc);
+	ns = wctc4xxp_frame_received(cpvt, samples);
 	spin_unlock_irqrestore(&cpvt->lock, flags);
 	dahdi_transcoder_alert(dtc);
+	if (ns) {
+		spin_lock_irqsave(&wc->stats.lock, flags);
+		latency_add(&wc->stats.latency, ns);
+		spin_unlock_irqrestore(&wc->stats.lock, flags);
+	}
 	return;
 }
 
@@ -2866,11 +3211,39 @@ wctc4xxp_ithread(void *arg)
 }
 #endif
 
+/* Called from the interrupt handler after each pass over the receive ring,
+ * to switch to the polling timer when the interrupts come too thick. */
+static void
+wctc4xxp_coalesce(struct wcdte *wc, unsigned int count)
+{
+#if !defined(CONFIG_WCTC4XXP_POLLING)
+	unsigned int budget = wctc4xxp_rx_budget();
+
+	if (!coalesce || test_bit(DTE_POLLING, &wc->flags))
+		return;
+
+	if (wc->jiffies_at_last_irq != jiffies) {
+		wc->jiffies_at_last_irq = jiffies;
+		wc->irqs_this_tick = 0;
+	}
+	if (++wc->irqs_this_tick <= wctc4xxp_coalesce_per_tick() &&
+	    (!budget || count < budget))
+		return;
+
+	if (test_and_set_bit(DTE_COALESCING, &wc->flags))
+		return;
+	wc->idle_ticks = 0;
+	atomic_inc(&wc->stats.coalesced);
+	wctc4xxp_enable_polling(wc);
+#endif
+}
+
 DAHDI_IRQ_HANDLER(wctc4xxp_interrupt)
 {
 	struct wcdte *wc = dev_id;
 	u32 ints;
 	u32 reg;
+	int count;
 	int res = IRQ_HANDLED;
 #define TX_COMPLETE_INTERRUPT 0x00000001
 #define RX_COMPLETE_INTERRUPT 0x00000040
@@ -2890,7 +3263,11 @@ DAHDI_IRQ_HANDLER(wctc4xxp_interrupt)
 			reg |= TX_COMPLETE_INTERRUPT;
 
 		if (ints & RX_COMPLETE_INTERRUPT) {
-			wctc4xxp_handle_receive_ring(wc);
+			atomic_inc(&wc->stats.irq_passes);
+			/* Whatever is left over is for the polling timer */
+			count = wctc4xxp_handle_receive_ring(wc,
+				coalesce ? wctc4xxp_rx_budget() : 0);
+			wctc4xxp_coalesce(wc, count);
 			reg |= RX_COMPLETE_INTERRUPT;
 		}
 
@@ -3562,6 +3939,8 @@ initialize_transcoder(struct wcdte *wc, unsigned int srcfmts,
 	(*zt)->dstfmts = dstfmts;
 	(*zt)->allocate = wctc4xxp_operation_allocate;
 	(*zt)->release = wctc4xxp_operation_release;
+	(*zt)->submit = wctc4xxp_batch_submit;
+	(*zt)->retrieve = wctc4xxp_batch_retrieve;
 	wctc4xxp_setup_file_operations(&((*zt)->fops));
 	for (chan = 0; chan < wc->numchannels; ++chan)
 		(*zt)->channels[chan].pvt = &pvts[chan];
@@ -3630,6 +4009,7 @@ wctc4xxp_watchdog(unsigned long data)
 		&wc->waiting_for_response_list, node) {
 		if (time_after(jiffies, cmd->timeout)) {
 			if (++cmd->retries > MAX_RETRIES) {
+				atomic_inc(&wc->stats.timeouts);
 				if (!(cmd->flags & TX_COMPLETE)) {
 
 					cmd->flags |= DTE_CMD_TIMEOUT;
@@ -3658,6 +4038,7 @@ wctc4xxp_watchdog(unsigned long data)
 				 */
 				list_move_tail(&cmd->node, &cmds_to_retry);
 				cmd->flags &= ~(TX_COMPLETE);
+				atomic_inc(&wc->stats.retransmits);
 			} else {
 				/* The command is still sitting on the tx
 				 * descriptor ring.  We don't want to move it
@@ -3669,6 +4050,7 @@ wctc4xxp_watchdog(unsigned long data)
 				  "still on descriptor list.\n");
 				cmd->timeout = jiffies + HZ/4;
 				wctc4xxp_transmit_demand_poll(wc);
+				atomic_inc(&wc->stats.ring_retries);
 				reschedule_timer = 1;
 			}
 		}
@@ -3732,6 +4114,206 @@ static struct wctc4xxp_desc wctce400 = {
 	.long_name = "Wildcard TCE400+TC400M",
 };
 
+#if defined(__FreeBSD__)
+#define stats_printf	sbuf_printf
+typedef struct sbuf stats_buf;
+#else
+#define stats_printf	seq_printf
+typedef struct seq_file stats_buf;
+#endif
+
+static void wctc4xxp_show_latency(stats_buf *buf, const char *prefix,
+				  const struct latency_stats *l)
+{
+	int b;
+
+	stats_printf(buf, "%slatency: frames %u avg %luus max %luus\n", prefix,
+		     l->count,
+		     l->count ? (unsigned long)(l->total_ns / l->count) / 1000 : 0,
+		     l->max_ns / 1000);
+	stats_printf(buf, "%slatency histogram:", prefix);
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		stats_printf(buf, " <%lu:%u",
+			     (1UL << (LAT_SHIFT + b)) / 1000, l->hist[b]);
+	}
+	stats_printf(buf, " more:%u\n", l->hist[b]);
+}
+
+static int list_count(const struct list_head *head)
+{
+	const struct list_head *cur;
+	int n = 0;
+
+	list_for_each(cur, head)
+		n++;
+	return n;
+}
+
+static void wctc4xxp_show_channels(stats_buf *buf, struct wcdte *wc,
+				   const char *name, struct channel_pvt *pvts)
+{
+	struct channel_stats st;
+	unsigned long flags;
+	int sent, received;
+	int x;
+
+	for (x = 0; x < wc->numchannels; x++) {
+		sent = atomic_read(&pvts[x].stats.packets_sent);
+		if (!sent)
+			continue;
+		received = atomic_read(&pvts[x].stats.packets_received);
+		spin_lock_irqsave(&pvts[x].lock, flags);
+		memcpy(&st, &pvts[x].stats, sizeof(st));
+		spin_unlock_irqrestore(&pvts[x].lock, flags);
+
+		stats_printf(buf, "%s %d: sent %d received %d in flight %u "
+			     "unmatched %u\n", name, x, sent, received,
+			     st.sent_in - st.sent_out, st.unmatched);
+		wctc4xxp_show_latency(buf, "  ", &st.latency);
+	}
+}
+
+/* Latency, queue depths and DMA ring occupancy.  Nothing is printed with
+ * a lock held. */
+static void wctc4xxp_show(stats_buf *buf, struct wcdte *wc)
+{
+	struct latency_stats latency;
+	int queued, waiting, rx_pending;
+	unsigned int txd_count, rxd_count, inflight = 0;
+	unsigned int batch_hist[BATCH_BUCKETS], budget_spent;
+	unsigned long flags;
+	int x;
+
+	spin_lock_irqsave(&wc->cmd_list_lock, flags);
+	queued = list_count(&wc->cmd_list);
+	waiting = list_count(&wc->waiting_for_response_list);
+	spin_unlock_irqrestore(&wc->cmd_list_lock, flags);
+
+	spin_lock_irqsave(&wc->rx_list_lock, flags);
+	rx_pending = list_count(&wc->rx_list);
+	spin_unlock_irqrestore(&wc->rx_list_lock, flags);
+
+	spin_lock_irqsave(&wc->txd->lock, flags);
+	txd_count = wc->txd->count;
+	spin_unlock_irqrestore(&wc->txd->lock, flags);
+	spin_lock_irqsave(&wc->rxd->lock, flags);
+	rxd_count = wc->rxd->count;
+	spin_unlock_irqrestore(&wc->rxd->lock, flags);
+
+	spin_lock_irqsave(&wc->stats.lock, flags);
+	memcpy(&latency, &wc->stats.latency, sizeof(latency));
+	spin_unlock_irqrestore(&wc->stats.lock, flags);
+
+	spin_lock_irqsave(&wc->rx_lock, flags);
+	memcpy(batch_hist, wc->stats.batch_hist, sizeof(batch_hist));
+	budget_spent = wc->stats.budget_spent;
+	spin_unlock_irqrestore(&wc->rx_lock, flags);
+
+	for (x = 0; x < wc->numchannels; x++) {
+		inflight += wc->encoders[x].stats.sent_in -
+			    wc->encoders[x].stats.sent_out;
+		inflight += wc->decoders[x].stats.sent_in -
+			    wc->decoders[x].stats.sent_out;
+	}
+
+	stats_printf(buf, "tx ring %u/%d rx ring %u/%d\n",
+		     txd_count, DRING_SIZE, rxd_count, DRING_SIZE);
+	stats_printf(buf, "cmd_list %d awaiting response %d rx_list %d "
+		     "frames in flight %u\n", queued, waiting, rx_pending,
+		     inflight);
+	stats_printf(buf, "retransmits %d ring retries %d timeouts %d "
+		     "tx ring full %d\n",
+		     atomic_read(&wc->stats.retransmits),
+		     atomic_read(&wc->stats.ring_retries),
+		     atomic_read(&wc->stats.timeouts),
+		     atomic_read(&wc->stats.tx_ring_full));
+	stats_printf(buf, "rx %s: coalesced %d uncoalesced %d "
+		     "interrupt passes %d poll passes %d budget spent %u\n",
+		     !test_bit(DTE_POLLING, &wc->flags) ? "interrupts" :
+		     test_bit(DTE_COALESCING, &wc->flags) ? "coalescing" :
+		     "polling",
+		     atomic_read(&wc->stats.coalesced),
+		     atomic_read(&wc->stats.uncoalesced),
+		     atomic_read(&wc->stats.irq_passes),
+		     atomic_read(&wc->stats.poll_passes), budget_spent);
+	stats_printf(buf, "rx batch histogram:");
+	for (x = 0; x < BATCH_BUCKETS - 1; x++)
+		stats_printf(buf, " <%u:%u", 1U << x, batch_hist[x]);
+	stats_printf(buf, " more:%u\n", batch_hist[x]);
+	wctc4xxp_show_latency(buf, "", &latency);
+	wctc4xxp_show_channels(buf, wc, "encoder", wc->encoders);
+	wctc4xxp_show_channels(buf, wc, "decoder", wc->decoders);
+}
+
+#if defined(__FreeBSD__)
+static int
+wctc4xxp_sysctl_stats(SYSCTL_HANDLER_ARGS)
+{
+	struct wcdte *wc = arg1;
+	struct sbuf *sb;
+	int error;
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 1024, req);
+	if (sb == NULL)
+		return (ENOMEM);
+	wctc4xxp_show(sb, wc);
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return (error);
+}
+
+static void wctc4xxp_add_stats(struct wcdte *wc)
+{
+	device_t dev = wc->pdev->dev.device;
+
+	sysctl_ctx_init(&wc->sysctl_ctx);
+	SYSCTL_ADD_PROC(&wc->sysctl_ctx,
+	    SYSCTL_CHILDREN(device_get_sysctl_tree(dev)), OID_AUTO, "stats",
+	    CTLTYPE_STRING | CTLFLAG_RD, wc, 0, wctc4xxp_sysctl_stats, "A",
+	    "Frame latency, queue depths and DMA ring occupancy");
+}
+
+static void wctc4xxp_remove_stats(struct wcdte *wc)
+{
+	sysctl_ctx_free(&wc->sysctl_ctx);
+}
+#elif defined(CONFIG_PROC_FS)
+static int wctc4xxp_proc_show(struct seq_file *sfile, void *v)
+{
+	wctc4xxp_show(sfile, sfile->private);
+	return 0;
+}
+
+static int wctc4xxp_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wctc4xxp_proc_show, PDE(inode)->data);
+}
+
+static const struct file_operations wctc4xxp_proc_ops = {
+	.owner		= THIS_MODULE,
+	.open		= wctc4xxp_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* /proc/dahdi/wctc4xxp<pos> */
+static void wctc4xxp_add_stats(struct wcdte *wc)
+{
+	snprintf(wc->proc_name, sizeof(wc->proc_name), "dahdi/wctc4xxp%d",
+		 wc->pos);
+	proc_create_data(wc->proc_name, 0444, NULL, &wctc4xxp_proc_ops, wc);
+}
+
+static void wctc4xxp_remove_stats(struct wcdte *wc)
+{
+	remove_proc_entry(wc->proc_name, NULL);
+}
+#else
+static inline void wctc4xxp_add_stats(struct wcdte *wc) {}
+static inline void wctc4xxp_remove_stats(struct wcdte *wc) {}
+#endif
+
 #if defined(__FreeBSD__)
 static int
 wctc4xxp_init_one(device_t dev, const struct pci_device_id *ent)
@@ -3805,6 +4387,7 @@ wctc4xxp_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 	spin_lock_init(&wc->cmd_list_lock);
 	spin_lock_init(&wc->rx_list_lock);
 	spin_lock_init(&wc->rx_lock);
+	spin_lock_init(&wc->stats.lock);
 	INIT_LIST_HEAD(&wc->cmd_list);
 	INIT_LIST_HEAD(&wc->waiting_for_response_list);
 	INIT_LIST_HEAD(&wc->rx_list);
@@ -3993,6 +4576,7 @@ wctc4xxp_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 	DTE_DEBUG(DTE_DEBUG_GENERAL, "Operating in DEBUG mode.\n");
 	dahdi_transcoder_register(wc->uencode);
 	dahdi_transcoder_register(wc->udecode);
+	wctc4xxp_add_stats(wc);
 
 	return 0;
 
@@ -4075,6 +4659,7 @@ static void __devexit wctc4xxp_remove_one(struct pci_dev *pdev)
 	if (!wc)
 		return;
 
+	wctc4xxp_remove_stats(wc);
 #if !defined(__FreeBSD__)
 	wctc4xxp_remove_from_device_list(wc);
 #endif
@@ -4084,6 +4669,7 @@ static void __devexit wctc4xxp_remove_one(struct pci_dev *pdev)
 		del_timer_sync(&wc->watchdog);
 
 	/* This should already be stopped, but it doesn't hurt to make sure. */
+	clear_bit(DTE_COALESCING, &wc->flags);
 	clear_bit(DTE_POLLING, &wc->flags);
 	if (del_timer_sync(&wc->polling))
 		del_timer_sync(&wc->polling);
@@ -4152,6 +4738,7 @@ static void __devexit wctc4xxp_remove_one(struct pci_dev *pdev)
 	spin_lock_destroy(&wc->cmd_list_lock);
 	spin_lock_destroy(&wc->rx_list_lock);
 	spin_lock_destroy(&wc->rx_lock);
+	spin_lock_destroy(&wc->stats.lock);
 #if !defined(__FreeBSD__)
 	kfree(wc);
 #endif
@@ -4299,8 +4886,14 @@ static void __exit wctc4xxp_cleanup(void)
 
 module_param(debug, int, S_IRUGO | S_IWUSR);
 module_param(mode, charp, S_IRUGO);
+module_param(coalesce, int, S_IRUGO | S_IWUSR);
+module_param(rx_budget, int, S_IRUGO | S_IWUSR);
 
 MODULE_PARM_DESC(mode, "'g729', 'g723.1', or 'any'.  Default 'any'.");
+MODULE_PARM_DESC(coalesce, "Receive interrupts a second over which the card "
+		 "is polled instead (0 to only poll for the channel count).");
+MODULE_PARM_DESC(rx_budget, "Packets the interrupt handler takes off the "
+		 "receive ring before leaving the rest to the polling timer.");
 MODULE_DESCRIPTION("Wildcard TC400P+TC400M Driver");
 MODULE_AUTHOR("Digium Incorporated <support@digium.com>");
 MODULE_LICENSE("GPL");
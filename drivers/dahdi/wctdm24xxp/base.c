@@ -5493,6 +5493,17 @@ voicebus_current_latency_show(struct device *dev,
 static DEVICE_ATTR(voicebus_current_latency, 0400,
 		   voicebus_current_latency_show, NULL);
 
+static ssize_t
+voicebus_latency_history_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct wctdm *wc = dev_get_drvdata(dev);
+	return voicebus_latency_report(&wc->vb, buf, PAGE_SIZE);
+}
+
+static DEVICE_ATTR(voicebus_latency_history, 0400,
+		   voicebus_latency_history_show, NULL);
+
 static ssize_t vpm_firmware_version_show(struct device *dev,
 				struct device_attribute *attr,
 				char *buf)
@@ -5564,6 +5575,13 @@ static void create_sysfs_files(struct wctdm *wc)
 			"Failed to create device attributes.\n");
 	}
 
+	ret = device_create_file(&wc->vb.pdev->dev,
+				 &dev_attr_voicebus_latency_history);
+	if (ret) {
+		dev_info(&wc->vb.pdev->dev,
+			"Failed to create device attributes.\n");
+	}
+
 	ret = device_create_file(&wc->vb.pdev->dev,
 				 &dev_attr_vpm_firmware_version);
 	if (ret) {
@@ -5587,6 +5605,9 @@ static void remove_sysfs_files(struct wctdm *wc)
 	device_remove_file(&wc->vb.pdev->dev,
 			   &dev_attr_vpm_firmware_version);
 
+	device_remove_file(&wc->vb.pdev->dev,
+			   &dev_attr_voicebus_latency_history);
+
 	device_remove_file(&wc->vb.pdev->dev,
 			   &dev_attr_voicebus_current_latency);
 }
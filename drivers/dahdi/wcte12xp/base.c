@@ -2627,6 +2627,17 @@ static ssize_t voicebus_current_latency_show(struct device *dev,
 static DEVICE_ATTR(voicebus_current_latency, 0400,
 		   voicebus_current_latency_show, NULL);
 
+static ssize_t
+voicebus_latency_history_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct t1 *wc = dev_get_drvdata(dev);
+	return voicebus_latency_report(&wc->vb, buf, PAGE_SIZE);
+}
+
+static DEVICE_ATTR(voicebus_latency_history, 0400,
+		   voicebus_latency_history_show, NULL);
+
 
 static ssize_t vpm_firmware_version_show(struct device *dev,
 				struct device_attribute *attr,
@@ -2660,6 +2671,13 @@ static void create_sysfs_files(struct t1 *wc)
 			"Failed to create device attributes.\n");
 	}
 
+	ret = device_create_file(&wc->vb.pdev->dev,
+				 &dev_attr_voicebus_latency_history);
+	if (ret) {
+		dev_info(&wc->vb.pdev->dev,
+			"Failed to create device attributes.\n");
+	}
+
 	ret = device_create_file(&wc->vb.pdev->dev,
 				 &dev_attr_vpm_firmware_version);
 	if (ret) {
@@ -2673,6 +2691,9 @@ static void remove_sysfs_files(struct t1 *wc)
 	device_remove_file(&wc->vb.pdev->dev,
 			   &dev_attr_vpm_firmware_version);
 
+	device_remove_file(&wc->vb.pdev->dev,
+			   &dev_attr_voicebus_latency_history);
+
 	device_remove_file(&wc->vb.pdev->dev,
 			   &dev_attr_voicebus_current_latency);
 }
@@ -128,6 +128,18 @@ static unsigned int minbits[2] = { 8, 10 };
 
 static unsigned int hdlc_encode[6][256];
 
+/*
+   HDLC Frame Check Sequence Tables
+
+   The 16 bit FCS (CRC-16/X.25, the same one as PPP_FCS) is worked
+   out four bytes at a time.  hdlc_fcs[0] is the usual byte at a time
+   table, and hdlc_fcs[n] is the same for a byte followed by n more.
+  */
+
+#define HDLC_FCS_POLY	0x8408
+
+static unsigned short hdlc_fcs[4][256];
+
 static inline char hdlc_search_precalc(unsigned char c)
 {
 	int x, p=0;
@@ -317,6 +329,28 @@ static inline void hdlc_encode_print(int x, unsigned char y, unsigned int val)
 }
 #endif
 
+static inline unsigned int hdlc_fcs_bits(unsigned int fcs)
+{
+	int x;
+
+	for (x=0;x<8;x++)
+		fcs = (fcs & 1) ? (fcs >> 1) ^ HDLC_FCS_POLY : fcs >> 1;
+	return fcs;
+}
+
+static inline void hdlc_fcs_precalc(unsigned char c)
+{
+	unsigned int fcs = hdlc_fcs_bits(c);
+	int x;
+
+	hdlc_fcs[0][c] = fcs;
+	for (x=1;x<4;x++) {
+		/* Then that many zero bytes after it */
+		fcs = (fcs >> 8) ^ hdlc_fcs_bits(fcs & 0xff);
+		hdlc_fcs[x][c] = fcs;
+	}
+}
+
 static inline void fasthdlc_precalc(void)
 {
 	int x;
@@ -348,6 +382,9 @@ static inline void fasthdlc_precalc(void)
 #endif
 		}
 	}
+	/* And the FCS */
+	for (x=0;x<256;x++)
+		hdlc_fcs_precalc(x);
 }
 
 
@@ -529,5 +566,22 @@ static inline int fasthdlc_rx_run(struct fasthdlc_state *h)
 	}
 	return retval;
 }
+
+/*
+   Returns 'fcs' updated with 'len' more bytes of a frame.  Start a
+   frame with PPP_INITFCS; a frame may be fed through in as many
+   pieces as it arrives in.
+*/
+static inline unsigned int fasthdlc_fcs(unsigned int fcs, const unsigned char *data, int len)
+{
+	for (;len >= 4;len -= 4, data += 4) {
+		fcs ^= data[0] | (data[1] << 8);
+		fcs = hdlc_fcs[3][fcs & 0xff] ^ hdlc_fcs[2][fcs >> 8] ^
+		      hdlc_fcs[1][data[2]] ^ hdlc_fcs[0][data[3]];
+	}
+	while (len-- > 0)
+		fcs = (fcs >> 8) ^ hdlc_fcs[0][(fcs ^ *(data++)) & 0xff];
+	return fcs;
+}
 #endif /* FAST_HDLC_NEED_TABLES */
 #endif
@@ -329,6 +329,22 @@ struct dahdi_echocan_ops {
 	 */
 	void (*echocan_NLP_toggle)(struct dahdi_echocan_state *ec, unsigned int enable);
 
+	/*! \brief Feed transmit samples without filtering or adapting.
+	 * \param[in,out] ec Pointer to the state structure.
+	 * \param[in] iref The transmit direction data.
+	 * \param[in] size The number of elements in the iref array.
+	 *
+	 * Called by the DAHDI core instead of echocan_process when the far end
+	 * has been silent for longer than the tail, so there is no echo to
+	 * cancel. The echocan should only push the samples into its reference
+	 * history (and any power estimates derived from it) so that it stays
+	 * converged when the far end resumes. The receive direction data is
+	 * passed through unchanged.
+	 *
+	 * \return Nothing.
+	 */
+	void (*echocan_bypass)(struct dahdi_echocan_state *ec, const short *iref, u32 size);
+
 #ifdef CONFIG_DAHDI_ECHOCAN_PROCESS_TX
 	/*! \brief Process an array of TX audio samples.
 	 *
@@ -419,6 +435,21 @@ struct dahdi_echocan_state {
 
 		/*! How many samples to wait before beginning the training operation. */
 		u32 pretrain_timer;
+
+		/*! How many consecutive transmit samples were below the idle threshold. */
+		u32 idle_samples;
+
+		/*! The number of taps the echocan was created with. */
+		u32 tap_length;
+
+		/*! First tap of the window the echocan is currently filtering with. */
+		u32 active_start;
+
+		/*! Number of taps in that window. Echocans that adapt their window
+		 * keep active_start and active_length up to date, for all others
+		 * the DAHDI core sets it to the whole tail.
+		 */
+		u32 active_length;
 	} status;
 
 	/*! This structure contains event flags, allowing the echocan to report
@@ -1046,9 +1077,15 @@ struct dahdi_transcoder_channel {
 #define DAHDI_TC_FLAG_CHAN_BUILT	2
 #define DAHDI_TC_FLAG_NONBLOCK		3
 #define DAHDI_TC_FLAG_DATA_WAITING	4
+#define DAHDI_TC_FLAG_BATCH		5
 	unsigned long flags;
 	u32 dstfmt;
 	u32 srcfmt;
+	/* The batch file's wait queue while DAHDI_TC_FLAG_BATCH is set */
+	wait_queue_head_t *batch_ready;
+	/* On one of the parent's free lists while not busy.  Only the
+	   transcode layer touches it, under its lock. */
+	struct list_head free_node;
 };
 
 int dahdi_is_sync_master(const struct dahdi_span *span);
@@ -1101,6 +1138,16 @@ static inline void
 dahdi_tc_clear_data_waiting(struct dahdi_transcoder_channel *dtc) {
 	clear_bit(DAHDI_TC_FLAG_DATA_WAITING, &dtc->flags);
 }
+static inline int
+dahdi_tc_is_batch(struct dahdi_transcoder_channel *dtc) {
+	return test_bit(DAHDI_TC_FLAG_BATCH, &dtc->flags);
+}
+
+/*! Number of built_fmts a transcoder keeps separate free lists for */
+#define DAHDI_TC_POOLS		8
+
+/*! Transcodes on the host CPU; only used once the others are busy */
+#define DAHDI_TRANSCODER_SOFTWARE	(1 << 0)
 
 struct dahdi_transcoder {
 	struct list_head active_list_node;
@@ -1109,9 +1156,28 @@ struct dahdi_transcoder {
 	int numchannels;
 	unsigned int srcfmts;
 	unsigned int dstfmts;
+	unsigned int flags;
 	struct file_operations fops;
 	int (*allocate)(struct dahdi_transcoder_channel *channel);
 	int (*release)(struct dahdi_transcoder_channel *channel);
+	/* Optional, for DAHDI_TC_BATCH: queue one frame from userspace, and
+	   hand back one transcoded frame without sleeping (-EAGAIN if there
+	   is none).  Both return the number of bytes or a negative errno. */
+	ssize_t (*submit)(struct dahdi_transcoder_channel *channel,
+			  const void __user *frame, size_t len);
+	ssize_t (*retrieve)(struct dahdi_transcoder_channel *channel,
+			    void __user *frame, size_t len);
+	/* Free channels: those not built, those built for each of up to
+	   DAHDI_TC_POOLS pairs of formats, and any built for others.  A
+	   driver may build or tear down a free channel behind our back, so
+	   these are only a hint, checked as channels are taken off them. */
+	struct list_head free_unbuilt;
+	struct {
+		u32 fmts;
+		struct list_head free;
+	} pools[DAHDI_TC_POOLS];
+	struct list_head free_other;
+	int nfree;
 	/* Transcoder channels */
 	struct dahdi_transcoder_channel channels[0];
 };
@@ -1126,6 +1192,22 @@ struct dahdi_transcoder {
 #define DAHDI_WATCHSTATE_FAILED		3
 
 
+/*! Dynamic span message carries a channel bitmap, and a full chunk of
+    audio only for the channels set in it; the rest send one byte, which
+    their whole chunk was */
+#define DAHDI_DYNAMIC_FLAG_CHANMAP		(1 << 6)
+/*! Sender of a dynamic span message takes DAHDI_DYNAMIC_FLAG_CHANMAP
+    ones.  Drivers that need messages of a fixed length clear it as
+    they are received. */
+#define DAHDI_DYNAMIC_FLAG_CHANMAP_OK		(1 << 7)
+
+/*! Largest dynamic span message for a span of n channels: header,
+    signalling, channel bitmap and audio */
+#define DAHDI_DYNAMIC_MSGLEN(n) \
+	(6 + (((n) + 3) / 4) * 2 + ((n) + 7) / 8 + (n) * DAHDI_CHUNKSIZE)
+
+struct dahdi_dynamic_jb;
+
 struct dahdi_dynamic {
 	char addr[40];
 	char dname[20];
@@ -1143,6 +1225,9 @@ struct dahdi_dynamic {
 	int master;
 	unsigned char *msgbuf;
 	struct device *dev;
+	struct dahdi_dynamic_jb *jb;	/*!< Receive jitter buffer */
+	int txworker;			/*!< Transmit worker, if tx_workers */
+	int peer_chanmap;		/*!< Far end takes idle suppression */
 
 	struct list_head list;
 };
@@ -1163,9 +1248,20 @@ struct dahdi_dynamic_driver {
 	/*! Transmit a given message */
 	void (*transmit)(struct dahdi_dynamic *d, u8 *msg, size_t msglen);
 
+	/*! Optional: return a buffer of at least msglen bytes to build the
+	    next message in, usually straight in the outgoing packet.  The
+	    message is then passed to transmit() in that buffer.  Returning
+	    NULL makes the core use msgbuf instead. */
+	u8 *(*get_txbuf)(struct dahdi_dynamic *d, size_t msglen);
+
 	/*! Flush any pending messages */
 	int (*flush)(void);
 
+	/*! Optional: spans for which this returns the same key share
+	    transmit state, and are always transmitted by the same worker.
+	    Without it transmit() may run for several spans at once. */
+	unsigned long (*tx_key)(struct dahdi_dynamic *d);
+
 	struct list_head list;
 	struct module *owner;
 
@@ -1182,6 +1278,10 @@ int dahdi_dynamic_register_driver(struct dahdi_dynamic_driver *driver);
 /*! \brief Unregister a dynamic driver */
 void dahdi_dynamic_unregister_driver(struct dahdi_dynamic_driver *driver);
 
+/*! \brief Create a dynamic span from inside the kernel, as
+    DAHDI_DYNAMIC_CREATE would.  Returns the span number. */
+int dahdi_dynamic_create(struct dahdi_dynamic_span *dds);
+
 int _dahdi_receive(struct dahdi_span *span);
 
 /*! Receive on a span.  The DAHDI interface will handle all the calculations for
@@ -1288,6 +1388,19 @@ void dahdi_init_tone_state(struct dahdi_tone_state *ts, struct dahdi_tone *zt);
 /*! \brief Get a given MF tone struct, suitable for dahdi_tone_nextsample. */
 struct dahdi_tone *dahdi_mf_tone(const struct dahdi_chan *chan, char digit, int digitmode);
 
+/*! \brief DAHDI_CHANCONFIG, for callers in the kernel */
+int dahdi_chanconfig(struct dahdi_chanconfig *ch);
+
+/*! \brief DAHDI_SETCONF on the channel in conf->chan, for callers in the
+    kernel */
+int dahdi_setconf(struct dahdi_confinfo *conf);
+
+/*! \brief DAHDI_ATTACH_ECHOCAN, for callers in the kernel */
+int dahdi_attach_echocan(struct dahdi_attach_echocan *ae);
+
+/*! \brief DAHDI_ECHOCANCEL, for callers in the kernel */
+int dahdi_echocancel(struct dahdi_chan *chan, int taps);
+
 /* Echo cancel a receive and transmit chunk for a given channel.  This
    should be called by the low-level driver as close to the interface
    as possible.  ECHO CANCELLATION IS NO LONGER AUTOMATICALLY DONE
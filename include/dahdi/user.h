@@ -479,6 +479,32 @@ struct dahdi_transcoder_info {
 	__u32 srcfmts;
 };
 
+/* DAHDI_TC_BATCH_ALLOCATE: a channel for 'fmts', by index on the file */
+struct dahdi_transcoder_batch_alloc {
+	struct dahdi_transcoder_formats fmts;
+	__u32 chan;		/* Returned */
+};
+
+/* One frame in a DAHDI_TC_BATCH submit or retrieve vector */
+struct dahdi_transcoder_frame {
+	__u32 chan;		/* From DAHDI_TC_BATCH_ALLOCATE (set on retrieve) */
+	__u32 len;		/* Bytes in buf; on retrieve, its size on the way
+				   in and the length of the frame on the way out */
+	__s32 status;		/* 0 or a negative errno, per frame */
+	__u32 reserved;
+	__u64 buf;		/* User pointer to the frame */
+};
+
+struct dahdi_transcoder_batch {
+	__u32 nsubmit;		/* Frames in 'submit' to be transcoded */
+	__u32 nretrieve;	/* Room in 'retrieve'; returns the count filled */
+	__u32 timeout;		/* If nothing is ready, ms to wait for a frame
+				   (at most 10000) */
+	__u32 reserved;
+	__u64 submit;		/* struct dahdi_transcoder_frame[nsubmit] */
+	__u64 retrieve;		/* struct dahdi_transcoder_frame[nretrieve] */
+};
+
 #define DAHDI_MAX_ECHOCANPARAMS 8
 
 /* ioctl definitions */
@@ -1068,6 +1094,16 @@ struct dahdi_hwgain {
 #define DAHDI_TC_ALLOCATE		_IOW(DAHDI_TC_CODE, 1, struct dahdi_transcoder_formats)
 #define DAHDI_TC_GETINFO		_IOWR(DAHDI_TC_CODE, 2, struct dahdi_transcoder_info)
 
+/*
+ * Batched transcoding: many channels on one open file of the transcode
+ * device, with one call to submit frames for any of them and collect
+ * whatever transcoded frames are ready.  A file used with these cannot
+ * also be used with DAHDI_TC_ALLOCATE, read or write.
+ */
+#define DAHDI_TC_BATCH_ALLOCATE		_IOWR(DAHDI_TC_CODE, 3, struct dahdi_transcoder_batch_alloc)
+#define DAHDI_TC_BATCH_RELEASE		_IOW(DAHDI_TC_CODE, 4, int)
+#define DAHDI_TC_BATCH			_IOWR(DAHDI_TC_CODE, 5, struct dahdi_transcoder_batch)
+
 /*
  * VMWI Specification 
  */
@@ -1098,6 +1134,19 @@ struct dahdi_vmwi_info {
 
 #define DAHDI_ECHOCANCEL_FAX_MODE	_IOW(DAHDI_CODE, 102, int)
 
+/*
+ * Get the tap window a channel's echo canceller is currently filtering
+ * with.  Software echo cancellers may restrict filtering to the part of
+ * the configured tail that actually holds echo.
+ */
+struct dahdi_echocan_window {
+	__u32 tap_length;	/* configured number of taps */
+	__u32 active_start;	/* first tap currently filtered */
+	__u32 active_length;	/* number of taps currently filtered */
+};
+
+#define DAHDI_ECHOCANCEL_WINDOW		_IOR(DAHDI_CODE, 106, struct dahdi_echocan_window)
+
 /*
  * Defines which channel to receive mirrored traffic from
  */
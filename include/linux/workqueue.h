@@ -44,6 +44,7 @@ struct workqueue_struct {
 };
 
 struct workqueue_struct *create_singlethread_workqueue(const char *name);
+struct workqueue_struct *create_singlethread_workqueue_cpu(const char *name, int cpu);
 void destroy_workqueue(struct workqueue_struct *wq);
 void flush_workqueue(struct workqueue_struct *wq);
 void queue_work(struct workqueue_struct *wq, struct work_struct *work);